@@ -0,0 +1,22 @@
+#!/bin/bash
+# end-to-end benchmark: payoutd against the SSP simulator, needs a running redis-server
+# usage: bench/run.sh [payoutbench arguments], ex. bench/run.sh -n 20 -j
+
+cd "$(dirname "$0")/.." || exit 1
+export LD_LIBRARY_PATH=.
+
+PTY=/tmp/sspsim-$$
+
+# notes every 5s, 1% jams, up to 5ms reply jitter, fixed seed for a repeatable scenario
+./sspsim -l $PTY -n 5000 -J 1 -j 5 -s 1 > /dev/null &
+SIM=$!
+trap 'kill $PAYOUTD $SIM 2>/dev/null' EXIT
+sleep 1
+
+./payoutd -d $PTY &
+PAYOUTD=$!
+
+# the devices need a few seconds for the key exchange and the setup
+sleep ${STARTUP:-5}
+
+./payoutbench -P $PAYOUTD -n ${ROUNDS:-10} "$@"
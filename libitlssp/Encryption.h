@@ -31,6 +31,7 @@
 // error types
 #define E_AES_SUCCESS       0x0
 #define E_AES_WRONG_MODE	0x1
+#define E_AES_SELF_TEST_FAILED	0x2
 
 
 #define SSP_STEX			0x7E
@@ -43,6 +44,7 @@
 typedef struct
 {
     UINT32 enc_round_keys[(C_NUMBER_ROUNDS + 1) * C_MAX_KEY_LENGTH/4];   /* encryption round keys         */
+    UINT32 dec_round_keys[(C_NUMBER_ROUNDS + 1) * C_MAX_KEY_LENGTH/4];   /* decryption round keys (equivalent inverse cipher) */
     UINT8  IV[16];                                                       /* 128-bit initialization vector */
 } aes_context;
 
@@ -74,12 +76,22 @@ extern UINT8 aes_decrypt( const UINT8   aes_mode,              // the AES mode (
                                 UINT8  *cipher_data,           // pointer to encrypted data to decrypt (might be same as plain_data)
                           const UINT32  data_length );         // length of data to decrypt in bytes (must be a multiple of 16)
 
+/* known answer test of aes_encrypt / aes_decrypt, returns E_AES_SUCCESS if the output matches FIPS-197 */
+extern UINT8 aes_self_test( void );
+
 
 unsigned short cal_crc_loop_CCITT_A( short l, unsigned char* p, unsigned short seed,unsigned short cd );
+
+/* lookup table for CRC_SSP_POLY */
+extern const unsigned short crc_ssp_table[256];
 /***************************************************************************
  * 6. MACRO FUNCTIONS                                                      *
  ***************************************************************************/
 
+/* feeds one more byte into a CRC_SSP_POLY crc */
+#define CRC_SSP_UPDATE( crc, byte ) \
+	( (unsigned short) ( ( (crc) << 8 ) ^ crc_ssp_table[ ( ( (crc) >> 8 ) ^ (byte) ) & 0xFF ] ) )
+
 /***************************************************************************
  * 7. END                                                                  *
  ***************************************************************************/
@@ -18,8 +18,9 @@ extern unsigned char download_in_progress;
 #define VER_REV	 0		// not > 255
 
 
-unsigned int encPktCount[MAX_SSP_PORT];
-unsigned char sspSeq[MAX_SSP_PORT];
+/* the sequence bit and the packet counter are kept per bus (SSP_COMMAND.PortNumber) and ssp address */
+unsigned int encPktCount[MAX_SSP_BUS][MAX_SSP_PORT];
+unsigned char sspSeq[MAX_SSP_BUS][MAX_SSP_PORT];
 /*
 extern int PortStatus,PortStatus2,PortStatusUSB,PortStatusCCT;
 extern HANDLE hDevice,hDevice2,hDeviceUSB,hDeviceCCT;
@@ -54,7 +55,7 @@ int GetProcDLLVersion(unsigned char *ver)
 
 
 /*    DLL function call to generate host intermediate numbers to send to slave  */
-int InitiateSSPHostKeys(SSP_KEYS * keyArray, const unsigned char ssp_address)
+int InitiateSSPHostKeys(SSP_KEYS * keyArray, const unsigned char bus, const unsigned char ssp_address)
 {
 
 
@@ -76,11 +77,17 @@ int InitiateSSPHostKeys(SSP_KEYS * keyArray, const unsigned char ssp_address)
 
 
 	/* reset the apcket counter here for a successful key neg  */
-	encPktCount[ssp_address] = 0;
+	ResetSSPPacketCount(bus, ssp_address);
 
 	return 1;
 }
 
+/* a new key starts with packet count 0, call this when the host keys are prepared elsewhere */
+void ResetSSPPacketCount(const unsigned char bus, const unsigned char ssp_address)
+{
+	encPktCount[bus][ssp_address] = 0;
+}
+
 
 
 
@@ -94,7 +101,7 @@ int CreateSSPHostEncryptionKey(SSP_KEYS * keyArray)
 }
 
 
-int EncryptSSPPacket(unsigned char ptNum, unsigned char *dataIn, unsigned char *dataOut, unsigned char *lengthIn,
+int EncryptSSPPacket(unsigned char bus, unsigned char ptNum, unsigned char *dataIn, unsigned char *dataOut, unsigned char *lengthIn,
 		     unsigned char *lengthOut, unsigned long long *key)
 {
 #define FIXED_PACKET_LENGTH   7
@@ -115,7 +122,7 @@ int EncryptSSPPacket(unsigned char ptNum, unsigned char *dataIn, unsigned char *
 
 	/* add in the encrypted packet count   */
 	for (i = 0; i < 4; i++)
-		tmpData[1 + i] = (unsigned char) ((encPktCount[ptNum] >> (8 * i) & 0xFF));
+		tmpData[1 + i] = (unsigned char) ((encPktCount[bus][ptNum] >> (8 * i) & 0xFF));
 
 
 	for (i = 0; i < *lengthIn; i++)
@@ -141,7 +148,7 @@ int EncryptSSPPacket(unsigned char ptNum, unsigned char *dataIn, unsigned char *
 	*lengthOut = pkLength;
 	dataOut[0] = SSP_STEX;
 
-	encPktCount[ptNum]++;	/* incremnet the counter after a successful encrypted packet   */
+	encPktCount[bus][ptNum]++;	/* incremnet the counter after a successful encrypted packet   */
 
 	return 1;
 }
@@ -183,10 +190,12 @@ int CreateHostInterKey(SSP_KEYS * keyArray)
 
 void __attribute__ ((constructor)) my_init(void)
 {
-	int i;
-	for (i = 0; i < MAX_SSP_PORT; i++) {
-		encPktCount[i] = 0;
-		sspSeq[i] = 0x80;
+	int i, j;
+	for (i = 0; i < MAX_SSP_BUS; i++) {
+		for (j = 0; j < MAX_SSP_PORT; j++) {
+			encPktCount[i][j] = 0;
+			sspSeq[i][j] = 0x80;
+		}
 	}
 	srand((int) GetRTSC());
 	download_in_progress = 0;
@@ -205,6 +214,7 @@ void __attribute__ ((destructor)) my_fini(void)
 Name: NegotiateSSPEncryption
 Inputs:
     SSP_PORT The port handle (returned from OpenSSPPort) of the port to use
+    unsigned char bus: The bus index (SSP_COMMAND.PortNumber) of the port
     char ssp_address: The ssp_address to negotiate on
     SSP_FULL_KEY * key: The ssp encryption key to be used
 Return:
@@ -213,14 +223,36 @@ Return:
 Notes:
     Only the EncryptKey iin SSP_FULL_KEY will be set. The FixedKey needs to be set by the user
 */
-int NegotiateSSPEncryption(SSP_PORT port, const char ssp_address, SSP_FULL_KEY * key)
+int NegotiateSSPEncryption(SSP_PORT port, const unsigned char bus, const char ssp_address, SSP_FULL_KEY * key)
 {
 	SSP_KEYS temp_keys;
-	SSP_COMMAND sspc;
-	unsigned char i;
 	//setup the intial host keys
-	if (InitiateSSPHostKeys(&temp_keys, ssp_address) == 0)
+	if (InitiateSSPHostKeys(&temp_keys, bus, ssp_address) == 0)
 		return 0;
+	return ExchangeSSPEncryptionKeys(port, bus, ssp_address, &temp_keys, key);
+}
+
+/*
+Name: ExchangeSSPEncryptionKeys
+Inputs:
+    SSP_PORT The port handle (returned from OpenSSPPort) of the port to use
+    unsigned char bus: The bus index (SSP_COMMAND.PortNumber) of the port
+    char ssp_address: The ssp_address to negotiate on
+    SSP_KEYS * temp_keys: Host keys prepared by InitiateSSPHostKeys
+    SSP_FULL_KEY * key: The ssp encryption key to be used
+Return:
+    1 on success
+    0 on failure
+Notes:
+    The second half of NegotiateSSPEncryption, only this part talks to the unit. Preparing the
+    host keys (prime generation) takes a while, so it can be done without holding the port.
+*/
+int ExchangeSSPEncryptionKeys(SSP_PORT port, const unsigned char bus, const char ssp_address, SSP_KEYS * temp_keys,
+			      SSP_FULL_KEY * key)
+{
+	SSP_COMMAND sspc;
+	unsigned char i;
+	sspc.PortNumber = bus;
 	sspc.EncryptionStatus = 0;
 	sspc.RetryLevel = 2;
 	sspc.Timeout = 1000;
@@ -237,7 +269,7 @@ int NegotiateSSPEncryption(SSP_PORT port, const char ssp_address, SSP_FULL_KEY *
 	sspc.CommandDataLength = 9;
 	sspc.CommandData[0] = SSP_CMD_SET_GENERATOR;
 	for (i = 0; i < 8; ++i)
-		sspc.CommandData[1 + i] = (unsigned char) (temp_keys.Generator >> (i * 8));
+		sspc.CommandData[1 + i] = (unsigned char) (temp_keys->Generator >> (i * 8));
 	//send the command
 	SSPSendCommand(port, &sspc);
 	if (sspc.ResponseData[0] != SSP_RESPONSE_OK)
@@ -247,7 +279,7 @@ int NegotiateSSPEncryption(SSP_PORT port, const char ssp_address, SSP_FULL_KEY *
 	sspc.CommandDataLength = 9;
 	sspc.CommandData[0] = SSP_CMD_SET_MODULUS;
 	for (i = 0; i < 8; ++i)
-		sspc.CommandData[1 + i] = (unsigned char) (temp_keys.Modulus >> (i * 8));
+		sspc.CommandData[1 + i] = (unsigned char) (temp_keys->Modulus >> (i * 8));
 	//send the command
 	SSPSendCommand(port, &sspc);
 	if (sspc.ResponseData[0] != SSP_RESPONSE_OK)
@@ -257,20 +289,20 @@ int NegotiateSSPEncryption(SSP_PORT port, const char ssp_address, SSP_FULL_KEY *
 	sspc.CommandDataLength = 9;
 	sspc.CommandData[0] = SSP_CMD_REQ_KEY_EXCHANGE;
 	for (i = 0; i < 8; ++i)
-		sspc.CommandData[1 + i] = (unsigned char) (temp_keys.HostInter >> (i * 8));
+		sspc.CommandData[1 + i] = (unsigned char) (temp_keys->HostInter >> (i * 8));
 	//send the command
 	SSPSendCommand(port, &sspc);
 	if (sspc.ResponseData[0] != SSP_RESPONSE_OK)
 		return 0;
 
 	//read the slave key
-	temp_keys.SlaveInterKey = 0;
+	temp_keys->SlaveInterKey = 0;
 	for (i = 0; i < 8; ++i)
-		temp_keys.SlaveInterKey += ((long long) (sspc.ResponseData[1 + i])) << (8 * i);
+		temp_keys->SlaveInterKey += ((long long) (sspc.ResponseData[1 + i])) << (8 * i);
 
 
-	if (CreateSSPHostEncryptionKey(&temp_keys) == 0)
+	if (CreateSSPHostEncryptionKey(temp_keys) == 0)
 		return 0;
-	key->EncryptKey = temp_keys.KeyHost;
+	key->EncryptKey = temp_keys->KeyHost;
 	return 1;
 }
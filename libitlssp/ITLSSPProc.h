@@ -65,6 +65,13 @@ typedef struct {
 	SSP_FULL_KEY Key;
 	char portname[255];
 	unsigned long baud;
+	/* length of fData, which is mapped from the file if fMapped (and otherwise malloc'ed) */
+	unsigned long fLength;
+	unsigned char fMapped;
+	/* bus index (SSP_COMMAND.PortNumber) of the packet counters used while encrypted */
+	unsigned char bus;
+	SSP_DOWNLOAD_PROGRESS progress;
+	void *progressArg;
 } ITL_FILE_DOWNLOAD;
 void DownloadITLTarget(void *itl_file_pointer);
 int TestSplit(PAY * py, UINT32 valueToFind);
@@ -75,10 +82,12 @@ void __attribute__ ((destructor)) my_fini(void);
 //private
 clock_t GetClockMs();
 void SSPDataIn(unsigned char RxChar, SSP_TX_RX_PACKET * ss);
-int EncryptSSPPacket(unsigned char ptNum, unsigned char *dataIn, unsigned char *dataOut, unsigned char *lengthIn,
+int SSPDataInBlock(const unsigned char *data, int length, SSP_TX_RX_PACKET * ss);
+int EncryptSSPPacket(unsigned char bus, unsigned char ptNum, unsigned char *dataIn, unsigned char *dataOut, unsigned char *lengthIn,
 		     unsigned char *lengthOut, unsigned long long *key);
 int DecryptSSPPacket(unsigned char *dataIn, unsigned char *dataOut, unsigned char *lengthIn, unsigned char *lengthOut,
 		     unsigned long long *key);
-int InitiateSSPHostKeys(SSP_KEYS * keyArray, const unsigned char ssp_address);
+int InitiateSSPHostKeys(SSP_KEYS * keyArray, const unsigned char bus, const unsigned char ssp_address);
+void ResetSSPPacketCount(const unsigned char bus, const unsigned char ssp_address);
 int CreateHostInterKey(SSP_KEYS * keyArray);
 int CreateSSPHostEncryptionKey(SSP_KEYS * keyArray);
@@ -11,15 +11,19 @@
 
 
 
-extern unsigned int encPktCount[MAX_SSP_PORT];
-extern unsigned char sspSeq[MAX_SSP_PORT];
+extern unsigned int encPktCount[MAX_SSP_BUS][MAX_SSP_PORT];
+extern unsigned char sspSeq[MAX_SSP_BUS][MAX_SSP_PORT];
 
 int CompileSSPCommand(SSP_COMMAND * cmd, SSP_TX_RX_PACKET * ss)
 {
 
 	int i, j;
 	unsigned short crc;
-	unsigned char tBuffer[255];
+	unsigned char b;
+
+	/* the sequence bits and packet counters only exist for MAX_SSP_BUS buses */
+	if (cmd->PortNumber >= MAX_SSP_BUS)
+		return 0;
 
 	ss->rxPtr = 0;
 	for (i = 0; i < 255; i++)
@@ -32,7 +36,7 @@ int CompileSSPCommand(SSP_COMMAND * cmd, SSP_TX_RX_PACKET * ss)
 
 	/* for sync commands reset the deq bit   */
 	if (cmd->CommandData[0] == SSP_CMD_SYNC)
-		sspSeq[cmd->SSPAddress] = 0x80;
+		sspSeq[cmd->PortNumber][cmd->SSPAddress] = 0x80;
 
 
 
@@ -40,7 +44,7 @@ int CompileSSPCommand(SSP_COMMAND * cmd, SSP_TX_RX_PACKET * ss)
 	if (cmd->EncryptionStatus) {
 
 		if (!EncryptSSPPacket
-		    (cmd->SSPAddress, cmd->CommandData, cmd->CommandData, &cmd->CommandDataLength,
+		    (cmd->PortNumber, cmd->SSPAddress, cmd->CommandData, cmd->CommandData, &cmd->CommandDataLength,
 		     &cmd->CommandDataLength, (unsigned long long *) &cmd->Key))
 			return 0;
 
@@ -52,30 +56,41 @@ int CompileSSPCommand(SSP_COMMAND * cmd, SSP_TX_RX_PACKET * ss)
 	ss->rxPtr = 0;
 	ss->txPtr = 0;
 	ss->rxBufferLength = 3;
-	ss->txBufferLength = cmd->CommandDataLength + 5;	/* the full ssp packet length   */
-	ss->txData[0] = SSP_STX;	/* ssp packet start   */
-	ss->txData[1] = cmd->SSPAddress | sspSeq[cmd->SSPAddress];	/* the address/seq bit */
-	ss->txData[2] = cmd->CommandDataLength;	/* the data length only (always > 0)  */
-	for (i = 0; i < cmd->CommandDataLength; i++)	/* add the command data  */
-		ss->txData[3 + i] = cmd->CommandData[i];
-	/* calc the packet CRC  (all bytes except STX)   */
-	crc = cal_crc_loop_CCITT_A(ss->txBufferLength - 3, &ss->txData[1], CRC_SSP_SEED, CRC_SSP_POLY);
-	ss->txData[3 + cmd->CommandDataLength] = (unsigned char) (crc & 0xFF);
-	ss->txData[4 + cmd->CommandDataLength] = (unsigned char) ((crc >> 8) & 0xFF);
-
-
-	/* we now need to 'byte stuff' this buffered data   */
+/* appends one byte to the packet, 'byte stuffing' it if it is a SSP_STX */
+#define STUFF_BYTE(b)										\
+	do {											\
+		if (j >= (int) sizeof(ss->txData) - 1)						\
+			return 0;								\
+		ss->txData[j++] = (b);								\
+		if ((b) == SSP_STX)								\
+			ss->txData[j++] = SSP_STX;	/* SSP_STX found in data so add another to 'stuff it'  */	\
+	} while (0)
+
+	/* build, CRC and stuff the packet in a single pass: STX, address/seq, length, data, CRC  */
 	j = 0;
-	tBuffer[j++] = ss->txData[0];
-	for (i = 1; i < ss->txBufferLength; i++) {
-		tBuffer[j] = ss->txData[i];
-		if (ss->txData[i] == SSP_STX) {
-			tBuffer[++j] = SSP_STX;	/* SSP_STX found in data so add another to 'stuff it'  */
-		}
-		j++;
+	ss->txData[j++] = SSP_STX;	/* ssp packet start, the only byte not covered by the CRC   */
+	crc = CRC_SSP_SEED;
+
+	b = cmd->SSPAddress | sspSeq[cmd->PortNumber][cmd->SSPAddress];	/* the address/seq bit */
+	crc = CRC_SSP_UPDATE(crc, b);
+	STUFF_BYTE(b);
+
+	b = cmd->CommandDataLength;	/* the data length only (always > 0)  */
+	crc = CRC_SSP_UPDATE(crc, b);
+	STUFF_BYTE(b);
+
+	for (i = 0; i < cmd->CommandDataLength; i++) {	/* add the command data  */
+		b = cmd->CommandData[i];
+		crc = CRC_SSP_UPDATE(crc, b);
+		STUFF_BYTE(b);
 	}
-	for (i = 0; i < j; i++)
-		ss->txData[i] = tBuffer[i];
+
+	b = (unsigned char) (crc & 0xFF);
+	STUFF_BYTE(b);
+	b = (unsigned char) ((crc >> 8) & 0xFF);
+	STUFF_BYTE(b);
+#undef STUFF_BYTE
+
 	ss->txBufferLength = j;
 
 	return 1;
@@ -101,10 +116,12 @@ int SSPSendCommand(const SSP_PORT port, SSP_COMMAND * cmd)
 	int i;
 	unsigned char encryptLength;
 	unsigned short crcR;
-	unsigned char buffer;
-	unsigned char tData[255];
+	unsigned char buffer[255];
+	int bytesRead;
+	int ready;
 	unsigned char retry;
 	unsigned int slaveCount;
+	cmd->RetryCount = 0;
 	/* complie the SSP packet and check for errors  */
 	if (!CompileSSPCommand(cmd, &ssp)) {
 		cmd->ResponseStatus = SSP_PACKET_ERROR;
@@ -131,16 +148,26 @@ int SSPSendCommand(const SSP_PORT port, SSP_COMMAND * cmd)
 				cmd->ResponseStatus = SSP_CMD_TIMEOUT;
 				break;
 			}
-			while (BytesInBuffer(port) > 0) {
-				ReadData(port, &buffer, 1);
-				SSPDataIn(buffer, &ssp);
+			/* sleep until data arrives or the reply timeout is due */
+			ready = WaitForData(port, cmd->Timeout - (currentTime - txTime) + 1);
+			if (ready < 0) {
+				cmd->ResponseStatus = PORT_ERROR;
+				return 0;
 			}
+			if (ready == 0)
+				continue;
+			/* take everything that is there in one go */
+			bytesRead = ReadData(port, buffer, sizeof(buffer));
+			if (bytesRead > 0)
+				SSPDataInBlock(buffer, bytesRead, &ssp);
 		}
 
 		if (cmd->ResponseStatus == SSP_REPLY_OK)
 			break;
 
 		retry--;
+		if (retry > 0)
+			cmd->RetryCount++;
 	} while (retry > 0);
 
 
@@ -168,27 +195,21 @@ int SSPSendCommand(const SSP_PORT port, SSP_COMMAND * cmd)
 		for (i = 0; i < 4; i++)
 			slaveCount += (unsigned int) (ssp.rxData[5 + i]) << (i * 8);
 		/* no match then we discard this packet and do not act on it's info  */
-		if (slaveCount != encPktCount[cmd->SSPAddress]) {
+		if (slaveCount != encPktCount[cmd->PortNumber][cmd->SSPAddress]) {
 			cmd->ResponseStatus = SSP_PACKET_ERROR;
 			return 0;
 		}
 
-		/* restore data for correct decode  */
+		/* restore data for correct decode: move the plain data in place of the
+		   encrypted block, the CRC has been verified above so it isn't rebuilt  */
 		ssp.rxBufferLength = ssp.rxData[4] + 5;
-		tData[0] = ssp.rxData[0];
-		tData[1] = ssp.rxData[1];
-		tData[2] = ssp.rxData[4];
-		for (i = 0; i < ssp.rxData[4]; i++)
-			tData[3 + i] = ssp.rxData[9 + i];
-		crcR = cal_crc_loop_CCITT_A(ssp.rxBufferLength - 3, &tData[1], CRC_SSP_SEED, CRC_SSP_POLY);
-		tData[3 + ssp.rxData[4]] = (unsigned char) (crcR & 0xFF);
-		tData[4 + ssp.rxData[4]] = (unsigned char) ((crcR >> 8) & 0xFF);
-		for (i = 0; i < ssp.rxBufferLength; i++)
-			ssp.rxData[i] = tData[i];
+		ssp.rxData[2] = ssp.rxData[4];
+		for (i = 0; i < ssp.rxData[2]; i++)
+			ssp.rxData[3 + i] = ssp.rxData[9 + i];
 
 		/* for decrypted resonse with encrypted command, increment the counter here  */
 		//  if(!cmd->EncryptionStatus)
-		//encPktCount[cmd->SSPAddress]++;
+		//encPktCount[cmd->PortNumber][cmd->SSPAddress]++;
 
 
 	}
@@ -202,10 +223,10 @@ int SSPSendCommand(const SSP_PORT port, SSP_COMMAND * cmd)
 
 
 	/* alternate the seq bit   */
-	if (sspSeq[cmd->SSPAddress] == 0x80)
-		sspSeq[cmd->SSPAddress] = 0;
+	if (sspSeq[cmd->PortNumber][cmd->SSPAddress] == 0x80)
+		sspSeq[cmd->PortNumber][cmd->SSPAddress] = 0;
 	else
-		sspSeq[cmd->SSPAddress] = 0x80;
+		sspSeq[cmd->PortNumber][cmd->SSPAddress] = 0x80;
 
 
 	/* terminate the thread function   */
@@ -217,13 +238,23 @@ int SSPSendCommand(const SSP_PORT port, SSP_COMMAND * cmd)
 clock_t GetClockMs()
 {
 	clock_t test;
-	struct timeval tv;
-	gettimeofday(&tv, 0);
-	test = tv.tv_sec * 1000;
-	test += (tv.tv_usec) / 1000;
+	struct timespec ts;
+	/* monotonic, only ever used for measuring timeouts */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	test = ts.tv_sec * 1000;
+	test += (ts.tv_nsec) / 1000000;
 	return test;
 }
 
+/* feeds a block of received bytes into the packet decoder, stops after a complete packet */
+int SSPDataInBlock(const unsigned char *data, int length, SSP_TX_RX_PACKET * ss)
+{
+	int i;
+	for (i = 0; i < length && !ss->NewResponse; i++)
+		SSPDataIn(data[i], ss);
+	return i;
+}
+
 
 void SSPDataIn(unsigned char RxChar, SSP_TX_RX_PACKET * ss)
 {
@@ -15,6 +15,8 @@ extern "C" {
 
 
 #define MAX_SSP_PORT 200
+/* number of serial buses whose sequence bits and packet counters are kept apart, see SSP_COMMAND.PortNumber */
+#define MAX_SSP_BUS 8
 
 #define NO_ENCRYPTION 0
 #define ENCRYPTION_SET 1
@@ -40,7 +42,7 @@ extern "C" {
 		SSP_FULL_KEY Key;
 		unsigned long BaudRate;
 		unsigned long Timeout;
-		unsigned char PortNumber;
+		unsigned char PortNumber;	/* bus index (< MAX_SSP_BUS) of the port the command is sent on */
 		unsigned char SSPAddress;
 		unsigned char RetryLevel;
 		unsigned char EncryptionStatus;
@@ -50,6 +52,7 @@ extern "C" {
 		unsigned char ResponseDataLength;
 		unsigned char ResponseData[255];
 		unsigned char IgnoreError;
+		unsigned char RetryCount;	/* set by SSPSendCommand: number of retransmissions it needed */
 	} SSP_COMMAND;
 
 
@@ -178,6 +181,9 @@ Notes:
 
 
 
+/* called after each block of a download, block is 0 once the ram part (the loader) has been downloaded */
+	typedef void (*SSP_DOWNLOAD_PROGRESS) (const unsigned long block, const unsigned long blocks, void *arg);
+
 /*
 Name: DownloadFileToTarget
 Inputs:
@@ -241,6 +247,28 @@ Notes:
 	int DownloadDataToTarget(const unsigned char *data, const unsigned long dlength, const char *cPort,
 				 const unsigned char sspAddress, const unsigned long long key);
 
+/*
+Name:   DownloadFileToPort
+Inputs:
+    char *file: The full path of the file to download
+    SSP_PORT *port: The open port to use, replaced by the port reopened after the unit has restarted (-1 if that failed)
+    char *portname: The name of the port, needed to reopen it
+    unsigned char bus: The bus index (SSP_COMMAND.PortNumber) of the port
+    unsigned char sspAddress: The ssp address to download to
+    key: The encryption key to use. 0 to disable encryption
+    SSP_DOWNLOAD_PROGRESS progress: Called after each block, may be NULL
+    void *arg: Passed to progress
+Return:
+    DOWNLOAD_COMPLETE (0x100000) on success, otherwise one of the failures listed at DownloadFileToTarget
+Notes:
+    Same as DownloadFileToTarget, but on a port the caller has opened and in the calling thread. The file is
+    mapped instead of read, and the checksum of the next block is calculated while a block is transmitted.
+    The port is left at the download baud rate, set it back once the unit has restarted.
+*/
+	unsigned long DownloadFileToPort(const char *file, SSP_PORT * port, const char *portname, const unsigned char bus,
+					 const unsigned char sspAddress, const unsigned long long key,
+					 SSP_DOWNLOAD_PROGRESS progress, void *arg);
+
 /*
 Name:   GetDownloadStatus
 Inputs:
@@ -271,6 +299,7 @@ Notes:
 Name: NegotiateSSPEncryption
 Inputs:
     SSP_PORT The port handle (returned from OpenSSPPort) of the port to use
+    unsigned char bus: The bus index (SSP_COMMAND.PortNumber) of the port
     char ssp_address: The ssp_address to negotiate on
     SSP_FULL_KEY * key: The ssp encryption key to be used
 Return:
@@ -279,7 +308,24 @@ Return:
 Notes:
     Only the EncryptKey iin SSP_FULL_KEY will be set. The FixedKey needs to be set by the user
 */
-	int NegotiateSSPEncryption(SSP_PORT port, const char ssp_address, SSP_FULL_KEY * key);
+	int NegotiateSSPEncryption(SSP_PORT port, const unsigned char bus, const char ssp_address, SSP_FULL_KEY * key);
+
+/*
+Name: ExchangeSSPEncryptionKeys
+Inputs:
+    SSP_PORT The port handle (returned from OpenSSPPort) of the port to use
+    unsigned char bus: The bus index (SSP_COMMAND.PortNumber) of the port
+    char ssp_address: The ssp_address to negotiate on
+    SSP_KEYS * temp_keys: Host keys prepared by InitiateSSPHostKeys
+    SSP_FULL_KEY * key: The ssp encryption key to be used
+Return:
+    1 on success
+    0 on failure
+Notes:
+    NegotiateSSPEncryption without preparing the host keys, only this part needs the port
+*/
+	int ExchangeSSPEncryptionKeys(SSP_PORT port, const unsigned char bus, const char ssp_address, SSP_KEYS * temp_keys,
+				      SSP_FULL_KEY * key);
 
 
 //SSP functions
@@ -1,8 +1,10 @@
-
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 
 #include <pthread.h>
@@ -15,6 +17,132 @@
 #include "../libitlssp/SSPComs.h"
 unsigned char download_in_progress;
 unsigned long download_block;
+
+/* maps the file read only, the pages are read ahead as the download goes through them */
+static unsigned long _map_file(const char *file, unsigned char **data, unsigned long *length)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd == -1)
+		return OPEN_FILE_ERROR;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return READ_FILE_ERROR;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return READ_FILE_ERROR;
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	*data = map;
+	*length = st.st_size;
+	return 0;
+}
+
+static void _free_download(ITL_FILE_DOWNLOAD * itlFile)
+{
+	if (itlFile->fMapped)
+		munmap(itlFile->fData, itlFile->fLength);
+	else
+		free(itlFile->fData);
+	free(itlFile);
+}
+
+/* checks the ITL header and calculates the number of blocks, returns 0 or NOT_ITL_FILE */
+static unsigned long _read_header(ITL_FILE_DOWNLOAD * itlFile)
+{
+	int i;
+	unsigned long numCurBytes;
+	unsigned short dBlockSize;
+
+	// check for ITL BV/SH type file
+	if (itlFile->fLength < 128 || itlFile->fData[0] != 'I' || itlFile->fData[1] != 'T'
+	    || itlFile->fData[2] != 'L')
+		return NOT_ITL_FILE;
+
+	numCurBytes = 0;
+	for (i = 0; i < 4; i++) {
+		numCurBytes += (unsigned long) itlFile->fData[17 + i] << (8 * (3 - i));
+	}
+	//get the block size from header
+	dBlockSize = (256 * (unsigned short) itlFile->fData[0x3e]) + (unsigned short) itlFile->fData[0x3f];
+	// correct for NV9 type
+	if (dBlockSize == 0)
+		dBlockSize = 4096;
+
+	itlFile->NumberOfBlocks = numCurBytes / dBlockSize;
+	if (numCurBytes % dBlockSize != 0)
+		itlFile->NumberOfBlocks += 1;
+
+	//get the number of ram bytes to download
+	itlFile->NumberOfRamBytes = 0;
+	for (i = 0; i < 4; i++)
+		itlFile->NumberOfRamBytes += (unsigned long) itlFile->fData[7 + i] << (8 * (3 - i));
+	return 0;
+}
+
+/* syncs with the target on itlFile->port and negotiates the encryption if there is a key */
+static unsigned long _connect_target(ITL_FILE_DOWNLOAD * itlFile, const unsigned long long key)
+{
+	SSP_COMMAND sspC;
+
+	/* check target connection   */
+	sspC.Timeout = 1000;
+	sspC.BaudRate = 9600;
+	sspC.RetryLevel = 2;
+	sspC.SSPAddress = itlFile->SSPAddress;
+	sspC.PortNumber = itlFile->bus;
+	sspC.EncryptionStatus = 0;
+	sspC.CommandDataLength = 1;
+	sspC.CommandData[0] = SSP_CMD_SYNC;
+
+	if (SSPSendCommand(itlFile->port, &sspC) == 0)
+		return SYNC_CONNECTION_FAIL;
+	if (sspC.ResponseData[0] != SSP_RESPONSE_OK)
+		return SYNC_CONNECTION_FAIL;
+	if (key > 0) {
+		if (NegotiateSSPEncryption(itlFile->port, itlFile->bus, itlFile->SSPAddress, &itlFile->Key) == 0)
+			return SYNC_CONNECTION_FAIL;
+		itlFile->EncryptionStatus = 1;
+		itlFile->Key.FixedKey = key;
+	}
+	return 0;
+}
+
+/* opens the port and starts the download thread, which frees itlFile */
+static int _start_download(ITL_FILE_DOWNLOAD * itlFile, const char *cPort, const unsigned char sspAddress,
+			   const unsigned long long key)
+{
+	unsigned long result;
+	pthread_t thread;
+
+	itlFile->SSPAddress = sspAddress;
+	itlFile->bus = 0;	/* the download has a port of its own, use the counters of the first bus */
+	itlFile->progress = NULL;
+	itlFile->EncryptionStatus = 0;
+	strncpy(itlFile->portname, cPort, sizeof(itlFile->portname) - 1);
+	itlFile->portname[sizeof(itlFile->portname) - 1] = '\0';
+	itlFile->port = OpenSSPPort(cPort);
+	if (itlFile->port == -1) {
+		_free_download(itlFile);
+		return PORT_OPEN_FAIL;
+	}
+	result = _connect_target(itlFile, key);
+	if (result != 0) {
+		CloseSSPPort(itlFile->port);
+		_free_download(itlFile);
+		return result;
+	}
+	result = itlFile->NumberOfBlocks;
+	pthread_create(&thread, NULL, (void *) DownloadITLTarget, (void *) itlFile);
+	//_beginthread(DownloadITLTarget,0,NULL);
+	return result;
+}
+
 /*
 Name:   DownloadDataToTarget
 Inputs:
@@ -46,17 +174,13 @@ Notes:
 int DownloadDataToTarget(const unsigned char *data, const unsigned long dlength, const char *cPort,
 			 const unsigned char sspAddress, const unsigned long long key)
 {
-
-	int i;
-	unsigned long numCurBytes;
-	unsigned short dBlockSize;
 	ITL_FILE_DOWNLOAD *itlFile;
-	SSP_COMMAND sspC;
-	SSP_PORT port;
 	if (download_in_progress == 1)
 		return PORT_OPEN_FAIL;
 	itlFile = malloc(sizeof(ITL_FILE_DOWNLOAD));
 	itlFile->fData = malloc(dlength);
+	itlFile->fLength = dlength;
+	itlFile->fMapped = 0;
 	memcpy(itlFile->fData, data, dlength);
 
 	/*ramStatus.currentRamBlocks = 0;
@@ -65,75 +189,11 @@ int DownloadDataToTarget(const unsigned char *data, const unsigned long dlength,
 	 */
 
 	download_block = 0;
-	// check for ITL BV/SH type file
-	if (itlFile->fData[0] == 'I' && itlFile->fData[1] == 'T' && itlFile->fData[2] == 'L') {
-
-		numCurBytes = 0;
-		for (i = 0; i < 4; i++) {
-			numCurBytes += (unsigned long) itlFile->fData[17 + i] << (8 * (3 - i));
-		}
-		//get the block size from header
-		dBlockSize = (256 * (unsigned short) itlFile->fData[0x3e]) + (unsigned short) itlFile->fData[0x3f];
-		// correct for NV9 type
-		if (dBlockSize == 0)
-			dBlockSize = 4096;
-
-		itlFile->NumberOfBlocks = numCurBytes / dBlockSize;
-		if (numCurBytes % dBlockSize != 0)
-			itlFile->NumberOfBlocks += 1;
-	} else {
-		free(itlFile->fData);
-		free(itlFile);
+	if (_read_header(itlFile) != 0) {
+		_free_download(itlFile);
 		return NOT_ITL_FILE;
 	}
-
-	/* check target connection   */
-	sspC.Timeout = 1000;
-	sspC.BaudRate = 9600;
-	sspC.RetryLevel = 2;
-	sspC.SSPAddress = sspAddress;
-	itlFile->SSPAddress = sspAddress;
-	port = OpenSSPPort(cPort);
-	strcpy(itlFile->portname, cPort);
-	itlFile->port = port;
-	if (port == -1) {
-		free(itlFile->fData);
-		free(itlFile);
-		return PORT_OPEN_FAIL;
-	}
-	sspC.EncryptionStatus = 0;
-	sspC.CommandDataLength = 1;
-	sspC.CommandData[0] = SSP_CMD_SYNC;
-
-	if (SSPSendCommand(port, &sspC) == 0) {
-		CloseSSPPort(port);
-		free(itlFile->fData);
-		free(itlFile);
-		return SYNC_CONNECTION_FAIL;
-	}
-	if (sspC.ResponseData[0] != SSP_RESPONSE_OK) {
-		CloseSSPPort(port);
-		free(itlFile->fData);
-		free(itlFile);
-		return SYNC_CONNECTION_FAIL;
-	}
-	if (key > 0) {
-		if (NegotiateSSPEncryption(port, sspAddress, &itlFile->Key) == 0) {
-			CloseSSPPort(port);
-			free(itlFile->fData);
-			free(itlFile);
-			return SYNC_CONNECTION_FAIL;
-		}
-		itlFile->EncryptionStatus = 1;
-		itlFile->Key.FixedKey = key;
-	}
-	pthread_t thread;
-	pthread_create(&thread, NULL, (void *) DownloadITLTarget, (void *) itlFile);
-	//_beginthread(DownloadITLTarget,0,NULL);
-
-	return itlFile->NumberOfBlocks;
-
-
+	return _start_download(itlFile, cPort, sspAddress, key);
 }
 
 /*
@@ -162,52 +222,55 @@ Return:
 Notes:
     The download is done in a seperate thread - see GetDownloadStatus() for information about its progress.
     Only one download operation may be in progress at once.
+    The file is mapped and not copied, it must not change during the download.
 */
 int DownloadFileToTarget(const char *file, const char *port, const unsigned char sspAddress,
 			 const unsigned long long key)
 {
-	FILE *f;
-	unsigned long data_length = 0;
-	unsigned char *data;
-	unsigned long i;
-	f = fopen(file, "rb");
-
-	if (f == 0)
-		return OPEN_FILE_ERROR;
+	ITL_FILE_DOWNLOAD *itlFile;
+	unsigned long result;
+	if (download_in_progress == 1)
+		return PORT_OPEN_FAIL;
+	itlFile = malloc(sizeof(ITL_FILE_DOWNLOAD));
+	result = _map_file(file, &itlFile->fData, &itlFile->fLength);
+	if (result != 0) {
+		free(itlFile);
+		return result;
+	}
+	itlFile->fMapped = 1;
 
-	//get length of file
-	fseek(f, 0, SEEK_END);
-	data_length = ftell(f);
-	rewind(f);
-	data = malloc(data_length);
-	i = fread(data, 1, data_length, f);
-	fclose(f);
-	i = DownloadDataToTarget(data, data_length, port, sspAddress, key);
-	free(data);
-	return i;
+	download_block = 0;
+	if (_read_header(itlFile) != 0) {
+		_free_download(itlFile);
+		return NOT_ITL_FILE;
+	}
+	return _start_download(itlFile, port, sspAddress, key);
 }
 
 unsigned short _read_single_byte_reply(ITL_FILE_DOWNLOAD * itlFile, const unsigned long timeout)
 {
 	unsigned char buffer;
-	clock_t start = GetClockMs();
 
-	while (BytesInBuffer(itlFile->port) == 0) {
-		usleep(1000);
-		if (GetClockMs() - start > timeout)
-			return -1;
-	}
+	if (WaitForData(itlFile->port, timeout) <= 0)
+		return -1;
 	ReadData(itlFile->port, &buffer, 1);
 	return buffer;
 }
 
-unsigned char _send_download_command(const unsigned char *data, const unsigned long length,
-				     const unsigned char expected_response, ITL_FILE_DOWNLOAD * itlFile)
+/* throws away whatever the unit has sent so far */
+static void _flush_input(ITL_FILE_DOWNLOAD * itlFile)
 {
 	unsigned char buffer;
 	while (BytesInBuffer(itlFile->port) > 0) {
 		ReadData(itlFile->port, &buffer, 1);
 	}
+}
+
+unsigned char _send_download_command(const unsigned char *data, const unsigned long length,
+				     const unsigned char expected_response, ITL_FILE_DOWNLOAD * itlFile)
+{
+	unsigned char buffer;
+	_flush_input(itlFile);
 	WriteData(data, length, itlFile->port);
 
 	buffer = _read_single_byte_reply(itlFile, 500);
@@ -224,6 +287,10 @@ unsigned long _download_ram_file(ITL_FILE_DOWNLOAD * itlFile, SSP_COMMAND * sspC
 	unsigned long baud;
 	unsigned char buffer;
 	int numRamBlocks;
+
+	if (128 + itlFile->NumberOfRamBytes > itlFile->fLength)
+		return READ_FILE_ERROR;
+
 	//initiate communication
 	sspC->CommandDataLength = 2;
 	sspC->CommandData[0] = SSP_CMD_PROGRAM;
@@ -258,43 +325,65 @@ unsigned long _download_ram_file(ITL_FILE_DOWNLOAD * itlFile, SSP_COMMAND * sspC
 		if (baud == 0)
 			baud = 38400;
 	}
-	SetBaud(itlFile->port, baud);
+	if (SetBaud(itlFile->port, baud) == 0)
+		return HI_TRANSFER_SPEED_FAIL;
 	itlFile->baud = baud;
 
 	usleep(500000);
 
 	numRamBlocks = itlFile->NumberOfRamBytes / RAM_DWNL_BLOCK_SIZE;
 
+	/* the blocks follow each other without a handshake, so let the port queue them (a byte takes 11 bits on the wire) */
 	for (i = 0; i < numRamBlocks; i++) {
-		WriteData(&itlFile->fData[128 + (i * RAM_DWNL_BLOCK_SIZE)], RAM_DWNL_BLOCK_SIZE, itlFile->port);
-		while (TransmitComplete(itlFile->port) == 0)
-			usleep(1000);
+		QueueData(&itlFile->fData[128 + (i * RAM_DWNL_BLOCK_SIZE)], RAM_DWNL_BLOCK_SIZE, itlFile->port);
 
 		//ramStatus.currentRamBlocks = i;
 	}
 
 	if ((itlFile->NumberOfRamBytes % RAM_DWNL_BLOCK_SIZE) != 0) {
-		WriteData(&itlFile->fData[128 + (i * RAM_DWNL_BLOCK_SIZE)],
+		QueueData(&itlFile->fData[128 + (i * RAM_DWNL_BLOCK_SIZE)],
 			  itlFile->NumberOfRamBytes % RAM_DWNL_BLOCK_SIZE, itlFile->port);
 	}
-	buffer = _read_single_byte_reply(itlFile, 500);
+	buffer = _read_single_byte_reply(itlFile, 500 + itlFile->NumberOfRamBytes * 11000 / baud);
 	//check checksum
 	if (itlFile->fData[0x10] != buffer)
 		return DATA_TRANSFER_FAIL;
 
+	if (itlFile->progress)
+		itlFile->progress(0, itlFile->NumberOfBlocks, itlFile->progressArg);
 	return DOWNLOAD_COMPLETE;
 }
 
+/* checksum of a block of the main file */
+static unsigned char _block_checksum(const ITL_FILE_DOWNLOAD * itlFile, const unsigned long cur_block)
+{
+	unsigned long block_offset;
+	unsigned long i;
+	unsigned char chk = 0;
+	block_offset = 128 + ((cur_block - 1) * itlFile->dwnlBlockSize) + itlFile->NumberOfRamBytes;
+	for (i = 0; i < itlFile->dwnlBlockSize; ++i)
+		chk ^= itlFile->fData[block_offset + i];
+	return chk;
+}
+
 #define ram_OK_ACK  0x32
 unsigned long _download_main_file(ITL_FILE_DOWNLOAD * itlFile)
 {
 	unsigned char chk;
+	unsigned char next_chk;
+	unsigned short reply;
 	unsigned long cur_block;
-	unsigned long i;
 	unsigned long block_offset;
+
+	if (itlFile->dwnlBlockSize == 0
+	    || 128 + itlFile->NumberOfRamBytes + itlFile->NumberOfBlocks * itlFile->dwnlBlockSize > itlFile->fLength)
+		return READ_FILE_ERROR;
+
 	CloseSSPPort(itlFile->port);
 	sleep(2);
-	OpenSSPPort(itlFile->portname);
+	itlFile->port = OpenSSPPort(itlFile->portname);
+	if (itlFile->port == -1)
+		return PORT_OPEN_FAIL;
 	SetBaud(itlFile->port, itlFile->baud);
 	//ensure buffer clear after restart
 	if (_send_download_command(&itlFile->fData[6], 1, ram_OK_ACK, itlFile) == 0)
@@ -303,70 +392,110 @@ unsigned long _download_main_file(ITL_FILE_DOWNLOAD * itlFile)
 	if (_send_download_command(itlFile->fData, 128, ram_OK_ACK, itlFile) == 0)
 		return DATA_TRANSFER_FAIL;
 
+	/* the block and its checksum are queued, and the checksum of the next block is calculated
+	   (reading its pages from the file) while they are still on the wire */
+	chk = itlFile->NumberOfBlocks > 0 ? _block_checksum(itlFile, 1) : 0;
 	for (cur_block = 1; cur_block <= itlFile->NumberOfBlocks; ++cur_block) {
 		block_offset = 128 + ((cur_block - 1) * itlFile->dwnlBlockSize) + itlFile->NumberOfRamBytes;
-		chk = 0;
-		for (i = 0; i < itlFile->dwnlBlockSize; ++i)
-			chk ^= itlFile->fData[block_offset + i];
-		/*
-		   for(i = 0; i < itlFile->dwnlBlockSize/128; ++i)
-		   {
-		   WriteData(&itlFile->fData[block_offset + (i*128)],128,itlFile->port);
-		   while (TransmitComplete(itlFile->port) == 0)
-		   //usleep(1000);
-		   sleep(0);
-
-		   } */
-		WriteData(&itlFile->fData[block_offset], itlFile->dwnlBlockSize, itlFile->port);
-		while (TransmitComplete(itlFile->port) == 0)
-			usleep(1000);
-		if (_send_download_command(&chk, 1, chk, itlFile) == 0)
+		_flush_input(itlFile);
+		if (QueueData(&itlFile->fData[block_offset], itlFile->dwnlBlockSize, itlFile->port) == 0
+		    || QueueData(&chk, 1, itlFile->port) == 0)
 			return DATA_TRANSFER_FAIL;
 
+		next_chk = cur_block < itlFile->NumberOfBlocks ? _block_checksum(itlFile, cur_block + 1) : 0;
+
+		reply = _read_single_byte_reply(itlFile, 500 + itlFile->dwnlBlockSize * 11000 / itlFile->baud);
+		if (reply != chk)
+			return DATA_TRANSFER_FAIL;
+		chk = next_chk;
+
 		download_block = cur_block;
+		if (itlFile->progress)
+			itlFile->progress(cur_block, itlFile->NumberOfBlocks, itlFile->progressArg);
 	}
 	return DOWNLOAD_COMPLETE;
 
 }
 
-void DownloadITLTarget(void *itl_file_pointer)
+/* the ram part (the loader) and then the main part of the file */
+static unsigned long _download_file(ITL_FILE_DOWNLOAD * itlFile)
 {
-	ITL_FILE_DOWNLOAD *itlFile = 0;
-	unsigned int i;
 	unsigned long return_value;
 	SSP_COMMAND sspC;
-	itlFile = (ITL_FILE_DOWNLOAD *) itl_file_pointer;
-
-	download_in_progress = 1;
 
 	//ramStatus.ramState = rmd_ESTABLISH_COMS;
 	sspC.Timeout = 1000;
 	sspC.BaudRate = 9600;
 	sspC.RetryLevel = 2;
 	sspC.SSPAddress = itlFile->SSPAddress;
+	sspC.PortNumber = itlFile->bus;
 	sspC.EncryptionStatus = 0;
 
 	if (itlFile->EncryptionStatus) {
 		sspC.EncryptionStatus = 1;
 		sspC.Key = itlFile->Key;
 	}
-	//get the number of ram bytes to download
-	itlFile->NumberOfRamBytes = 0;
-	for (i = 0; i < 4; i++)
-		itlFile->NumberOfRamBytes += (unsigned long) itlFile->fData[7 + i] << (8 * (3 - i));
 
 	return_value = _download_ram_file(itlFile, &sspC);
 	if (return_value == DOWNLOAD_COMPLETE) {
 		return_value = _download_main_file(itlFile);
 	}
+	return return_value;
+}
+
+void DownloadITLTarget(void *itl_file_pointer)
+{
+	ITL_FILE_DOWNLOAD *itlFile = 0;
+	unsigned long return_value;
+	itlFile = (ITL_FILE_DOWNLOAD *) itl_file_pointer;
+
+	download_in_progress = 1;
+
+	return_value = _download_file(itlFile);
 	CloseSSPPort(itlFile->port);
-	free(itlFile->fData);
-	free(itlFile);
+	_free_download(itlFile);
 	download_in_progress = 0;
 	download_block = return_value;
 	pthread_exit(NULL);
 }
 
+unsigned long DownloadFileToPort(const char *file, SSP_PORT * port, const char *portname, const unsigned char bus,
+				 const unsigned char sspAddress, const unsigned long long key,
+				 SSP_DOWNLOAD_PROGRESS progress, void *arg)
+{
+	ITL_FILE_DOWNLOAD *itlFile;
+	unsigned long result;
+
+	itlFile = malloc(sizeof(ITL_FILE_DOWNLOAD));
+	if (itlFile == NULL)
+		return READ_FILE_ERROR;
+	result = _map_file(file, &itlFile->fData, &itlFile->fLength);
+	if (result != 0) {
+		free(itlFile);
+		return result;
+	}
+	itlFile->fMapped = 1;
+
+	result = _read_header(itlFile);
+	if (result == 0) {
+		itlFile->port = *port;
+		itlFile->bus = bus;
+		itlFile->SSPAddress = sspAddress;
+		itlFile->EncryptionStatus = 0;
+		itlFile->progress = progress;
+		itlFile->progressArg = arg;
+		strncpy(itlFile->portname, portname, sizeof(itlFile->portname) - 1);
+		itlFile->portname[sizeof(itlFile->portname) - 1] = '\0';
+
+		result = _connect_target(itlFile, key);
+		if (result == 0)
+			result = _download_file(itlFile);
+		*port = itlFile->port;
+	}
+	_free_download(itlFile);
+	return result;
+}
+
 unsigned long GetDownloadStatus()
 {
 	return download_block;
@@ -1,13 +1,621 @@
+#define _POSIX_C_SOURCE 200809L
 
 #include <termios.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/select.h>
+#include <time.h>
+#include <fcntl.h>
+
+#include <pthread.h>
 
 #include "../libitlssp/port_linux.h"
+#include "../libitlssp/ITLSSPProc.h"
+#include "../libitlssp/Random.h"
+#include "../libitlssp/serialfunc.h"
+
+
+/* everything kept per serial bus, selected by SSP_COMMAND.PortNumber */
+typedef struct {
+	/* port handle, only valid while is_open */
+	int port;
+	int is_open;
+	/* name of the port, to reopen it after a download */
+	char name[256];
+	/* rate the port is set to (changed with set_ssp_bus_baud while holding the bus) */
+	unsigned long baud;
+	/* protects busy and waiting, all devices on a bus share it */
+	pthread_mutex_t lock;
+	/* signaled whenever the bus becomes free */
+	pthread_cond_t released;
+	/* only one exchange may be in flight, set by acquire_bus */
+	int busy;
+	/* number of threads waiting for the bus, per priority */
+	unsigned int waiting[SSP_PRIORITIES];
+	/* minimum gap (ms) between two exchanges with the same ssp address */
+	unsigned long command_gap[MAX_SSP_PORT];
+	/* monotonic time (ms) the last exchange with an ssp address has finished, 0 if none yet */
+	unsigned long long last_exchange[MAX_SSP_PORT];
+	/* separate from lock, reading the stats must not wait for an exchange */
+	pthread_mutex_t stats_lock;
+	SSP_COMMAND_STATS stats[256];
+	SSP_NEGOTIATION_STATS negotiation;
+} SSP_BUS;
+
+static SSP_BUS buses[MAX_SSP_BUS];
+
+/* prepared host keys, filled by the key pool thread */
+static struct {
+	pthread_mutex_t lock;
+	/* signaled when a key has been taken or the thread should stop */
+	pthread_cond_t taken;
+	SSP_KEYS keys[SSP_KEY_POOL_SIZE];
+	int count;
+	int running;
+	pthread_t thread;
+	/* source of the random numbers, -1 if unavailable */
+	int random_fd;
+} key_pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, { { 0 } }, 0, 0, 0, -1 };
+
+/* records of the wire capture, queued by the exchanging threads and written out by the capture thread */
+#define SSP_CAPTURE_SLOTS 1024
+
+typedef struct {
+	/* slot is free for the producer at position == sequence, filled for the writer at sequence == position + 1 */
+	atomic_size_t sequence;
+	SSP_CAPTURE_RECORD record;
+	unsigned char data[255];
+} SSP_CAPTURE_SLOT;
+
+static struct {
+	SSP_CAPTURE_SLOT slots[SSP_CAPTURE_SLOTS];
+	atomic_size_t head;
+	/* only touched by the capture thread */
+	size_t tail;
+	atomic_int running;
+	int fd;
+	pthread_t thread;
+	atomic_ulong captured;
+	atomic_ulong dropped;
+} capture = { .fd = -1 };
+
+/* a capture mapped by start_ssp_replay, its records ordered by bus and address */
+typedef struct {
+	SSP_CAPTURE_RECORD record;
+	const unsigned char *data;
+} SSP_REPLAY_RECORD;
+
+#define SSP_REPLAY_KEYS (MAX_SSP_BUS * MAX_SSP_PORT)
+
+static struct {
+	int active;
+	int realtime;
+	unsigned char *map;
+	size_t length;
+	SSP_REPLAY_RECORD *records;
+	/* records of key k are records[first[k]] up to records[first[k + 1]], not yet replayed from cursor[k] */
+	size_t first[SSP_REPLAY_KEYS + 1];
+	size_t cursor[SSP_REPLAY_KEYS];
+	/* protects cursor and the counters */
+	pthread_mutex_t lock;
+	unsigned long replayed;
+	unsigned long unmatched;
+	unsigned long skipped;
+} replay = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* priority of the exchanges started by this thread, see set_ssp_priority */
+static _Thread_local int thread_priority = SSP_PRIORITY_INTERACTIVE;
+
+const unsigned long ssp_latency_bounds[SSP_LATENCY_BUCKETS - 1] = { 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000 };
+
+static unsigned long long monotonic_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* waits only for what is left of the gap since the last exchange with this address */
+static void wait_for_command_gap(const SSP_BUS * bus, const unsigned char ssp_address)
+{
+	unsigned long long due;
+	unsigned long long now;
+	struct timespec ts;
+
+	if (bus->command_gap[ssp_address] == 0 || bus->last_exchange[ssp_address] == 0)
+		return;
+	/* a replay as fast as possible doesn't wait for anything */
+	if (replay.active && !replay.realtime)
+		return;
+
+	due = bus->last_exchange[ssp_address] + bus->command_gap[ssp_address];
+	now = monotonic_ms();
+	if (now >= due)
+		return;
+
+	ts.tv_sec = (due - now) / 1000;
+	ts.tv_nsec = ((due - now) % 1000) * 1000000;
+	while (nanosleep(&ts, &ts) == -1)
+		;
+}
+
+/* waits until the bus is free and nobody with a higher priority is waiting for it */
+static void acquire_bus(SSP_BUS * bus)
+{
+	int priority = thread_priority;
+	int p;
+
+	pthread_mutex_lock(&bus->lock);
+	bus->waiting[priority]++;
+	for (;;) {
+		for (p = 0; p < priority && bus->waiting[p] == 0; p++)
+			;
+		if (!bus->busy && p == priority)
+			break;
+		pthread_cond_wait(&bus->released, &bus->lock);
+	}
+	bus->waiting[priority]--;
+	bus->busy = 1;
+	pthread_mutex_unlock(&bus->lock);
+}
+
+static void release_bus(SSP_BUS * bus)
+{
+	pthread_mutex_lock(&bus->lock);
+	bus->busy = 0;
+	pthread_cond_broadcast(&bus->released);
+	pthread_mutex_unlock(&bus->lock);
+}
+
+/* opens the port again if that failed after a download, called with the bus acquired, returns 0 while it is lost */
+static int reopen_port(SSP_BUS * bus)
+{
+	if (bus->port != -1 || replay.active)
+		return 1;
+	bus->port = OpenSSPPort(bus->name);
+	if (bus->port == -1)
+		return 0;
+	SetBaud(bus->port, bus->baud);
+	tcflush(bus->port, TCIFLUSH);
+	return 1;
+}
+
+/* random number from /dev/urandom, GenerateRandomNumber only changes once a second */
+static unsigned long long pool_random(void)
+{
+	unsigned long long n;
+
+	if (key_pool.random_fd == -1 || read(key_pool.random_fd, &n, sizeof(n)) != sizeof(n))
+		return GenerateRandomNumber();
+	return n;
+}
+
+static long long pool_prime(void)
+{
+	long long n = pool_random() % MAX_PRIME_NUMBER;
+
+	/* same as GeneratePrime, the next odd number which passes miller-rabin */
+	n |= 1;
+	if (n < 5)
+		n = 5;
+	while (MillerRabin(n, 5) == 0)
+		n += 2;
+	return n;
+}
+
+/* the same as InitiateSSPHostKeys, with a better random source and the generator below the modulus */
+static void prepare_host_keys(SSP_KEYS * keys)
+{
+	long long swap;
+
+	memset(keys, 0, sizeof(*keys));
+	do {
+		keys->Generator = pool_prime();
+		keys->Modulus = pool_prime();
+	} while (keys->Generator == keys->Modulus);
+	if (keys->Generator > keys->Modulus) {
+		swap = keys->Generator;
+		keys->Generator = keys->Modulus;
+		keys->Modulus = swap;
+	}
+	keys->HostRandom = (long long) (pool_random() % MAX_RANDOM_INTEGER);
+	keys->HostInter = XpowYmodN(keys->Generator, keys->HostRandom, keys->Modulus);
+}
+
+static void *key_pool_thread(void *arg)
+{
+	SSP_KEYS keys;
+
+	(void) arg;
+	pthread_mutex_lock(&key_pool.lock);
+	while (key_pool.running) {
+		if (key_pool.count == SSP_KEY_POOL_SIZE) {
+			pthread_cond_wait(&key_pool.taken, &key_pool.lock);
+			continue;
+		}
+		pthread_mutex_unlock(&key_pool.lock);
+		prepare_host_keys(&keys);
+		pthread_mutex_lock(&key_pool.lock);
+		key_pool.keys[key_pool.count++] = keys;
+	}
+	pthread_mutex_unlock(&key_pool.lock);
+	return NULL;
+}
+
+/* takes prepared host keys, returns 0 if the pool is empty */
+static int take_host_keys(SSP_KEYS * keys)
+{
+	int taken = 0;
+
+	pthread_mutex_lock(&key_pool.lock);
+	if (key_pool.count > 0) {
+		*keys = key_pool.keys[--key_pool.count];
+		taken = 1;
+		pthread_cond_signal(&key_pool.taken);
+	}
+	pthread_mutex_unlock(&key_pool.lock);
+	return taken;
+}
+
+int start_ssp_key_pool(void)
+{
+	pthread_mutex_lock(&key_pool.lock);
+	if (key_pool.running) {
+		pthread_mutex_unlock(&key_pool.lock);
+		return 1;
+	}
+	key_pool.random_fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+	key_pool.running = 1;
+	if (pthread_create(&key_pool.thread, NULL, key_pool_thread, NULL) != 0) {
+		key_pool.running = 0;
+		pthread_mutex_unlock(&key_pool.lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&key_pool.lock);
+	return 1;
+}
 
+void stop_ssp_key_pool(void)
+{
+	pthread_mutex_lock(&key_pool.lock);
+	if (!key_pool.running) {
+		pthread_mutex_unlock(&key_pool.lock);
+		return;
+	}
+	key_pool.running = 0;
+	pthread_cond_signal(&key_pool.taken);
+	pthread_mutex_unlock(&key_pool.lock);
+
+	pthread_join(key_pool.thread, NULL);
+	if (key_pool.random_fd != -1)
+		close(key_pool.random_fd);
+	key_pool.random_fd = -1;
+	key_pool.count = 0;
+}
 
-static int open_port = 0;
+static unsigned long long monotonic_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* queues a record for the capture thread, counts it as dropped if the ring is full */
+static void capture_record(const unsigned char type, const SSP_COMMAND * sspC, const unsigned char status,
+			   const unsigned char retries, const unsigned char result, const unsigned char *data,
+			   const unsigned char length)
+{
+	SSP_CAPTURE_SLOT *slot;
+	size_t pos;
+	size_t sequence;
+
+	if (!atomic_load_explicit(&capture.running, memory_order_acquire))
+		return;
+
+	pos = atomic_load_explicit(&capture.head, memory_order_relaxed);
+	for (;;) {
+		slot = &capture.slots[pos & (SSP_CAPTURE_SLOTS - 1)];
+		sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+		if (sequence == pos) {
+			if (atomic_compare_exchange_weak_explicit(&capture.head, &pos, pos + 1, memory_order_relaxed,
+								  memory_order_relaxed))
+				break;
+		} else if (sequence < pos) {
+			/* the writer hasn't caught up */
+			atomic_fetch_add_explicit(&capture.dropped, 1, memory_order_relaxed);
+			return;
+		} else {
+			pos = atomic_load_explicit(&capture.head, memory_order_relaxed);
+		}
+	}
+
+	slot->record.length = length;
+	slot->record.type = type;
+	slot->record.bus = sspC->PortNumber;
+	slot->record.address = sspC->SSPAddress;
+	slot->record.status = status;
+	slot->record.retries = retries;
+	slot->record.result = result;
+	slot->record.time_us = monotonic_us();
+	if (length)
+		memcpy(slot->data, data, length);
+	atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+	atomic_fetch_add_explicit(&capture.captured, 1, memory_order_relaxed);
+}
+
+static void write_all(const int fd, const unsigned char *data, size_t length)
+{
+	ssize_t written;
+
+	while (length > 0) {
+		written = write(fd, data, length);
+		if (written < 0 && errno == EINTR)
+			continue;
+		/* a full disk must not stop the exchanges, what can't be written is lost */
+		if (written <= 0)
+			return;
+		data += written;
+		length -= written;
+	}
+}
+
+/* writes out the filled slots in order, returns their number */
+static size_t drain_capture(void)
+{
+	/* collected to write in larger chunks */
+	static unsigned char buffer[64 * 1024];
+	size_t used = 0;
+	size_t count = 0;
+	SSP_CAPTURE_SLOT *slot;
+
+	for (;;) {
+		slot = &capture.slots[capture.tail & (SSP_CAPTURE_SLOTS - 1)];
+		if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != capture.tail + 1)
+			break;
+		if (used + sizeof(slot->record) + slot->record.length > sizeof(buffer)) {
+			write_all(capture.fd, buffer, used);
+			used = 0;
+		}
+		memcpy(buffer + used, &slot->record, sizeof(slot->record));
+		memcpy(buffer + used + sizeof(slot->record), slot->data, slot->record.length);
+		used += sizeof(slot->record) + slot->record.length;
+		atomic_store_explicit(&slot->sequence, capture.tail + SSP_CAPTURE_SLOTS, memory_order_release);
+		capture.tail++;
+		count++;
+	}
+	write_all(capture.fd, buffer, used);
+	return count;
+}
+
+static void *capture_thread(void *arg)
+{
+	struct timespec ts = { 0, 10 * 1000000 };
+
+	(void) arg;
+	while (atomic_load_explicit(&capture.running, memory_order_acquire)) {
+		if (drain_capture() == 0)
+			nanosleep(&ts, NULL);
+	}
+	return NULL;
+}
+
+int start_ssp_capture(const char *file)
+{
+	size_t i;
+
+	if (atomic_load(&capture.running) || replay.active)
+		return 0;
+
+	capture.fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (capture.fd == -1)
+		return 0;
+	write_all(capture.fd, (const unsigned char *) SSP_CAPTURE_MAGIC, SSP_CAPTURE_MAGIC_LENGTH);
+
+	for (i = 0; i < SSP_CAPTURE_SLOTS; i++)
+		atomic_init(&capture.slots[i].sequence, i);
+	atomic_store(&capture.head, 0);
+	capture.tail = 0;
+	atomic_store(&capture.running, 1);
+	if (pthread_create(&capture.thread, NULL, capture_thread, NULL) != 0) {
+		atomic_store(&capture.running, 0);
+		close(capture.fd);
+		capture.fd = -1;
+		return 0;
+	}
+	return 1;
+}
+
+void stop_ssp_capture(void)
+{
+	if (!atomic_exchange(&capture.running, 0))
+		return;
+
+	pthread_join(capture.thread, NULL);
+	/* whatever has been queued until now */
+	drain_capture();
+	close(capture.fd);
+	capture.fd = -1;
+}
+
+int start_ssp_replay(const char *file, const int realtime)
+{
+	struct stat st;
+	SSP_CAPTURE_RECORD record;
+	size_t offset;
+	size_t count = 0;
+	size_t key;
+	int fd;
+
+	if (replay.active || atomic_load(&capture.running))
+		return 0;
+
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return 0;
+	if (fstat(fd, &st) == -1 || (size_t) st.st_size < SSP_CAPTURE_MAGIC_LENGTH) {
+		close(fd);
+		return 0;
+	}
+	replay.length = st.st_size;
+	replay.map = mmap(NULL, replay.length, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (replay.map == MAP_FAILED || memcmp(replay.map, SSP_CAPTURE_MAGIC, SSP_CAPTURE_MAGIC_LENGTH) != 0) {
+		if (replay.map != MAP_FAILED)
+			munmap(replay.map, replay.length);
+		replay.map = NULL;
+		return 0;
+	}
+
+	/* counts the records per bus and address, a record cut off at the end (killed while capturing) is ignored */
+	memset(replay.first, 0, sizeof(replay.first));
+	for (offset = SSP_CAPTURE_MAGIC_LENGTH; offset + sizeof(record) <= replay.length;
+	     offset += sizeof(record) + record.length) {
+		memcpy(&record, replay.map + offset, sizeof(record));
+		if (offset + sizeof(record) + record.length > replay.length)
+			break;
+		if (record.bus < MAX_SSP_BUS && record.address < MAX_SSP_PORT) {
+			replay.first[record.bus * MAX_SSP_PORT + record.address + 1]++;
+			count++;
+		}
+	}
+	for (key = 0; key < SSP_REPLAY_KEYS; key++) {
+		replay.first[key + 1] += replay.first[key];
+		replay.cursor[key] = replay.first[key];
+	}
+
+	replay.records = malloc((count ? count : 1) * sizeof(*replay.records));
+	if (replay.records == NULL) {
+		munmap(replay.map, replay.length);
+		replay.map = NULL;
+		return 0;
+	}
+	/* in the order they have been captured, cursor is used as insert position meanwhile */
+	for (offset = SSP_CAPTURE_MAGIC_LENGTH; offset + sizeof(record) <= replay.length;
+	     offset += sizeof(record) + record.length) {
+		memcpy(&record, replay.map + offset, sizeof(record));
+		if (offset + sizeof(record) + record.length > replay.length)
+			break;
+		if (record.bus < MAX_SSP_BUS && record.address < MAX_SSP_PORT) {
+			key = record.bus * MAX_SSP_PORT + record.address;
+			replay.records[replay.cursor[key]].record = record;
+			replay.records[replay.cursor[key]].data = replay.map + offset + sizeof(record);
+			replay.cursor[key]++;
+		}
+	}
+	for (key = 0; key < SSP_REPLAY_KEYS; key++)
+		replay.cursor[key] = replay.first[key];
+
+	replay.realtime = realtime;
+	replay.replayed = 0;
+	replay.unmatched = 0;
+	replay.skipped = 0;
+	replay.active = 1;
+	return 1;
+}
+
+void stop_ssp_replay(void)
+{
+	if (!replay.active)
+		return;
+
+	replay.active = 0;
+	free(replay.records);
+	replay.records = NULL;
+	munmap(replay.map, replay.length);
+	replay.map = NULL;
+}
+
+int is_ssp_replay(void)
+{
+	return replay.active;
+}
+
+void get_ssp_capture_stats(SSP_CAPTURE_STATS * stats)
+{
+	stats->captured = atomic_load_explicit(&capture.captured, memory_order_relaxed);
+	stats->dropped = atomic_load_explicit(&capture.dropped, memory_order_relaxed);
+	pthread_mutex_lock(&replay.lock);
+	stats->replayed = replay.replayed;
+	stats->unmatched = replay.unmatched;
+	stats->skipped = replay.skipped;
+	pthread_mutex_unlock(&replay.lock);
+}
+
+/* the next record of the type recorded for the bus and address of the command, for SSP_CAPTURE_TX with the command
+   id of the command and followed by its SSP_CAPTURE_RX. the records passed over are skipped, NULL if there is none */
+static const SSP_REPLAY_RECORD *replay_next(const SSP_COMMAND * sspC, const unsigned char type)
+{
+	size_t key = sspC->PortNumber * MAX_SSP_PORT + sspC->SSPAddress;
+	const SSP_REPLAY_RECORD *found = NULL;
+	size_t end;
+	size_t i;
+
+	if (sspC->PortNumber >= MAX_SSP_BUS || sspC->SSPAddress >= MAX_SSP_PORT)
+		return NULL;
+
+	pthread_mutex_lock(&replay.lock);
+	end = replay.first[key + 1];
+	for (i = replay.cursor[key]; i < end; i++) {
+		const SSP_REPLAY_RECORD *r = &replay.records[i];
+		if (r->record.type != type)
+			continue;
+		if (type == SSP_CAPTURE_TX
+		    && (r->record.length == 0 || r->data[0] != sspC->CommandData[0] || i + 1 == end
+			|| replay.records[i + 1].record.type != SSP_CAPTURE_RX))
+			continue;
+		found = r;
+		break;
+	}
+	if (found) {
+		replay.skipped += i - replay.cursor[key];
+		replay.cursor[key] = i + (type == SSP_CAPTURE_TX ? 2 : 1);
+		replay.replayed++;
+	} else {
+		/* the cursor stays, what follows might still be the answer to the next command */
+		replay.unmatched++;
+	}
+	pthread_mutex_unlock(&replay.lock);
+	return found;
+}
+
+/* answers the command with the recorded response, a timeout if the capture has none */
+static int replay_command(SSP_COMMAND * sspC)
+{
+	const SSP_REPLAY_RECORD *tx = replay_next(sspC, SSP_CAPTURE_TX);
+	const SSP_REPLAY_RECORD *rx;
+	unsigned long long duration;
+	struct timespec ts;
+
+	sspC->RetryCount = 0;
+	if (tx == NULL) {
+		sspC->ResponseStatus = SSP_CMD_TIMEOUT;
+		sspC->ResponseDataLength = 1;
+		sspC->ResponseData[0] = SSP_RESPONSE_TIMEOUT;
+		return 0;
+	}
+
+	rx = tx + 1;
+	if (replay.realtime && rx->record.time_us > tx->record.time_us) {
+		duration = rx->record.time_us - tx->record.time_us;
+		ts.tv_sec = duration / 1000000;
+		ts.tv_nsec = (duration % 1000000) * 1000;
+		while (nanosleep(&ts, &ts) == -1)
+			;
+	}
+
+	sspC->ResponseStatus = rx->record.status;
+	sspC->RetryCount = rx->record.retries;
+	sspC->ResponseDataLength = rx->record.length;
+	memcpy(sspC->ResponseData, rx->data, rx->record.length);
+	return rx->record.result;
+}
 
 /* Some helper funtions for detecting keyboard input */
 void changemode(int dir)
@@ -49,24 +657,365 @@ int kbhit(void)
 
 
 
+/* returns the bus a command is sent on, NULL if it hasn't been opened */
+static SSP_BUS *get_bus(const SSP_COMMAND * sspC)
+{
+	if (sspC->PortNumber >= MAX_SSP_BUS || !buses[sspC->PortNumber].is_open)
+		return NULL;
+	return &buses[sspC->PortNumber];
+}
+
+int open_ssp_bus(const unsigned char bus, const char *port)
+{
+	SSP_BUS *b;
+
+	if (bus >= MAX_SSP_BUS || buses[bus].is_open)
+		return 0;
+
+	b = &buses[bus];
+	if (strlen(port) >= sizeof(b->name))
+		return 0;
+	/* a replay answers from the capture, the port isn't needed (and likely not there) */
+	b->port = replay.active ? -1 : OpenSSPPort(port);
+	if (b->port == -1 && !replay.active)
+		return 0;
+	strcpy(b->name, port);
+	b->baud = 9600;
+
+	pthread_mutex_init(&b->lock, NULL);
+	pthread_cond_init(&b->released, NULL);
+	b->busy = 0;
+	memset(b->waiting, 0, sizeof(b->waiting));
+	pthread_mutex_init(&b->stats_lock, NULL);
+	memset(b->stats, 0, sizeof(b->stats));
+	memset(&b->negotiation, 0, sizeof(b->negotiation));
+	b->is_open = 1;
+	return 1;
+}
+
+void close_ssp_bus(const unsigned char bus)
+{
+	if (bus >= MAX_SSP_BUS || !buses[bus].is_open)
+		return;
+
+	if (buses[bus].port != -1)
+		CloseSSPPort(buses[bus].port);
+	pthread_mutex_destroy(&buses[bus].lock);
+	pthread_cond_destroy(&buses[bus].released);
+	pthread_mutex_destroy(&buses[bus].stats_lock);
+	buses[bus].is_open = 0;
+}
+
+/* the single port api, the port is bus 0 */
 int open_ssp_port(const char *port)
 {
-	open_port = OpenSSPPort(port);
-	return (open_port != -1);
+	return open_ssp_bus(0, port);
 }
 
 void close_ssp_port()
 {
-	CloseSSPPort(open_port);
+	close_ssp_bus(0);
+}
+
+void set_ssp_command_gap(const unsigned char bus, const unsigned char ssp_address, const unsigned long gap_ms)
+{
+	if (bus >= MAX_SSP_BUS || ssp_address >= MAX_SSP_PORT)
+		return;
+	buses[bus].command_gap[ssp_address] = gap_ms;
+}
+
+void set_ssp_priority(const int priority)
+{
+	if (priority >= 0 && priority < SSP_PRIORITIES)
+		thread_priority = priority;
+}
+
+void record_ssp_latency(SSP_LATENCY * latency, const unsigned long ms)
+{
+	int i;
+
+	for (i = 0; i < SSP_LATENCY_BUCKETS - 1 && ms > ssp_latency_bounds[i]; i++)
+		;
+	latency->buckets[i]++;
+	latency->count++;
+	latency->total_ms += ms;
+	if (ms > latency->max_ms)
+		latency->max_ms = ms;
+}
+
+int get_ssp_command_stats(const unsigned char bus, const unsigned char command, SSP_COMMAND_STATS * stats)
+{
+	if (bus >= MAX_SSP_BUS || !buses[bus].is_open)
+		return 0;
+
+	pthread_mutex_lock(&buses[bus].stats_lock);
+	*stats = buses[bus].stats[command];
+	pthread_mutex_unlock(&buses[bus].stats_lock);
+
+	return stats->latency.count != 0;
 }
 
 int send_ssp_command(SSP_COMMAND * sspC)
 {
+	SSP_BUS *bus = get_bus(sspC);
+	SSP_COMMAND_STATS *stats;
+	/* the command data is encrypted in place, remember the id before */
+	unsigned char command = sspC->CommandData[0];
+	/* and the plain command for the capture */
+	unsigned char plain[255];
+	unsigned char plain_length = sspC->CommandDataLength;
+	int capturing = atomic_load_explicit(&capture.running, memory_order_relaxed);
+	unsigned long long started = monotonic_ms();
+	unsigned long long finished;
+	int result;
+
+	if (bus == NULL) {
+		sspC->ResponseStatus = PORT_ERROR;
+		return 0;
+	}
+
+	/* the gap is per address, so wait outside of the lock and let the other devices use the bus meanwhile */
+	wait_for_command_gap(bus, sspC->SSPAddress);
 
-	return SSPSendCommand(open_port, sspC);
+	if (capturing)
+		memcpy(plain, sspC->CommandData, plain_length);
+
+	acquire_bus(bus);
+	if (replay.active) {
+		result = replay_command(sspC);
+	} else {
+		if (capturing)
+			capture_record(SSP_CAPTURE_TX, sspC, 0, 0, 0, plain, plain_length);
+		if (reopen_port(bus)) {
+			result = SSPSendCommand(bus->port, sspC);
+		} else {
+			sspC->ResponseStatus = PORT_ERROR;
+			result = 0;
+		}
+		if (capturing)
+			capture_record(SSP_CAPTURE_RX, sspC, sspC->ResponseStatus, sspC->RetryCount, result,
+				       sspC->ResponseData, sspC->ResponseDataLength);
+	}
+	finished = monotonic_ms();
+	bus->last_exchange[sspC->SSPAddress] = finished;
+	release_bus(bus);
+
+	pthread_mutex_lock(&bus->stats_lock);
+	stats = &bus->stats[command];
+	record_ssp_latency(&stats->latency, finished - started);
+	stats->retries += sspC->RetryCount;
+	if (!result) {
+		if (sspC->ResponseStatus == SSP_CMD_TIMEOUT)
+			stats->timeouts++;
+		else if (sspC->ResponseStatus == SSP_PACKET_ERROR)
+			stats->packet_errors++;
+		else if (sspC->ResponseStatus == PORT_ERROR)
+			stats->port_errors++;
+	}
+	pthread_mutex_unlock(&bus->stats_lock);
+
+	return result;
 }
 
 int negotiate_ssp_encryption(SSP_COMMAND * sspC, SSP_FULL_KEY * hostKey)
 {
-	return NegotiateSSPEncryption(open_port, sspC->SSPAddress, hostKey);
+	SSP_BUS *bus = get_bus(sspC);
+	SSP_KEYS temp_keys;
+	unsigned long long started = monotonic_ms();
+	unsigned long long finished;
+	int pooled;
+	int result;
+
+	if (bus == NULL)
+		return 0;
+
+	/* the keys don't matter, the replayed responses are plain */
+	if (replay.active) {
+		const SSP_REPLAY_RECORD *r = replay_next(sspC, SSP_CAPTURE_KEYS);
+		return r != NULL && r->record.result;
+	}
+
+	/* the prime generation takes a while, use prepared keys if there are some, and
+	   don't keep the other devices off the bus meanwhile if there aren't */
+	pooled = take_host_keys(&temp_keys);
+	if (pooled)
+		ResetSSPPacketCount(sspC->PortNumber, sspC->SSPAddress);
+	else if (InitiateSSPHostKeys(&temp_keys, sspC->PortNumber, sspC->SSPAddress) == 0)
+		return 0;
+
+	wait_for_command_gap(bus, sspC->SSPAddress);
+
+	acquire_bus(bus);
+	result = reopen_port(bus)
+	    && ExchangeSSPEncryptionKeys(bus->port, sspC->PortNumber, sspC->SSPAddress, &temp_keys, hostKey);
+	capture_record(SSP_CAPTURE_KEYS, sspC, 0, 0, result, NULL, 0);
+	finished = monotonic_ms();
+	bus->last_exchange[sspC->SSPAddress] = finished;
+	release_bus(bus);
+
+	pthread_mutex_lock(&bus->stats_lock);
+	record_ssp_latency(&bus->negotiation.latency, finished - started);
+	if (!result)
+		bus->negotiation.failures++;
+	if (pooled)
+		bus->negotiation.pool_hits++;
+	else
+		bus->negotiation.pool_misses++;
+	pthread_mutex_unlock(&bus->stats_lock);
+
+	return result;
+}
+
+int get_ssp_negotiation_stats(const unsigned char bus, SSP_NEGOTIATION_STATS * stats)
+{
+	if (bus >= MAX_SSP_BUS || !buses[bus].is_open)
+		return 0;
+
+	pthread_mutex_lock(&buses[bus].stats_lock);
+	*stats = buses[bus].negotiation;
+	pthread_mutex_unlock(&buses[bus].stats_lock);
+
+	return stats->latency.count != 0;
+}
+
+/* the rate code of the set baud rate command, -1 if the units don't support the rate */
+static int baud_code(const unsigned long baud)
+{
+	switch (baud) {
+	case 9600:
+		return SSP_BAUD_9600;
+	case 38400:
+		return SSP_BAUD_38400;
+	case 115200:
+		return SSP_BAUD_115200;
+	}
+	return -1;
+}
+
+int set_ssp_bus_baud(const unsigned char bus, const unsigned long baud)
+{
+	SSP_BUS *b;
+	int result;
+
+	if (bus >= MAX_SSP_BUS || !buses[bus].is_open || baud_code(baud) < 0)
+		return 0;
+
+	b = &buses[bus];
+	if (replay.active) {
+		b->baud = baud;
+		return 1;
+	}
+	acquire_bus(b);
+	if (!reopen_port(b)) {
+		release_bus(b);
+		return 0;
+	}
+	tcdrain(b->port);
+	result = SetBaud(b->port, baud);
+	if (result)
+		b->baud = baud;
+	/* whatever arrived meanwhile has been garbled by the change */
+	tcflush(b->port, TCIFLUSH);
+	release_bus(b);
+
+	return result;
+}
+
+unsigned long get_ssp_bus_baud(const unsigned char bus)
+{
+	if (bus >= MAX_SSP_BUS || !buses[bus].is_open)
+		return 0;
+	return buses[bus].baud;
+}
+
+int set_ssp_device_baud(SSP_COMMAND * sspC, const unsigned long current, const unsigned long baud)
+{
+	SSP_BUS *bus = get_bus(sspC);
+	SSP_COMMAND c = *sspC;
+	int code = baud_code(baud);
+	int result = 0;
+
+	if (bus == NULL || code < 0 || baud_code(current) < 0)
+		return 0;
+
+	if (replay.active) {
+		const SSP_REPLAY_RECORD *r = replay_next(sspC, SSP_CAPTURE_BAUD);
+		sspC->ResponseStatus = r ? r->record.status : SSP_CMD_TIMEOUT;
+		sspC->ResponseData[0] = r && r->record.length ? r->data[0] : SSP_RESPONSE_TIMEOUT;
+		return r != NULL && r->record.result;
+	}
+
+	/* the unit doesn't expect encryption after a reset, and a sync is not accepted encrypted */
+	c.EncryptionStatus = 0;
+
+	wait_for_command_gap(bus, sspC->SSPAddress);
+
+	/* the other units on the bus can't be talked to while the port is at the rate of this one */
+	acquire_bus(bus);
+	if (!reopen_port(bus)) {
+		release_bus(bus);
+		sspC->ResponseStatus = PORT_ERROR;
+		sspC->ResponseData[0] = SSP_RESPONSE_TIMEOUT;
+		return 0;
+	}
+	if (current != bus->baud)
+		SetBaud(bus->port, current);
+
+	c.CommandDataLength = 1;
+	c.CommandData[0] = SSP_CMD_SYNC;
+	if (!SSPSendCommand(bus->port, &c)) {
+		/* most likely the unit is at another rate, anything it sent has been garbage */
+		c.ResponseData[0] = SSP_RESPONSE_TIMEOUT;
+	} else if (c.ResponseData[0] == SSP_RESPONSE_OK) {
+		/* the unit answers at the current rate and switches afterwards, only until its next reset */
+		c.CommandDataLength = 3;
+		c.CommandData[0] = SSP_CMD_SET_BAUD_RATE;
+		c.CommandData[1] = code;
+		c.CommandData[2] = 0;
+		if (!SSPSendCommand(bus->port, &c))
+			c.ResponseData[0] = SSP_RESPONSE_TIMEOUT;
+		result = c.ResponseData[0] == SSP_RESPONSE_OK;
+	}
+
+	tcdrain(bus->port);
+	if (current != bus->baud)
+		SetBaud(bus->port, bus->baud);
+	tcflush(bus->port, TCIFLUSH);
+	bus->last_exchange[sspC->SSPAddress] = monotonic_ms();
+	capture_record(SSP_CAPTURE_BAUD, sspC, c.ResponseStatus, 0, result, c.ResponseData, 1);
+	release_bus(bus);
+
+	sspC->ResponseStatus = c.ResponseStatus;
+	sspC->ResponseData[0] = c.ResponseData[0];
+	return result;
+}
+
+unsigned long download_ssp_file(SSP_COMMAND * sspC, const char *file, const unsigned long long key,
+				SSP_DOWNLOAD_PROGRESS progress, void *arg)
+{
+	SSP_BUS *bus = get_bus(sspC);
+	unsigned long result;
+
+	/* there is no port to download to while replaying */
+	if (bus == NULL || replay.active)
+		return PORT_OPEN_FAIL;
+
+	/* the download switches the baud rate and reopens the port, so nobody else may use the bus meanwhile */
+	acquire_bus(bus);
+	if (!reopen_port(bus)) {
+		release_bus(bus);
+		return PORT_OPEN_FAIL;
+	}
+	tcdrain(bus->port);
+	result = DownloadFileToPort(file, &bus->port, bus->name, sspC->PortNumber, sspC->SSPAddress, key, progress,
+				    arg);
+	if (bus->port != -1) {
+		SetBaud(bus->port, bus->baud);
+		tcflush(bus->port, TCIFLUSH);
+	}
+	/* else the bus stays open, the port is opened again by the next user of the bus (reopen_port) */
+	bus->last_exchange[sspC->SSPAddress] = monotonic_ms();
+	release_bus(bus);
+
+	return result;
 }
@@ -14,9 +14,132 @@
 void changemode(int dir);
 int kbhit(void);
 
+/* each bus (< MAX_SSP_BUS) has its own port, commands are sent on the bus in SSP_COMMAND.PortNumber */
+int open_ssp_bus(const unsigned char bus, const char *port);
+void close_ssp_bus(const unsigned char bus);
+/* same as open_ssp_bus(0, port) / close_ssp_bus(0) */
 int open_ssp_port(const char *port);
 void close_ssp_port();
 int send_ssp_command(SSP_COMMAND * sspC);
+void set_ssp_command_gap(const unsigned char bus, const unsigned char ssp_address, const unsigned long gap_ms);
 int negotiate_ssp_encryption(SSP_COMMAND * sspC, SSP_FULL_KEY * hostKey);
 
+/* threads waiting for a bus get it by priority (lower values first), equal priorities in no particular order */
+#define SSP_PRIORITY_TRANSACTION 0
+#define SSP_PRIORITY_INTERACTIVE 1
+#define SSP_PRIORITY_BACKGROUND 2
+#define SSP_PRIORITIES 3
+/* sets the priority of the exchanges started by the calling thread, SSP_PRIORITY_INTERACTIVE until set */
+void set_ssp_priority(const int priority);
+
+/* latency histogram, bucket i counts up to ssp_latency_bounds[i] ms, the last bucket everything slower */
+#define SSP_LATENCY_BUCKETS 12
+extern const unsigned long ssp_latency_bounds[SSP_LATENCY_BUCKETS - 1];
+
+typedef struct {
+	unsigned long count;
+	unsigned long long total_ms;
+	unsigned long max_ms;
+	unsigned long buckets[SSP_LATENCY_BUCKETS];
+} SSP_LATENCY;
+
+void record_ssp_latency(SSP_LATENCY * latency, const unsigned long ms);
+
+/* what send_ssp_command has seen per bus and command id */
+typedef struct {
+	/* time spent in send_ssp_command, including the command gap and waiting for the bus */
+	SSP_LATENCY latency;
+	unsigned long retries;
+	unsigned long timeouts;
+	unsigned long packet_errors;
+	unsigned long port_errors;
+} SSP_COMMAND_STATS;
+
+/* copies the stats of a command id on a bus, returns 0 if it has never been sent there */
+int get_ssp_command_stats(const unsigned char bus, const unsigned char command, SSP_COMMAND_STATS * stats);
+
+/* what negotiate_ssp_encryption has seen per bus */
+typedef struct {
+	/* time spent in negotiate_ssp_encryption, including preparing the host keys if the pool was empty */
+	SSP_LATENCY latency;
+	unsigned long failures;
+	/* host keys taken from the pool / prepared on the spot because the pool was empty (or not started) */
+	unsigned long pool_hits;
+	unsigned long pool_misses;
+} SSP_NEGOTIATION_STATS;
+
+/* copies the negotiation stats of a bus, returns 0 if there hasn't been one yet */
+int get_ssp_negotiation_stats(const unsigned char bus, SSP_NEGOTIATION_STATS * stats);
+
+/* changes the baud rate of the port of a bus (9600, 38400 or 115200, the rates of the set baud rate command),
+   between two exchanges. returns 0 if the rate is not supported */
+int set_ssp_bus_baud(const unsigned char bus, const unsigned long baud);
+unsigned long get_ssp_bus_baud(const unsigned char bus);
+/* syncs with the unit at the rate it is at now (current) and asks it to change to baud until its next reset,
+   without encryption and without changing the rate of the bus. returns 1 if the unit has accepted the change,
+   otherwise sspC->ResponseData[0] is its answer (SSP_RESPONSE_TIMEOUT if there was none) */
+int set_ssp_device_baud(SSP_COMMAND * sspC, const unsigned long current, const unsigned long baud);
+
+/* downloads a firmware / dataset file (DownloadFileToPort) to the unit while holding the bus, the other units
+   on the bus wait until it has finished. returns DOWNLOAD_COMPLETE or the failure, the unit restarts at 9600 baud.
+   if the port can't be opened again afterwards the bus stays open, every later use of the bus tries again */
+unsigned long download_ssp_file(SSP_COMMAND * sspC, const char *file, const unsigned long long key,
+				SSP_DOWNLOAD_PROGRESS progress, void *arg);
+
+/* a background thread keeps SSP_KEY_POOL_SIZE prepared host keys (primes and host intermediate key) ready
+   for negotiate_ssp_encryption, so a renegotiation only costs the exchanges with the unit */
+#define SSP_KEY_POOL_SIZE 4
+int start_ssp_key_pool(void);
+void stop_ssp_key_pool(void);
+
+/* wire capture: send_ssp_command records every command (plain, before the encryption) and its response (decrypted),
+   negotiate_ssp_encryption and set_ssp_device_baud their results. the records are queued in a lock-free ring and
+   written out by a background thread, a full ring drops them. the file starts with SSP_CAPTURE_MAGIC, followed by
+   the records, each a SSP_CAPTURE_RECORD (host byte order) and length bytes of data */
+#define SSP_CAPTURE_MAGIC "SSPCAP\0\1"
+#define SSP_CAPTURE_MAGIC_LENGTH 8
+
+#define SSP_CAPTURE_TX 0	/* the command data */
+#define SSP_CAPTURE_RX 1	/* the response data, status / retries / result of send_ssp_command */
+#define SSP_CAPTURE_KEYS 2	/* result of negotiate_ssp_encryption, no data */
+#define SSP_CAPTURE_BAUD 3	/* result of set_ssp_device_baud, the answer of the unit as data */
+
+typedef struct {
+	unsigned short length;
+	unsigned char type;
+	unsigned char bus;
+	unsigned char address;
+	unsigned char status;
+	unsigned char retries;
+	unsigned char result;
+	/* CLOCK_MONOTONIC in us */
+	unsigned long long time_us;
+} SSP_CAPTURE_RECORD;
+
+/* truncates the file and captures to it until stop_ssp_capture, returns 0 if it can't be written or a replay is active */
+int start_ssp_capture(const char *file);
+void stop_ssp_capture(void);
+
+/* answers the commands from a capture instead of the port, call before opening the buses (which then don't open their
+   port). the records are taken in order per bus and address: a command gets the response of the next recorded command
+   with the same id (skipping the records before), SSP_CMD_TIMEOUT if there is none left. with realtime each exchange
+   takes as long as it did when captured, otherwise there is no waiting at all (neither for the command gap).
+   downloads fail with PORT_OPEN_FAIL. returns 0 if the file is no capture */
+int start_ssp_replay(const char *file, const int realtime);
+void stop_ssp_replay(void);
+int is_ssp_replay(void);
+
+typedef struct {
+	unsigned long captured;
+	/* not captured, the ring was full */
+	unsigned long dropped;
+	/* exchanges answered from the capture / unanswered as there was none left */
+	unsigned long replayed;
+	unsigned long unmatched;
+	/* records passed over, the commands diverged from the capture */
+	unsigned long skipped;
+} SSP_CAPTURE_STATS;
+
+void get_ssp_capture_stats(SSP_CAPTURE_STATS * stats);
+
 #endif
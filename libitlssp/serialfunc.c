@@ -7,6 +7,7 @@
 #include <errno.h>		/* Error number definitions */
 #include <termios.h>		/* POSIX terminal control definitions */
 #include <sys/ioctl.h>
+#include <poll.h>
 #include "../libitlssp/itl_types.h"
 #include "../libitlssp/serialfunc.h"
 //#include <asm/termios.h>
@@ -49,22 +50,42 @@ void CloseSSPPort(const SSP_PORT port)
 	}
 }
 
-int WriteData(const unsigned char *data, unsigned long length, const SSP_PORT port)
+/*
+Name: QueueData
+Inputs:
+    unsigned char * data: The data to write
+    unsigned long length: The number of bytes to write
+    SSP_PORT port: The port to write to
+Return:
+    1 on success
+    0 on failure
+Notes:
+    Blocks (without spinning) until the port accepts the data, but returns while
+    it is still being transmitted, so the caller can prepare the next data meanwhile.
+*/
+int QueueData(const unsigned char *data, unsigned long length, const SSP_PORT port)
 {
 	long n;
-	/*printf("OUT: ");
-	   for (n = 0; n < length; ++n)
-	   printf("%x ",(unsigned char)data[n]);
-	   printf("\n"); */
 	long offset;
 	long bytes_left = length;
+	struct pollfd pfd;
 	offset = 0;
 	while (bytes_left > 0) {
-		while (TransmitComplete(port) == 0)
-			usleep(100);
 		n = write(port, &data[offset], bytes_left);
-		usleep(500);
 		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				/* output queue is full, sleep until the port is writable again */
+				pfd.fd = port;
+				pfd.events = POLLOUT;
+				pfd.revents = 0;
+				if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+					perror("Write Port Failed");
+					return 0;
+				}
+				continue;
+			}
 			perror("Write Port Failed");
 			return 0;
 		}
@@ -74,6 +95,70 @@ int WriteData(const unsigned char *data, unsigned long length, const SSP_PORT po
 	return 1;
 }
 
+/*
+Name: WriteData
+Inputs:
+    unsigned char * data: The data to write
+    unsigned long length: The number of bytes to write
+    SSP_PORT port: The port to write to
+Return:
+    1 on success
+    0 on failure
+Notes:
+    Blocks (without spinning) until the port accepts the data and then until
+    the data has actually been transmitted.
+*/
+int WriteData(const unsigned char *data, unsigned long length, const SSP_PORT port)
+{
+	/*printf("OUT: ");
+	   for (n = 0; n < length; ++n)
+	   printf("%x ",(unsigned char)data[n]);
+	   printf("\n"); */
+	if (QueueData(data, length, port) == 0)
+		return 0;
+	/* wait until everything is on the wire */
+	while (tcdrain(port) < 0) {
+		if (errno != EINTR) {
+			perror("Write Port Failed");
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+Name: WaitForData
+Inputs:
+    SSP_PORT port: The port to wait on
+    long timeout: The maximum time to wait in milliseconds
+Return:
+    >0 if data is available for reading
+    0 on timeout
+    -1 on error
+Notes:
+    Sleeps in poll() instead of busy waiting for the data to arrive.
+*/
+int WaitForData(const SSP_PORT port, long timeout)
+{
+	struct pollfd pfd;
+	int rc;
+
+	if (timeout < 0)
+		timeout = 0;
+
+	pfd.fd = port;
+	pfd.events = POLLIN;
+	do {
+		pfd.revents = 0;
+		rc = poll(&pfd, 1, timeout);
+	} while (rc < 0 && errno == EINTR);
+
+	if (rc > 0 && (pfd.revents & (POLLERR | POLLNVAL)))
+		return -1;
+
+	return rc;
+}
+
 
 void SetupSSPPort(const SSP_PORT port)
 {
@@ -127,28 +212,44 @@ int ReadData(const SSP_PORT port, unsigned char *buffer, unsigned long bytes_to_
 	return read(port, buffer, bytes_to_read);
 }
 
-void SetBaud(const SSP_PORT port, const unsigned long baud)
+/*
+Name: SetBaud
+Inputs:
+    SSP_PORT port: The port to change
+    unsigned long baud: 9600, 19200, 38400, 57600 or 115200
+Return:
+    1 on success
+    0 if the rate is not supported or the port could not be changed
+Notes:
+    Sets both the input and the output speed, the data still queued for output
+    may be transmitted at the new rate - drain the port first if that matters.
+*/
+int SetBaud(const SSP_PORT port, const unsigned long baud)
 {
 	struct termios options;
-	tcgetattr(port, &options);
-	//9600 baud
+	speed_t speed;
 	switch (baud) {
 	case 9600:
-		cfsetispeed(&options, B9600);
+		speed = B9600;
 		break;
 	case 19200:
-		cfsetispeed(&options, B19200);
+		speed = B19200;
 		break;
 	case 38400:
-		cfsetispeed(&options, B38400);
+		speed = B38400;
 		break;
 	case 57600:
-		cfsetispeed(&options, B57600);
+		speed = B57600;
 		break;
 	case 115200:
-		cfsetispeed(&options, B115200);
+		speed = B115200;
 		break;
+	default:
+		return 0;
 	}
-	tcsetattr(port, TCSANOW, &options);
-	tcgetattr(port, &options);
+	if (tcgetattr(port, &options) != 0)
+		return 0;
+	cfsetispeed(&options, speed);
+	cfsetospeed(&options, speed);
+	return tcsetattr(port, TCSANOW, &options) == 0;
 }
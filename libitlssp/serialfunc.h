@@ -1,5 +1,7 @@
 
 
+int QueueData(const unsigned char *data, unsigned long length, const SSP_PORT port);
+
 int WriteData(const unsigned char *data, unsigned long length, const SSP_PORT port);
 
 void SetupSSPPort(const SSP_PORT port);
@@ -8,6 +10,8 @@ int BytesInBuffer(SSP_PORT port);
 
 int ReadData(const SSP_PORT port, unsigned char *buffer, unsigned long bytes_to_read);
 
-void SetBaud(const SSP_PORT port, const unsigned long baud);
+int WaitForData(const SSP_PORT port, long timeout);
+
+int SetBaud(const SSP_PORT port, const unsigned long baud);
 
 int TransmitComplete(SSP_PORT port);
@@ -1,5 +1,7 @@
 #include "../libitlssp/ssp_commands.h"
 
+#include <string.h>
+
 #ifdef WIN32
 #include "../libitlssp/port_win32.h"
 #include "../libitlssp/port_win32_ssp.h"
@@ -241,152 +243,122 @@ SSP_RESPONSE_ENUM ssp6_set_inhibits(SSP_COMMAND * sspC,
 	return resp;
 }
 
+// layout of the data following an event code in a poll response, see poll_layouts
+enum poll_layout {
+	POLL_LAYOUT_NONE = 0,	// no data
+	POLL_LAYOUT_BYTE,	// one byte (channel, error code) in data1
+	POLL_LAYOUT_VALUE,	// 4 bytes value in data1, 3 bytes country code
+	POLL_LAYOUT_COUNTRIES,	// country count, per country 4 bytes value in data1 and 3 bytes country code
+	POLL_LAYOUT_COUNTRIES_2	// country count, per country 4 bytes in data1, 4 bytes in data2 and 3 bytes country code
+};
+
+// payload layout per event code, every code not listed has no data
+static const unsigned char poll_layouts[256] = {
+	[SSP_POLL_CREDIT] = POLL_LAYOUT_BYTE,
+	[SSP_POLL_READ] = POLL_LAYOUT_BYTE,
+	[SSP_POLL_CLEARED_FROM_FRONT] = POLL_LAYOUT_BYTE,
+	[SSP_POLL_CLEARED_INTO_CASHBOX] = POLL_LAYOUT_BYTE,
+	[SSP_POLL_CALIBRATION_FAIL] = POLL_LAYOUT_BYTE,
+	[SSP_POLL_COIN_CREDIT] = POLL_LAYOUT_VALUE,
+	[SSP_POLL_DISPENSING] = POLL_LAYOUT_COUNTRIES,
+	[SSP_POLL_DISPENSED] = POLL_LAYOUT_COUNTRIES,
+	[SSP_POLL_JAMMED] = POLL_LAYOUT_COUNTRIES,
+	[SSP_POLL_HALTED] = POLL_LAYOUT_COUNTRIES,
+	[SSP_POLL_FLOATING] = POLL_LAYOUT_COUNTRIES,
+	[SSP_POLL_FLOATED] = POLL_LAYOUT_COUNTRIES,
+	[SSP_POLL_TIMEOUT] = POLL_LAYOUT_COUNTRIES,
+	[SSP_POLL_CASHBOX_PAID] = POLL_LAYOUT_COUNTRIES,
+	[SSP_POLL_SMART_EMPTYING] = POLL_LAYOUT_COUNTRIES,
+	[SSP_POLL_SMART_EMPTIED] = POLL_LAYOUT_COUNTRIES,
+	[SSP_POLL_FRAUD_ATTEMPT] = POLL_LAYOUT_COUNTRIES,
+	[SSP_POLL_INCOMPLETE_PAYOUT] = POLL_LAYOUT_COUNTRIES_2,
+	[SSP_POLL_INCOMPLETE_FLOAT] = POLL_LAYOUT_COUNTRIES_2
+};
+
+// read a little endian 4 byte value
+static unsigned long _ssp_uint32(const unsigned char *data)
+{
+	return (unsigned long) data[0] | ((unsigned long) data[1] << 8)
+	    | ((unsigned long) data[2] << 16) | ((unsigned long) data[3] << 24);
+}
+
+// decode the events of a poll response (data without the response code), one event per country
+// for the multi country events. returns 0 if the whole response was decoded, 1 if it is truncated
+// or has more events than fit (the events decoded so far are kept)
+int ssp6_decode_poll(const unsigned char *data, unsigned int length, SSP_POLL_DATA6 * poll_response)
+{
+	static const unsigned char block_lengths[] = { 0, 1, 7, 7, 11 };
+	const unsigned int max_events = sizeof(poll_response->events) / sizeof(poll_response->events[0]);
+	unsigned int i = 0;
+
+	poll_response->event_count = 0;
+
+	while (i < length) {
+		unsigned char event = data[i++];
+		unsigned char layout = poll_layouts[event];
+		unsigned int blocks = 1;
+		unsigned int j;
+
+		// the multi country events start with the number of countries
+		if (layout == POLL_LAYOUT_COUNTRIES || layout == POLL_LAYOUT_COUNTRIES_2) {
+			if (i >= length)
+				return 1;
+			blocks = data[i++];
+		}
+		if (blocks * block_lengths[layout] > length - i)
+			return 1;
+
+		// an event without countries is still reported once, without data
+		for (j = 0; j < blocks || j == 0; ++j) {
+			SSP_POLL_EVENT6 *e;
+			const unsigned char *block = data + i;
+
+			if (poll_response->event_count >= max_events)
+				return 1;
+			e = &poll_response->events[poll_response->event_count++];
+			e->event = event;
+			e->data1 = 0;
+			e->data2 = 0;
+			memset(e->cc, 0, sizeof(e->cc));
+			if (blocks == 0)
+				break;
+
+			switch (layout) {
+			case POLL_LAYOUT_BYTE:
+				e->data1 = block[0];
+				break;
+			case POLL_LAYOUT_VALUE:
+			case POLL_LAYOUT_COUNTRIES:
+				e->data1 = _ssp_uint32(block);
+				memcpy(e->cc, block + 4, 3);
+				break;
+			case POLL_LAYOUT_COUNTRIES_2:
+				e->data1 = _ssp_uint32(block);
+				e->data2 = _ssp_uint32(block + 4);
+				memcpy(e->cc, block + 8, 3);
+				break;
+			}
+			i += block_lengths[layout];
+		}
+	}
+	return 0;
+}
+
 // poll the validator, and extract the responses.
 SSP_RESPONSE_ENUM ssp6_poll(SSP_COMMAND * sspC, SSP_POLL_DATA6 * poll_response)
 {
 	SSP_RESPONSE_ENUM resp;
-	unsigned char i, j;
 
 	// send the poll command
 	sspC->CommandDataLength = 1;
 	sspC->CommandData[0] = SSP_CMD_POLL;
 	resp = _ssp_return_values(sspC);
 
-	if (resp == SSP_RESPONSE_OK) {
-		// if the poll was successful, iterate over all of the response
+	if (resp == SSP_RESPONSE_OK && sspC->ResponseDataLength > 0) {
+		// a truncated response keeps the complete events in front of it
+		ssp6_decode_poll(sspC->ResponseData + 1, sspC->ResponseDataLength - 1, poll_response);
+	} else {
 		poll_response->event_count = 0;
-
-		for (i = 1; i < sspC->ResponseDataLength; ++i) {
-			// initialise the event structure
-			poll_response->events[poll_response->event_count].event = sspC->ResponseData[i];
-			poll_response->events[poll_response->event_count].data1 = 0;
-			poll_response->events[poll_response->event_count].data2 = 0;
-			poll_response->events[poll_response->event_count].cc[0] = 0;
-			poll_response->events[poll_response->event_count].cc[1] = 0;
-			poll_response->events[poll_response->event_count].cc[2] = 0;
-			poll_response->events[poll_response->event_count].cc[3] = 0;
-
-			switch (sspC->ResponseData[i]) {
-				//all these commands have one data byte
-			case SSP_POLL_CREDIT:
-			case SSP_POLL_READ:
-			case SSP_POLL_CLEARED_FROM_FRONT:
-			case SSP_POLL_CLEARED_INTO_CASHBOX:
-			case SSP_POLL_CALIBRATION_FAIL:
-				i++;	//move onto the data
-				poll_response->events[poll_response->event_count].data1 = sspC->ResponseData[i];
-				break;
-			case SSP_POLL_COIN_CREDIT:
-				{
-					int k;
-					for (k = 0; k < 4; ++k) {
-						i++;	//move through the 4 bytes of data
-						poll_response->events[poll_response->event_count].data1 +=
-						    (((unsigned long) sspC->ResponseData[i])
-						     << (8 * k));	// METALAB FIX: wrong index (was i)
-					}
-					for (k = 0; k < 3; ++k) {	// METALAB FIX: k < 3 (was 4)
-						i++;	//move through the 3 bytes of country code
-						poll_response->events[poll_response->event_count].cc[k] +=
-						    sspC->ResponseData[i];
-					}
-				}
-				break;
-				//all these commands have 7 data bytes per country;
-			case SSP_POLL_DISPENSING:
-			case SSP_POLL_DISPENSED:
-			case SSP_POLL_JAMMED:
-			case SSP_POLL_HALTED:
-			case SSP_POLL_FLOATING:
-			case SSP_POLL_FLOATED:
-			case SSP_POLL_TIMEOUT:
-			case SSP_POLL_CASHBOX_PAID:
-			case SSP_POLL_SMART_EMPTYING:
-			case SSP_POLL_SMART_EMPTIED:
-			case SSP_POLL_FRAUD_ATTEMPT:
-				{
-					unsigned char event = sspC->ResponseData[i];
-					unsigned int countries;
-					i++;	// move onto the country count;
-					countries = (unsigned int) sspC->ResponseData[i];
-					// for every country in the response, make a new event structure and store into it
-					for (j = 0; j < countries; ++j) {
-						int k;
-						poll_response->events[poll_response->event_count].event = event;
-						poll_response->events[poll_response->event_count].data1 = 0;
-						poll_response->events[poll_response->event_count].data2 = 0;
-						poll_response->events[poll_response->event_count].cc[3] = '\0';
-
-						for (k = 0; k < 4; ++k) {
-							i++;	//move through the 4 bytes of data
-							poll_response->events[poll_response->event_count].data1 +=
-							    (((unsigned long) sspC->ResponseData[i])
-							     << (8 * k));	// METALAB FIX: wrong index (was i)
-						}
-						for (k = 0; k < 3; ++k) {	// METALAB FIX: k < 3 (was 4)
-							i++;	//move through the 3 bytes of country code
-							poll_response->events[poll_response->event_count].cc[k] +=
-							    sspC->ResponseData[i];
-						}
-
-						// METALAB FIX: fix terminator
-						poll_response->events[poll_response->event_count].cc[3] = '\0';
-
-						if (j != countries - 1)	// the last time through event_count will be updated elsewhere.
-							poll_response->event_count++;
-					}
-
-				}
-				break;
-
-				//all these commands have 11 data bytes per country;
-			case SSP_POLL_INCOMPLETE_PAYOUT:
-			case SSP_POLL_INCOMPLETE_FLOAT:
-				{
-					unsigned int countries;
-					unsigned char event = sspC->ResponseData[i];
-					i++;	// move onto the country count;
-					countries = (unsigned int) sspC->ResponseData[i];
-					// for every country in the response, make a new event structure and store into it
-					for (j = 0; j < countries; ++j) {
-						int k;
-						poll_response->events[poll_response->event_count].event = event;
-						poll_response->events[poll_response->event_count].data1 = 0;
-						poll_response->events[poll_response->event_count].data2 = 0;
-						poll_response->events[poll_response->event_count].cc[3] = '\0';
-
-						for (k = 0; k < 4; ++k) {
-							i++;	//move through the 4 bytes of data
-							poll_response->events[poll_response->event_count].data1 +=
-							    (((unsigned long) sspC->ResponseData[i])
-							     << (8 * k));	// METALAB FIX: wrong index
-						}
-						for (k = 0; k < 4; ++k) {
-							i++;	//move through the 4 bytes of data
-							poll_response->events[poll_response->event_count].data2 +=
-							    (((unsigned long) sspC->ResponseData[i])
-							     << (8 * k));	// METALAB FIX: wrong index
-						}
-						for (k = 0; k < 3; ++k) {
-							i++;	//move through the 3 bytes of country code
-							poll_response->events[poll_response->event_count].cc[k] +=
-							    sspC->ResponseData[i];
-						}
-
-						if (j != countries - 1)	// the last time through event_count will be updated elsewhere.
-							poll_response->event_count++;
-					}
-
-				}
-				break;
-			default:	//every other command has no data bytes
-				poll_response->events[poll_response->event_count].data1 = 0;
-				poll_response->events[poll_response->event_count].data2 = 0;
-				poll_response->events[poll_response->event_count].cc[0] = '\0';
-				break;
-			}
-			poll_response->event_count++;
-		}
 	}
 	return resp;
 }
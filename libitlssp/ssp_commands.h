@@ -111,6 +111,7 @@ SSP_RESPONSE_ENUM ssp6_enable_payout(SSP_COMMAND * sspC, const char type);
 SSP_RESPONSE_ENUM ssp6_set_inhibits(SSP_COMMAND * sspC, const unsigned char lowchannels,
 				    const unsigned char highchannels);
 SSP_RESPONSE_ENUM ssp6_poll(SSP_COMMAND * sspC, SSP_POLL_DATA6 * poll_response);
+int ssp6_decode_poll(const unsigned char *data, unsigned int length, SSP_POLL_DATA6 * poll_response);
 SSP_RESPONSE_ENUM ssp6_reset(SSP_COMMAND * sspC);
 SSP_RESPONSE_ENUM ssp6_disable_payout(SSP_COMMAND * sspC);
 SSP_RESPONSE_ENUM ssp6_disable(SSP_COMMAND * sspC);
@@ -30,6 +30,10 @@
 #define SSP_CMD_MANUFACTURER 0x30
 #define SSP_CMD_EXPANSION 0x30
 #define SSP_CMD_ENABLE_HIGHER_PROTOCOL 0x19
+#define SSP_CMD_SET_BAUD_RATE 0x4D	//data: SSP_BAUD_* rate, 0 until the next reset / 1 permanently
+#define SSP_BAUD_9600 0
+#define SSP_BAUD_38400 1
+#define SSP_BAUD_115200 2
 
 //PAYOUT and HOPPER COMMANDS
 #define SSP_CMD_PAYOUT_VALUE 0x33
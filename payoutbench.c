@@ -0,0 +1,578 @@
+/** \file payoutbench.c
+ *  \brief Load driver for payoutd, replays recorded requests and reports latencies and CPU usage.
+ *
+ *  In a nutshell:
+ *  - the traffic file (-f) has one JSON object per line: {"topic":"hopper-request","message":{...}}
+ *    with the optional properties "delay" (ms to wait before sending) and "event" (name of an event the request triggers)
+ *  - the msgId of each message is replaced by a unique one, the response is matched by its correlId
+ *  - the response and event topics are derived from the request topic ('hopper-request' -> 'hopper-response' / 'hopper-event')
+ *  - request latency: publishing the request until the response arrives
+ *  - event delivery latency: publishing the request until the first matching event arrives on the event topic
+ *  - CPU per transaction: user + system time of payoutd (-P pid) while running the traffic divided by the responses
+ *  - the traffic is replayed -n times, p50 / p99 / p999 are reported as text or with -j as a single JSON line
+ *  - main() supports arguments -h (redis hostname), -p (redis port), -f (traffic file), -n (repetitions),
+ *    -t (response timeout in ms), -P (pid of payoutd), -j and -?
+ */
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// json library
+#include <jansson.h>
+
+// c client for redis
+#include <hiredis/hiredis.h>
+
+#define TOPIC_MAX_LENGTH 64
+#define MSGID_MAX_LENGTH 48
+#define MAX_TOPICS 32
+
+/** \brief One line of the traffic file */
+struct b_entry {
+	char requestTopic[TOPIC_MAX_LENGTH];
+	int responseTopic; // index into b_bench.topics
+	int eventTopic; // index into b_bench.topics
+	json_t *message;
+	unsigned long delay;
+	char *event; // NULL if no event is expected
+};
+
+/** \brief One request sent, the timestamps are in us (0 = not yet) */
+struct b_request {
+	struct b_entry *entry;
+	char msgId[MSGID_MAX_LENGTH];
+	unsigned long long sentAt;
+	unsigned long long respondedAt;
+	unsigned long long eventAt;
+};
+
+struct b_bench {
+	char *redisHost;
+	int redisPort;
+	char *trafficFile;
+	unsigned int repetitions;
+	unsigned long timeout;
+	int pid;
+	int json;
+
+	struct b_entry *entries;
+	unsigned int entryCount;
+
+	char topics[MAX_TOPICS][TOPIC_MAX_LENGTH];
+	unsigned int topicCount;
+
+	pthread_mutex_t lock; // protects requests, subscribed
+	pthread_cond_t cond;
+	struct b_request *requests;
+	unsigned int requestCount; // sent so far
+	unsigned int responseCount;
+	int subscribed;
+};
+
+unsigned long long monotonicUs(void);
+int parseCmdLine(int argc, char *argv[], struct b_bench *bench);
+int loadTraffic(struct b_bench *bench);
+int addTopic(struct b_bench *bench, const char *requestTopic, const char *suffix);
+void *subscriber(void *privdata);
+void onMessage(struct b_bench *bench, const char *topic, const char *payload, unsigned long long now);
+int readCpuTicks(int pid, unsigned long long *ticks);
+unsigned long long percentile(unsigned long long *values, unsigned int count, double p);
+void report(struct b_bench *bench, unsigned long long elapsedUs, unsigned long long cpuTicks, int cpuValid);
+
+/**
+ * \brief Returns a monotonic timestamp in us.
+ */
+unsigned long long monotonicUs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * \brief Registers the response / event topic belonging to a request topic, returns its index or -1.
+ */
+int addTopic(struct b_bench *bench, const char *requestTopic, const char *suffix) {
+	char topic[TOPIC_MAX_LENGTH];
+	size_t length = strlen(requestTopic);
+	const char *request = "-request";
+
+	if (length < strlen(request) || strcmp(requestTopic + length - strlen(request), request) != 0) {
+		fprintf(stderr, "topic '%s' doesn't end with '-request'\n", requestTopic);
+		return -1;
+	}
+	if (snprintf(topic, sizeof(topic), "%.*s%s", (int) (length - strlen(request)), requestTopic, suffix)
+			>= (int) sizeof(topic)) {
+		fprintf(stderr, "topic '%s' is too long\n", requestTopic);
+		return -1;
+	}
+
+	for (unsigned int i = 0; i < bench->topicCount; i++) {
+		if (strcmp(bench->topics[i], topic) == 0) {
+			return i;
+		}
+	}
+	if (bench->topicCount == MAX_TOPICS) {
+		fprintf(stderr, "too many topics (max %d)\n", MAX_TOPICS);
+		return -1;
+	}
+	strcpy(bench->topics[bench->topicCount], topic);
+	return bench->topicCount++;
+}
+
+/**
+ * \brief Reads the traffic file, empty lines and lines starting with '#' are skipped.
+ */
+int loadTraffic(struct b_bench *bench) {
+	FILE *file = fopen(bench->trafficFile, "r");
+	if (file == NULL) {
+		fprintf(stderr, "could not open %s: %s\n", bench->trafficFile, strerror(errno));
+		return 1;
+	}
+
+	char *line = NULL;
+	size_t size = 0;
+	unsigned int lineNumber = 0;
+	int rc = 0;
+
+	while (getline(&line, &size, file) != -1) {
+		lineNumber++;
+		char *p = line;
+		while (isspace((unsigned char) *p)) {
+			p++;
+		}
+		if (*p == '\0' || *p == '#') {
+			continue;
+		}
+
+		json_error_t error;
+		json_t *json = json_loads(p, 0, &error);
+		json_t *topic = json ? json_object_get(json, "topic") : NULL;
+		json_t *message = json ? json_object_get(json, "message") : NULL;
+		json_t *delay = json ? json_object_get(json, "delay") : NULL;
+		json_t *event = json ? json_object_get(json, "event") : NULL;
+
+		if (json == NULL || ! json_is_string(topic) || ! json_is_object(message)
+				|| (delay != NULL && ! json_is_integer(delay)) || (event != NULL && ! json_is_string(event))
+				|| json_string_length(topic) >= TOPIC_MAX_LENGTH) {
+			fprintf(stderr, "%s:%u: expected {\"topic\":\"...-request\",\"message\":{...}}\n",
+					bench->trafficFile, lineNumber);
+			json_decref(json);
+			rc = 1;
+			break;
+		}
+
+		struct b_entry *entries = realloc(bench->entries, (bench->entryCount + 1) * sizeof(struct b_entry));
+		if (entries == NULL) {
+			json_decref(json);
+			rc = 1;
+			break;
+		}
+		bench->entries = entries;
+
+		struct b_entry *entry = &bench->entries[bench->entryCount];
+		strcpy(entry->requestTopic, json_string_value(topic));
+		entry->responseTopic = addTopic(bench, entry->requestTopic, "-response");
+		entry->eventTopic = addTopic(bench, entry->requestTopic, "-event");
+		entry->message = json_incref(message);
+		entry->delay = delay ? json_integer_value(delay) : 0;
+		entry->event = event ? strdup(json_string_value(event)) : NULL;
+		json_decref(json);
+
+		if (entry->responseTopic < 0 || entry->eventTopic < 0) {
+			rc = 1;
+			break;
+		}
+		bench->entryCount++;
+	}
+
+	free(line);
+	fclose(file);
+
+	if (rc == 0 && bench->entryCount == 0) {
+		fprintf(stderr, "%s contains no requests\n", bench->trafficFile);
+		rc = 1;
+	}
+	return rc;
+}
+
+/**
+ * \brief Matches a response by its correlId and an event by its name with the oldest request waiting for it.
+ */
+void onMessage(struct b_bench *bench, const char *topic, const char *payload, unsigned long long now) {
+	json_error_t error;
+	json_t *json = json_loads(payload, 0, &error);
+	if (json == NULL) {
+		return;
+	}
+
+	json_t *correlId = json_object_get(json, "correlId");
+	json_t *event = json_object_get(json, "event");
+
+	pthread_mutex_lock(&bench->lock);
+	for (unsigned int i = 0; i < bench->requestCount; i++) {
+		struct b_request *request = &bench->requests[i];
+		struct b_entry *entry = request->entry;
+
+		if (json_is_string(correlId) && request->respondedAt == 0
+				&& strcmp(bench->topics[entry->responseTopic], topic) == 0
+				&& strcmp(request->msgId, json_string_value(correlId)) == 0) {
+			request->respondedAt = now;
+			bench->responseCount++;
+			pthread_cond_signal(&bench->cond);
+			break;
+		}
+
+		if (json_is_string(event) && entry->event != NULL && request->eventAt == 0
+				&& strcmp(bench->topics[entry->eventTopic], topic) == 0
+				&& strcmp(entry->event, json_string_value(event)) == 0) {
+			request->eventAt = now;
+			pthread_cond_signal(&bench->cond);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&bench->lock);
+
+	json_decref(json);
+}
+
+/**
+ * \brief Subscriber thread, has its own redis connection as a subscribed connection can't publish.
+ */
+void *subscriber(void *privdata) {
+	struct b_bench *bench = privdata;
+
+	redisContext *ctx = redisConnect(bench->redisHost, bench->redisPort);
+	if (ctx == NULL || ctx->err) {
+		fprintf(stderr, "could not connect to redis at %s:%d: %s\n", bench->redisHost, bench->redisPort,
+				ctx ? ctx->errstr : "out of memory");
+		exit(1);
+	}
+
+	const char *argv[MAX_TOPICS + 1];
+	argv[0] = "SUBSCRIBE";
+	for (unsigned int i = 0; i < bench->topicCount; i++) {
+		argv[i + 1] = bench->topics[i];
+	}
+	redisAppendCommandArgv(ctx, bench->topicCount + 1, argv, NULL);
+
+	unsigned int confirmed = 0;
+	redisReply *reply;
+	while (redisGetReply(ctx, (void **) &reply) == REDIS_OK) {
+		unsigned long long now = monotonicUs();
+
+		if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 3
+				&& reply->element[0]->type == REDIS_REPLY_STRING) {
+			if (strcmp(reply->element[0]->str, "message") == 0) {
+				onMessage(bench, reply->element[1]->str, reply->element[2]->str, now);
+			} else if (strcmp(reply->element[0]->str, "subscribe") == 0 && ++confirmed == bench->topicCount) {
+				pthread_mutex_lock(&bench->lock);
+				bench->subscribed = 1;
+				pthread_cond_signal(&bench->cond);
+				pthread_mutex_unlock(&bench->lock);
+			}
+		}
+		freeReplyObject(reply);
+	}
+
+	fprintf(stderr, "lost the redis subscription: %s\n", ctx->errstr);
+	exit(1);
+	return NULL;
+}
+
+/**
+ * \brief Reads utime + stime of a process from /proc/<pid>/stat.
+ */
+int readCpuTicks(int pid, unsigned long long *ticks) {
+	char path[64];
+	char buffer[1024];
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+
+	FILE *file = fopen(path, "r");
+	if (file == NULL) {
+		return 1;
+	}
+	size_t length = fread(buffer, 1, sizeof(buffer) - 1, file);
+	fclose(file);
+	buffer[length] = '\0';
+
+	// the command name may contain spaces and parentheses, the fields start after the last ')'
+	char *p = strrchr(buffer, ')');
+	unsigned long long utime, stime;
+	if (p == NULL || sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2) {
+		return 1;
+	}
+	*ticks = utime + stime;
+	return 0;
+}
+
+/**
+ * \brief Nearest rank percentile of sorted values.
+ */
+unsigned long long percentile(unsigned long long *values, unsigned int count, double p) {
+	if (count == 0) {
+		return 0;
+	}
+	unsigned int rank = (unsigned int) ceil(p * count);
+	return values[rank > 0 ? rank - 1 : 0];
+}
+
+static int compareUll(const void *a, const void *b) {
+	unsigned long long x = *(const unsigned long long *) a;
+	unsigned long long y = *(const unsigned long long *) b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * \brief Prints the latencies (in ms) and the CPU per transaction.
+ */
+void report(struct b_bench *bench, unsigned long long elapsedUs, unsigned long long cpuTicks, int cpuValid) {
+	unsigned long long *responses = calloc(bench->requestCount + 1, sizeof(unsigned long long));
+	unsigned long long *events = calloc(bench->requestCount + 1, sizeof(unsigned long long));
+	unsigned int responseCount = 0, eventCount = 0, eventsExpected = 0;
+
+	if (responses == NULL || events == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	for (unsigned int i = 0; i < bench->requestCount; i++) {
+		struct b_request *request = &bench->requests[i];
+		if (request->respondedAt) {
+			responses[responseCount++] = request->respondedAt - request->sentAt;
+		}
+		if (request->entry->event != NULL) {
+			eventsExpected++;
+			if (request->eventAt) {
+				events[eventCount++] = request->eventAt - request->sentAt;
+			}
+		}
+	}
+	qsort(responses, responseCount, sizeof(unsigned long long), compareUll);
+	qsort(events, eventCount, sizeof(unsigned long long), compareUll);
+
+	double cpuMs = cpuValid ? cpuTicks * 1000.0 / sysconf(_SC_CLK_TCK) : 0;
+	double cpuPerTransaction = cpuValid && responseCount > 0 ? cpuMs / responseCount : 0;
+
+	if (bench->json) {
+		printf("{\"requests\":%u,\"responses\":%u,\"elapsedMs\":%.3f,"
+				"\"latency\":{\"p50\":%.3f,\"p99\":%.3f,\"p999\":%.3f,\"max\":%.3f},"
+				"\"events\":%u,\"eventsExpected\":%u,"
+				"\"eventLatency\":{\"p50\":%.3f,\"p99\":%.3f,\"p999\":%.3f,\"max\":%.3f}",
+				bench->requestCount, responseCount, elapsedUs / 1000.0,
+				percentile(responses, responseCount, 0.5) / 1000.0,
+				percentile(responses, responseCount, 0.99) / 1000.0,
+				percentile(responses, responseCount, 0.999) / 1000.0,
+				responseCount ? responses[responseCount - 1] / 1000.0 : 0,
+				eventCount, eventsExpected,
+				percentile(events, eventCount, 0.5) / 1000.0,
+				percentile(events, eventCount, 0.99) / 1000.0,
+				percentile(events, eventCount, 0.999) / 1000.0,
+				eventCount ? events[eventCount - 1] / 1000.0 : 0);
+		if (cpuValid) {
+			printf(",\"cpuMs\":%.3f,\"cpuMsPerTransaction\":%.3f", cpuMs, cpuPerTransaction);
+		}
+		printf("}\n");
+	} else {
+		printf("requests:        %u sent, %u answered, %u lost in %.1f s\n", bench->requestCount, responseCount,
+				bench->requestCount - responseCount, elapsedUs / 1000000.0);
+		printf("request latency: p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms\n",
+				percentile(responses, responseCount, 0.5) / 1000.0,
+				percentile(responses, responseCount, 0.99) / 1000.0,
+				percentile(responses, responseCount, 0.999) / 1000.0,
+				responseCount ? responses[responseCount - 1] / 1000.0 : 0);
+		if (eventsExpected > 0) {
+			printf("event latency:   p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms (%u of %u events)\n",
+					percentile(events, eventCount, 0.5) / 1000.0,
+					percentile(events, eventCount, 0.99) / 1000.0,
+					percentile(events, eventCount, 0.999) / 1000.0,
+					eventCount ? events[eventCount - 1] / 1000.0 : 0, eventCount, eventsExpected);
+		}
+		if (cpuValid) {
+			printf("cpu:             %.1f ms total, %.3f ms per transaction\n", cpuMs, cpuPerTransaction);
+		}
+	}
+
+	free(responses);
+	free(events);
+}
+
+/**
+ * \brief Supports arguments -h (redis hostname), -p (redis port), -f (traffic file), -n (repetitions),
+ * -t (response timeout in ms), -P (pid of payoutd), -j and -?.
+ */
+int parseCmdLine(int argc, char *argv[], struct b_bench *bench) {
+	opterr = 0;
+
+	int c;
+	while ((c = getopt(argc, argv, "jh:p:f:n:t:P:")) != -1) {
+		switch (c) {
+		case 'h':
+			bench->redisHost = optarg;
+			break;
+		case 'p':
+			bench->redisPort = atoi(optarg);
+			break;
+		case 'f':
+			bench->trafficFile = optarg;
+			break;
+		case 'n':
+			bench->repetitions = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			bench->timeout = strtoul(optarg, NULL, 10);
+			break;
+		case 'P':
+			bench->pid = atoi(optarg);
+			break;
+		case 'j':
+			bench->json = 1;
+			break;
+		case '?':
+			if (strchr("hpfntP", optopt) != NULL) {
+				fprintf(stderr, "Option -%c requires an argument.\n", optopt);
+			} else if (isprint(optopt)) {
+				fprintf(stderr, "Unknown option '-%c'.\n", optopt);
+			} else {
+				fprintf(stderr, "Unknown option character 'x%x'.\n", optopt);
+			}
+			return 1;
+		default:
+			fprintf(stderr, "Unknown argument: %c", c);
+			return 1;
+		}
+	}
+
+	return bench->repetitions == 0;
+}
+
+int main(int argc, char *argv[]) {
+	struct b_bench bench;
+	memset(&bench, 0, sizeof(bench));
+	bench.redisHost = "127.0.0.1"; // default, override with -h argument
+	bench.redisPort = 6379; // default, override with -p argument
+	bench.trafficFile = "bench/traffic.jsonl"; // default, override with -f argument
+	bench.repetitions = 1; // default, override with -n argument
+	bench.timeout = 5000; // default, override with -t argument
+	pthread_mutex_init(&bench.lock, NULL);
+	pthread_cond_init(&bench.cond, NULL);
+
+	if (parseCmdLine(argc, argv, &bench)) {
+		fprintf(stderr, "usage: %s [-h redis host] [-p redis port] [-f traffic file] [-n repetitions] "
+				"[-t timeout ms] [-P pid of payoutd] [-j]\n", argv[0]);
+		return 1;
+	}
+
+	if (loadTraffic(&bench)) {
+		return 1;
+	}
+
+	bench.requests = calloc((size_t) bench.entryCount * bench.repetitions, sizeof(struct b_request));
+	if (bench.requests == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	redisContext *publishCtx = redisConnect(bench.redisHost, bench.redisPort);
+	if (publishCtx == NULL || publishCtx->err) {
+		fprintf(stderr, "could not connect to redis at %s:%d: %s\n", bench.redisHost, bench.redisPort,
+				publishCtx ? publishCtx->errstr : "out of memory");
+		return 1;
+	}
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, subscriber, &bench)) {
+		fprintf(stderr, "could not start the subscriber\n");
+		return 1;
+	}
+	pthread_detach(thread);
+
+	// don't send anything before all responses / events can be seen
+	pthread_mutex_lock(&bench.lock);
+	while (! bench.subscribed) {
+		pthread_cond_wait(&bench.cond, &bench.lock);
+	}
+	pthread_mutex_unlock(&bench.lock);
+
+	unsigned long long cpuBefore = 0, cpuAfter = 0;
+	int cpuValid = bench.pid > 0 && readCpuTicks(bench.pid, &cpuBefore) == 0;
+	if (bench.pid > 0 && ! cpuValid) {
+		fprintf(stderr, "could not read the cpu time of pid %d\n", bench.pid);
+	}
+
+	unsigned long long startedAt = monotonicUs();
+	unsigned int total = bench.entryCount * bench.repetitions;
+	for (unsigned int i = 0; i < total; i++) {
+		struct b_entry *entry = &bench.entries[i % bench.entryCount];
+
+		if (entry->delay > 0) {
+			struct timespec ts = { entry->delay / 1000, (entry->delay % 1000) * 1000000 };
+			nanosleep(&ts, NULL);
+		}
+
+		struct b_request *request = &bench.requests[i];
+		request->entry = entry;
+		snprintf(request->msgId, sizeof(request->msgId), "bench-%d-%u", (int) getpid(), i);
+
+		json_object_set_new(entry->message, "msgId", json_string(request->msgId));
+		char *message = json_dumps(entry->message, JSON_COMPACT);
+		if (message == NULL) {
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+
+		pthread_mutex_lock(&bench.lock);
+		request->sentAt = monotonicUs();
+		bench.requestCount++;
+		pthread_mutex_unlock(&bench.lock);
+
+		redisReply *reply = redisCommand(publishCtx, "PUBLISH %s %s", entry->requestTopic, message);
+		free(message);
+		if (reply == NULL) {
+			fprintf(stderr, "publishing failed: %s\n", publishCtx->errstr);
+			return 1;
+		}
+		freeReplyObject(reply);
+	}
+
+	// wait for the outstanding responses / events, at most timeout ms after the last request
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += bench.timeout / 1000;
+	deadline.tv_nsec += (bench.timeout % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&bench.lock);
+	for (;;) {
+		int pending = bench.responseCount < bench.requestCount;
+		for (unsigned int i = 0; ! pending && i < bench.requestCount; i++) {
+			pending = bench.requests[i].entry->event != NULL && bench.requests[i].eventAt == 0;
+		}
+		if (! pending || pthread_cond_timedwait(&bench.cond, &bench.lock, &deadline) == ETIMEDOUT) {
+			break;
+		}
+	}
+	unsigned long long elapsedUs = monotonicUs() - startedAt;
+
+	if (cpuValid && readCpuTicks(bench.pid, &cpuAfter)) {
+		cpuValid = 0;
+	}
+	report(&bench, elapsedUs, cpuAfter - cpuBefore, cpuValid);
+	int lost = bench.responseCount < bench.requestCount;
+	pthread_mutex_unlock(&bench.lock);
+
+	redisFree(publishCtx);
+	return lost ? 2 : 0;
+}
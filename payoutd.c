@@ -2,20 +2,63 @@
  *  \brief Main source file for the payoutd daemon.
  *
  *  In a nutshell:
- *  - we are single threaded
+ *  - redis and libevent are served by the main thread, each device has its own worker thread which owns its SSP traffic
+ *  - one process serves several serial buses (-d / -b), each with a hopper and a validator, the topics of a bus
+ *    named with -b are prefixed with its name (ex. 'kiosk3:hopper-request')
  *  - libevent is used to trigger 2 periodic events ("poll event" and "check quit") which poll the hardware and check if we should quit
- *  - main() function supports arguments -h (redis hostname), -p (redis port), -d (serial device name) and -?
- *  - libevent calls cbOnPollEvent() for the "poll" event
+ *  - main() function supports arguments -h (redis hostname), -p (redis port), -d (serial device name), -b (named bus),
+ *    -g/-G (minimum gap between two SSP exchanges with the hopper/validator in ms), -s (maximum age of cached levels in ms),
+ *    -S (directory for the configuration snapshots), -m (interval of the 'payout-metrics' publishing in s),
+ *    -T (transport 'pubsub' or 'streams'), -M (approximate maximum length of the written streams),
+ *    -Q (KiB of messages kept while redis is unavailable), -O (spill file for them), -E (the events of a poll as
+ *    one array in '*-events'), -C (coalesce repeated progress events), -L (log file instead of syslog),
+ *    -J (transaction journal file), -B (baud rate negotiated with the devices), -U (local socket),
+ *    -w (wire capture file), -r/-F (replay a wire capture at the recorded speed / as fast as possible),
+ *    -q (maximum number of jobs queued per device), -W (queue depth from which read-only commands are shed) and -?
+ *  - log messages are queued in a lock-free ring (logMessage()) and written out by the log thread, so a slow syslog
+ *    never stalls the event loop or a worker
+ *  - with -J requests, results, poll events and levels are journaled to a memory mapped ring file (journalAppend()),
+ *    synced once per poll tick by the journal thread and replayed into the state cache on startup (journalReplay())
+ *  - libevent calls cbOnPollEvent() for the "poll" event, which queues a poll job for each device whose next poll is due
+ *  - the poll interval of a device adapts: short bursts while events are reported or a payout/float/empty is running,
+ *    exponential backoff to the idle interval once the device has been quiet for a while
  *  - libevent calls cbOnCheckQuitEvent() for the "check quit" event
  *  - redis is used in conjunction with libevent
  *  - if a message is detected in 'validator-request' or 'hopper-request' the cbOnRequestMessage() is called
- *  - the cbOnRequestMessage() checks if the command is known and if its known dispatches the call to a handle<Cmd> function
+ *  - with -T streams the request topics are read as redis streams with a consumer group (cbOnStreamRequests()) and
+ *    the responses / events are appended with XADD instead of being published
+ *  - both hand the request to processRequest(), which looks up the command in the commandDefs table (hashed in commandIndex) and if its known queues a job for the handle<Cmd> function on the worker of the device
+ *  - the job queue of a worker is ordered by priority (transactions, other commands, polls), identical pending reads are
+ *    coalesced into one job whose response is fanned out (mcSspQueueJob()), the bus is shared by priority as well
+ *  - the queue is bounded (-q), read-only commands are shed first (-W), and a command still waiting when its
+ *    deadline ('deadlineMs' or the default of the command) has passed is answered without reaching the bus
+ *  - all messages (responses and events) are queued in the outbox and published by the main thread in cbOnOutboxEvent()
+ *  - with -U co-located clients send requests and subscribe topics on a local SOCK_SEQPACKET socket (cbOnLocalClientEvent()),
+ *    they get the messages of the outbox as well (flushLocal()) and the responses to their requests on their own connection only
+ *  - both redis connections are reconnected with a backoff (scheduleReconnect()), meanwhile the outbox keeps the messages
+ *    (bounded by -Q, spilled to the -O file or dropped except the money events) and hands them over once reconnected
+ *  - with -w every SSP exchange is captured to a binary file by libitlssp, with -r a capture answers the commands
+ *    instead of the serial devices, which turns a field incident into a repeatable benchmark
+ *  - latencies, retries, errors and queue depths are reported by the 'metrics' command and periodically in 'payout-metrics'
+ *  - with -B the devices of a bus are switched to a faster baud rate before they are set up (mcSspNegotiateBaud()),
+ *    all of them or none as they share the port, a device found back at 9600 baud after a reset is switched again
+ *  - 'download' sends a firmware / dataset file to a device, publishing its progress to 'payout-event'
+ *  - the host keys for (re)negotiating the SSP encryption are prepared in the background by the key pool of libitlssp,
+ *    a device answering "key not set" is renegotiated by its own worker with the next poll
+ *  - a resent request (same msgId and cmd for the same device) is not executed again: the request cache
+ *    (requestCacheBegin()) answers it with the kept response, or with the response of the executing one
+ *  - read-only queries (versions, levels) are answered from the state cache of the device in processRequest() unless "fresh":true is requested
+ *  - test-payout / test-float are answered by the payout planner (replyWithPlan()) from the cached levels unless "verify":true is requested
+ *    or the device is disabled / busy
  *  - a command handler interprets the provided JSON message, issues commands to the money hardware and publishes a JSON response
  *  - the naming convention used most of the time is like: the JSON command is 'configure-bezel' so the handler function is called handleConfigureBezel()
  *  - handleConfigureBezel() itself calls mc_ssp_configure_bezel() which sends the SSP command to the hardware
- *  - each device has its own poll event handling function (responsible for publishing the events to the devices event topic)
- *  - those poll handler functions are hopperEventHandler() and validatorEventHandler()
+ *  - the events of a poll are decoded by ssp6_decode_poll() of libitlssp and rendered with the pre-split JSON templates
+ *    of the eventDefs table (indexed by SSP event code, one column per device kind) by mcSspPublishEvent(), called by
+ *    mcSspDispatchEvents() which optionally coalesces repeated progress events (-C) and batches the events of a poll (-E)
  *  - on startup/exiting of the daemon started/exiting messages are published to the 'payout-event' topic
+ *  - the workers initialize their devices concurrently, each device publishes 'started' to its event topic once it is ready
+ *  - with -S the applied routes / coin mech inhibits are remembered per dataset version and not sent again on the next start
  */
 
 #define _GNU_SOURCE
@@ -24,19 +67,26 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <pthread.h>
+#include <time.h>
 
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 // lowlevel library provided by the cash hardware vendor
 // innovative technologies (http://innovative-technology.com).
 // ssp manual available at http://innovative-technology.com/images/pdocuments/manuals/SSP_Manual.pdf
 #include "libitlssp/ssp_commands.h"
+#include "libitlssp/Encryption.h"
 
 // json library
 #include <jansson.h>
@@ -48,13 +98,148 @@
 #include <hiredis/adapters/libevent.h>
 
 #include <syslog.h>
+#include <stdatomic.h>
+#include <stdint.h>
 
 // libuuid is used to generate msgIds for the responses
 #include <uuid/uuid.h>
 
 // https://sites.google.com/site/rickcreamer/Home/cc/c-implementation-of-stringbuffer-functionality
-#include "StringBuffer.h"
-#include "StringBuffer.c"
+
+/** \brief Number of slots in the log ring, must be a power of 2 */
+#define LOG_RING_SIZE 512
+/** \brief Maximum length of a log message including the terminating NUL, longer ones are truncated */
+#define LOG_LINE_MAX 256
+#ifndef LOG_COMPILE_LEVEL
+/** \brief Messages less important than this are compiled out (ex. -DLOG_COMPILE_LEVEL=LOG_NOTICE) */
+#define LOG_COMPILE_LEVEL LOG_INFO
+#endif
+
+/**
+ * \brief Queues a message for the log, used instead of syslog() everywhere but in die().
+ * Messages less important than LOG_COMPILE_LEVEL are not even formatted.
+ */
+#define logMessage(priority, ...) do { \
+		if ((priority) <= LOG_COMPILE_LEVEL) { \
+			logWrite(priority, __VA_ARGS__); \
+		} \
+	} while (0)
+
+/**
+ * \brief A message in the log ring.
+ */
+struct m_log_slot {
+	/** \brief Position the slot is free for (== position) or readable at (== position + 1) */
+	atomic_size_t sequence;
+	/** \brief The syslog priority of the message */
+	int priority;
+	/** \brief The formatted message */
+	char line[LOG_LINE_MAX];
+};
+
+/**
+ * \brief Bounded lock-free MPSC ring of log messages. Any thread formats its messages into the ring,
+ * the log thread writes them out to syslog (or the -L file), so a slow syslog never blocks us.
+ * \details The producers claim a slot by advancing head with a CAS and publish it by setting its sequence,
+ * if the ring is full the message is dropped and counted.
+ */
+struct m_log {
+	/** \brief The slots */
+	struct m_log_slot slots[LOG_RING_SIZE];
+	/** \brief Next position claimed by a producer */
+	atomic_size_t head;
+	/** \brief Next position read by the consumer (protected by lock) */
+	size_t tail;
+	/** \brief Number of messages dropped because the ring was full */
+	atomic_ulong dropped;
+	/** \brief Number of dropped messages reported in the log so far (protected by lock) */
+	unsigned long reportedDropped;
+	/** \brief If !=0 the log thread is running and the messages go through the ring */
+	atomic_int running;
+	/** \brief Serializes the consumers (the log thread and die()) */
+	pthread_mutex_t lock;
+	/** \brief The log thread */
+	pthread_t thread;
+	/** \brief File the messages are written to instead of syslog (-L), NULL for syslog */
+	FILE *file;
+};
+
+/** \brief The log ring of the process */
+struct m_log logRing = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/** \brief Number of records in the journal file (-J), 4 MiB with the header */
+#define JOURNAL_RECORDS 65536
+/** \brief Identifies a journal file, changes whenever m_journal_record changes */
+static const char JOURNAL_MAGIC[8] = "PAYJRNL1";
+
+/**
+ * \brief Types of the records in the journal.
+ */
+enum m_journal_type {
+	/** \brief A request for the hardware has been queued: code is the index in commandDefs, status 1 if mutating,
+	 * value the amount (if any), id the correlId */
+	JOURNAL_REQUEST = 1,
+	/** \brief A request has been executed: code/status are the SSP response / status of its last exchange,
+	 * value the index in commandDefs, id the correlId */
+	JOURNAL_RESULT,
+	/** \brief A poll event: code is the event, value/data are data1/data2, id the correlId of the running transaction */
+	JOURNAL_EVENT,
+	/** \brief One denomination of a "get-all-levels": code is the number of denominations, status the index of this one,
+	 * value/data are value/level, id the currency followed by the bus name */
+	JOURNAL_LEVEL,
+};
+
+/**
+ * \brief A record in the journal, the file is an array of them (the first one holds the header).
+ */
+struct m_journal_record {
+	/** \brief Sequence number, the record lives at index seq % JOURNAL_RECORDS + 1, 0 if unused */
+	uint64_t seq;
+	/** \brief Wall clock time in ms the record has been written */
+	uint64_t at;
+	/** \brief One of m_journal_type */
+	uint8_t type;
+	/** \brief Bus index * 2, + 1 for the validator */
+	uint8_t device;
+	/** \brief Depends on type */
+	uint8_t code;
+	/** \brief Depends on type */
+	uint8_t status;
+	/** \brief Depends on type */
+	uint32_t value;
+	/** \brief Depends on type */
+	uint32_t data;
+	/** \brief Depends on type, NUL padded (not terminated if all 36 chars are used) */
+	char id[36];
+};
+
+_Static_assert(sizeof(struct m_journal_record) == 64, "journal records must stay 64 bytes");
+
+/**
+ * \brief Append-only ring of m_journal_record in a memory mapped file (-J), which tells after a restart
+ * which request caused which events and what the levels were.
+ * \details Any thread claims a record by advancing next and writes it into the mapping, the journal thread
+ * msyncs the file once per POLL_TICK if something has been written (group commit).
+ */
+struct m_journal {
+	/** \brief The mapped file */
+	struct m_journal_record *map;
+	/** \brief The records, map + 1 */
+	struct m_journal_record *records;
+	/** \brief Sequence number of the next record */
+	atomic_ulong next;
+	/** \brief Set by the writers, reset by the journal thread before msync */
+	atomic_int dirty;
+	/** \brief If !=0 the journal thread is running */
+	atomic_int running;
+	/** \brief Number of msyncs done */
+	atomic_ulong syncs;
+	/** \brief The journal thread */
+	pthread_t thread;
+};
+
+/** \brief The journal of the process, map is NULL without -J */
+struct m_journal journal;
 
 /** \brief redis context used for publishing messages */
 redisAsyncContext *redisPublishCtx = NULL;
@@ -63,6 +248,202 @@ redisAsyncContext *redisPublishCtx = NULL;
 redisAsyncContext *redisSubscribeCtx = NULL;
 
 struct m_metacash;
+struct m_command;
+
+/**
+ * \brief State of one of the two redis connections, which is reconnected with an exponential
+ * backoff when it is lost (libevent thread only).
+ */
+struct m_redis_link {
+	/** \brief Name of the connection used in the log ("publish" or "subscribe") */
+	const char *name;
+	/** \brief Where the context is kept (redisPublishCtx or redisSubscribeCtx), NULL while disconnected */
+	redisAsyncContext **ctx;
+	/** \brief The connect callback of the context */
+	void (*connectFn)(const redisAsyncContext *c, int status);
+	/** \brief The disconnect callback of the context */
+	void (*disconnectFn)(const redisAsyncContext *c, int status);
+	/** \brief Delay in ms before the next reconnect attempt */
+	unsigned long backoff;
+	/** \brief Number of reconnect attempts so far */
+	unsigned long reconnects;
+	/** \brief Timer of the next reconnect attempt */
+	struct event evReconnect;
+	/** \brief Timer which reads the request streams again after an error reply (subscribe connection with -T only) */
+	struct event evRetry;
+	/** \brief The metacash struct, used as data of the context */
+	struct m_metacash *metacash;
+};
+
+/** \brief The connection used for publishing messages */
+struct m_redis_link publishLink;
+
+/** \brief The connection used for subscribing to topics */
+struct m_redis_link subscribeLink;
+
+/**
+ * \brief Types of jobs which can be queued for the worker thread of a device.
+ */
+enum m_job_type {
+	/** \brief Initialize and configure the device, always the first job of a worker */
+	JOB_SETUP,
+	/** \brief Poll the device and dispatch the reported events */
+	JOB_POLL,
+	/** \brief Execute a command received in one of our request topics */
+	JOB_COMMAND,
+};
+
+/**
+ * \brief Result of mcSspQueueJob().
+ */
+enum m_queue_result {
+	/** \brief The worker owns the job now */
+	QUEUE_OK = 0,
+	/** \brief The worker of the device isn't running */
+	QUEUE_UNAVAILABLE,
+	/** \brief The queue of the device is too full for the job (see -q / -W) */
+	QUEUE_SHED,
+};
+
+/**
+ * \brief Structure which describes a unit of work for the worker thread of a device.
+ */
+struct m_job {
+	/** \brief What the worker should do */
+	enum m_job_type type;
+	/** \brief The command to execute (JOB_COMMAND only), owned by the job */
+	struct m_command *cmd;
+	/** \brief The handler function to call for the command (JOB_COMMAND only) */
+	void (*handlerFn) (struct m_command *cmd);
+	/** \brief The m_command_flags of the command (JOB_COMMAND only) */
+	unsigned int flags;
+	/** \brief One of SSP_PRIORITY_*, the queue is ordered by it (set by mcSspQueueJob()) */
+	int priority;
+	/** \brief Monotonic time in ms the job has been queued */
+	unsigned long long queuedAt;
+	/** \brief Next job in the queue */
+	struct m_job *next;
+};
+
+/**
+ * \brief Structure which describes a contiguous, growable byte buffer.
+ * \details The memory is kept when the buffer is reset (length = 0), so a buffer
+ * which is reused doesn't allocate anymore once it has grown to its working size.
+ */
+struct m_buffer {
+	/** \brief The content, always NUL terminated if data != NULL */
+	char *data;
+	/** \brief Number of bytes used (without the terminating NUL) */
+	size_t length;
+	/** \brief Number of bytes allocated */
+	size_t capacity;
+	/** \brief If !=0 an append failed (out of memory) since the last reset, the content is incomplete */
+	int failed;
+};
+
+/**
+ * \brief Flags describing a command in the commandDefs table.
+ */
+enum m_command_flags {
+	/** \brief The command needs the actual hardware and is executed on the worker of the device */
+	CMD_HARDWARE = 1 << 0,
+	/** \brief The command changes the state of the device (as opposed to only reading it) */
+	CMD_MUTATING = 1 << 1,
+	/** \brief The command is supported by the hopper */
+	CMD_HOPPER = 1 << 2,
+	/** \brief The command is supported by the validator */
+	CMD_VALIDATOR = 1 << 3,
+	/** \brief The command moves money (payout, float, empty), it is served before any other work of the device */
+	CMD_TRANSACTION = 1 << 4,
+	/** \brief The command only reads and has no arguments, a pending one is shared by later duplicates */
+	CMD_COALESCE = 1 << 5,
+};
+
+/**
+ * \brief Structure which describes a command we understand in our request topics.
+ */
+struct m_command_def {
+	/** \brief The command as used in the 'cmd' property of the message */
+	const char *name;
+	/** \brief The handler function for the command */
+	void (*handlerFn) (struct m_command *cmd);
+	/**
+	 * \brief Optional function which answers the command from the state cache of the device,
+	 * called by the libevent thread. Returns !=0 if it has replied.
+	 */
+	int (*cachedFn) (struct m_command *cmd);
+	/** \brief Combination of m_command_flags */
+	unsigned int flags;
+	/** \brief Time in ms a request may wait for the worker before it is dropped unexecuted, 0 for no limit (overridden by 'deadlineMs') */
+	unsigned long deadline;
+	/** \brief Number of times the command has been received (libevent thread only) */
+	unsigned long received;
+	/** \brief Number of times the command has been rejected without executing it (libevent thread only) */
+	unsigned long rejected;
+	/** \brief Time from receiving the command until it has been answered (protected by metrics.lock) */
+	SSP_LATENCY latency;
+};
+
+/** \brief Maximum number of denominations the payout planner handles */
+#define PLAN_MAX_DENOMINATIONS 20
+
+/**
+ * \brief Structure which describes the number of coins / notes of one denomination.
+ */
+struct m_denomination {
+	/** \brief Value of the denomination in cents */
+	unsigned int value;
+	/** \brief Number of coins / notes */
+	unsigned int level;
+};
+
+/**
+ * \brief Structure which caches what we know about the state of a device, so read-only
+ * queries can be answered without talking to the hardware.
+ * \details Timestamps are monotonicMs() values of the moment the data was read from the
+ * device, 0 means not cached.
+ */
+struct m_device_state {
+	/** \brief Protects the cache, it is filled by the worker and read by the libevent thread */
+	pthread_mutex_t lock;
+	/** \brief Firmware version as reported by the device, never changes at runtime */
+	char firmwareVersion[100];
+	/** \brief When firmwareVersion was read */
+	unsigned long long firmwareVersionAt;
+	/** \brief Dataset version as reported by the device, never changes at runtime */
+	char datasetVersion[100];
+	/** \brief When datasetVersion was read */
+	unsigned long long datasetVersionAt;
+	/** \brief JSON array content of the last "get-all-levels" response */
+	struct m_buffer levels;
+	/** \brief When levels was read, reset by poll events which change the levels */
+	unsigned long long levelsAt;
+	/** \brief JSON array content of the last "cashbox-payout-operation-data" response */
+	struct m_buffer cashboxData;
+	/** \brief When cashboxData was read, reset by poll events which change the levels */
+	unsigned long long cashboxDataAt;
+	/** \brief Levels set with "set-cashbox-payout-limit" (level is the limit), kept back by the payout planner */
+	struct m_denomination cashboxLimits[PLAN_MAX_DENOMINATIONS];
+	/** \brief Number of used entries in cashboxLimits */
+	unsigned int cashboxLimitCount;
+	/** \brief If !=0 the device is disabled ("disable" or a "disabled" poll event) until it is enabled again */
+	int disabled;
+	/** \brief If !=0 a payout, float or empty is running, the device would answer "busy" */
+	int transactionRunning;
+	/** \brief Number of payouts, floats and empties queued for the worker or being sent to the device (taken after jobLock) */
+	unsigned int transactionsQueued;
+};
+
+/** \brief Maximum length of a topic name including the terminating NUL */
+#define TOPIC_MAX_LENGTH 64
+
+/**
+ * \brief Selects the column of eventDefs used for a device, the devices name some events differently.
+ */
+enum m_event_kind {
+	EVENT_HOPPER,
+	EVENT_VALIDATOR
+};
 
 /**
  * \brief Structure which describes an actual physical ITL device
@@ -72,35 +453,169 @@ struct m_device {
 	int id;
 	/** \brief Human readable name of the device */
 	char *name;
-	/** \brief Indicates if the device is available */
+	/** \brief Either CMD_HOPPER or CMD_VALIDATOR, checked against the flags of a command */
+	unsigned int commandClass;
+	/** \brief Indicates if the device is available, set by the worker once initialized (protected by jobLock) */
 	int sspDeviceAvailable;
 	/** \brief Preshared secret key */
 	unsigned long long key;
 	/** \brief State of the channel inhibits */
 	unsigned char channelInhibits;
+	/** \brief Minimum gap in ms between two SSP exchanges with this device (metacash.hopperCommandGap / validatorCommandGap) */
+	unsigned long commandGap;
 	/** \brief SSP_COMMAND structure to use for communicating with this device */
 	SSP_COMMAND sspC;
-	/** \brief SSP6_REQUEST_DATA structure to use initializing this device */
+	/** \brief SSP6_REQUEST_DATA structure to use initializing this device (also our cached channel table) */
 	SSP6_SETUP_REQUEST_DATA sspSetupReq;
-	/** \brief Callback function which is used to inspect and publish events reported by this device */
-	void (*eventHandlerFn) (struct m_device *device, struct m_metacash *metacash, SSP_POLL_DATA6 *poll);
+	/** \brief Cached state of the device */
+	struct m_device_state state;
+	/** \brief Callback function which configures the device after it has been initialized (worker only), returns 0 on success */
+	int (*setupFn) (struct m_device *device);
+	/** \brief Column of eventDefs the events reported by this device are rendered with */
+	enum m_event_kind eventKind;
+
+	/** \brief The metacash structure this device belongs to */
+	struct m_metacash *metacash;
+	/** \brief The bus this device is connected to */
+	struct m_bus *bus;
+	/** \brief Either "hopper" or "validator", the base of the topic and snapshot names */
+	const char *kind;
+	/** \brief Topic in which we receive the commands for this device (ex. "kiosk3:hopper-request") */
+	char requestTopic[TOPIC_MAX_LENGTH];
+	/** \brief Topic to which the responses of this device are published */
+	char responseTopic[TOPIC_MAX_LENGTH];
+	/** \brief Topic to which the events of this device are published */
+	char eventTopic[TOPIC_MAX_LENGTH];
+	/** \brief Topic to which the events of a poll are published as one JSON array with -E (ex. "kiosk3:hopper-events") */
+	char eventsTopic[TOPIC_MAX_LENGTH];
+	/** \brief Worker thread which owns all SSP traffic of this device */
+	pthread_t worker;
+	/** \brief If !=0 the worker thread has been started */
+	int workerStarted;
+	/** \brief If !=0 the worker thread should exit */
+	int workerQuit;
+	/** \brief Protects the job queue, the pollPending flag and the poll schedule */
+	pthread_mutex_t jobLock;
+	/** \brief Signaled whenever a job has been queued or the worker should exit */
+	pthread_cond_t jobCond;
+	/** \brief First job in the queue of the worker */
+	struct m_job *jobHead;
+	/** \brief Last job in the queue of the worker */
+	struct m_job *jobTail;
+	/** \brief Number of jobs in the queue of the worker */
+	unsigned int jobCount;
+	/** \brief Highest jobCount seen so far */
+	unsigned int maxJobCount;
+	/** \brief If !=0 a poll job (or a retried setup) is already queued or running, so don't queue another one */
+	int pollPending;
+	/** \brief If !=0 the device has been lost, mcSspQueuePoll() queues its setup in place of the polls until it is back */
+	int setupRetry;
+	/** \brief Number of commands which have been answered by the exchange of a pending duplicate */
+	unsigned long coalescedCommands;
+	/** \brief Number of commands answered with "overloaded" because the queue was full (see mcSspQueueJob()) */
+	unsigned long shedCommands;
+	/** \brief Number of commands answered with "deadline exceeded" before they were executed (see mcSspExpireCommands()) */
+	unsigned long expiredCommands;
+	/** \brief Buffer the command handlers build larger responses in (worker only), reused for every command */
+	struct m_buffer reply;
+	/** \brief Current poll interval in ms, adapted by the worker after each poll */
+	unsigned long pollInterval;
+	/** \brief Monotonic time in ms at which the next poll is due */
+	unsigned long long nextPoll;
+	/** \brief Number of consecutive polls which returned no events */
+	unsigned int idlePolls;
+	/** \brief Number of consecutive polls which timed out (worker only) */
+	unsigned int pollTimeouts;
+	/** \brief Monotonic time in ms until which we poll in burst mode because a payout, float or empty is running (worker only) */
+	unsigned long long transactionUntil;
+	/** \brief correlId of the request which started the running payout, float or empty, journaled with its events (worker only) */
+	char transactionCorrelId[37];
+	/** \brief If !=0 publishDeviceEvent() collects the events in events instead of publishing them (worker only) */
+	int batchingEvents;
+	/** \brief The JSON array of the events of the current poll with -E, without the closing ']' (worker only) */
+	struct m_buffer events;
+	/** \brief The latest event of the current run of progress events with -C, event is 0 without a run (worker only) */
+	SSP_POLL_EVENT6 heldEvent;
+	/** \brief Number of events of the run swallowed since heldAt (worker only) */
+	unsigned int heldCount;
+	/** \brief Monotonic time in ms the last event of the run has been published (worker only) */
+	unsigned long long heldAt;
+};
+
+/**
+ * \brief Structure which describes a serial bus and the two ITL devices connected to it.
+ */
+struct m_bus {
+	/** \brief Index of the bus in metacash.buses, used as SSP_COMMAND.PortNumber */
+	unsigned char index;
+	/** \brief Namespace of the topics of this bus, "" for none (ex. "kiosk3" -> "kiosk3:hopper-request") */
+	char *name;
+	/** \brief The name of the device we should use to connect to the ITL hardware */
+	char *serialDevice;
+	/** \brief If !=0 then we have actual hardware available on this bus */
+	int sspAvailable;
+
+	/** \brief struct for the smart-hopper device */
+	struct m_device hopper;
+	/** \brief struct for the smart-payout device */
+	struct m_device validator;
 };
 
 /**
  * \brief Structure which contains the generic setup data and
- * the device structures for our two ITL devices.
+ * the bus structures with our ITL devices.
  */
 struct m_metacash {
 	/** \brief If !=0 then we should quit, checked via libevent callback */
 	int quit;
-	/** \brief If !=0 then we have actual hardware available */
-	int sspAvailable;
-	/** \brief The name of the device we should use to connect to the ITL hardware */
-	char *serialDevice;
+	/** \brief The buses we serve, added with -d / -b (default one unnamed bus on /dev/ttyACM0) */
+	struct m_bus buses[MAX_SSP_BUS];
+	/** \brief Number of used entries in buses */
+	unsigned int busCount;
+	/** \brief Maximum number of jobs queued per device, 0 for no limit (override with -q) */
+	unsigned int queueLimit;
+	/** \brief Queue depth from which read-only commands are shed, 0 to shed them only at queueLimit (override with -W) */
+	unsigned int shedThreshold;
+	/** \brief Baud rate negotiated with the devices of each bus, DEFAULT_BAUD_RATE for none (override with -B) */
+	unsigned long baudRate;
+	/** \brief Minimum gap in ms between two SSP exchanges with a hopper (override with -g) */
+	unsigned long hopperCommandGap;
+	/** \brief Minimum gap in ms between two SSP exchanges with a validator (override with -G) */
+	unsigned long validatorCommandGap;
 	/** \brief Should the hardware accept coins at all (default off for now) */
 	int acceptCoins;
 	/** \brief Should the syslog messages also be written to stderr (default no, enable with -e) */
 	int logSyslogStderr;
+	/** \brief File the log is written to instead of syslog, NULL for syslog (set with -L) */
+	char *logFile;
+	/** \brief File of the transaction journal, NULL for none (set with -J) */
+	char *journalFile;
+	/** \brief Maximum age in ms of cached levels before we ask the hardware again, 0 for no limit (override with -s) */
+	unsigned long cacheMaxAge;
+	/** \brief Directory for the snapshots of the applied device configuration, NULL to always configure (set with -S) */
+	char *snapshotDir;
+	/** \brief Interval in s of publishing the metrics to "payout-metrics", 0 to disable (override with -m) */
+	unsigned long metricsInterval;
+	/** \brief Publish the events of a poll as one JSON array to the "*-events" topics (enable with -E) */
+	int batchEvents;
+	/** \brief Collapse consecutive identical progress events into one with a count (enable with -C) */
+	int coalesceEvents;
+	/** \brief Use redis streams (XREADGROUP / XADD) instead of pub/sub (set with -T streams) */
+	int useStreams;
+	/** \brief Approximate maximum length of the streams we write to (override with -M) */
+	unsigned long streamMaxLen;
+	/** \brief Maximum size in KiB of the messages kept while redis is unavailable (override with -Q) */
+	unsigned long outboxLimit;
+	/** \brief File the messages are spilled to while redis is unavailable and the outbox is full (set with -O) */
+	char *spillFile;
+	/** \brief Path of the local SOCK_SEQPACKET socket for co-located clients, NULL for none (set with -U) */
+	char *localSocket;
+	/** \brief File the SSP exchanges are captured to, NULL for none (set with -w) */
+	char *captureFile;
+	/** \brief Capture the SSP exchanges are replayed from instead of the serial devices, NULL for none (set with -r) */
+	char *replayFile;
+	/** \brief Replay at the recorded speed (default) or as fast as possible (set with -F) */
+	int replayRealtime;
 
 	/** \brief The port of the redis server to which we connect */
 	int redisPort;
@@ -113,11 +628,41 @@ struct m_metacash {
 	struct event evPoll;
 	/** \brief event struct for the periodic check for quitting */
 	struct event evCheckQuit;
+	/** \brief event struct triggered by the workers if messages are waiting in the outbox */
+	struct event evOutbox;
+	/** \brief event struct for the periodic publishing of the metrics */
+	struct event evMetrics;
+};
 
-	/** \brief struct for the smart-hopper device */
-	struct m_device hopper;
-	/** \brief struct for the smart-payout device */
-	struct m_device validator;
+/** \brief Maximum number of properties of a message split by parseFlatJson() */
+#define CMD_MAX_FIELDS 16
+
+/**
+ * \brief Types of the values of a property split by parseFlatJson().
+ */
+enum m_field_type {
+	FIELD_STRING,
+	FIELD_INTEGER,
+	FIELD_REAL,
+	FIELD_TRUE,
+	FIELD_FALSE,
+	FIELD_NULL
+};
+
+/**
+ * \brief A property of a flat JSON message, key and value point into the message itself.
+ */
+struct m_field {
+	/** \brief The key, NUL terminated in place */
+	const char *key;
+	/** \brief Length of the key */
+	size_t keyLength;
+	/** \brief The value of a FIELD_STRING, NUL terminated in place */
+	const char *value;
+	/** \brief The value of a FIELD_INTEGER */
+	long long integer;
+	/** \brief Type of the value */
+	enum m_field_type type;
 };
 
 /**
@@ -125,26 +670,288 @@ struct m_metacash {
  * received in one of our request topics.
  */
 struct m_command {
-	/** \brief The complete received message parsed as JSON */
+	/** \brief The received message parsed by jansson, only if parseFlatJson() couldn't handle it (else NULL) */
 	json_t *jsonMessage;
+	/** \brief The properties of the message split by parseFlatJson() */
+	struct m_field fields[CMD_MAX_FIELDS];
+	/** \brief Number of used entries in fields */
+	unsigned int fieldCount;
 	/** \brief The command from the message */
 	char *command;
 	/** \brief The correlId to use in the response (this is the msgId from the message which contained the command) */
 	char *correlId;
 	/** \brief The msgId for the response */
-	char *msgId;
+	char msgId[37]; // ex. "1b4e28ba-2fa1-11d2-883f-0016d3cca427" + "\0"
 	/** \brief The topic to which the response should be published */
 	char *responseTopic;
+	/** \brief The response topic addressed to the local client which sent the request (see processRequest()) */
+	char replyTopic[TOPIC_MAX_LENGTH + 24];
 	/** \brief The device to which the command should be issued */
 	struct m_device *device;
+	/** \brief The definition of the command, NULL if unknown */
+	struct m_command_def *def;
+	/** \brief Monotonic time in ms the message has been received */
+	unsigned long long receivedAt;
+	/** \brief Monotonic time in ms after which the command is answered with "deadline exceeded" instead of executed, 0 for never */
+	unsigned long long deadlineAt;
+	/** \brief Next duplicate read which waits for the answer of this one (see mcSspQueueJob()), owned by this command */
+	struct m_command *coalesced;
+	/** \brief If !=0 the command owns an entry of the request cache, filled by requestCacheFinish() once answered */
+	int cached;
+	/** \brief Copy of the received message (allocated together with the command), fields point into it */
+	char text[];
+};
+
+/**
+ * \brief Structure which holds the messages published by the worker threads until
+ * the libevent thread hands them over to redis (hiredis is not thread safe).
+ * \details The messages are stored as complete RESP "PUBLISH" (or "XADD" with -T streams) commands,
+ * each one prefixed by its length (size_t), so they can be handed to redisAsyncFormattedCommand().
+ */
+struct m_outbox {
+	/** \brief Protects pending */
+	pthread_mutex_t lock;
+	/** \brief Messages waiting to be published */
+	struct m_buffer pending;
+	/** \brief Messages currently being handed over to redis (libevent thread only) */
+	struct m_buffer flushing;
+	/** \brief Pipe used to wake up the libevent thread, [0] is watched by evOutbox */
+	int wakeupFd[2];
+	/** \brief 0 to PUBLISH the messages, else they are appended with XADD to streams trimmed to about this length */
+	unsigned long streamMaxLen;
+	/** \brief Messages handed over to redis which it hasn't acknowledged yet, queued again if the connection is lost (libevent thread only) */
+	struct m_buffer unacked;
+	/** \brief Offset in unacked of the oldest message which hasn't been acknowledged yet (libevent thread only) */
+	size_t unackedOffset;
+	/** \brief Bytes in unacked after unackedOffset, counted against offlineLimit (changed by the libevent thread with lock held) */
+	size_t unackedLength;
+	/** \brief If !=0 messages are held back in pending until redis has acknowledged enough of the unacked ones (libevent thread only) */
+	int throttled;
+	/** \brief If !=0 the publish connection is down, pending is kept (bounded by offlineLimit) until it is back */
+	int offline;
+	/** \brief Maximum number of bytes in pending while offline, above the older messages are spilled or dropped */
+	size_t offlineLimit;
+	/** \brief File the messages are spilled to while offline (-O), -1 if none */
+	int spillFd;
+	/** \brief Number of bytes of messages in the spill file */
+	size_t spillLength;
+	/** \brief Number of messages dropped because pending was full while offline */
+	unsigned long dropped;
+};
+
+/** \brief The outbox shared by all threads, offline until the publish connection is established */
+struct m_outbox outbox = { PTHREAD_MUTEX_INITIALIZER, { NULL, 0, 0, 0 }, { NULL, 0, 0, 0 }, { -1, -1 }, 0,
+		{ NULL, 0, 0, 0 }, 0, 0, 0, 1, 0, -1, 0, 0 };
+
+/** \brief Maximum number of clients connected to the local socket at the same time */
+#define LOCAL_MAX_CLIENTS 16
+/** \brief Maximum number of topics a local client can subscribe */
+#define LOCAL_MAX_SUBSCRIPTIONS 8
+/** \brief Maximum size of a datagram received from a local client */
+#define LOCAL_MAX_MESSAGE 65536
+/** \brief First character of the response topics addressed to a single local client ("@<slot>.<generation>:<topic>") */
+#define LOCAL_TOPIC_PREFIX '@'
+
+/**
+ * \brief A client connected to the local socket (libevent thread only).
+ */
+struct m_local_client {
+	/** \brief The connection, -1 if this slot is free */
+	int fd;
+	/** \brief Incremented whenever the slot is freed, so responses for a former client are not delivered to a new one */
+	unsigned int generation;
+	/** \brief event struct for the datagrams of the client */
+	struct event evRead;
+	/** \brief The topics the client has subscribed */
+	char subscriptions[LOCAL_MAX_SUBSCRIPTIONS][TOPIC_MAX_LENGTH];
+	/** \brief Number of used entries in subscriptions */
+	unsigned int subscriptionCount;
+	/** \brief The metacash the requests of the client are processed with */
+	struct m_metacash *metacash;
+};
+
+/**
+ * \brief Structure which holds the local socket and the messages for its clients.
+ * \details The messages are queued by publishMessage() next to the ones for redis, each one as
+ * [size_t frame length][size_t topic length][topic][payload], and delivered by the libevent thread
+ * in flushLocal(). Only while a client is connected, or if the topic is addressed to one.
+ */
+struct m_local {
+	/** \brief The listening socket, -1 if disabled */
+	int fd;
+	/** \brief event struct for the incoming connections */
+	struct event evAccept;
+	/** \brief The connections */
+	struct m_local_client clients[LOCAL_MAX_CLIENTS];
+	/** \brief Number of connected clients, read by the workers to decide whether to queue their messages */
+	atomic_uint clientCount;
+	/** \brief Messages waiting to be delivered, protected by outbox.lock */
+	struct m_buffer pending;
+	/** \brief Messages currently being delivered (libevent thread only) */
+	struct m_buffer flushing;
+	/** \brief Number of datagrams sent to the clients */
+	unsigned long sent;
+	/** \brief Number of datagrams dropped because the socket buffer of a client was full */
+	unsigned long dropped;
+};
+
+/** \brief The local socket, disabled unless -U is given */
+struct m_local local = { .fd = -1 };
+
+/**
+ * \brief Collects the responses of the steps of a batch instead of publishing them (worker only).
+ */
+struct m_reply_capture {
+	/** \brief The response topic whose messages are captured */
+	const char *topic;
+	/** \brief The captured responses, separated by ',' */
+	struct m_buffer replies;
+	/** \brief Number of captured responses */
+	unsigned int count;
+	/** \brief If !=0 the responses are published anyway and only the last one is kept (for requestCacheFinish()) */
+	int publish;
+	/** \brief Set by replyWithError() once one of the captured responses is an error */
+	int error;
+};
+
+/** \brief Number of requests whose response is kept for resent duplicates */
+#define REQUEST_CACHE_ENTRIES 512
+/** \brief Number of slots in the index of the request cache, a power of 2 and at least twice REQUEST_CACHE_ENTRIES */
+#define REQUEST_CACHE_SLOTS 1024
+/** \brief Longest msgId (including the terminating NUL) of a request which is cached */
+#define REQUEST_CACHE_MSGID_MAX 64
+
+/**
+ * \brief Structure which describes a request in the request cache, either still executing or with its response.
+ */
+struct m_request_entry {
+	/** \brief The msgId of the request, together with device the key */
+	char msgId[REQUEST_CACHE_MSGID_MAX];
+	/** \brief The device the request has been sent to */
+	struct m_device *device;
+	/** \brief The command of the request, a resent msgId with another command is not a duplicate */
+	struct m_command_def *def;
+	/** \brief hashCommand() of msgId */
+	unsigned int hash;
+	/** \brief The command executing the request, NULL once it has been answered */
+	struct m_command *owner;
+	/** \brief Duplicates received while executing, chained by their coalesced member, answered with the response */
+	struct m_command *waiting;
+	/** \brief The response of the request once it has been answered */
+	struct m_buffer response;
+	/** \brief Monotonic time in ms the request has been answered */
+	unsigned long long answeredAt;
+	/** \brief Neighbours in the LRU list (index in entries, -1 for none), prev is the more recently used one */
+	int prev;
+	int next;
+};
+
+/**
+ * \brief Structure which describes the cache of the recent requests by msgId, so a resent request is not
+ * executed again (see requestCacheBegin()).
+ * \details An open addressing hash (linear probing) over a fixed pool of entries, kept in LRU order.
+ * Answered entries expire after REQUEST_CACHE_TTL, executing ones are never evicted.
+ */
+struct m_request_cache {
+	/** \brief Protects everything, taken by the libevent thread and the workers */
+	pthread_mutex_t lock;
+	struct m_request_entry entries[REQUEST_CACHE_ENTRIES];
+	/** \brief Index in entries + 1 of the entry hashed to the slot, 0 for a free slot */
+	unsigned short slots[REQUEST_CACHE_SLOTS];
+	/** \brief Number of used entries, the next free ones are used in order until all are */
+	unsigned int used;
+	/** \brief Most / least recently used entry, -1 if none */
+	int head;
+	int tail;
+	/** \brief Duplicates answered with the kept response */
+	unsigned long hits;
+	/** \brief Duplicates attached to the request while it was executing */
+	unsigned long attached;
+	/** \brief Requests which weren't in the cache */
+	unsigned long misses;
+	/** \brief Answered entries reused for another request before they expired */
+	unsigned long evictions;
+};
+
+/**
+ * \brief Result of requestCacheBegin().
+ */
+enum m_request_result {
+	/** \brief Not a duplicate, the request has to be executed */
+	REQUEST_NEW,
+	/** \brief A duplicate of an answered request, it has been answered with the kept response */
+	REQUEST_ANSWERED,
+	/** \brief A duplicate of an executing request, it is answered with its response */
+	REQUEST_ATTACHED,
+};
+
+/** \brief The request cache shared by the libevent thread and the workers */
+struct m_request_cache requestCache = { .lock = PTHREAD_MUTEX_INITIALIZER, .head = -1, .tail = -1 };
+
+/** \brief Set by handleBatch() while a step is executed on this thread, NULL otherwise */
+static _Thread_local struct m_reply_capture *replyCapture = NULL;
+
+/**
+ * \brief Events which are about money, they are never dropped from a full outbox.
+ */
+static const char *MONEY_EVENTS[] = {
+	"\"event\":\"credit\"", "\"event\":\"coin credit\"", "\"event\":\"dispensed\"", "\"event\":\"floated\"",
+	"\"event\":\"cashbox paid\"", "\"event\":\"smart emptied\"", "\"event\":\"incomplete payout\"",
+	"\"event\":\"incomplete float\"", "\"event\":\"stored\"", "\"event\":\"stacked\"", NULL
+};
+
+/**
+ * \brief Structure which holds the counters reported by the "metrics" command and in the "payout-metrics" topic.
+ * \details The SSP exchanges are counted by libitlssp (get_ssp_command_stats()), the per command latencies
+ * in commandDefs and the queue depths in the devices.
+ */
+struct m_metrics {
+	/** \brief Protects the latencies in commandDefs, which are recorded by the workers */
+	pthread_mutex_t lock;
+	/** \brief Monotonic time in ms we have been started */
+	unsigned long long startedAt;
+	/** \brief Monotonic time in ms of the last poll tick (libevent thread only) */
+	unsigned long long lastPollTick;
+	/** \brief Number of measured poll ticks (libevent thread only) */
+	unsigned long pollTicks;
+	/** \brief Sum of the deviations in ms of the poll ticks from POLL_TICK (libevent thread only) */
+	unsigned long long pollJitterTotal;
+	/** \brief Largest deviation in ms of a poll tick from POLL_TICK (libevent thread only) */
+	unsigned long pollJitterMax;
+	/** \brief Number of messages handed over to redis (libevent thread only) */
+	unsigned long published;
+	/** \brief Number of messages handed over to redis which it hasn't acknowledged yet (libevent thread only) */
+	unsigned long publishInFlight;
+	/** \brief Highest publishInFlight seen so far (libevent thread only) */
+	unsigned long publishMaxInFlight;
 };
 
+/** \brief The metrics of the whole process */
+struct m_metrics metrics = { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0, 0, 0, 0, 0 };
+
 // mcSsp* : ssp helper functions
-int mcSspOpenSerialDevice(struct m_metacash *metacash);
-void mcSspCloseSerialDevice(struct m_metacash *metacash);
-void mcSspSetupCommand(SSP_COMMAND *sspC, int deviceId);
-void mcSspInitializeDevice(SSP_COMMAND *sspC, unsigned long long key, struct m_device *device);
-void mcSspPollDevice(struct m_device *device, struct m_metacash *metacash);
+int mcSspOpenSerialDevice(struct m_bus *bus);
+void mcSspCloseSerialDevice(struct m_bus *bus);
+void mcSspSetupCommand(SSP_COMMAND *sspC, unsigned char busIndex, int deviceId);
+int mcSspInitializeDevice(SSP_COMMAND *sspC, unsigned long long key, struct m_device *device);
+void mcSspSetupDevice(struct m_device *device);
+int mcSspProbeRestart(struct m_device *device);
+void mcSspNegotiateBaud(struct m_metacash *metacash, struct m_bus *bus);
+int mcSspPollDevice(struct m_device *device, struct m_metacash *metacash);
+void mcSspSchedulePoll(struct m_device *device, int eventCount);
+void mcSspStartTransaction(struct m_device *device, const char *correlId);
+int mcSspIsLevelChange(unsigned char event);
+void mcSspStartWorker(struct m_device *device);
+void mcSspStopWorker(struct m_device *device);
+int mcSspIsSheddable(const struct m_job *job);
+void mcSspUnlinkJob(struct m_device *device, struct m_job *previous, struct m_job *job);
+int mcSspQueueJob(struct m_device *device, struct m_job *job);
+struct m_job *mcSspNextJob(struct m_device *device);
+int mcSspSetDeadline(struct m_command *cmd);
+unsigned int mcSspExpireCommands(struct m_job *job);
+void mcSspRunCommand(struct m_job *job);
+void mcSspQueuePoll(struct m_device *device);
+void mcSspDispatchEvents(struct m_device *device, struct m_metacash *metacash, SSP_POLL_DATA6 *poll);
 
 // mc_ssp_* : ssp magic values and functions (each of these relate directly to a command specified in the ssp protocol)
 
@@ -175,14 +982,14 @@ void mcSspPollDevice(struct m_device *device, struct m_metacash *metacash);
 
 SSP_RESPONSE_ENUM mc_ssp_empty(SSP_COMMAND *sspC);
 SSP_RESPONSE_ENUM mc_ssp_smart_empty(SSP_COMMAND *sspC);
-SSP_RESPONSE_ENUM mc_ssp_cashbox_payout_operation_data(SSP_COMMAND *sspC, char **json);
+SSP_RESPONSE_ENUM mc_ssp_cashbox_payout_operation_data(SSP_COMMAND *sspC, struct m_buffer *json);
 SSP_RESPONSE_ENUM mc_ssp_configure_bezel(SSP_COMMAND *sspC, unsigned char r, unsigned char g,
 		unsigned char b, unsigned char volatileOption, unsigned char bezelTypeOption);
 SSP_RESPONSE_ENUM mc_ssp_display_on(SSP_COMMAND *sspC);
 SSP_RESPONSE_ENUM mc_ssp_display_off(SSP_COMMAND *sspC);
 SSP_RESPONSE_ENUM mc_ssp_last_reject_note(SSP_COMMAND *sspC, unsigned char *reason);
 SSP_RESPONSE_ENUM mc_ssp_set_refill_mode(SSP_COMMAND *sspC);
-SSP_RESPONSE_ENUM mc_ssp_get_all_levels(SSP_COMMAND *sspC, char **json);
+SSP_RESPONSE_ENUM mc_ssp_get_all_levels(SSP_COMMAND *sspC, struct m_buffer *json);
 SSP_RESPONSE_ENUM mc_ssp_set_denomination_level(SSP_COMMAND *sspC, int amount, int level, const char *cc);
 SSP_RESPONSE_ENUM mc_ssp_set_cashbox_payout_limit(SSP_COMMAND *sspC, unsigned int amount, int level, const char *cc);
 SSP_RESPONSE_ENUM mc_ssp_float(SSP_COMMAND *sspC, const int value, const char *cc, const char option);
@@ -208,1793 +1015,6038 @@ const unsigned char SSP_OPTION_DISABLED = 0x02;
 
 static const unsigned long long DEFAULT_KEY = 0x123456701234567LL;
 
+/**
+ * \brief Default minimum gap in ms between two SSP exchanges with the same device.
+ * \details The gap is measured from the end of the previous exchange, so a device which
+ * has been idle for a while is talked to immediately.
+ */
+static const unsigned long DEFAULT_COMMAND_GAP = 50;
+
+/** \brief Serial device of the unnamed bus if neither -d nor -b is given */
+static char DEFAULT_SERIAL_DEVICE[] = "/dev/ttyACM0";
+
+/** \brief Baud rate the devices start with, the buses stay at it unless another one is negotiated with -B */
+static const unsigned long DEFAULT_BAUD_RATE = 9600;
+/** \brief Number of consecutive poll timeouts after which a device is assumed to be back at DEFAULT_BAUD_RATE (reset) */
+static const unsigned int BAUD_RESET_TIMEOUTS = 2;
+/** \brief Time in ms a device may take to restart after a download until we give up setting it up again */
+static const unsigned long DOWNLOAD_RESTART_TIMEOUT = 30000;
+/** \brief Time in ms between two attempts to set up a device again which hasn't come back after a download */
+static const unsigned long SETUP_RETRY_INTERVAL = 5000;
+
+/** \brief Granularity in ms of the libevent timer which checks if a device is due for a poll */
+static const unsigned long POLL_TICK = 50;
+/** \brief Poll interval in ms while a device reports events or a transaction is running */
+static const unsigned long POLL_INTERVAL_BURST = 200;
+/**
+ * \brief Upper bound in ms for the poll interval of an idle device.
+ * \details The devices disable themselves if they are not polled for a few seconds (SSP watchdog),
+ * so the backoff must stay well below that.
+ */
+static const unsigned long POLL_INTERVAL_IDLE = 2000;
+/** \brief Number of consecutive polls without events before we start backing off */
+static const unsigned int POLL_IDLE_THRESHOLD = 10;
+/**
+ * \brief Maximum time in ms we stay in burst mode after starting a payout, float or empty.
+ * \details Normally the terminal event (dispensed, floated, emptied, ...) ends the burst earlier.
+ */
+static const unsigned long TRANSACTION_BURST_LIMIT = 60000;
+/**
+ * \brief Maximum time in ms a queued poll gives way to commands of the device.
+ * \details An older poll is executed next regardless of its priority, so a stream of requests
+ * can't starve the SSP watchdog.
+ */
+static const unsigned long POLL_MAX_DEFER = 1000;
+
+/**
+ * \brief Default maximum age in ms of cached levels.
+ * \details Poll events which change the levels invalidate the cache anyway, this is only a safety net.
+ */
+static const unsigned long DEFAULT_CACHE_MAX_AGE = 60000;
+
+/**
+ * \brief Maximum number of steps the payout planner searches for a split before it gives up
+ * and leaves the answer to the device.
+ */
+static const unsigned long PLAN_MAX_STEPS = 20000;
+/** \brief Number of entries in the table of the payout planner which remembers dead ends, a power of 2 */
+#define PLAN_MEMO_SIZE 2048
+
+/** \brief Default interval in s of publishing the metrics to "payout-metrics" */
+static const unsigned long DEFAULT_METRICS_INTERVAL = 60;
+
+/** \brief Time in ms after which a run of coalesced progress events (-C) is published even if it goes on */
+static const unsigned long COALESCE_WINDOW = 1000;
+
+/** \brief Maximum number of commands in one "batch" command */
+static const size_t BATCH_MAX_COMMANDS = 32;
+
+/** \brief Default maximum number of jobs queued for a device */
+static const unsigned int DEFAULT_QUEUE_LIMIT = 64;
+/** \brief Default queue depth from which read-only commands are shed, so the money moving ones still find room */
+static const unsigned int DEFAULT_SHED_THRESHOLD = 16;
+/** \brief Default deadline in ms of the commands which only read, they are worthless once the client has given up */
+#define DEADLINE_READ 3000
+/** \brief Default deadline in ms of the commands which change the device or move money */
+#define DEADLINE_CHANGE 10000
+/** \brief Time in ms the response of a request is kept for resent duplicates */
+static const unsigned long REQUEST_CACHE_TTL = 60000;
+
+/** \brief Default maximum size in KiB of the messages kept while redis is unavailable */
+static const unsigned long DEFAULT_OUTBOX_LIMIT = 1024;
+/** \brief First delay in ms before reconnecting to redis, doubled on every failed attempt */
+static const unsigned long REDIS_RECONNECT_MIN = 250;
+/** \brief Maximum delay in ms before reconnecting to redis */
+static const unsigned long REDIS_RECONNECT_MAX = 10000;
+
+/** \brief Default approximate maximum length of the streams written with -T streams (MAXLEN ~) */
+static const unsigned long DEFAULT_STREAM_MAX_LEN = 10000;
+/** \brief Consumer group (and consumer) name used for reading the request streams */
+static const char STREAM_GROUP[] = "payoutd";
+/** \brief Maximum number of requests read from one stream with one XREADGROUP */
+#define STREAM_READ_COUNT 16
+/** \brief Time in ms an XREADGROUP waits for new requests before it is sent again */
+static const unsigned long STREAM_BLOCK_MS = 5000;
+
 // metacash
+void logWrite(int priority, const char *format, ...);
+void logStart(const char *file);
+void logStop(void);
+void die(char *reason, int rc);
+void journalStart(struct m_metacash *metacash, const char *file);
+void journalStop(void);
+void journalAppend(struct m_device *device, unsigned char type, unsigned char code, unsigned char status,
+		unsigned long value, unsigned long data, const char *id);
+void journalLevels(struct m_device *device, const char *levels);
+int scanLevel(const char **json, unsigned int *value, unsigned int *level, char *cc);
+void cacheStatus(struct m_device *device, int *status, int value);
+unsigned long long monotonicMs(void);
 int parseCmdLine(int argc, char *argv[], struct m_metacash *metacash);
+int addBus(struct m_metacash *metacash, char *name, char *serialDevice);
 void setup(struct m_metacash *metacash);
-void hopperEventHandler(struct m_device *device, struct m_metacash *metacash, SSP_POLL_DATA6 *poll);
-void validatorEventHandler(struct m_device *device, struct m_metacash *metacash, SSP_POLL_DATA6 *poll);
+void setupBus(struct m_metacash *metacash, struct m_bus *bus);
+void buildMetrics(struct m_metacash *metacash, struct m_buffer *buffer);
+void cbOnMetricsEvent(int fd, short event, void *privdata);
+void processRequest(struct m_metacash *m, const char *topic, const char *message, struct m_local_client *client);
+void createRequestStreamGroups(redisAsyncContext *c);
+void readRequestStreams(redisAsyncContext *c);
+int openRedisLink(struct m_redis_link *link);
+void scheduleReconnect(struct m_redis_link *link);
+void flushOutbox(void);
+void setOutboxOnline(void);
+void setOutboxOffline(void);
+void handleBatch(struct m_command *cmd);
+int setupHopper(struct m_device *device);
+int setupValidator(struct m_device *device);
+int mcSspPublishEvent(struct m_device *device, const SSP_POLL_EVENT6 *event, unsigned int count);
+void mcSspPublishEvents(struct m_device *device, SSP_POLL_DATA6 *poll);
 
 static const char *CURRENCY = "EUR";
 
 /**
- * \brief Set by the signalHandler function and checked in cbCheckQuit.
+ * \brief Formats the message into the log ring (or hands it to syslog directly while the
+ * log thread is not running). Safe to call from any thread, never blocks.
  */
-int receivedSignal = 0;
+void logWrite(int priority, const char *format, ...) {
+	va_list varargs;
+	va_start(varargs, format);
 
-/**
- * \brief Signal handler
- */
-void signalHandler(int signal) {
-	receivedSignal = signal;
+	if (! atomic_load_explicit(&logRing.running, memory_order_acquire)) {
+		vsyslog(priority, format, varargs);
+		va_end(varargs);
+		return;
+	}
+
+	size_t pos = atomic_load_explicit(&logRing.head, memory_order_relaxed);
+	struct m_log_slot *slot;
+	for (;;) {
+		slot = &logRing.slots[pos & (LOG_RING_SIZE - 1)];
+		size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+		long diff = (long) (sequence - pos);
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&logRing.head, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed)) {
+				break;
+			}
+		} else if (diff < 0) {
+			// full, the log thread can't keep up
+			atomic_fetch_add_explicit(&logRing.dropped, 1, memory_order_relaxed);
+			va_end(varargs);
+			return;
+		} else {
+			pos = atomic_load_explicit(&logRing.head, memory_order_relaxed);
+		}
+	}
+
+	slot->priority = priority;
+	vsnprintf(slot->line, sizeof(slot->line), format, varargs);
+	va_end(varargs);
+	atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
 }
 
 /**
- * \brief Waits for 300ms each time called.
- * \details Details only to get graph.
- * \callergraph
+ * \brief Writes a message out to the -L file or syslog (logRing.lock must be held).
  */
-void hardwareWaitTime() {
-	struct timespec ts;
-	ts.tv_sec = 0;
-	ts.tv_nsec = 300000000;
-	nanosleep(&ts, NULL);
+void logOutput(int priority, const char *line) {
+	if (logRing.file == NULL) {
+		syslog(priority, "%s", line);
+		return;
+	}
+
+	char stamp[32];
+	time_t now = time(NULL);
+	struct tm tm;
+	strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", localtime_r(&now, &tm));
+	size_t length = strlen(line);
+	fprintf(logRing.file, "%s payoutd[%d] <%d> %s%s", stamp, (int) getpid(), priority, line,
+			length && line[length - 1] == '\n' ? "" : "\n");
 }
 
 /**
- * \brief Connect to redis and return a new redisAsyncContext.
+ * \brief Writes out all messages in the log ring (logRing.lock must be held), returns their number.
  */
-redisAsyncContext* connectRedis(struct m_metacash *metacash) {
-	redisAsyncContext *conn = redisAsyncConnect(metacash->redisHost,
-			metacash->redisPort);
+int logDrain() {
+	int count = 0;
 
-	if (conn == NULL || conn->err) {
-		if (conn) {
-			syslog(LOG_ERR,  "fatal: Connection error: %s\n", conn->errstr);
-		} else {
-			syslog(LOG_ERR,
-					"fatal: Connection error: can't allocate redis context\n");
+	for (;;) {
+		struct m_log_slot *slot = &logRing.slots[logRing.tail & (LOG_RING_SIZE - 1)];
+		if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != logRing.tail + 1) {
+			break; // empty (or the producer is still formatting)
 		}
-	} else {
-		// reference the metcash struct in data for use in connect/disconnect callback
-		conn->data = metacash;
+		logOutput(slot->priority, slot->line);
+		atomic_store_explicit(&slot->sequence, logRing.tail + LOG_RING_SIZE, memory_order_release);
+		logRing.tail++;
+		count++;
 	}
 
-	return conn;
+	unsigned long dropped = atomic_load_explicit(&logRing.dropped, memory_order_relaxed);
+	if (dropped != logRing.reportedDropped) {
+		char line[64];
+		snprintf(line, sizeof(line), "log ring full, %lu messages dropped so far", dropped);
+		logOutput(LOG_WARNING, line);
+		logRing.reportedDropped = dropped;
+	}
+
+	if (count && logRing.file) {
+		fflush(logRing.file);
+	}
+	return count;
 }
 
 /**
- * \brief Callback function for libEvent timer triggered "Poll" event.
- * \details Details only to get graph.
- * \callgraph
+ * \brief Main function of the log thread, writes out the log ring until logStop() is called.
  */
-void cbOnPollEvent(int fd, short event, void *privdata) {
-	struct m_metacash *metacash = privdata;
-	if (metacash->sspAvailable == 0) {
-		// return immediately if we can't communicate with the hardware
-		return;
+void *logThread(void *arg) {
+	while (atomic_load_explicit(&logRing.running, memory_order_acquire)) {
+		pthread_mutex_lock(&logRing.lock);
+		int count = logDrain();
+		pthread_mutex_unlock(&logRing.lock);
+
+		if (count == 0) {
+			// nothing to do, a message waits 10ms at most
+			struct timespec idle = { 0, 10000000 };
+			nanosleep(&idle, NULL);
+		}
 	}
+	return NULL;
+}
 
-	// don't poll the hopper for events if it is unavailable
-	if(metacash->hopper.sspDeviceAvailable) {
-		mcSspPollDevice(&metacash->hopper, metacash);
+/**
+ * \brief Starts the log thread, from now on the messages go through the log ring.
+ * Writes to the file instead of syslog if one is given.
+ */
+void logStart(const char *file) {
+	if (file) {
+		logRing.file = fopen(file, "a");
+		if (logRing.file == NULL) {
+			syslog(LOG_ERR, "could not open log file '%s': %s, using syslog", file, strerror(errno));
+		}
 	}
 
-	// don't poll the validator for events if it is unavailable
-	if(metacash->validator.sspDeviceAvailable) {
-		mcSspPollDevice(&metacash->validator, metacash);
+	for (size_t i = 0; i < LOG_RING_SIZE; i++) {
+		atomic_init(&logRing.slots[i].sequence, i);
+	}
+	atomic_store(&logRing.running, 1);
+	if (pthread_create(&logRing.thread, NULL, logThread, NULL) != 0) {
+		atomic_store(&logRing.running, 0);
+		syslog(LOG_ERR, "could not start the log thread, logging synchronously");
 	}
 }
 
 /**
- * \brief Callback function for libEvent timer triggered "CheckQuit" event.
+ * \brief Stops the log thread (if running) and writes out what is left in the log ring,
+ * messages are handed to syslog directly from now on.
  */
-void cbOnCheckQuitEvent(int fd, short event, void *privdata) {
-	if (receivedSignal != 0) {
-		syslog(LOG_NOTICE, "received signal or quit cmd. going to exit event loop.");
-
-		struct m_metacash *metacash = privdata;
-		event_base_loopexit(metacash->eventBase, NULL);
-		receivedSignal = 0;
+void logStop() {
+	if (atomic_exchange(&logRing.running, 0)) {
+		if (! pthread_equal(pthread_self(), logRing.thread)) {
+			pthread_join(logRing.thread, NULL);
+		}
+		pthread_mutex_lock(&logRing.lock);
+		logDrain();
+		if (logRing.file) {
+			fclose(logRing.file);
+			logRing.file = NULL;
+		}
+		pthread_mutex_unlock(&logRing.lock);
 	}
 }
 
 /**
- * \brief Callback function triggered by an incoming message in the "metacash" topic.
+ * \brief Set by the signalHandler function and checked in cbCheckQuit.
  */
-void cbOnMetacashMessage(redisAsyncContext *c, void *r, void *privdata) {
-	// empty for now
-}
+int receivedSignal = 0;
 
 /**
- * \brief Test if cmd.command equals command
+ * \brief Signal handler
  */
-int isCommand(struct m_command *cmd, const char *command) {
-	return ! strcmp(cmd->command, command);
+void signalHandler(int signal) {
+	receivedSignal = signal;
 }
 
 /**
- * \brief Helper function to publish a message to the "payout-event" topic.
+ * \brief Connect to redis and return a new redisAsyncContext.
  */
-int publishPayoutEvent(char *format, ...) {
-	va_list varags;
-	va_start(varags, format);
+redisAsyncContext* connectRedis(struct m_metacash *metacash) {
+	redisAsyncContext *conn = redisAsyncConnect(metacash->redisHost,
+			metacash->redisPort);
 
-	char *reply = NULL;
-	vasprintf(&reply, format, varags);
+	if (conn == NULL || conn->err) {
+		if (conn) {
+			logMessage(LOG_ERR,  "Connection error: %s\n", conn->errstr);
+		} else {
+			logMessage(LOG_ERR,
+					"Connection error: can't allocate redis context\n");
+		}
+	} else {
+		// reference the metcash struct in data for use in connect/disconnect callback
+		conn->data = metacash;
+	}
 
-	va_end(varags);
+	return conn;
+}
 
-	redisAsyncCommand(redisPublishCtx, NULL, NULL, "PUBLISH %s %s", "payout-event", reply);
+/**
+ * \brief Starts connecting the link to redis, a reconnect is scheduled if that fails right away.
+ */
+int openRedisLink(struct m_redis_link *link) {
+	redisAsyncContext *conn = connectRedis(link->metacash);
+	if (conn == NULL || conn->err) {
+		if (conn) {
+			redisAsyncFree(conn);
+		}
+		scheduleReconnect(link);
+		return 1;
+	}
 
-	free(reply);
+	redisLibeventAttach(conn, link->metacash->eventBase);
+	redisAsyncSetConnectCallback(conn, link->connectFn);
+	redisAsyncSetDisconnectCallback(conn, link->disconnectFn);
+	*link->ctx = conn;
 
 	return 0;
 }
 
 /**
- * \brief Helper function to publish a message to the "hopper-event" topic.
+ * \brief Callback function for libEvent timer triggered "reconnect" event of a redis link.
  */
-int publishHopperEvent(char *format, ...) {
-	va_list varags;
-	va_start(varags, format);
-
-	char *reply = NULL;
-	vasprintf(&reply, format, varags);
-
-	va_end(varags);
-
-	redisAsyncCommand(redisPublishCtx, NULL, NULL, "PUBLISH %s %s", "hopper-event", reply);
+void cbOnReconnectEvent(int fd, short event, void *privdata) {
+	struct m_redis_link *link = privdata;
 
-	free(reply);
-
-	return 0;
+	link->reconnects++;
+	logMessage(LOG_INFO, "reconnecting the %s connection to redis (attempt %lu)", link->name, link->reconnects);
+	openRedisLink(link);
 }
 
 /**
- * \brief Helper function to publish a message to the "validator-event" topic.
+ * \brief Schedules the next attempt to connect the link, the delay doubles on every attempt
+ * up to REDIS_RECONNECT_MAX and is reset once the link is connected.
  */
-int publishValidatorEvent(char *format, ...) {
-	va_list varags;
-	va_start(varags, format);
+void scheduleReconnect(struct m_redis_link *link) {
+	*link->ctx = NULL; // freed by hiredis (or never connected)
 
-	char *reply = NULL;
-	vasprintf(&reply, format, varags);
-
-	va_end(varags);
+	if (evtimer_pending(&link->evReconnect, NULL)) {
+		return;
+	}
 
-	redisAsyncCommand(redisPublishCtx, NULL, NULL, "PUBLISH %s %s", "validator-event", reply);
+	struct timeval delay;
+	delay.tv_sec = link->backoff / 1000;
+	delay.tv_usec = (link->backoff % 1000) * 1000;
+	evtimer_add(&link->evReconnect, &delay);
 
-	free(reply);
+	logMessage(LOG_WARNING, "%s connection to redis lost, reconnecting in %lums", link->name, link->backoff);
 
-	return 0;
+	link->backoff *= 2;
+	if (link->backoff > REDIS_RECONNECT_MAX) {
+		link->backoff = REDIS_RECONNECT_MAX;
+	}
 }
 
 /**
- * \brief Helper function to publish a message to the given topic.
- * \details Details only to get graph.
- * \callergraph
+ * \brief Callback function for libEvent timer triggered "retry" event, reads the request streams again.
  */
-int replyWith(char *topic, char *format, ...) {
-	va_list varags;
-	va_start(varags, format);
+void cbOnRetryEvent(int fd, short event, void *privdata) {
+	struct m_redis_link *link = privdata;
 
-	char *reply = NULL;
-	vasprintf(&reply, format, varags);
+	// while reconnecting the streams are read once connected
+	if (*link->ctx != NULL) {
+		readRequestStreams(*link->ctx);
+	}
+}
 
-	va_end(varags);
+/**
+ * \brief Schedules reading the request streams again after redis has answered with an error but kept the
+ * connection (-LOADING after a restart, -READONLY after a failover, -OOM). Uses the backoff of the reconnects.
+ */
+void scheduleRetry(struct m_redis_link *link) {
+	if (evtimer_pending(&link->evRetry, NULL)) {
+		return;
+	}
 
-	redisAsyncCommand(redisPublishCtx, NULL, NULL, "PUBLISH %s %s", topic, reply);
+	struct timeval delay;
+	delay.tv_sec = link->backoff / 1000;
+	delay.tv_usec = (link->backoff % 1000) * 1000;
+	evtimer_add(&link->evRetry, &delay);
 
-	free(reply);
+	logMessage(LOG_WARNING, "reading the request streams again in %lums", link->backoff);
 
-	return 0;
+	link->backoff *= 2;
+	if (link->backoff > REDIS_RECONNECT_MAX) {
+		link->backoff = REDIS_RECONNECT_MAX;
+	}
 }
 
 /**
- * \brief Helper function to publish a reply to a message which was missing a
- * mandatory property (or the property was of the wrong type).
+ * \brief Callback function for libEvent timer triggered "Poll" event.
  * \details Details only to get graph.
- * \callergraph
+ * \callgraph
  */
-int replyWithPropertyError(struct m_command *cmd, char *name) {
-	char *msgId = "unknown";
-	if(cmd->msgId) {
-		msgId = cmd->msgId;
-	}
+void cbOnPollEvent(int fd, short event, void *privdata) {
+	struct m_metacash *metacash = privdata;
 
-	char *correlId = "unknown";
-	if(cmd->correlId) {
-		correlId = cmd->correlId;
+	// how far libevent is off the tick tells how busy this thread is
+	unsigned long long now = monotonicMs();
+	if (metrics.lastPollTick) {
+		unsigned long long elapsed = now - metrics.lastPollTick;
+		unsigned long jitter = elapsed > POLL_TICK ? elapsed - POLL_TICK : POLL_TICK - elapsed;
+		metrics.pollTicks++;
+		metrics.pollJitterTotal += jitter;
+		if (jitter > metrics.pollJitterMax) {
+			metrics.pollJitterMax = jitter;
+		}
 	}
+	metrics.lastPollTick = now;
 
-	return replyWith(cmd->responseTopic,
-			"{\"msgId\":\"%s\",\"correlId\":\"%s\",\"error\":\"Property '%s' missing or of wrong type\"}",
-			msgId,
-			correlId,
-			name);
+	for (unsigned int i = 0; i < metacash->busCount; i++) {
+		struct m_bus *bus = &metacash->buses[i];
+		if (bus->sspAvailable == 0) {
+			// skip the bus if we can't communicate with its hardware
+			continue;
+		}
+
+		// devices which are unavailable (or still initializing) are skipped by mcSspQueuePoll()
+		mcSspQueuePoll(&bus->hopper);
+		mcSspQueuePoll(&bus->validator);
+	}
 }
 
 /**
- * \brief Helper function to publish a reply to a message which contains a human readable
- * version of the SSP response.
- * \details Details only to get graph.
- * \callergraph
+ * \brief Callback function for libEvent timer triggered "CheckQuit" event.
  */
-int replyWithSspResponse(struct m_command *cmd, SSP_RESPONSE_ENUM response) {
-	if(response == SSP_RESPONSE_OK) {
-		return replyWith(cmd->responseTopic, "{\"msgId\":\"%s\",\"correlId\":\"%s\",\"result\":\"ok\"}",
-				cmd->msgId,
-				cmd->correlId);
-	} else {
-		char *errorMsg;
-
-		switch(response) {
-			case SSP_RESPONSE_UNKNOWN_COMMAND:
-				errorMsg = "unknown command";
-				break;
-			case SSP_RESPONSE_INCORRECT_PARAMETERS:
-				errorMsg = "incorrect parameters";
-				break;
-			case SSP_RESPONSE_INVALID_PARAMETER:
-				errorMsg = "invalid parameter";
-				break;
-			case SSP_RESPONSE_COMMAND_NOT_PROCESSED:
-				errorMsg = "command not processed";
-				break;
-			case SSP_RESPONSE_SOFTWARE_ERROR:
-				errorMsg = "software error";
-				break;
-			case SSP_RESPONSE_CHECKSUM_ERROR:
-				errorMsg = "checksum error";
-				break;
-			case SSP_RESPONSE_FAILURE:
-				errorMsg = "failure";
-				break;
-			case SSP_RESPONSE_HEADER_FAILURE:
-				errorMsg = "header failure";
-				break;
-			case SSP_RESPONSE_KEY_NOT_SET:
-				errorMsg = "key not set";
-				break;
-			case SSP_RESPONSE_TIMEOUT:
-				errorMsg = "timeout";
-				break;
-			default:
-				errorMsg = "unknown";
-		}
+void cbOnCheckQuitEvent(int fd, short event, void *privdata) {
+	if (receivedSignal != 0) {
+		logMessage(LOG_NOTICE, "received signal or quit cmd. going to exit event loop.");
 
-		return replyWith(cmd->responseTopic, "{\"msgId\":\"%s\",\"correlId\":\"%s\",\"sspError\":\"%s\"}",
-				cmd->msgId,
-				cmd->correlId,
-				errorMsg);
+		struct m_metacash *metacash = privdata;
+		event_base_loopexit(metacash->eventBase, NULL);
+		receivedSignal = 0;
 	}
 }
 
 /**
- * \brief Handles the JSON "quit" command.
+ * \brief Callback function triggered by an incoming message in the "metacash" topic.
  */
-void handleQuit(struct m_command *cmd) {
-	receivedSignal = 1;
-	replyWithSspResponse(cmd, SSP_RESPONSE_OK); // :D
+void cbOnMetacashMessage(redisAsyncContext *c, void *r, void *privdata) {
+	// empty for now
 }
 
 /**
- * \brief Handles the JSON "empty" command.
+ * \brief Frees the command and the JSON message associated with it, as well as
+ * the duplicates coalesced into it.
  */
-void handleEmpty(struct m_command *cmd) {
-	replyWithSspResponse(cmd, mc_ssp_empty(&cmd->device->sspC));
+void freeCommand(struct m_command *cmd) {
+	while(cmd) {
+		struct m_command *next = cmd->coalesced;
+		if(cmd->def) {
+			// the command has been answered (or dropped while shutting down) by now
+			pthread_mutex_lock(&metrics.lock);
+			record_ssp_latency(&cmd->def->latency, monotonicMs() - cmd->receivedAt);
+			pthread_mutex_unlock(&metrics.lock);
+		}
+		if(cmd->jsonMessage) {
+			json_decref(cmd->jsonMessage);
+		}
+		free(cmd);
+		cmd = next;
+	}
 }
 
 /**
- * \brief Handles the JSON "smart-empty" command.
+ * \brief Returns the end of the JSON string starting at text (after the opening quote), NULL if
+ * it contains escapes or control characters or isn't terminated.
  */
-void handleSmartEmpty(struct m_command *cmd) {
-	replyWithSspResponse(cmd, mc_ssp_smart_empty(&cmd->device->sspC));
+char *scanJsonString(char *text) {
+	while (*text != '"') {
+		if (*text == '\\' || (unsigned char) *text < 0x20) {
+			return NULL;
+		}
+		text++;
+	}
+	return text;
 }
 
 /**
- * \brief Handles the JSON "do-payout" and "test-payout" commands.
+ * \brief Returns the first character after the JSON whitespace at text.
  */
-void handlePayout(struct m_command *cmd) {
-	int payoutOption = 0;
-
-	if (isCommand(cmd, "do-payout")) {
-		payoutOption = SSP6_OPTION_BYTE_DO;
-	} else {
-		payoutOption = SSP6_OPTION_BYTE_TEST;
+char *skipJsonSpace(char *text) {
+	while (*text == ' ' || *text == '\t' || *text == '\n' || *text == '\r') {
+		text++;
 	}
+	return text;
+}
 
-	json_t *jAmount = json_object_get(cmd->jsonMessage, "amount");
-	if(! json_is_integer(jAmount)) {
-		replyWithPropertyError(cmd, "amount");
-		return;
+/**
+ * \brief Splits a flat JSON object into fields in place, without allocating anything. The keys and
+ * string values are NUL terminated within text. Returns the number of fields, or -1 if the message
+ * is anything else (nested values, escapes, more than maxFields properties, invalid JSON).
+ * jansson parses such a message instead.
+ */
+int parseFlatJson(char *text, struct m_field *fields, int maxFields) {
+	char *p = skipJsonSpace(text);
+	int count = 0;
+
+	if (*p++ != '{') {
+		return -1;
 	}
+	p = skipJsonSpace(p);
 
-	int amount = json_integer_value(jAmount);
+	while (*p != '}') {
+		if (count == maxFields || *p != '"') {
+			return -1;
+		}
+		struct m_field *field = &fields[count++];
 
-	SSP_RESPONSE_ENUM resp = ssp6_payout(&cmd->device->sspC, amount, CURRENCY,
-			payoutOption);
+		field->key = ++p;
+		if ((p = scanJsonString(p)) == NULL) {
+			return -1;
+		}
+		field->keyLength = p - field->key;
+		*p = '\0';
+		p = skipJsonSpace(p + 1);
+		if (*p++ != ':') {
+			return -1;
+		}
+		p = skipJsonSpace(p);
 
-	if (resp == SSP_RESPONSE_COMMAND_NOT_PROCESSED) {
-		char *error = NULL;
-		switch (cmd->device->sspC.ResponseData[1]) {
-		case 0x01:
-			error = "not enough value in smart payout";
-			break;
-		case 0x02:
-			error = "can't pay exact amount";
-			break;
-		case 0x03:
-			error = "smart payout busy";
-			break;
-		case 0x04:
-			error = "smart payout disabled";
-			break;
-		default:
-			error = "unknown";
-			break;
+		if (*p == '"') {
+			field->type = FIELD_STRING;
+			field->value = ++p;
+			if ((p = scanJsonString(p)) == NULL) {
+				return -1;
+			}
+			*p++ = '\0';
+		} else if (*p == '-' || isdigit((unsigned char) *p)) {
+			char *number = p;
+			field->type = FIELD_INTEGER;
+			if (*p == '-') {
+				p++;
+			}
+			if (! isdigit((unsigned char) *p) || (*p == '0' && isdigit((unsigned char) p[1]))) {
+				return -1;
+			}
+			while (isdigit((unsigned char) *p)) {
+				p++;
+			}
+			if (*p == '.') {
+				field->type = FIELD_REAL;
+				if (! isdigit((unsigned char) *++p)) {
+					return -1;
+				}
+				while (isdigit((unsigned char) *p)) {
+					p++;
+				}
+			}
+			if (*p == 'e' || *p == 'E') {
+				field->type = FIELD_REAL;
+				if (*++p == '+' || *p == '-') {
+					p++;
+				}
+				if (! isdigit((unsigned char) *p)) {
+					return -1;
+				}
+				while (isdigit((unsigned char) *p)) {
+					p++;
+				}
+			}
+			if (field->type == FIELD_INTEGER) {
+				errno = 0;
+				field->integer = strtoll(number, NULL, 10);
+				if (errno == ERANGE) {
+					return -1; // jansson reports that
+				}
+			}
+		} else if (strncmp(p, "true", 4) == 0) {
+			field->type = FIELD_TRUE;
+			p += 4;
+		} else if (strncmp(p, "false", 5) == 0) {
+			field->type = FIELD_FALSE;
+			p += 5;
+		} else if (strncmp(p, "null", 4) == 0) {
+			field->type = FIELD_NULL;
+			p += 4;
+		} else {
+			return -1; // object, array or garbage
 		}
 
-		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"error\":\"%s\"}", cmd->correlId, error);
-	} else {
-		replyWithSspResponse(cmd, resp);
+		p = skipJsonSpace(p);
+		if (*p == ',') {
+			p = skipJsonSpace(p + 1);
+			if (*p == '}') {
+				return -1; // trailing comma
+			}
+		} else if (*p != '}') {
+			return -1;
+		}
 	}
+
+	p = skipJsonSpace(p + 1);
+	return *p == '\0' ? count : -1;
 }
 
 /**
- * \brief Handles the JSON "do-float" and "test-float" commands.
+ * \brief Looks up a property split by parseFlatJson(), the last one wins (like in jansson). NULL if missing.
  */
-void handleFloat(struct m_command *cmd) {
-	// basically a copy of do/test-payout ...
-	int payoutOption = 0;
-
-	if (isCommand(cmd, "do-float")) {
-		payoutOption = SSP6_OPTION_BYTE_DO;
-	} else {
-		payoutOption = SSP6_OPTION_BYTE_TEST;
+struct m_field *findField(struct m_command *cmd, const char *name) {
+	size_t length = strlen(name);
+	for (unsigned int i = cmd->fieldCount; i-- > 0;) {
+		if (cmd->fields[i].keyLength == length && memcmp(cmd->fields[i].key, name, length) == 0) {
+			return &cmd->fields[i];
+		}
 	}
+	return NULL;
+}
 
-	json_t *jAmount = json_object_get(cmd->jsonMessage, "amount");
-	if(! json_is_integer(jAmount)) {
-		replyWithPropertyError(cmd, "amount");
-		return;
+/**
+ * \brief Gets the string property of the message, returns 0 on success.
+ * The value is owned by the command.
+ */
+int cmdGetString(struct m_command *cmd, const char *name, const char **value) {
+	if (cmd->jsonMessage) {
+		json_t *jValue = json_object_get(cmd->jsonMessage, name);
+		if (! json_is_string(jValue)) {
+			return 1;
+		}
+		*value = json_string_value(jValue);
+		return 0;
 	}
 
-	int amount = json_integer_value(jAmount);
-
-	SSP_RESPONSE_ENUM resp = mc_ssp_float(&cmd->device->sspC, amount, CURRENCY,
-			payoutOption);
+	struct m_field *field = findField(cmd, name);
+	if (field == NULL || field->type != FIELD_STRING) {
+		return 1;
+	}
+	*value = field->value;
+	return 0;
+}
 
-	if (resp == SSP_RESPONSE_COMMAND_NOT_PROCESSED) {
-		char *error = NULL;
-		switch (cmd->device->sspC.ResponseData[1]) {
-		case 0x01:
-			error = "not enough value in smart payout";
-			break;
-		case 0x02:
-			error = "can't pay exact amount";
-			break;
-		case 0x03:
-			error = "smart payout busy";
-			break;
-		case 0x04:
-			error = "smart payout disabled";
-			break;
-		default:
-			error = "unknown";
-			break;
+/**
+ * \brief Gets the integer property of the message, returns 0 on success.
+ */
+int cmdGetInteger(struct m_command *cmd, const char *name, long long *value) {
+	if (cmd->jsonMessage) {
+		json_t *jValue = json_object_get(cmd->jsonMessage, name);
+		if (! json_is_integer(jValue)) {
+			return 1;
 		}
-		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"error\":\"%s\"}",
-				cmd->correlId, error);
-	} else {
-		replyWithSspResponse(cmd, resp);
+		*value = json_integer_value(jValue);
+		return 0;
 	}
+
+	struct m_field *field = findField(cmd, name);
+	if (field == NULL || field->type != FIELD_INTEGER) {
+		return 1;
+	}
+	*value = field->integer;
+	return 0;
 }
 
 /**
- * \brief Print inhibits debug output.
+ * \brief Test if the message has the property, whatever its type.
  */
-void dbgDisplayInhibits(unsigned char inhibits) {
-	syslog(LOG_DEBUG, "dbgDisplayInhibits: inhibits are: 0=%d 1=%d 2=%d 3=%d 4=%d 5=%d 6=%d 7=%d\n",
-			(inhibits >> 0) & 1,
-			(inhibits >> 1) & 1,
-			(inhibits >> 2) & 1,
-			(inhibits >> 3) & 1,
-			(inhibits >> 4) & 1,
-			(inhibits >> 5) & 1,
-			(inhibits >> 6) & 1,
-			(inhibits >> 7) & 1);
+int cmdHasProperty(struct m_command *cmd, const char *name) {
+	if (cmd->jsonMessage) {
+		return json_object_get(cmd->jsonMessage, name) != NULL;
+	}
+	return findField(cmd, name) != NULL;
 }
 
 /**
- * \brief Handles the JSON "enable-channels" command.
+ * \brief Test if the property of the message is true.
  */
-void handleEnableChannels(struct m_command *cmd) {
-	json_t *jChannels = json_object_get(cmd->jsonMessage, "channels");
-	if(! json_is_string(jChannels)) {
-		replyWithPropertyError(cmd, "channels");
-		return;
+int cmdIsTrue(struct m_command *cmd, const char *name) {
+	if (cmd->jsonMessage) {
+		return json_is_true(json_object_get(cmd->jsonMessage, name));
 	}
 
-	char *channels = (char *) json_string_value(jChannels);
-
-	// this will be updated and written back to the device state
-	// if the update succeeds
-	unsigned char currentChannelInhibits = cmd->device->channelInhibits;
-	unsigned char highChannels = 0xFF; // actually not in use
+	struct m_field *field = findField(cmd, name);
+	return field != NULL && field->type == FIELD_TRUE;
+}
 
-	// 8 channels for now, set the bit to 1 for each requested channel
-	if(strstr(channels, "1") != NULL) {
-		currentChannelInhibits |= 1 << 0;
-	}
-	if(strstr(channels, "2") != NULL) {
-		currentChannelInhibits |= 1 << 1;
-	}
-	if(strstr(channels, "3") != NULL) {
-		currentChannelInhibits |= 1 << 2;
-	}
-	if(strstr(channels, "4") != NULL) {
-		currentChannelInhibits |= 1 << 3;
-	}
-	if(strstr(channels, "5") != NULL) {
-		currentChannelInhibits |= 1 << 4;
-	}
-	if(strstr(channels, "6") != NULL) {
-		currentChannelInhibits |= 1 << 5;
-	}
-	if(strstr(channels, "7") != NULL) {
-		currentChannelInhibits |= 1 << 6;
-	}
-	if(strstr(channels, "8") != NULL) {
-		currentChannelInhibits |= 1 << 7;
-	}
-
-	SSP_RESPONSE_ENUM resp = ssp6_set_inhibits(&cmd->device->sspC, currentChannelInhibits, highChannels);
+/**
+ * \brief Test if cmd.command equals command
+ */
+int isCommand(struct m_command *cmd, const char *command) {
+	return ! strcmp(cmd->command, command);
+}
 
-	if(resp == SSP_RESPONSE_OK) {
-		// okay, update the channelInhibits in the device structure with the new state
-		cmd->device->channelInhibits = currentChannelInhibits;
+/**
+ * \brief Makes sure at least extra more bytes (plus the terminating NUL) fit into the buffer.
+ * Returns 0 on success.
+ */
+int bufferReserve(struct m_buffer *buffer, size_t extra) {
+	size_t needed = buffer->length + extra + 1;
+	if(needed <= buffer->capacity) {
+		return 0;
+	}
 
-		if(0) {
-			syslog(LOG_DEBUG, "enable-channels:\n");
-			dbgDisplayInhibits(currentChannelInhibits);
-		}
+	size_t capacity = buffer->capacity ? buffer->capacity : 256;
+	while(capacity < needed) {
+		capacity *= 2;
 	}
 
-	replyWithSspResponse(cmd, resp);
+	char *data = realloc(buffer->data, capacity);
+	if(data == NULL) {
+		buffer->failed = 1;
+		return 1;
+	}
+	buffer->data = data;
+	buffer->capacity = capacity;
+	return 0;
 }
 
 /**
- * \brief Handles the JSON "disable-channels" command.
+ * \brief Appends length bytes of data to the buffer. Returns 0 on success.
  */
-void handleDisableChannels(struct m_command *cmd) {
-	json_t *jChannels = json_object_get(cmd->jsonMessage, "channels");
-	if(! json_is_string(jChannels)) {
-		replyWithPropertyError(cmd, "channels");
-		return;
+int bufferAppend(struct m_buffer *buffer, const void *data, size_t length) {
+	if(bufferReserve(buffer, length)) {
+		return 1;
 	}
+	memcpy(buffer->data + buffer->length, data, length);
+	buffer->length += length;
+	buffer->data[buffer->length] = '\0';
+	return 0;
+}
 
-	char *channels = (char *) json_string_value(jChannels);
-
-	// this will be updated and written back to the device state
-	// if the update succeeds
-	unsigned char currentChannelInhibits = cmd->device->channelInhibits;
-	unsigned char highChannels = 0xFF; // actually not in use
-
-	// 8 channels for now, set the bit to 0 for each requested channel
-	if(strstr(channels, "1") != NULL) {
-		currentChannelInhibits &= ~(1 << 0);
-	}
-	if(strstr(channels, "2") != NULL) {
-		currentChannelInhibits &= ~(1 << 1);
-	}
-	if(strstr(channels, "3") != NULL) {
-		currentChannelInhibits &= ~(1 << 2);
-	}
-	if(strstr(channels, "4") != NULL) {
-		currentChannelInhibits &= ~(1 << 3);
-	}
-	if(strstr(channels, "5") != NULL) {
-		currentChannelInhibits &= ~(1 << 4);
-	}
-	if(strstr(channels, "6") != NULL) {
-		currentChannelInhibits &= ~(1 << 5);
-	}
-	if(strstr(channels, "7") != NULL) {
-		currentChannelInhibits &= ~(1 << 6);
-	}
-	if(strstr(channels, "8") != NULL) {
-		currentChannelInhibits &= ~(1 << 7);
+/**
+ * \brief Appends the formatted string to the buffer. Returns 0 on success.
+ */
+int bufferVPrintf(struct m_buffer *buffer, const char *format, va_list varargs) {
+	if(bufferReserve(buffer, 0)) {
+		return 1;
 	}
 
-	SSP_RESPONSE_ENUM resp = ssp6_set_inhibits(&cmd->device->sspC, currentChannelInhibits, highChannels);
+	size_t available = buffer->capacity - buffer->length;
+	va_list copy;
+	va_copy(copy, varargs);
+	int length = vsnprintf(buffer->data + buffer->length, available, format, copy);
+	va_end(copy);
 
-	if(resp == SSP_RESPONSE_OK) {
-		// okay, update the channelInhibits in the device structure with the new state
-		cmd->device->channelInhibits = currentChannelInhibits;
+	if(length < 0) {
+		buffer->data[buffer->length] = '\0';
+		buffer->failed = 1;
+		return 1;
+	}
 
-		if(0) {
-			syslog(LOG_DEBUG, "disable-channels:\n");
-			dbgDisplayInhibits(currentChannelInhibits);
+	if((size_t) length >= available) {
+		// didn't fit, grow once and format again
+		if(bufferReserve(buffer, length)) {
+			buffer->data[buffer->length] = '\0';
+			return 1;
 		}
+		vsnprintf(buffer->data + buffer->length, length + 1, format, varargs);
 	}
 
-	replyWithSspResponse(cmd, resp);
+	buffer->length += length;
+	return 0;
 }
 
 /**
- * \brief Handles the JSON "inhibit-channels" command.
+ * \brief Appends the formatted string to the buffer. Returns 0 on success.
  */
-void handleInhibitChannels(struct m_command *cmd) {
-	json_t *jChannels = json_object_get(cmd->jsonMessage, "channels");
-	if(! json_is_string(jChannels)) {
-		replyWithPropertyError(cmd, "channels");
-		return;
-	}
-
-	char *channels = (char *) json_string_value(jChannels);
-
-	unsigned char lowChannels = 0xFF;
-	unsigned char highChannels = 0xFF;
+int bufferPrintf(struct m_buffer *buffer, const char *format, ...) {
+	va_list varargs;
+	va_start(varargs, format);
+	int rc = bufferVPrintf(buffer, format, varargs);
+	va_end(varargs);
+	return rc;
+}
 
-	// 8 channels for now
-	if(strstr(channels, "1") != NULL) {
-		lowChannels &= ~(1 << 0);
-	}
-	if(strstr(channels, "2") != NULL) {
-		lowChannels &= ~(1 << 1);
-	}
-	if(strstr(channels, "3") != NULL) {
-		lowChannels &= ~(1 << 2);
-	}
-	if(strstr(channels, "4") != NULL) {
-		lowChannels &= ~(1 << 3);
-	}
-	if(strstr(channels, "5") != NULL) {
-		lowChannels &= ~(1 << 4);
-	}
-	if(strstr(channels, "6") != NULL) {
-		lowChannels &= ~(1 << 5);
-	}
-	if(strstr(channels, "7") != NULL) {
-		lowChannels &= ~(1 << 6);
-	}
-	if(strstr(channels, "8") != NULL) {
-		lowChannels &= ~(1 << 7);
+/**
+ * \brief Empties the buffer but keeps its memory for reuse.
+ */
+void bufferReset(struct m_buffer *buffer) {
+	buffer->length = 0;
+	buffer->failed = 0;
+	if(buffer->data) {
+		buffer->data[0] = '\0';
 	}
-
-	replyWithSspResponse(cmd, ssp6_set_inhibits(&cmd->device->sspC, lowChannels, highChannels));
 }
 
 /**
- * \brief Handles the JSON "enable" command.
+ * \brief Releases the memory of the buffer.
  */
-void handleEnable(struct m_command *cmd) {
-	replyWithSspResponse(cmd, ssp6_enable(&cmd->device->sspC));
+void bufferFree(struct m_buffer *buffer) {
+	free(buffer->data);
+	buffer->data = NULL;
+	buffer->length = 0;
+	buffer->capacity = 0;
+	buffer->failed = 0;
 }
 
 /**
- * \brief Handles the JSON "disable" command.
+ * \brief Returns the wall clock time in ms, used for the journal.
  */
-void handleDisable(struct m_command *cmd) {
-	replyWithSspResponse(cmd, ssp6_disable(&cmd->device->sspC));
+unsigned long long realtimeMs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (unsigned long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
 /**
- * \brief Handles the JSON "set-denomination-levels" command.
+ * \brief Scans the next {"value":..,"level":..,"cc":".."} (as written by mc_ssp_get_all_levels()) of a
+ * levels JSON array content and advances json behind it. Returns 0 if there is none.
  */
-void handleSetDenominationLevels(struct m_command *cmd) {
-	json_t *jLevel = json_object_get(cmd->jsonMessage, "level");
-	if(! json_is_integer(jLevel)) {
-		replyWithPropertyError(cmd, "level");
-		return;
-	}
-
-	json_t *jAmount = json_object_get(cmd->jsonMessage, "amount");
-	if(! json_is_integer(jAmount)) {
-		replyWithPropertyError(cmd, "amount");
-		return;
+int scanLevel(const char **json, unsigned int *value, unsigned int *level, char *cc) {
+	int consumed = 0;
+	if (*json == NULL || sscanf(*json, "%*[{,]\"value\":%u,\"level\":%u,\"cc\":\"%3[^\"]\"}%n",
+			value, level, cc, &consumed) != 3 || consumed == 0) {
+		return 0;
 	}
+	*json += consumed;
+	return 1;
+}
 
-	int level = json_integer_value(jLevel);
-	int amount = json_integer_value(jAmount);
+/**
+ * \brief Returns the device number used in the journal.
+ */
+unsigned char journalDevice(struct m_device *device) {
+	return device->bus->index * 2 + (device->commandClass == CMD_VALIDATOR);
+}
 
-	if(level > 0) {
-		/* Quote from the spec -.-
-		 *
-		 * A command to increment the level of coins of a denomination stored in the hopper.
-		 * The command is formatted with the command byte first, amount of coins to *add*
-		 * as a 2-byte little endian, the value of coin as 2-byte little endian and
-		 * (if using protocol version 6) the country code of the coin as 3 byte ASCII. The level of coins for a
-		 * denomination can be set to zero by sending a zero level for that value.
-		 *
-		 * In a nutshell: This command behaves only with a level of 0 as expected (setting the absolute value),
-		 * otherwise it works like the not existing "increment denomination level" command.
-		 */
+/**
+ * \brief Fills the record claimed with sequence number seq.
+ */
+void journalWrite(unsigned long seq, struct m_device *device, unsigned char type, unsigned char code,
+		unsigned char status, unsigned long value, unsigned long data, const char *id, size_t idLength) {
+	struct m_journal_record *record = &journal.records[seq % JOURNAL_RECORDS];
+
+	// a torn record must not look valid, the sequence number is written last
+	record->seq = 0;
+	record->at = realtimeMs();
+	record->type = type;
+	record->device = journalDevice(device);
+	record->code = code;
+	record->status = status;
+	record->value = value;
+	record->data = data;
+	memset(record->id, 0, sizeof(record->id));
+	memcpy(record->id, id, idLength < sizeof(record->id) ? idLength : sizeof(record->id));
+	atomic_thread_fence(memory_order_release);
+	record->seq = seq;
+}
 
-		// ignore the result for now. we could not do much anyway now.
-		mc_ssp_set_denomination_level(&cmd->device->sspC, amount, 0, CURRENCY);
+/**
+ * \brief Appends a record to the journal (if -J is given). Safe to call from any thread, never blocks.
+ */
+void journalAppend(struct m_device *device, unsigned char type, unsigned char code, unsigned char status,
+		unsigned long value, unsigned long data, const char *id) {
+	if (journal.map == NULL) {
+		return;
 	}
 
-	replyWithSspResponse(cmd, mc_ssp_set_denomination_level(&cmd->device->sspC, amount, level, CURRENCY));
+	unsigned long seq = atomic_fetch_add_explicit(&journal.next, 1, memory_order_relaxed);
+	journalWrite(seq, device, type, code, status, value, data, id ? id : "", id ? strlen(id) : 0);
+	atomic_store_explicit(&journal.dirty, 1, memory_order_release);
 }
 
 /**
- * \brief Handles the JSON "set-cashbox-payout-limit" command.
+ * \brief Appends the levels (JSON array content of a "get-all-levels") to the journal as consecutive
+ * JOURNAL_LEVEL records, so they can be restored by journalReplay().
  */
-void handleSetCashboxPayoutLimit(struct m_command *cmd) {
-	json_t *jLevel = json_object_get(cmd->jsonMessage, "level");
-	if(! json_is_integer(jLevel)) {
-		replyWithPropertyError(cmd, "level");
+void journalLevels(struct m_device *device, const char *levels) {
+	if (journal.map == NULL) {
 		return;
 	}
 
-	json_t *jAmount = json_object_get(cmd->jsonMessage, "amount");
-	if(! json_is_integer(jAmount)) {
-		replyWithPropertyError(cmd, "amount");
+	unsigned int count = 0;
+	unsigned int value, level;
+	char cc[4];
+	for (const char *p = levels; count < UINT8_MAX && scanLevel(&p, &value, &level, cc); ) {
+		count++;
+	}
+	if (count == 0) {
 		return;
 	}
 
-	int level = json_integer_value(jLevel);
-	int amount = json_integer_value(jAmount);
-
-	replyWithSspResponse(cmd, mc_ssp_set_cashbox_payout_limit(&cmd->device->sspC, level, amount, CURRENCY));
+	// currency and bus name, the bus must be the same one when restoring
+	char id[sizeof(((struct m_journal_record *) 0)->id)];
+	memset(id, 0, sizeof(id));
+	size_t nameLength = strlen(device->bus->name);
+	memcpy(id + 4, device->bus->name, nameLength < sizeof(id) - 4 ? nameLength : sizeof(id) - 4);
+
+	unsigned long seq = atomic_fetch_add_explicit(&journal.next, count, memory_order_relaxed);
+	const char *p = levels;
+	for (unsigned int i = 0; i < count && scanLevel(&p, &value, &level, cc); i++) {
+		memcpy(id, cc, sizeof(cc));
+		journalWrite(seq + i, device, JOURNAL_LEVEL, count, i, value, level, id, sizeof(id));
+	}
+	atomic_store_explicit(&journal.dirty, 1, memory_order_release);
 }
 
 /**
- * \brief Handles the JSON "get-all-levels" command.
+ * \brief Rebuilds the state cache from the journal and finds the next sequence number.
+ * \details The levels of a device are restored from its last "get-all-levels" unless a
+ * mutating request or an event which changes the levels has been journaled after it. They keep
+ * their age, so -s still applies.
  */
-void handleGetAllLevels(struct m_command *cmd) {
-	char *json = NULL;
+void journalReplay(struct m_metacash *metacash) {
+	unsigned long long latest[MAX_SSP_BUS * 2] = { 0 };
+	unsigned long long changed[MAX_SSP_BUS * 2] = { 0 };
+	unsigned long long last = 0;
+
+	for (unsigned long i = 0; i < JOURNAL_RECORDS; i++) {
+		struct m_journal_record *record = &journal.records[i];
+		if (record->seq == 0 || record->seq % JOURNAL_RECORDS != i) {
+			continue;
+		}
+		if (record->seq > last) {
+			last = record->seq;
+		}
+		if (record->device >= metacash->busCount * 2) {
+			continue;
+		}
+		if (record->type == JOURNAL_LEVEL && record->status == 0 && record->seq > latest[record->device]) {
+			latest[record->device] = record->seq;
+		} else if (((record->type == JOURNAL_EVENT && mcSspIsLevelChange(record->code))
+				|| (record->type == JOURNAL_REQUEST && record->status)) && record->seq > changed[record->device]) {
+			changed[record->device] = record->seq;
+		}
+	}
+	atomic_store(&journal.next, last + 1);
+
+	unsigned long long now = realtimeMs();
+	unsigned long long monotonicNow = monotonicMs();
+	for (unsigned int d = 0; d < metacash->busCount * 2; d++) {
+		struct m_bus *bus = &metacash->buses[d / 2];
+		struct m_device *device = d % 2 ? &bus->validator : &bus->hopper;
+		unsigned long long base = latest[d];
+		if (base == 0 || changed[d] > base) {
+			continue;
+		}
 
-	SSP_RESPONSE_ENUM resp = mc_ssp_get_all_levels(&cmd->device->sspC, &json);
+		struct m_journal_record *first = &journal.records[base % JOURNAL_RECORDS];
+		unsigned long long age = now - first->at;
+		if (first->at > now || age >= monotonicNow || strncmp(first->id + 4, bus->name, sizeof(first->id) - 4) != 0) {
+			continue;
+		}
 
-	if(resp == SSP_RESPONSE_OK) {
-		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"levels\":[%s]}", cmd->correlId, json);
-	} else {
-		replyWithSspResponse(cmd, resp);
+		struct m_buffer levels = { NULL, 0, 0, 0 };
+		unsigned int i;
+		for (i = 0; i < first->code; i++) {
+			struct m_journal_record *record = &journal.records[(base + i) % JOURNAL_RECORDS];
+			if (record->seq != base + i || record->type != JOURNAL_LEVEL || record->status != i || record->device != d) {
+				break; // overwritten or torn
+			}
+			bufferPrintf(&levels, "%s{\"value\":%u,\"level\":%u,\"cc\":\"%.3s\"}",
+					i ? "," : "", (unsigned int) record->value, (unsigned int) record->data, record->id);
+		}
+
+		if (i == first->code && ! levels.failed) {
+			pthread_mutex_lock(&device->state.lock);
+			bufferReset(&device->state.levels);
+			if (bufferAppend(&device->state.levels, levels.data, levels.length) == 0) {
+				device->state.levelsAt = monotonicNow - age;
+			}
+			pthread_mutex_unlock(&device->state.lock);
+			logMessage(LOG_INFO, "restored the levels of device '%s' from the journal (%u denominations, %llu ms old)",
+					device->name, i, age);
+		}
+		bufferFree(&levels);
 	}
+}
 
-	free(json);
+/**
+ * \brief Main function of the journal thread, msyncs the journal once per POLL_TICK if it has been written.
+ */
+void *journalThread(void *arg) {
+	struct timespec tick = { POLL_TICK / 1000, (POLL_TICK % 1000) * 1000000 };
+
+	while (atomic_load_explicit(&journal.running, memory_order_acquire)) {
+		nanosleep(&tick, NULL);
+		if (atomic_exchange_explicit(&journal.dirty, 0, memory_order_acq_rel)) {
+			if (msync(journal.map, (JOURNAL_RECORDS + 1) * sizeof(struct m_journal_record), MS_SYNC) != 0) {
+				logMessage(LOG_ERR, "could not sync the journal: %s", strerror(errno));
+			}
+			atomic_fetch_add_explicit(&journal.syncs, 1, memory_order_relaxed);
+		}
+	}
+	return NULL;
 }
 
 /**
- * \brief Handles the JSON "cashbox-payout-operation-data" command.
+ * \brief Maps the journal file (creating and pre-allocating it if needed), restores the state cache
+ * from it and starts the journal thread. Dies if the file can't be used.
  */
-void handleCashboxPayoutOperationData(struct m_command *cmd) {
-	char *json = NULL;
+void journalStart(struct m_metacash *metacash, const char *file) {
+	size_t length = (JOURNAL_RECORDS + 1) * sizeof(struct m_journal_record);
 
-	SSP_RESPONSE_ENUM resp = mc_ssp_cashbox_payout_operation_data(&cmd->device->sspC, &json);
+	int fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd == -1) {
+		logMessage(LOG_ERR, "could not open journal '%s': %s", file, strerror(errno));
+		die("could not open journal", 1);
+		// never reached, already exited
+	}
 
-	if(resp == SSP_RESPONSE_OK) {
-		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"levels\":[%s]}", cmd->correlId, json);
+	// allocate the blocks now, a full disk must not show up as SIGBUS in a worker later
+	struct stat st;
+	int fresh = fstat(fd, &st) != 0 || (size_t) st.st_size != length;
+	int rc = 0;
+	if (fresh && ftruncate(fd, 0) != 0) {
+		rc = errno;
+	} else if (fresh) {
+		rc = posix_fallocate(fd, 0, length);
+	}
+	if (rc != 0) {
+		logMessage(LOG_ERR, "could not allocate journal '%s': %s", file, strerror(rc));
+		die("could not allocate journal", 1);
+		// never reached, already exited
+	}
+
+	journal.map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (journal.map == MAP_FAILED) {
+		journal.map = NULL;
+		logMessage(LOG_ERR, "could not map journal '%s': %s", file, strerror(errno));
+		die("could not map journal", 1);
+		// never reached, already exited
+	}
+	journal.records = journal.map + 1;
+
+	struct m_journal_record *header = journal.map;
+	if (fresh || memcmp(header, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0) {
+		logMessage(LOG_NOTICE, "starting a new journal in '%s'", file);
+		memset(journal.map, 0, length);
+		memcpy(header, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+		atomic_store(&journal.next, 1);
 	} else {
-		replyWithSspResponse(cmd, resp);
+		journalReplay(metacash);
 	}
 
-	free(json);
+	atomic_store(&journal.running, 1);
+	if (pthread_create(&journal.thread, NULL, journalThread, NULL) != 0) {
+		atomic_store(&journal.running, 0);
+		die("could not start the journal thread", 1);
+		// never reached, already exited
+	}
 }
 
-
 /**
- * \brief Handles the JSON "get-firmware-version" command.
+ * \brief Stops the journal thread, syncs and unmaps the journal (if -J is given).
  */
-void handleGetFirmwareVersion(struct m_command *cmd) {
-	char firmwareVersion[100] = { 0 };
-
-	SSP_RESPONSE_ENUM resp = mc_ssp_get_firmware_version(&cmd->device->sspC, &firmwareVersion[0]);
+void journalStop() {
+	if (journal.map == NULL) {
+		return;
+	}
 
-	if(resp == SSP_RESPONSE_OK) {
-		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"version\":\"%s\"}", cmd->correlId, firmwareVersion);
-	} else {
-		replyWithSspResponse(cmd, resp);
+	if (atomic_exchange(&journal.running, 0) && ! pthread_equal(pthread_self(), journal.thread)) {
+		pthread_join(journal.thread, NULL);
 	}
+	size_t length = (JOURNAL_RECORDS + 1) * sizeof(struct m_journal_record);
+	msync(journal.map, length, MS_SYNC);
+	munmap(journal.map, length);
+	journal.map = NULL;
 }
 
 /**
- * \brief Handles the JSON "get-dataset-version" command.
+ * \brief Test if the message (a frame of the outbox) is about money.
  */
-void handleGetDatasetVersion(struct m_command *cmd) {
-	char datasetVersion[100] = { 0 };
-
-	SSP_RESPONSE_ENUM resp = mc_ssp_get_dataset_version(&cmd->device->sspC, &datasetVersion[0]);
-
-	if(resp == SSP_RESPONSE_OK) {
-		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"version\":\"%s\"}",
-				cmd->correlId, datasetVersion);
-	} else {
-		replyWithSspResponse(cmd, resp);
+int isMoneyMessage(const char *frame, size_t length) {
+	for (int i = 0; MONEY_EVENTS[i]; i++) {
+		if (memmem(frame, length, MONEY_EVENTS[i], strlen(MONEY_EVENTS[i]))) {
+			return 1;
+		}
 	}
+	return 0;
 }
 
 /**
- * \brief Handles the JSON "last-reject-note" command.
+ * \brief Writes the whole buffer to the file descriptor, returns 0 on success.
  */
-void handleLastRejectNote(struct m_command *cmd) {
-	unsigned char reasonCode;
+int writeAll(int fd, const char *data, size_t length) {
+	while (length) {
+		ssize_t written = write(fd, data, length);
+		if (written == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 1;
+		}
+		data += written;
+		length -= written;
+	}
+	return 0;
+}
 
-	SSP_RESPONSE_ENUM resp = mc_ssp_last_reject_note(&cmd->device->sspC, &reasonCode);
+/**
+ * \brief Makes room in the outbox while redis is unavailable or behind (outbox.lock must be held).
+ * \details While offline with a spill file all pending messages are appended to it. Otherwise (or if
+ * writing fails) the oldest messages are dropped until half of outbox.offlineLimit is free,
+ * messages about money are always kept. The messages redis hasn't acknowledged yet count against the limit.
+ */
+void trimOutbox() {
+	struct m_buffer *pending = &outbox.pending;
+
+	// spilled messages are only read back on a reconnect, so they are no help while online
+	if (outbox.spillFd != -1 && outbox.offline) {
+		if (writeAll(outbox.spillFd, pending->data, pending->length) == 0) {
+			outbox.spillLength += pending->length;
+			pending->length = 0;
+			pending->data[0] = '\0';
+			return;
+		}
+		logMessage(LOG_ERR, "trimOutbox: could not write the spill file: %s", strerror(errno));
+		if (ftruncate(outbox.spillFd, outbox.spillLength) != 0) { // no partial message
+			logMessage(LOG_ERR, "trimOutbox: could not truncate the spill file: %s", strerror(errno));
+		}
+	}
+
+	size_t excess = pending->length + outbox.unackedLength - outbox.offlineLimit / 2;
+	size_t from = 0, to = 0;
+	unsigned long dropped = 0;
+	while (from < pending->length) {
+		size_t frameLength;
+		memcpy(&frameLength, pending->data + from, sizeof(frameLength));
+		size_t total = sizeof(frameLength) + frameLength;
+
+		if (excess && ! isMoneyMessage(pending->data + from + sizeof(frameLength), frameLength)) {
+			excess = excess > total ? excess - total : 0;
+			dropped++;
+		} else {
+			memmove(pending->data + to, pending->data + from, total);
+			to += total;
+		}
+		from += total;
+	}
+	pending->length = to;
+	pending->data[to] = '\0';
+
+	if (dropped) {
+		outbox.dropped += dropped;
+		logMessage(LOG_WARNING, "trimOutbox: redis unavailable or behind and outbox full, dropped %lu messages", dropped);
+	}
+}
+
+/**
+ * \brief Queues the message for the clients of the local socket (outbox.lock must be held).
+ */
+int queueLocalMessage(const char *topic, const char *payload, size_t length) {
+	struct m_buffer *pending = &local.pending;
+	size_t start = pending->length;
+	size_t topicLength = strlen(topic);
+	size_t frameLength = sizeof(topicLength) + topicLength + 1 + length;
+
+	// [frame length][topic length]<topic> <payload>, the datagram is sent from the topic on
+	if(bufferAppend(pending, &frameLength, sizeof(frameLength))
+			|| bufferAppend(pending, &topicLength, sizeof(topicLength))
+			|| bufferAppend(pending, topic, topicLength)
+			|| bufferAppend(pending, " ", 1)
+			|| bufferAppend(pending, payload, length)) {
+		pending->length = start;
+		logMessage(LOG_ERR, "queueLocalMessage: out of memory, dropping message for topic='%s'", topic);
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * \brief Wakes up the libevent thread, it always drains the whole outbox.
+ */
+void wakeOutbox() {
+	// one byte is enough
+	if(outbox.wakeupFd[1] != -1) {
+		char wakeup = 0;
+		if(write(outbox.wakeupFd[1], &wakeup, 1) == -1 && errno != EAGAIN) {
+			logMessage(LOG_ERR, "publishMessage: could not wake up the event loop: %s", strerror(errno));
+		}
+	}
+}
+
+/**
+ * \brief Queues the message for publishing to the given topic in the outbox and wakes up
+ * the libevent thread. The payload is copied (binary safe), so the caller keeps its ownership.
+ * Safe to call from any thread.
+ * \details The connected local clients get a copy of every message, a topic addressed to one of
+ * them (see processRequest()) only goes to that client and never to redis.
+ */
+int publishMessage(const char *topic, const char *payload, size_t length) {
+	// the responses of the steps of a batch are combined by handleBatch(), the one of a cached request is kept
+	if(replyCapture && strcmp(topic, replyCapture->topic) == 0) {
+		if(replyCapture->publish) {
+			// the response is kept for resent duplicates (mcSspRunCommand()), the last one is the result
+			bufferReset(&replyCapture->replies);
+			bufferAppend(&replyCapture->replies, payload, length);
+			replyCapture->count++;
+		} else {
+			if(replyCapture->count++ && bufferAppend(&replyCapture->replies, ",", 1)) {
+				return 1;
+			}
+			return bufferAppend(&replyCapture->replies, payload, length);
+		}
+	}
+
+	int localOnly = topic[0] == LOCAL_TOPIC_PREFIX;
+
+	pthread_mutex_lock(&outbox.lock);
+	int wakeUp = 0;
+	if(localOnly || atomic_load_explicit(&local.clientCount, memory_order_relaxed)) {
+		wakeUp = local.pending.length == 0;
+		if(queueLocalMessage(topic, payload, length) && localOnly) {
+			pthread_mutex_unlock(&outbox.lock);
+			return 1;
+		}
+	}
+	if(localOnly) {
+		pthread_mutex_unlock(&outbox.lock);
+		if(wakeUp) {
+			wakeOutbox();
+		}
+		return 0;
+	}
+
+	struct m_buffer *pending = &outbox.pending;
+	int wasEmpty = pending->length == 0;
+	size_t start = pending->length;
+	size_t frameLength = 0;
+
+	// length prefix (patched below) followed by the RESP encoded PUBLISH / XADD command
+	int failed = bufferAppend(pending, &frameLength, sizeof(frameLength));
+	if(! failed && outbox.streamMaxLen) {
+		// XADD <topic> MAXLEN ~ <n> * message <payload>
+		char maxLen[24];
+		snprintf(maxLen, sizeof(maxLen), "%lu", outbox.streamMaxLen);
+		failed = bufferPrintf(pending, "*8\r\n$4\r\nXADD\r\n$%zu\r\n%s\r\n$6\r\nMAXLEN\r\n$1\r\n~\r\n"
+				"$%zu\r\n%s\r\n$1\r\n*\r\n$7\r\nmessage\r\n$%zu\r\n",
+				strlen(topic), topic, strlen(maxLen), maxLen, length);
+	} else if(! failed) {
+		failed = bufferPrintf(pending, "*3\r\n$7\r\nPUBLISH\r\n$%zu\r\n%s\r\n$%zu\r\n",
+				strlen(topic), topic, length);
+	}
+	if(failed
+			|| bufferAppend(pending, payload, length)
+			|| bufferAppend(pending, "\r\n", 2)) {
+		pending->length = start;
+		pthread_mutex_unlock(&outbox.lock);
+		logMessage(LOG_ERR, "publishMessage: out of memory, dropping message for topic='%s'", topic);
+		if(wakeUp) {
+			wakeOutbox();
+		}
+		return 1;
+	}
+
+	frameLength = pending->length - start - sizeof(frameLength);
+	memcpy(pending->data + start, &frameLength, sizeof(frameLength));
+	if(pending->length + outbox.unackedLength > outbox.offlineLimit) {
+		trimOutbox();
+	}
+	pthread_mutex_unlock(&outbox.lock);
+
+	if(wasEmpty || wakeUp) {
+		wakeOutbox();
+	}
+
+	return 0;
+}
+
+/**
+ * \brief Formats the message into the scratch buffer of the calling thread and queues it
+ * for publishing to the given topic.
+ */
+int publishFormatted(const char *topic, const char *format, va_list varargs) {
+	// reused for every message of this thread, never shrinks
+	static _Thread_local struct m_buffer scratch;
+
+	bufferReset(&scratch);
+	if(bufferVPrintf(&scratch, format, varargs)) {
+		logMessage(LOG_ERR, "publishFormatted: could not format message for topic='%s'", topic);
+		return 1;
+	}
+
+	return publishMessage(topic, scratch.data, scratch.length);
+}
+
+/**
+ * \brief Callback function triggered by redis once it has answered a PUBLISH / XADD from the outbox
+ * (or the connection is gone).
+ */
+void cbOnPublished(redisAsyncContext *c, void *r, void *privdata) {
+	if (metrics.publishInFlight) {
+		metrics.publishInFlight--;
+	}
+
+	// redis answers in order, so this is the oldest message we are waiting for
+	struct m_buffer *unacked = &outbox.unacked;
+	if (r != NULL && outbox.unackedOffset < unacked->length) {
+		size_t frameLength;
+		memcpy(&frameLength, unacked->data + outbox.unackedOffset, sizeof(frameLength));
+		size_t total = sizeof(frameLength) + frameLength;
+		outbox.unackedOffset += total;
+		if (outbox.unackedOffset >= unacked->length) {
+			unacked->length = 0;
+			outbox.unackedOffset = 0;
+		} else if (outbox.unackedOffset > unacked->length / 2) {
+			// redis may never catch up completely, so move the rest to the front instead of appending forever
+			unacked->length -= outbox.unackedOffset;
+			memmove(unacked->data, unacked->data + outbox.unackedOffset, unacked->length);
+			unacked->data[unacked->length] = '\0';
+			outbox.unackedOffset = 0;
+		}
+
+		pthread_mutex_lock(&outbox.lock);
+		outbox.unackedLength -= total;
+		pthread_mutex_unlock(&outbox.lock);
+
+		if (outbox.throttled) {
+			flushOutbox();
+		}
+	}
+}
+
+/**
+ * \brief Puts the messages back in front of the pending ones in the outbox (outbox.lock must be held).
+ */
+void requeueOutbox(const char *frames, size_t length) {
+	struct m_buffer requeued = { NULL, 0, 0, 0 };
+
+	if (bufferAppend(&requeued, frames, length) || bufferAppend(&requeued, outbox.pending.data, outbox.pending.length)) {
+		bufferFree(&requeued);
+		logMessage(LOG_ERR, "requeueOutbox: out of memory, dropping %zu bytes of messages", length);
+		return;
+	}
+	bufferFree(&outbox.pending);
+	outbox.pending = requeued;
+}
+
+/**
+ * \brief Hands all messages waiting in the outbox over to redis. Must only be called
+ * by the libevent thread.
+ */
+void flushOutbox() {
+	struct m_buffer *flushing = &outbox.flushing;
+
+	// swap the buffers so the workers can go on publishing while we hand over to redis
+	pthread_mutex_lock(&outbox.lock);
+	if (outbox.offline || redisPublishCtx == NULL) {
+		// kept (and bounded) until the publish connection is back
+		pthread_mutex_unlock(&outbox.lock);
+		return;
+	}
+	struct m_buffer swap = outbox.pending;
+	outbox.pending = *flushing;
+	*flushing = swap;
+	pthread_mutex_unlock(&outbox.lock);
+
+	outbox.throttled = 0;
+	size_t offset = 0;
+	while(offset < flushing->length) {
+		size_t frameLength;
+		memcpy(&frameLength, flushing->data + offset, sizeof(frameLength));
+
+		// redis is behind, keep the rest pending until it has acknowledged enough to stay within the limit
+		if ((outbox.unackedLength || offset)
+				&& outbox.unackedLength + offset + sizeof(frameLength) + frameLength > outbox.offlineLimit) {
+			outbox.throttled = 1;
+			break;
+		}
+
+		if (redisAsyncFormattedCommand(redisPublishCtx, cbOnPublished, NULL, flushing->data + offset + sizeof(frameLength), frameLength) != REDIS_OK) {
+			break; // the connection is going away
+		}
+		metrics.published++;
+		metrics.publishInFlight++;
+		if (metrics.publishInFlight > metrics.publishMaxInFlight) {
+			metrics.publishMaxInFlight = metrics.publishInFlight;
+		}
+
+		offset += sizeof(frameLength) + frameLength;
+	}
+
+	// remember the messages handed over until redis has acknowledged them
+	struct m_buffer *unacked = &outbox.unacked;
+	size_t handedOver = offset;
+	if (unacked->length == 0 && offset == flushing->length) {
+		swap = *unacked;
+		*unacked = *flushing;
+		*flushing = swap;
+	} else if (bufferAppend(unacked, flushing->data, offset)) {
+		logMessage(LOG_ERR, "flushOutbox: out of memory, messages lost on a reconnect aren't published again");
+		handedOver = 0;
+	}
+
+	pthread_mutex_lock(&outbox.lock);
+	outbox.unackedLength += handedOver;
+	if (offset < flushing->length) {
+		requeueOutbox(flushing->data + offset, flushing->length - offset);
+	}
+	pthread_mutex_unlock(&outbox.lock);
+	flushing->length = 0;
+}
+
+/**
+ * \brief Called once the publish connection is lost, keeps the messages in the outbox from now on and
+ * queues the ones redis hasn't acknowledged again (libevent thread only).
+ * \details A message might be published twice if the connection broke after redis has received it.
+ */
+void setOutboxOffline() {
+	pthread_mutex_lock(&outbox.lock);
+	outbox.offline = 1;
+	if (outbox.unackedOffset < outbox.unacked.length) {
+		requeueOutbox(outbox.unacked.data + outbox.unackedOffset, outbox.unacked.length - outbox.unackedOffset);
+	}
+	outbox.unacked.length = 0;
+	outbox.unackedOffset = 0;
+	outbox.unackedLength = 0;
+	outbox.throttled = 0;
+	pthread_mutex_unlock(&outbox.lock);
+}
+
+/**
+ * \brief Called once the publish connection is established, hands the spilled and the pending
+ * messages over to redis in one pipelined burst (libevent thread only).
+ */
+void setOutboxOnline() {
+	pthread_mutex_lock(&outbox.lock);
+	if (outbox.spillLength) {
+		char *spilled = mmap(NULL, outbox.spillLength, PROT_READ, MAP_PRIVATE, outbox.spillFd, 0);
+		if (spilled == MAP_FAILED) {
+			logMessage(LOG_ERR, "setOutboxOnline: could not map the spill file: %s", strerror(errno));
+		} else {
+			// the spilled messages are older than the pending ones, a truncated last one (crash while writing) is skipped
+			size_t length = 0;
+			while (length + sizeof(size_t) <= outbox.spillLength) {
+				size_t frameLength;
+				memcpy(&frameLength, spilled + length, sizeof(frameLength));
+				if (frameLength > outbox.spillLength - length - sizeof(frameLength)) {
+					break;
+				}
+				length += sizeof(frameLength) + frameLength;
+			}
+			requeueOutbox(spilled, length);
+			munmap(spilled, outbox.spillLength);
+			logMessage(LOG_NOTICE, "setOutboxOnline: publishing %zu bytes of messages from the spill file", length);
+		}
+		if (ftruncate(outbox.spillFd, 0) != 0) {
+			logMessage(LOG_ERR, "setOutboxOnline: could not truncate the spill file: %s", strerror(errno));
+		}
+		outbox.spillLength = 0;
+	}
+	outbox.offline = 0;
+	pthread_mutex_unlock(&outbox.lock);
+
+	flushOutbox();
+}
+
+/**
+ * \brief Disconnects the local client and frees its slot (libevent thread only).
+ */
+void closeLocalClient(struct m_local_client *client) {
+	logMessage(LOG_INFO, "local client %ld disconnected", (long) (client - local.clients));
+
+	event_del(&client->evRead);
+	close(client->fd);
+	client->fd = -1;
+	client->generation++;
+	client->subscriptionCount = 0;
+	atomic_fetch_sub_explicit(&local.clientCount, 1, memory_order_relaxed);
+}
+
+/**
+ * \brief Sends one datagram to the local client without blocking, it is dropped if the socket buffer
+ * of the client is full (libevent thread only).
+ */
+void sendLocal(struct m_local_client *client, const char *data, size_t length) {
+	if (send(client->fd, data, length, MSG_DONTWAIT | MSG_NOSIGNAL) != -1) {
+		local.sent++;
+	} else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+		local.dropped++;
+	} else {
+		logMessage(LOG_WARNING, "sendLocal: could not send to local client %ld: %s",
+				(long) (client - local.clients), strerror(errno));
+		closeLocalClient(client);
+	}
+}
+
+/**
+ * \brief Delivers the messages queued for the local clients, each one as "<topic> <payload>"
+ * datagram. Must only be called by the libevent thread.
+ */
+void flushLocal() {
+	struct m_buffer *flushing = &local.flushing;
+
+	pthread_mutex_lock(&outbox.lock);
+	struct m_buffer swap = local.pending;
+	local.pending = *flushing;
+	*flushing = swap;
+	pthread_mutex_unlock(&outbox.lock);
+
+	size_t offset = 0;
+	while (offset < flushing->length) {
+		size_t frameLength, topicLength;
+		memcpy(&frameLength, flushing->data + offset, sizeof(frameLength));
+		memcpy(&topicLength, flushing->data + offset + sizeof(frameLength), sizeof(topicLength));
+		char *topic = flushing->data + offset + sizeof(frameLength) + sizeof(topicLength);
+		size_t datagramLength = frameLength - sizeof(topicLength);
+		offset += sizeof(frameLength) + frameLength;
+
+		if (topic[0] == LOCAL_TOPIC_PREFIX) {
+			// "@<slot>.<generation>:<topic>", a response for the client which sent the request
+			char *end;
+			unsigned long slot = strtoul(topic + 1, &end, 10);
+			unsigned long generation = strtoul(end + 1, &end, 10);
+			if (slot >= LOCAL_MAX_CLIENTS || *end != ':') {
+				continue;
+			}
+			struct m_local_client *client = &local.clients[slot];
+			if (client->fd != -1 && client->generation == generation) {
+				sendLocal(client, end + 1, datagramLength - (end + 1 - topic));
+			}
+			continue;
+		}
+
+		for (unsigned int i = 0; i < LOCAL_MAX_CLIENTS; i++) {
+			struct m_local_client *client = &local.clients[i];
+			for (unsigned int j = 0; client->fd != -1 && j < client->subscriptionCount; j++) {
+				if (strlen(client->subscriptions[j]) == topicLength && memcmp(client->subscriptions[j], topic, topicLength) == 0) {
+					sendLocal(client, topic, datagramLength);
+					break;
+				}
+			}
+		}
+	}
+	flushing->length = 0;
+}
+
+/**
+ * \brief Callback function for libEvent triggered by a worker thread which has put messages
+ * into the outbox.
+ */
+void cbOnOutboxEvent(int fd, short event, void *privdata) {
+	char buffer[64];
+	while(read(fd, buffer, sizeof(buffer)) > 0) {
+		// just drain the wakeup pipe
+	}
+
+	flushLocal();
+	flushOutbox();
+}
+
+/**
+ * \brief Helper function to publish a message to the "payout-event" topic.
+ */
+int publishPayoutEvent(char *format, ...) {
+	va_list varags;
+	va_start(varags, format);
+	int rc = publishFormatted("payout-event", format, varags);
+	va_end(varags);
+
+	return rc;
+}
+
+/**
+ * \brief Helper function to publish a message to the event topic of the device (ex. "hopper-event").
+ */
+int publishDeviceEvent(struct m_device *device, char *format, ...) {
+	va_list varags;
+	va_start(varags, format);
+	int rc;
+	if (device->batchingEvents) {
+		// published by mcSspPollDevice() as one array once the whole poll response has been dispatched
+		rc = (device->events.length > 1 && bufferAppend(&device->events, ",", 1))
+				|| bufferVPrintf(&device->events, format, varags);
+	} else {
+		rc = publishFormatted(device->eventTopic, format, varags);
+	}
+	va_end(varags);
+
+	return rc;
+}
+
+/**
+ * \brief Helper function to publish a message to the given topic.
+ * \details Details only to get graph.
+ * \callergraph
+ */
+int replyWith(char *topic, char *format, ...) {
+	va_list varags;
+	va_start(varags, format);
+	int rc = publishFormatted(topic, format, varags);
+	va_end(varags);
+
+	return rc;
+}
+
+/**
+ * \brief Helper function to publish an error reply to the given topic, marks a captured
+ * batch step as failed (replyCapture).
+ * \details Details only to get graph.
+ * \callergraph
+ */
+int replyWithError(char *topic, char *format, ...) {
+	if(replyCapture && strcmp(topic, replyCapture->topic) == 0) {
+		replyCapture->error = 1;
+	}
+
+	va_list varags;
+	va_start(varags, format);
+	int rc = publishFormatted(topic, format, varags);
+	va_end(varags);
+
+	return rc;
+}
+
+/**
+ * \brief Helper function to publish a reply to a message which was missing a
+ * mandatory property (or the property was of the wrong type).
+ * \details Details only to get graph.
+ * \callergraph
+ */
+int replyWithPropertyError(struct m_command *cmd, char *name) {
+	char *msgId = "unknown";
+	if(cmd->msgId[0]) {
+		msgId = cmd->msgId;
+	}
+
+	char *correlId = "unknown";
+	if(cmd->correlId) {
+		correlId = cmd->correlId;
+	}
+
+	return replyWithError(cmd->responseTopic,
+			"{\"msgId\":\"%s\",\"correlId\":\"%s\",\"error\":\"Property '%s' missing or of wrong type\"}",
+			msgId,
+			correlId,
+			name);
+}
+
+/**
+ * \brief Helper function to publish a reply to a message which contains a human readable
+ * version of the SSP response.
+ * \details Details only to get graph.
+ * \callergraph
+ */
+int replyWithSspResponse(struct m_command *cmd, SSP_RESPONSE_ENUM response) {
+	if(response == SSP_RESPONSE_OK) {
+		return replyWith(cmd->responseTopic, "{\"msgId\":\"%s\",\"correlId\":\"%s\",\"result\":\"ok\"}",
+				cmd->msgId,
+				cmd->correlId);
+	} else {
+		char *errorMsg;
+
+		switch(response) {
+			case SSP_RESPONSE_UNKNOWN_COMMAND:
+				errorMsg = "unknown command";
+				break;
+			case SSP_RESPONSE_INCORRECT_PARAMETERS:
+				errorMsg = "incorrect parameters";
+				break;
+			case SSP_RESPONSE_INVALID_PARAMETER:
+				errorMsg = "invalid parameter";
+				break;
+			case SSP_RESPONSE_COMMAND_NOT_PROCESSED:
+				errorMsg = "command not processed";
+				break;
+			case SSP_RESPONSE_SOFTWARE_ERROR:
+				errorMsg = "software error";
+				break;
+			case SSP_RESPONSE_CHECKSUM_ERROR:
+				errorMsg = "checksum error";
+				break;
+			case SSP_RESPONSE_FAILURE:
+				errorMsg = "failure";
+				break;
+			case SSP_RESPONSE_HEADER_FAILURE:
+				errorMsg = "header failure";
+				break;
+			case SSP_RESPONSE_KEY_NOT_SET:
+				errorMsg = "key not set";
+				break;
+			case SSP_RESPONSE_TIMEOUT:
+				errorMsg = "timeout";
+				break;
+			default:
+				errorMsg = "unknown";
+		}
+
+		return replyWithError(cmd->responseTopic, "{\"msgId\":\"%s\",\"correlId\":\"%s\",\"sspError\":\"%s\"}",
+				cmd->msgId,
+				cmd->correlId,
+				errorMsg);
+	}
+}
+
+/**
+ * \brief Publishes the response of cmd once more for a duplicate which has been coalesced into it,
+ * with the msgId and correlId of the duplicate instead of the ones of cmd.
+ */
+int replyCoalesced(struct m_command *cmd, struct m_command *duplicate, const char *reply, size_t length) {
+	const char *keys[] = { "\"msgId\":\"", "\"correlId\":\"" };
+	const char *from[] = { cmd->msgId, cmd->correlId };
+	const char *to[] = { duplicate->msgId, duplicate->correlId };
+	struct m_buffer *buffer = &duplicate->device->reply;
+	const char *end = reply + length;
+	const char *copied = reply;
+
+	bufferReset(buffer);
+	for(const char *p = reply; p < end; p++) {
+		for(unsigned int i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+			size_t keyLength = strlen(keys[i]);
+			size_t fromLength = strlen(from[i]);
+			if((size_t) (end - p) > keyLength + fromLength
+					&& memcmp(p, keys[i], keyLength) == 0
+					&& memcmp(p + keyLength, from[i], fromLength) == 0
+					&& p[keyLength + fromLength] == '"') {
+				bufferAppend(buffer, copied, p + keyLength - copied);
+				bufferAppend(buffer, to[i], strlen(to[i]));
+				p += keyLength + fromLength;
+				copied = p;
+				break;
+			}
+		}
+	}
+	bufferAppend(buffer, copied, end - copied);
+
+	if(buffer->failed) {
+		logMessage(LOG_ERR, "replyCoalesced: out of memory\n");
+		return replyWithError(duplicate->responseTopic, "{\"correlId\":\"%s\",\"error\":\"out of memory\"}",
+				duplicate->correlId);
+	}
+	return publishMessage(duplicate->responseTopic, buffer->data, buffer->length);
+}
+
+/**
+ * \brief Handles the JSON "metrics" command.
+ */
+void handleMetrics(struct m_command *cmd) {
+	static struct m_buffer buffer = { NULL, 0, 0, 0 };
+	bufferReset(&buffer);
+	buildMetrics(cmd->device->metacash, &buffer);
+
+	if(buffer.failed) {
+		replyWithError(cmd->responseTopic, "{\"correlId\":\"%s\",\"error\":\"out of memory\"}", cmd->correlId);
+	} else {
+		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"metrics\":%s}", cmd->correlId, buffer.data);
+	}
+}
+
+/**
+ * \brief Handles the JSON "quit" command.
+ */
+void handleQuit(struct m_command *cmd) {
+	receivedSignal = 1;
+	replyWithSspResponse(cmd, SSP_RESPONSE_OK); // :D
+}
+
+/**
+ * \brief Handles the JSON "empty" command.
+ */
+void handleEmpty(struct m_command *cmd) {
+	SSP_RESPONSE_ENUM resp = mc_ssp_empty(&cmd->device->sspC);
+	if (resp == SSP_RESPONSE_OK) {
+		mcSspStartTransaction(cmd->device, cmd->correlId);
+	}
+	replyWithSspResponse(cmd, resp);
+}
+
+/**
+ * \brief Handles the JSON "smart-empty" command.
+ */
+void handleSmartEmpty(struct m_command *cmd) {
+	SSP_RESPONSE_ENUM resp = mc_ssp_smart_empty(&cmd->device->sspC);
+	if (resp == SSP_RESPONSE_OK) {
+		mcSspStartTransaction(cmd->device, cmd->correlId);
+	}
+	replyWithSspResponse(cmd, resp);
+}
+
+/**
+ * \brief Handles the JSON "do-payout" and "test-payout" commands.
+ */
+void handlePayout(struct m_command *cmd) {
+	int payoutOption = 0;
+
+	if (isCommand(cmd, "do-payout")) {
+		payoutOption = SSP6_OPTION_BYTE_DO;
+	} else {
+		payoutOption = SSP6_OPTION_BYTE_TEST;
+	}
+
+	long long amount;
+	if(cmdGetInteger(cmd, "amount", &amount)) {
+		replyWithPropertyError(cmd, "amount");
+		return;
+	}
+
+	SSP_RESPONSE_ENUM resp = ssp6_payout(&cmd->device->sspC, amount, CURRENCY,
+			payoutOption);
+
+	if (resp == SSP_RESPONSE_OK && payoutOption == SSP6_OPTION_BYTE_DO) {
+		mcSspStartTransaction(cmd->device, cmd->correlId);
+	}
+
+	if (resp == SSP_RESPONSE_COMMAND_NOT_PROCESSED) {
+		char *error = NULL;
+		switch (cmd->device->sspC.ResponseData[1]) {
+		case 0x01:
+			error = "not enough value in smart payout";
+			break;
+		case 0x02:
+			error = "can't pay exact amount";
+			break;
+		case 0x03:
+			error = "smart payout busy";
+			break;
+		case 0x04:
+			error = "smart payout disabled";
+			break;
+		default:
+			error = "unknown";
+			break;
+		}
+
+		replyWithError(cmd->responseTopic, "{\"correlId\":\"%s\",\"error\":\"%s\"}", cmd->correlId, error);
+	} else {
+		replyWithSspResponse(cmd, resp);
+	}
+}
+
+/**
+ * \brief Handles the JSON "do-float" and "test-float" commands.
+ */
+void handleFloat(struct m_command *cmd) {
+	// basically a copy of do/test-payout ...
+	int payoutOption = 0;
+
+	if (isCommand(cmd, "do-float")) {
+		payoutOption = SSP6_OPTION_BYTE_DO;
+	} else {
+		payoutOption = SSP6_OPTION_BYTE_TEST;
+	}
+
+	long long amount;
+	if(cmdGetInteger(cmd, "amount", &amount)) {
+		replyWithPropertyError(cmd, "amount");
+		return;
+	}
+
+	SSP_RESPONSE_ENUM resp = mc_ssp_float(&cmd->device->sspC, amount, CURRENCY,
+			payoutOption);
+
+	if (resp == SSP_RESPONSE_OK && payoutOption == SSP6_OPTION_BYTE_DO) {
+		mcSspStartTransaction(cmd->device, cmd->correlId);
+	}
+
+	if (resp == SSP_RESPONSE_COMMAND_NOT_PROCESSED) {
+		char *error = NULL;
+		switch (cmd->device->sspC.ResponseData[1]) {
+		case 0x01:
+			error = "not enough value in smart payout";
+			break;
+		case 0x02:
+			error = "can't pay exact amount";
+			break;
+		case 0x03:
+			error = "smart payout busy";
+			break;
+		case 0x04:
+			error = "smart payout disabled";
+			break;
+		default:
+			error = "unknown";
+			break;
+		}
+		replyWithError(cmd->responseTopic, "{\"correlId\":\"%s\",\"error\":\"%s\"}",
+				cmd->correlId, error);
+	} else {
+		replyWithSspResponse(cmd, resp);
+	}
+}
+
+/**
+ * \brief Print inhibits debug output.
+ */
+void dbgDisplayInhibits(unsigned char inhibits) {
+	logMessage(LOG_DEBUG, "dbgDisplayInhibits: inhibits are: 0=%d 1=%d 2=%d 3=%d 4=%d 5=%d 6=%d 7=%d\n",
+			(inhibits >> 0) & 1,
+			(inhibits >> 1) & 1,
+			(inhibits >> 2) & 1,
+			(inhibits >> 3) & 1,
+			(inhibits >> 4) & 1,
+			(inhibits >> 5) & 1,
+			(inhibits >> 6) & 1,
+			(inhibits >> 7) & 1);
+}
+
+/**
+ * \brief Handles the JSON "enable-channels" command.
+ */
+void handleEnableChannels(struct m_command *cmd) {
+	const char *channels;
+	if(cmdGetString(cmd, "channels", &channels)) {
+		replyWithPropertyError(cmd, "channels");
+		return;
+	}
+
+	// this will be updated and written back to the device state
+	// if the update succeeds
+	unsigned char currentChannelInhibits = cmd->device->channelInhibits;
+	unsigned char highChannels = 0xFF; // actually not in use
+
+	// 8 channels for now, set the bit to 1 for each requested channel
+	if(strstr(channels, "1") != NULL) {
+		currentChannelInhibits |= 1 << 0;
+	}
+	if(strstr(channels, "2") != NULL) {
+		currentChannelInhibits |= 1 << 1;
+	}
+	if(strstr(channels, "3") != NULL) {
+		currentChannelInhibits |= 1 << 2;
+	}
+	if(strstr(channels, "4") != NULL) {
+		currentChannelInhibits |= 1 << 3;
+	}
+	if(strstr(channels, "5") != NULL) {
+		currentChannelInhibits |= 1 << 4;
+	}
+	if(strstr(channels, "6") != NULL) {
+		currentChannelInhibits |= 1 << 5;
+	}
+	if(strstr(channels, "7") != NULL) {
+		currentChannelInhibits |= 1 << 6;
+	}
+	if(strstr(channels, "8") != NULL) {
+		currentChannelInhibits |= 1 << 7;
+	}
+
+	SSP_RESPONSE_ENUM resp = ssp6_set_inhibits(&cmd->device->sspC, currentChannelInhibits, highChannels);
+
+	if(resp == SSP_RESPONSE_OK) {
+		// okay, update the channelInhibits in the device structure with the new state
+		cmd->device->channelInhibits = currentChannelInhibits;
+
+		if(0) {
+			logMessage(LOG_DEBUG, "enable-channels:\n");
+			dbgDisplayInhibits(currentChannelInhibits);
+		}
+	}
+
+	replyWithSspResponse(cmd, resp);
+}
+
+/**
+ * \brief Handles the JSON "disable-channels" command.
+ */
+void handleDisableChannels(struct m_command *cmd) {
+	const char *channels;
+	if(cmdGetString(cmd, "channels", &channels)) {
+		replyWithPropertyError(cmd, "channels");
+		return;
+	}
+
+	// this will be updated and written back to the device state
+	// if the update succeeds
+	unsigned char currentChannelInhibits = cmd->device->channelInhibits;
+	unsigned char highChannels = 0xFF; // actually not in use
+
+	// 8 channels for now, set the bit to 0 for each requested channel
+	if(strstr(channels, "1") != NULL) {
+		currentChannelInhibits &= ~(1 << 0);
+	}
+	if(strstr(channels, "2") != NULL) {
+		currentChannelInhibits &= ~(1 << 1);
+	}
+	if(strstr(channels, "3") != NULL) {
+		currentChannelInhibits &= ~(1 << 2);
+	}
+	if(strstr(channels, "4") != NULL) {
+		currentChannelInhibits &= ~(1 << 3);
+	}
+	if(strstr(channels, "5") != NULL) {
+		currentChannelInhibits &= ~(1 << 4);
+	}
+	if(strstr(channels, "6") != NULL) {
+		currentChannelInhibits &= ~(1 << 5);
+	}
+	if(strstr(channels, "7") != NULL) {
+		currentChannelInhibits &= ~(1 << 6);
+	}
+	if(strstr(channels, "8") != NULL) {
+		currentChannelInhibits &= ~(1 << 7);
+	}
+
+	SSP_RESPONSE_ENUM resp = ssp6_set_inhibits(&cmd->device->sspC, currentChannelInhibits, highChannels);
+
+	if(resp == SSP_RESPONSE_OK) {
+		// okay, update the channelInhibits in the device structure with the new state
+		cmd->device->channelInhibits = currentChannelInhibits;
+
+		if(0) {
+			logMessage(LOG_DEBUG, "disable-channels:\n");
+			dbgDisplayInhibits(currentChannelInhibits);
+		}
+	}
+
+	replyWithSspResponse(cmd, resp);
+}
+
+/**
+ * \brief Handles the JSON "inhibit-channels" command.
+ */
+void handleInhibitChannels(struct m_command *cmd) {
+	const char *channels;
+	if(cmdGetString(cmd, "channels", &channels)) {
+		replyWithPropertyError(cmd, "channels");
+		return;
+	}
+
+	unsigned char lowChannels = 0xFF;
+	unsigned char highChannels = 0xFF;
+
+	// 8 channels for now
+	if(strstr(channels, "1") != NULL) {
+		lowChannels &= ~(1 << 0);
+	}
+	if(strstr(channels, "2") != NULL) {
+		lowChannels &= ~(1 << 1);
+	}
+	if(strstr(channels, "3") != NULL) {
+		lowChannels &= ~(1 << 2);
+	}
+	if(strstr(channels, "4") != NULL) {
+		lowChannels &= ~(1 << 3);
+	}
+	if(strstr(channels, "5") != NULL) {
+		lowChannels &= ~(1 << 4);
+	}
+	if(strstr(channels, "6") != NULL) {
+		lowChannels &= ~(1 << 5);
+	}
+	if(strstr(channels, "7") != NULL) {
+		lowChannels &= ~(1 << 6);
+	}
+	if(strstr(channels, "8") != NULL) {
+		lowChannels &= ~(1 << 7);
+	}
+
+	replyWithSspResponse(cmd, ssp6_set_inhibits(&cmd->device->sspC, lowChannels, highChannels));
+}
+
+/**
+ * \brief Handles the JSON "enable" command.
+ */
+void handleEnable(struct m_command *cmd) {
+	SSP_RESPONSE_ENUM resp = ssp6_enable(&cmd->device->sspC);
+	if (resp == SSP_RESPONSE_OK) {
+		cacheStatus(cmd->device, &cmd->device->state.disabled, 0);
+	}
+	replyWithSspResponse(cmd, resp);
+}
+
+/**
+ * \brief Handles the JSON "disable" command.
+ */
+void handleDisable(struct m_command *cmd) {
+	SSP_RESPONSE_ENUM resp = ssp6_disable(&cmd->device->sspC);
+	if (resp == SSP_RESPONSE_OK) {
+		cacheStatus(cmd->device, &cmd->device->state.disabled, 1);
+	}
+	replyWithSspResponse(cmd, resp);
+}
+
+/**
+ * \brief Handles the JSON "set-denomination-levels" command.
+ */
+void handleSetDenominationLevels(struct m_command *cmd) {
+	long long level;
+	if(cmdGetInteger(cmd, "level", &level)) {
+		replyWithPropertyError(cmd, "level");
+		return;
+	}
+
+	long long amount;
+	if(cmdGetInteger(cmd, "amount", &amount)) {
+		replyWithPropertyError(cmd, "amount");
+		return;
+	}
+
+	if(level > 0) {
+		/* Quote from the spec -.-
+		 *
+		 * A command to increment the level of coins of a denomination stored in the hopper.
+		 * The command is formatted with the command byte first, amount of coins to *add*
+		 * as a 2-byte little endian, the value of coin as 2-byte little endian and
+		 * (if using protocol version 6) the country code of the coin as 3 byte ASCII. The level of coins for a
+		 * denomination can be set to zero by sending a zero level for that value.
+		 *
+		 * In a nutshell: This command behaves only with a level of 0 as expected (setting the absolute value),
+		 * otherwise it works like the not existing "increment denomination level" command.
+		 */
+
+		// ignore the result for now. we could not do much anyway now.
+		mc_ssp_set_denomination_level(&cmd->device->sspC, amount, 0, CURRENCY);
+	}
+
+	replyWithSspResponse(cmd, mc_ssp_set_denomination_level(&cmd->device->sspC, amount, level, CURRENCY));
+}
+
+/**
+ * \brief Handles the JSON "set-cashbox-payout-limit" command.
+ */
+void handleSetCashboxPayoutLimit(struct m_command *cmd) {
+	long long level;
+	if(cmdGetInteger(cmd, "level", &level)) {
+		replyWithPropertyError(cmd, "level");
+		return;
+	}
+
+	long long amount;
+	if(cmdGetInteger(cmd, "amount", &amount)) {
+		replyWithPropertyError(cmd, "amount");
+		return;
+	}
+
+	SSP_RESPONSE_ENUM resp = mc_ssp_set_cashbox_payout_limit(&cmd->device->sspC, level, amount, CURRENCY);
+
+	if(resp == SSP_RESPONSE_OK) {
+		// remembered for the payout planner
+		struct m_device_state *state = &cmd->device->state;
+		pthread_mutex_lock(&state->lock);
+		unsigned int i;
+		for(i = 0; i < state->cashboxLimitCount && state->cashboxLimits[i].value != amount; i++)
+			;
+		if(i < PLAN_MAX_DENOMINATIONS) {
+			state->cashboxLimits[i] = (struct m_denomination) { amount, level };
+			if(i == state->cashboxLimitCount) {
+				state->cashboxLimitCount++;
+			}
+		}
+		pthread_mutex_unlock(&state->lock);
+	}
+
+	replyWithSspResponse(cmd, resp);
+}
+
+/**
+ * \brief Checks if the message asks us to bypass the state cache ("fresh":true).
+ */
+int wantsFresh(struct m_command *cmd) {
+	return cmdIsTrue(cmd, "fresh");
+}
+
+/**
+ * \brief Checks if data read from the device at the given time may still be used.
+ */
+int isCacheValid(unsigned long long at, unsigned long maxAge, unsigned long long now) {
+	return at != 0 && (maxAge == 0 || now - at <= maxAge);
+}
+
+/**
+ * \brief Stores the JSON array content of a levels response in the state cache.
+ */
+void cacheLevels(struct m_device *device, struct m_buffer *cache, unsigned long long *at,
+		const char *levels, size_t length) {
+	struct m_device_state *state = &device->state;
+
+	pthread_mutex_lock(&state->lock);
+	bufferReset(cache);
+	if(bufferAppend(cache, levels, length) == 0) {
+		*at = monotonicMs();
+	} else {
+		*at = 0;
+	}
+	pthread_mutex_unlock(&state->lock);
+}
+
+/**
+ * \brief Replies with cached levels if they aren't too old. Returns !=0 if it has replied.
+ */
+int replyWithCachedLevels(struct m_command *cmd, struct m_buffer *cache, unsigned long long *at) {
+	struct m_device_state *state = &cmd->device->state;
+	unsigned long long now = monotonicMs();
+	int replied = 0;
+
+	if(wantsFresh(cmd)) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&state->lock);
+	if(isCacheValid(*at, cmd->device->metacash->cacheMaxAge, now)) {
+		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"levels\":[%s],\"cached\":true,\"age_ms\":%llu}",
+				cmd->correlId, cache->data, now - *at);
+		replied = 1;
+	}
+	pthread_mutex_unlock(&state->lock);
+
+	return replied;
+}
+
+/**
+ * \brief Replies with a cached version. Returns !=0 if it has replied.
+ */
+int replyWithCachedVersion(struct m_command *cmd, const char *version, unsigned long long *at) {
+	struct m_device_state *state = &cmd->device->state;
+	int replied = 0;
+
+	if(wantsFresh(cmd)) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&state->lock);
+	if(*at != 0) {
+		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"version\":\"%s\",\"cached\":true,\"age_ms\":%llu}",
+				cmd->correlId, version, monotonicMs() - *at);
+		replied = 1;
+	}
+	pthread_mutex_unlock(&state->lock);
+
+	return replied;
+}
+
+/**
+ * \brief Stores a version read from the device in the state cache.
+ */
+void cacheVersion(struct m_device *device, char *cache, unsigned long long *at, const char *version) {
+	struct m_device_state *state = &device->state;
+
+	pthread_mutex_lock(&state->lock);
+	snprintf(cache, sizeof(state->firmwareVersion), "%s", version);
+	*at = monotonicMs();
+	pthread_mutex_unlock(&state->lock);
+}
+
+/**
+ * \brief Stores whether the device is disabled / busy in the state cache.
+ */
+void cacheStatus(struct m_device *device, int *status, int value) {
+	pthread_mutex_lock(&device->state.lock);
+	*status = value;
+	pthread_mutex_unlock(&device->state.lock);
+}
+
+/**
+ * \brief Forgets the cached levels of the device, called if they have (probably) changed.
+ */
+void invalidateLevels(struct m_device *device) {
+	pthread_mutex_lock(&device->state.lock);
+	device->state.levelsAt = 0;
+	device->state.cashboxDataAt = 0;
+	pthread_mutex_unlock(&device->state.lock);
+}
+
+/**
+ * \brief Answers the JSON "get-all-levels" command from the state cache.
+ */
+int cachedGetAllLevels(struct m_command *cmd) {
+	return replyWithCachedLevels(cmd, &cmd->device->state.levels, &cmd->device->state.levelsAt);
+}
+
+/**
+ * \brief Answers the JSON "cashbox-payout-operation-data" command from the state cache.
+ */
+int cachedCashboxPayoutOperationData(struct m_command *cmd) {
+	return replyWithCachedLevels(cmd, &cmd->device->state.cashboxData, &cmd->device->state.cashboxDataAt);
+}
+
+/**
+ * \brief Answers the JSON "get-firmware-version" command from the state cache.
+ */
+int cachedGetFirmwareVersion(struct m_command *cmd) {
+	return replyWithCachedVersion(cmd, cmd->device->state.firmwareVersion, &cmd->device->state.firmwareVersionAt);
+}
+
+/**
+ * \brief Answers the JSON "get-dataset-version" command from the state cache.
+ */
+int cachedGetDatasetVersion(struct m_command *cmd) {
+	return replyWithCachedVersion(cmd, cmd->device->state.datasetVersion, &cmd->device->state.datasetVersionAt);
+}
+
+/**
+ * \brief Structure which holds the state of a search of the payout planner.
+ */
+struct m_plan {
+	/** \brief The denominations available for paying, by descending value (level is what may be used) */
+	struct m_denomination denominations[PLAN_MAX_DENOMINATIONS];
+	/** \brief Number of used entries in denominations */
+	unsigned int count;
+	/** \brief Total value of denominations[i..count - 1] */
+	unsigned long long remainingValue[PLAN_MAX_DENOMINATIONS + 1];
+	/** \brief Number of coins / notes of each denomination paid by the split found */
+	unsigned int use[PLAN_MAX_DENOMINATIONS];
+	/** \brief Steps searched so far, bounded by PLAN_MAX_STEPS */
+	unsigned long steps;
+	/** \brief (amount << 5 | denomination) + 1 of amounts known to be unpayable from a denomination on, 0 if unused */
+	unsigned long long deadEnds[PLAN_MEMO_SIZE];
+};
+
+/**
+ * \brief Checks (and with insert !=0 remembers) if the amount can't be paid with the denominations from i on.
+ */
+int planDeadEnd(struct m_plan *plan, unsigned int i, unsigned long long amount, int insert) {
+	unsigned long long key = (amount << 5 | i) + 1;
+	unsigned long slot = (unsigned long) ((key * 0x9E3779B97F4A7C15ULL) >> 32) & (PLAN_MEMO_SIZE - 1);
+
+	for(unsigned int probe = 0; probe < 8; probe++, slot = (slot + 1) & (PLAN_MEMO_SIZE - 1)) {
+		if(plan->deadEnds[slot] == key) {
+			return 1;
+		}
+		if(plan->deadEnds[slot] == 0) {
+			if(insert) {
+				plan->deadEnds[slot] = key;
+			}
+			return 0;
+		}
+	}
+	return 0; // too crowded to remember
+}
+
+/**
+ * \brief Searches the split of the amount with the most of the highest denominations, like the devices do.
+ * Returns 1 if it found one (in plan->use), 0 if the amount can't be paid and -1 if it gave up.
+ */
+int planSearch(struct m_plan *plan, unsigned int i, unsigned long long amount) {
+	if(amount == 0) {
+		return 1;
+	}
+	if(i == plan->count || amount > plan->remainingValue[i]) {
+		return 0;
+	}
+	if(++plan->steps > PLAN_MAX_STEPS) {
+		return -1;
+	}
+	if(planDeadEnd(plan, i, amount, 0)) {
+		return 0;
+	}
+
+	struct m_denomination *denomination = &plan->denominations[i];
+	unsigned long long n = amount / denomination->value;
+	if(n > denomination->level) {
+		n = denomination->level;
+	}
+	for(;; n--) {
+		plan->use[i] = n;
+		int rc = planSearch(plan, i + 1, amount - n * denomination->value);
+		if(rc != 0) {
+			return rc;
+		}
+		if(n == 0) {
+			break;
+		}
+	}
+
+	planDeadEnd(plan, i, amount, 1);
+	return 0;
+}
+
+/**
+ * \brief Answers "test-payout" (isFloat == 0) or "test-float" from the cached levels, without
+ * asking the device. Returns !=0 if it has replied.
+ * \details A float keeps amount in the payout and moves the rest to the cashbox, so it is planned as paying
+ * out the rest. Coins up to the cashbox payout limit of their denomination are kept back. If the levels
+ * aren't cached, the device is disabled or busy with a payout, float or empty, the search gives up,
+ * or "verify":true / "fresh":true is given, the device answers.
+ */
+int replyWithPlan(struct m_command *cmd, int isFloat) {
+	struct m_device_state *state = &cmd->device->state;
+	long long amount;
+
+	if(wantsFresh(cmd) || cmdIsTrue(cmd, "verify") || cmdGetInteger(cmd, "amount", &amount) || amount <= 0) {
+		return 0;
+	}
+
+	struct m_plan *plan = calloc(1, sizeof(struct m_plan));
+	if(plan == NULL) {
+		return 0;
+	}
+
+	// take a snapshot of the levels, the poll events invalidate them as soon as a device pays
+	pthread_mutex_lock(&state->lock);
+	// only the device itself knows what it would refuse while disabled or busy
+	int valid = ! state->disabled && ! state->transactionRunning && state->transactionsQueued == 0
+			&& isCacheValid(state->levelsAt, cmd->device->metacash->cacheMaxAge, monotonicMs());
+	const char *p = valid ? state->levels.data : NULL;
+	unsigned int value, level;
+	char cc[4];
+	while(plan->count < PLAN_MAX_DENOMINATIONS && scanLevel(&p, &value, &level, cc)) {
+		for(unsigned int i = 0; i < state->cashboxLimitCount; i++) {
+			if(state->cashboxLimits[i].value == value) {
+				level = level > state->cashboxLimits[i].level ? level - state->cashboxLimits[i].level : 0;
+			}
+		}
+		if(value != 0 && level != 0 && strcmp(cc, CURRENCY) == 0) {
+			// insertion sort, by descending value
+			unsigned int j;
+			for(j = plan->count; j > 0 && plan->denominations[j - 1].value < value; j--) {
+				plan->denominations[j] = plan->denominations[j - 1];
+			}
+			plan->denominations[j] = (struct m_denomination) { value, level };
+			plan->count++;
+		}
+	}
+	pthread_mutex_unlock(&state->lock);
+
+	if(! valid) {
+		free(plan);
+		return 0;
+	}
+
+	plan->remainingValue[plan->count] = 0;
+	for(unsigned int i = plan->count; i > 0; i--) {
+		plan->remainingValue[i - 1] = plan->remainingValue[i]
+				+ (unsigned long long) plan->denominations[i - 1].value * plan->denominations[i - 1].level;
+	}
+
+	unsigned long long total = plan->remainingValue[0];
+	unsigned long long target = amount;
+	int rc = 0;
+	if(isFloat) {
+		rc = target <= total ? planSearch(plan, 0, total - target) : 0;
+	} else if(target <= total) {
+		rc = planSearch(plan, 0, target);
+	}
+
+	if(rc < 0) {
+		logMessage(LOG_INFO, "no plan for cmd='%s' amount=%lld after %lu steps, asking the device\n",
+				cmd->command, amount, plan->steps);
+		free(plan);
+		return 0;
+	}
+
+	if(target > total) {
+		replyWithError(cmd->responseTopic, "{\"correlId\":\"%s\",\"error\":\"not enough value in smart payout\",\"planned\":true}",
+				cmd->correlId);
+	} else if(rc == 0) {
+		replyWithError(cmd->responseTopic, "{\"correlId\":\"%s\",\"error\":\"can't pay exact amount\",\"planned\":true}",
+				cmd->correlId);
+	} else {
+		// with a float the split is what goes to the cashbox
+		struct m_buffer reply = { NULL, 0, 0, 0 };
+		bufferPrintf(&reply, "{\"msgId\":\"%s\",\"correlId\":\"%s\",\"result\":\"ok\",\"planned\":true,\"split\":[",
+				cmd->msgId, cmd->correlId);
+		int first = 1;
+		for(unsigned int i = 0; i < plan->count; i++) {
+			if(plan->use[i]) {
+				bufferPrintf(&reply, "%s{\"value\":%u,\"count\":%u}", first ? "" : ",",
+						plan->denominations[i].value, plan->use[i]);
+				first = 0;
+			}
+		}
+		bufferAppend(&reply, "]}", 2);
+		if(reply.failed) {
+			replyWithError(cmd->responseTopic, "{\"correlId\":\"%s\",\"error\":\"out of memory\"}", cmd->correlId);
+		} else {
+			publishMessage(cmd->responseTopic, reply.data, reply.length);
+		}
+		bufferFree(&reply);
+	}
+
+	free(plan);
+	return 1;
+}
+
+/**
+ * \brief Answers the JSON "test-payout" command with the payout planner.
+ */
+int cachedTestPayout(struct m_command *cmd) {
+	return replyWithPlan(cmd, 0);
+}
+
+/**
+ * \brief Answers the JSON "test-float" command with the payout planner.
+ */
+int cachedTestFloat(struct m_command *cmd) {
+	return replyWithPlan(cmd, 1);
+}
+
+/**
+ * \brief Handles the JSON "get-all-levels" command.
+ */
+void handleGetAllLevels(struct m_command *cmd) {
+	struct m_buffer *reply = &cmd->device->reply;
+
+	// the levels are appended by mc_ssp_get_all_levels directly behind the response header
+	bufferReset(reply);
+	bufferPrintf(reply, "{\"correlId\":\"%s\",\"levels\":[", cmd->correlId);
+	size_t levelsStart = reply->length;
+
+	SSP_RESPONSE_ENUM resp = mc_ssp_get_all_levels(&cmd->device->sspC, reply);
+
+	if(resp == SSP_RESPONSE_OK) {
+		if(! reply->failed) {
+			cacheLevels(cmd->device, &cmd->device->state.levels, &cmd->device->state.levelsAt,
+					reply->data + levelsStart, reply->length - levelsStart);
+			journalLevels(cmd->device, reply->data + levelsStart);
+		}
+		bufferAppend(reply, "]}", 2);
+		if(reply->failed) {
+			logMessage(LOG_ERR, "handleGetAllLevels: out of memory\n");
+			replyWithError(cmd->responseTopic, "{\"correlId\":\"%s\",\"error\":\"out of memory\"}", cmd->correlId);
+		} else {
+			publishMessage(cmd->responseTopic, reply->data, reply->length);
+		}
+	} else {
+		replyWithSspResponse(cmd, resp);
+	}
+}
+
+/**
+ * \brief Handles the JSON "cashbox-payout-operation-data" command.
+ */
+void handleCashboxPayoutOperationData(struct m_command *cmd) {
+	struct m_buffer *reply = &cmd->device->reply;
+
+	// the levels are appended by mc_ssp_cashbox_payout_operation_data directly behind the response header
+	bufferReset(reply);
+	bufferPrintf(reply, "{\"correlId\":\"%s\",\"levels\":[", cmd->correlId);
+	size_t levelsStart = reply->length;
+
+	SSP_RESPONSE_ENUM resp = mc_ssp_cashbox_payout_operation_data(&cmd->device->sspC, reply);
+
+	if(resp == SSP_RESPONSE_OK) {
+		if(! reply->failed) {
+			cacheLevels(cmd->device, &cmd->device->state.cashboxData, &cmd->device->state.cashboxDataAt,
+					reply->data + levelsStart, reply->length - levelsStart);
+		}
+		bufferAppend(reply, "]}", 2);
+		if(reply->failed) {
+			logMessage(LOG_ERR, "handleCashboxPayoutOperationData: out of memory\n");
+			replyWithError(cmd->responseTopic, "{\"correlId\":\"%s\",\"error\":\"out of memory\"}", cmd->correlId);
+		} else {
+			publishMessage(cmd->responseTopic, reply->data, reply->length);
+		}
+	} else {
+		replyWithSspResponse(cmd, resp);
+	}
+}
+
+
+/**
+ * \brief Handles the JSON "get-firmware-version" command.
+ */
+void handleGetFirmwareVersion(struct m_command *cmd) {
+	char firmwareVersion[100] = { 0 };
+
+	SSP_RESPONSE_ENUM resp = mc_ssp_get_firmware_version(&cmd->device->sspC, &firmwareVersion[0]);
+
+	if(resp == SSP_RESPONSE_OK) {
+		cacheVersion(cmd->device, cmd->device->state.firmwareVersion, &cmd->device->state.firmwareVersionAt, firmwareVersion);
+		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"version\":\"%s\"}", cmd->correlId, firmwareVersion);
+	} else {
+		replyWithSspResponse(cmd, resp);
+	}
+}
+
+/**
+ * \brief Handles the JSON "get-dataset-version" command.
+ */
+void handleGetDatasetVersion(struct m_command *cmd) {
+	char datasetVersion[100] = { 0 };
+
+	SSP_RESPONSE_ENUM resp = mc_ssp_get_dataset_version(&cmd->device->sspC, &datasetVersion[0]);
+
+	if(resp == SSP_RESPONSE_OK) {
+		cacheVersion(cmd->device, cmd->device->state.datasetVersion, &cmd->device->state.datasetVersionAt, datasetVersion);
+		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"version\":\"%s\"}",
+				cmd->correlId, datasetVersion);
+	} else {
+		replyWithSspResponse(cmd, resp);
+	}
+}
+
+/**
+ * \brief Handles the JSON "last-reject-note" command.
+ */
+void handleLastRejectNote(struct m_command *cmd) {
+	unsigned char reasonCode;
+
+	SSP_RESPONSE_ENUM resp = mc_ssp_last_reject_note(&cmd->device->sspC, &reasonCode);
 
 	if (resp == SSP_RESPONSE_OK) {
 		char *reason = NULL;
 
-		switch (reasonCode) {
-		case 0x00: // Note accepted
-			reason = "note accepted";
+		switch (reasonCode) {
+		case 0x00: // Note accepted
+			reason = "note accepted";
+			break;
+		case 0x01: // Note length incorrect
+			reason = "note length incorrect";
+			break;
+		case 0x02: // Average fail
+			reason = "internal validation failure: average fail";
+			break;
+		case 0x03: // Coastline fail
+			reason = "internal validation failure: coastline fail";
+			break;
+		case 0x04: // Graph fail
+			reason = "internal validation failure: graph fail";
+			break;
+		case 0x05: // Buried fail
+			reason = "internal validation failure: buried fail";
+			break;
+		case 0x06: // Channel inhibited
+			reason = "channel inhibited";
+			break;
+		case 0x07: // Second note inserted
+			reason = "second note inserted";
+			break;
+		case 0x08: // Reject by host
+			reason = "reject by host";
+			break;
+		case 0x09: // Note recognised in more than one channel
+			reason = "note recognised in more than one channel";
+			break;
+		case 0x0A: // Reject reason 10
+			reason = "rear sensor error";
+			break;
+		case 0x0B: // Note too long
+			reason = "note too long";
+			break;
+		case 0x0C: // Disabled by host
+			reason = "disabled by host";
+			break;
+		case 0x0D: // Mechanism slow/stalled
+			reason = "mechanism slow/stalled";
+			break;
+		case 0x0E: // Strimming attempt detected
+			reason = "strimming attempt detected";
+			break;
+		case 0x0F: // Fraud channel reject
+			reason = "fraud channel reject";
+			break;
+		case 0x10: // No notes inserted
+			reason = "no notes inserted";
+			break;
+		case 0x11: // Peak detect fail
+			reason = "peak detect fail";
+			break;
+		case 0x12: // Twisted note detected
+			reason = "twisted note detected";
+			break;
+		case 0x13: // Escrow time-out
+			reason = "escrow time-out";
+			break;
+		case 0x14: // Bar code scan fail
+			reason = "bar code scan fail";
+			break;
+		case 0x15: // Rear sensor 2 fail
+			reason = "rear sensor 2 fail";
+			break;
+		case 0x16: // Slot fail 1
+			reason = "slot fail 1";
+			break;
+		case 0x17: // Slot fail 2
+			reason = "slot fail 2";
+			break;
+		case 0x18: // Lens over-sample
+			reason = "lens over-sample";
+			break;
+		case 0x19: // Width detect fail
+			reason = "width detect fail";
+			break;
+		case 0x1A: // Short note detected
+			reason = "short note detected";
+			break;
+		case 0x1B: // Note payout
+			reason = "note payout";
+			break;
+		case 0x1C: // Unable to stack note
+			reason = "unable to stack note";
+			break;
+		default: // not defined in API doc
+			reason = "undefined in API";
+			break;
+		}
+
+		replyWith(cmd->responseTopic,
+				"{\"correlId\":\"%s\",\"reason\":\"%s\",\"code\":%ld}",
+				cmd->correlId, reason, reasonCode);
+	} else {
+		replyWithSspResponse(cmd, resp);
+	}
+}
+
+/**
+ * \brief Handles the JSON "channel-security" command.
+ */
+void handleChannelSecurityData(struct m_command *cmd) {
+	mc_ssp_channel_security_data(&cmd->device->sspC);
+}
+
+/**
+ * \brief Handles the JSON "test" command
+ */
+void handleTest(struct m_command *cmd) {
+	replyWithSspResponse(cmd, SSP_RESPONSE_OK);
+}
+
+/**
+ * \brief Handles the JSON "configure-bezel" command.
+ */
+void handleConfigureBezel(struct m_command *cmd) {
+	long long r;
+	if(cmdGetInteger(cmd, "r", &r)) {
+		replyWithPropertyError(cmd, "r");
+		return;
+	}
+
+	long long g;
+	if(cmdGetInteger(cmd, "g", &g)) {
+		replyWithPropertyError(cmd, "g");
+		return;
+	}
+
+	long long b;
+	if(cmdGetInteger(cmd, "b", &b)) {
+		replyWithPropertyError(cmd, "b");
+		return;
+	}
+
+	long long type;
+	if(cmdGetInteger(cmd, "type", &type)) {
+		replyWithPropertyError(cmd, "type");
+		return;
+	}
+
+	replyWithSspResponse(cmd,
+			mc_ssp_configure_bezel(&cmd->device->sspC, r, g, b, SSP_OPTION_NON_VOLATILE, type));
+}
+
+/**
+ * \brief Structure which describes a running download, passed to cbOnDownloadProgress().
+ */
+struct m_download {
+	/** \brief The "download" command */
+	struct m_command *cmd;
+	/** \brief Percentage of the blocks published last, -1 if none yet */
+	int percent;
+	/** \brief Number of blocks of the file, known once the loader has been downloaded */
+	unsigned long blocks;
+};
+
+/**
+ * \brief Called by libitlssp after each block of a download (on the worker), publishes "download-progress"
+ * to the "payout-event" topic whenever another percent of the blocks has been downloaded.
+ */
+void cbOnDownloadProgress(const unsigned long block, const unsigned long blocks, void *arg) {
+	struct m_download *download = arg;
+	int percent = blocks ? (int) (block * 100 / blocks) : 100;
+	if (percent == download->percent) {
+		return;
+	}
+	download->percent = percent;
+	download->blocks = blocks;
+
+	struct m_device *device = download->cmd->device;
+	publishPayoutEvent("{\"event\":\"download-progress\",\"bus\":\"%s\",\"device\":\"%s\",\"correlId\":\"%s\","
+			"\"block\":%lu,\"blocks\":%lu,\"percent\":%d}",
+			device->bus->name, device->kind, download->cmd->correlId, block, blocks, percent);
+}
+
+/**
+ * \brief Describes the result of a download as returned by download_ssp_file().
+ */
+const char *downloadError(unsigned long result) {
+	switch (result) {
+	case OPEN_FILE_ERROR:
+		return "could not open file";
+	case READ_FILE_ERROR:
+		return "could not read file";
+	case NOT_ITL_FILE:
+		return "not an ITL file";
+	case PORT_OPEN_FAIL:
+		return "could not open port";
+	case SYNC_CONNECTION_FAIL:
+		return "no connection";
+	case SECURITY_PROTECTED_FILE:
+		return "security protected file";
+	case DATA_TRANSFER_FAIL:
+		return "data transfer failed";
+	case PROG_COMMAND_FAIL:
+		return "program command failed";
+	case HEADER_FAIL:
+		return "header failure";
+	case PROG_STATUS_FAIL:
+		return "program status failed";
+	case PROG_RESET_FAIL:
+		return "program reset failed";
+	case DOWNLOAD_NOT_ALLOWED:
+		return "download not allowed";
+	case HI_TRANSFER_SPEED_FAIL:
+		return "transfer speed not supported";
+	default:
+		return "unknown";
+	}
+}
+
+/**
+ * \brief Handles the JSON "download" command, downloads a firmware or dataset file ("file") to the device
+ * and sets it up again once it has restarted (or every SETUP_RETRY_INTERVAL ms until it is back).
+ * \details The other device of the bus waits for the download, the progress is published by cbOnDownloadProgress().
+ */
+void handleDownload(struct m_command *cmd) {
+	const char *file;
+	if (cmdGetString(cmd, "file", &file)) {
+		replyWithPropertyError(cmd, "file");
+		return;
+	}
+
+	struct m_device *device = cmd->device;
+	if (device->transactionUntil != 0) {
+		replyWithError(cmd->responseTopic, "{\"msgId\":\"%s\",\"correlId\":\"%s\",\"error\":\"transaction running\"}",
+				cmd->msgId, cmd->correlId);
+		return;
+	}
+
+	logMessage(LOG_NOTICE, "downloading '%s' to device '%s'", file, device->name);
+	struct m_download download = { cmd, -1, 0 };
+	unsigned long result = download_ssp_file(&device->sspC, file, device->key, cbOnDownloadProgress, &download);
+	if (result != DOWNLOAD_COMPLETE) {
+		logMessage(LOG_ERR, "download to device '%s' failed: %s (0x%lx)", device->name, downloadError(result), result);
+		replyWithError(cmd->responseTopic, "{\"msgId\":\"%s\",\"correlId\":\"%s\",\"error\":\"%s\"}",
+				cmd->msgId, cmd->correlId, downloadError(result));
+		return;
+	}
+	logMessage(LOG_NOTICE, "download to device '%s' finished, waiting for its restart", device->name);
+
+	// the device restarts with the new firmware / dataset at 9600 baud and without a key, nothing is cached anymore
+	pthread_mutex_lock(&device->jobLock);
+	device->sspDeviceAvailable = 0;
+	pthread_mutex_unlock(&device->jobLock);
+	invalidateLevels(device);
+	mcSspSetupCommand(&device->sspC, device->bus->index, device->id);
+
+	unsigned long long until = monotonicMs() + DOWNLOAD_RESTART_TIMEOUT;
+	int restarted;
+	while (! (restarted = mcSspProbeRestart(device)) && monotonicMs() < until) {
+		sleep(1);
+	}
+	if (restarted) {
+		mcSspSetupDevice(device);
+	} else {
+		logMessage(LOG_ERR, "device '%s' did not restart after the download, retrying its setup", device->name);
+	}
+
+	// don't give up on the device, its setup is queued again until it is available
+	pthread_mutex_lock(&device->jobLock);
+	if (! device->sspDeviceAvailable) {
+		device->setupRetry = 1;
+		device->nextPoll = monotonicMs() + SETUP_RETRY_INTERVAL;
+	}
+	pthread_mutex_unlock(&device->jobLock);
+
+	replyWith(cmd->responseTopic, "{\"msgId\":\"%s\",\"correlId\":\"%s\",\"result\":\"ok\",\"blocks\":%lu,\"restarted\":%s}",
+			cmd->msgId, cmd->correlId, download.blocks, restarted ? "true" : "false");
+}
+
+/** \brief Shortcut for the flags of a command which works on both devices */
+#define CMD_ANY_DEVICE (CMD_HOPPER | CMD_VALIDATOR)
+
+/**
+ * \brief All commands we understand, looked up via commandIndex.
+ */
+struct m_command_def commandDefs[] = {
+	{ .name = "quit", .handlerFn = handleQuit, .flags = CMD_ANY_DEVICE },
+	{ .name = "test", .handlerFn = handleTest, .flags = CMD_ANY_DEVICE },
+	{ .name = "metrics", .handlerFn = handleMetrics, .flags = CMD_ANY_DEVICE },
+	{ .name = "configure-bezel", .handlerFn = handleConfigureBezel, .flags = CMD_HARDWARE | CMD_MUTATING | CMD_VALIDATOR, .deadline = DEADLINE_CHANGE },
+	{ .name = "empty", .handlerFn = handleEmpty, .flags = CMD_HARDWARE | CMD_MUTATING | CMD_TRANSACTION | CMD_ANY_DEVICE, .deadline = DEADLINE_CHANGE },
+	{ .name = "smart-empty", .handlerFn = handleSmartEmpty, .flags = CMD_HARDWARE | CMD_MUTATING | CMD_TRANSACTION | CMD_ANY_DEVICE, .deadline = DEADLINE_CHANGE },
+	{ .name = "cashbox-payout-operation-data", .handlerFn = handleCashboxPayoutOperationData, .cachedFn = cachedCashboxPayoutOperationData, .flags = CMD_HARDWARE | CMD_COALESCE | CMD_ANY_DEVICE, .deadline = DEADLINE_READ },
+	{ .name = "set-cashbox-payout-limit", .handlerFn = handleSetCashboxPayoutLimit, .flags = CMD_HARDWARE | CMD_MUTATING | CMD_ANY_DEVICE, .deadline = DEADLINE_CHANGE },
+	{ .name = "enable", .handlerFn = handleEnable, .flags = CMD_HARDWARE | CMD_MUTATING | CMD_ANY_DEVICE, .deadline = DEADLINE_CHANGE },
+	{ .name = "disable", .handlerFn = handleDisable, .flags = CMD_HARDWARE | CMD_MUTATING | CMD_ANY_DEVICE, .deadline = DEADLINE_CHANGE },
+	{ .name = "enable-channels", .handlerFn = handleEnableChannels, .flags = CMD_HARDWARE | CMD_MUTATING | CMD_ANY_DEVICE, .deadline = DEADLINE_CHANGE },
+	{ .name = "disable-channels", .handlerFn = handleDisableChannels, .flags = CMD_HARDWARE | CMD_MUTATING | CMD_ANY_DEVICE, .deadline = DEADLINE_CHANGE },
+	{ .name = "inhibit-channels", .handlerFn = handleInhibitChannels, .flags = CMD_HARDWARE | CMD_MUTATING | CMD_ANY_DEVICE, .deadline = DEADLINE_CHANGE },
+	{ .name = "test-float", .handlerFn = handleFloat, .cachedFn = cachedTestFloat, .flags = CMD_HARDWARE | CMD_ANY_DEVICE, .deadline = DEADLINE_READ },
+	{ .name = "do-float", .handlerFn = handleFloat, .flags = CMD_HARDWARE | CMD_MUTATING | CMD_TRANSACTION | CMD_ANY_DEVICE, .deadline = DEADLINE_CHANGE },
+	{ .name = "test-payout", .handlerFn = handlePayout, .cachedFn = cachedTestPayout, .flags = CMD_HARDWARE | CMD_ANY_DEVICE, .deadline = DEADLINE_READ },
+	{ .name = "do-payout", .handlerFn = handlePayout, .flags = CMD_HARDWARE | CMD_MUTATING | CMD_TRANSACTION | CMD_ANY_DEVICE, .deadline = DEADLINE_CHANGE },
+	{ .name = "get-firmware-version", .handlerFn = handleGetFirmwareVersion, .cachedFn = cachedGetFirmwareVersion, .flags = CMD_HARDWARE | CMD_COALESCE | CMD_ANY_DEVICE, .deadline = DEADLINE_READ },
+	{ .name = "get-dataset-version", .handlerFn = handleGetDatasetVersion, .cachedFn = cachedGetDatasetVersion, .flags = CMD_HARDWARE | CMD_COALESCE | CMD_ANY_DEVICE, .deadline = DEADLINE_READ },
+	{ .name = "channel-security-data", .handlerFn = handleChannelSecurityData, .flags = CMD_HARDWARE | CMD_COALESCE | CMD_ANY_DEVICE, .deadline = DEADLINE_READ },
+	{ .name = "get-all-levels", .handlerFn = handleGetAllLevels, .cachedFn = cachedGetAllLevels, .flags = CMD_HARDWARE | CMD_COALESCE | CMD_ANY_DEVICE, .deadline = DEADLINE_READ },
+	{ .name = "set-denomination-level", .handlerFn = handleSetDenominationLevels, .flags = CMD_HARDWARE | CMD_MUTATING | CMD_ANY_DEVICE, .deadline = DEADLINE_CHANGE },
+	{ .name = "last-reject-note", .handlerFn = handleLastRejectNote, .flags = CMD_HARDWARE | CMD_COALESCE | CMD_VALIDATOR, .deadline = DEADLINE_READ },
+	{ .name = "download", .handlerFn = handleDownload, .flags = CMD_HARDWARE | CMD_MUTATING | CMD_ANY_DEVICE, .deadline = DEADLINE_CHANGE },
+	{ .name = "batch", .handlerFn = handleBatch, .flags = CMD_HARDWARE | CMD_MUTATING | CMD_ANY_DEVICE, .deadline = DEADLINE_CHANGE },
+};
+
+/** \brief Number of slots in commandIndex, must be a power of 2 and well above the number of commands */
+#define COMMAND_INDEX_SIZE 64
+
+/** \brief Open addressing hash table over commandDefs, filled by buildCommandIndex() */
+struct m_command_def *commandIndex[COMMAND_INDEX_SIZE];
+
+/**
+ * \brief FNV-1a hash of a command name.
+ */
+unsigned int hashCommand(const char *command) {
+	unsigned int hash = 2166136261u;
+	while (*command) {
+		hash ^= (unsigned char) *command++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/**
+ * \brief Fills commandIndex from commandDefs, called once at startup.
+ */
+void buildCommandIndex(void) {
+	memset(commandIndex, 0, sizeof(commandIndex));
+
+	for (size_t i = 0; i < sizeof(commandDefs) / sizeof(commandDefs[0]); i++) {
+		unsigned int slot = hashCommand(commandDefs[i].name) & (COMMAND_INDEX_SIZE - 1);
+		while (commandIndex[slot]) {
+			slot = (slot + 1) & (COMMAND_INDEX_SIZE - 1);
+		}
+		commandIndex[slot] = &commandDefs[i];
+	}
+}
+
+/**
+ * \brief Looks up the command in commandIndex, returns NULL for unknown commands.
+ */
+struct m_command_def *findCommand(const char *command) {
+	unsigned int slot = hashCommand(command) & (COMMAND_INDEX_SIZE - 1);
+	while (commandIndex[slot]) {
+		if (strcmp(commandIndex[slot]->name, command) == 0) {
+			return commandIndex[slot];
+		}
+		slot = (slot + 1) & (COMMAND_INDEX_SIZE - 1);
+	}
+	return NULL;
+}
+
+/**
+ * \brief Returns the slot of the entry for the msgId on the device, or the free slot it would take if there
+ * is none (requestCache.lock must be held).
+ */
+unsigned int requestCacheSlot(struct m_device *device, const char *msgId, unsigned int hash) {
+	unsigned int slot = hash & (REQUEST_CACHE_SLOTS - 1);
+	while (requestCache.slots[slot]) {
+		struct m_request_entry *entry = &requestCache.entries[requestCache.slots[slot] - 1];
+		if (entry->hash == hash && entry->device == device && strcmp(entry->msgId, msgId) == 0) {
+			break;
+		}
+		slot = (slot + 1) & (REQUEST_CACHE_SLOTS - 1);
+	}
+	return slot;
+}
+
+/**
+ * \brief Unlinks the entry from the LRU list (requestCache.lock must be held).
+ */
+void requestCacheUnlink(int index) {
+	struct m_request_entry *entry = &requestCache.entries[index];
+	if (entry->prev == -1) {
+		requestCache.head = entry->next;
+	} else {
+		requestCache.entries[entry->prev].next = entry->next;
+	}
+	if (entry->next == -1) {
+		requestCache.tail = entry->prev;
+	} else {
+		requestCache.entries[entry->next].prev = entry->prev;
+	}
+}
+
+/**
+ * \brief Makes the entry the most recently used one (requestCache.lock must be held).
+ */
+void requestCacheTouch(int index) {
+	struct m_request_entry *entry = &requestCache.entries[index];
+	if (requestCache.head == index) {
+		return;
+	}
+	if (entry->prev != -1 || entry->next != -1 || requestCache.tail == index) {
+		requestCacheUnlink(index);
+	}
+	entry->prev = -1;
+	entry->next = requestCache.head;
+	if (requestCache.head != -1) {
+		requestCache.entries[requestCache.head].prev = index;
+	}
+	requestCache.head = index;
+	if (requestCache.tail == -1) {
+		requestCache.tail = index;
+	}
+}
+
+/**
+ * \brief Frees the slot, the following entries of the probe sequence are moved up so lookups don't have to
+ * skip deleted slots (requestCache.lock must be held). The entry stays in the LRU list.
+ */
+void requestCacheRemoveSlot(unsigned int slot) {
+	unsigned int next = slot;
+	requestCache.slots[slot] = 0;
+	for (;;) {
+		next = (next + 1) & (REQUEST_CACHE_SLOTS - 1);
+		if (requestCache.slots[next] == 0) {
+			return;
+		}
+		unsigned int home = requestCache.entries[requestCache.slots[next] - 1].hash & (REQUEST_CACHE_SLOTS - 1);
+		// the entry may move up if its home slot isn't cyclically between the free slot and itself
+		if (((next - home) & (REQUEST_CACHE_SLOTS - 1)) >= ((next - slot) & (REQUEST_CACHE_SLOTS - 1))) {
+			requestCache.slots[slot] = requestCache.slots[next];
+			requestCache.slots[next] = 0;
+			slot = next;
+		}
+	}
+}
+
+/**
+ * \brief Returns a free entry for a new request, the least recently used answered one if all are used,
+ * -1 if all of them are executing (requestCache.lock must be held).
+ */
+int requestCacheTake(unsigned long long now) {
+	if (requestCache.used < REQUEST_CACHE_ENTRIES) {
+		int index = requestCache.used++;
+		requestCache.entries[index].prev = -1;
+		requestCache.entries[index].next = -1;
+		return index;
+	}
+
+	for (int index = requestCache.tail; index != -1; index = requestCache.entries[index].prev) {
+		struct m_request_entry *entry = &requestCache.entries[index];
+		if (entry->owner) {
+			continue;
+		}
+		// a dropped entry isn't in the index anymore
+		if (entry->device) {
+			if (now - entry->answeredAt < REQUEST_CACHE_TTL) {
+				requestCache.evictions++;
+			}
+			requestCacheRemoveSlot(requestCacheSlot(entry->device, entry->msgId, entry->hash));
+		}
+		return index;
+	}
+	return -1;
+}
+
+/**
+ * \brief Looks up the msgId of a request about to be queued for the worker (libevent thread only).
+ * \details Returns REQUEST_NEW if it has to be executed, the command owns a new entry then (if there is
+ * room) which requestCacheFinish() fills with its response. A resent request which has already been
+ * answered gets the kept response once more (REQUEST_ANSWERED, cmd is still owned by the caller), one which
+ * is still executing waits for its response (REQUEST_ATTACHED, the cache owns cmd now).
+ */
+int requestCacheBegin(struct m_command *cmd) {
+	size_t length = strlen(cmd->correlId);
+	if (length >= REQUEST_CACHE_MSGID_MAX) {
+		return REQUEST_NEW;
+	}
+
+	unsigned long long now = monotonicMs();
+	unsigned int hash = hashCommand(cmd->correlId);
+	int result = REQUEST_NEW;
+
+	pthread_mutex_lock(&requestCache.lock);
+	unsigned int slot = requestCacheSlot(cmd->device, cmd->correlId, hash);
+	if (requestCache.slots[slot]) {
+		int index = requestCache.slots[slot] - 1;
+		struct m_request_entry *entry = &requestCache.entries[index];
+		if (entry->owner && entry->def == cmd->def) {
+			// answered together with the executing one, in the order they have been received
+			struct m_command **last = &entry->waiting;
+			while (*last) {
+				last = &(*last)->coalesced;
+			}
+			*last = cmd;
+			requestCache.attached++;
+			requestCacheTouch(index);
+			result = REQUEST_ATTACHED;
+		} else if (entry->owner) {
+			// the msgId has been reused for another command, leave the executing one alone
+			requestCache.misses++;
+		} else if (entry->def == cmd->def && now - entry->answeredAt < REQUEST_CACHE_TTL) {
+			publishMessage(cmd->responseTopic, entry->response.data, entry->response.length);
+			requestCache.hits++;
+			requestCacheTouch(index);
+			result = REQUEST_ANSWERED;
+		} else {
+			// expired or another command, replaced by the new request
+			requestCache.misses++;
+			entry->owner = cmd;
+			entry->def = cmd->def;
+			bufferReset(&entry->response);
+			requestCacheTouch(index);
+			cmd->cached = 1;
+		}
+	} else {
+		requestCache.misses++;
+		int index = requestCacheTake(now);
+		if (index != -1) {
+			struct m_request_entry *entry = &requestCache.entries[index];
+			// the slot may have moved when the taken entry has been removed from the index
+			slot = requestCacheSlot(cmd->device, cmd->correlId, hash);
+			memcpy(entry->msgId, cmd->correlId, length + 1);
+			entry->device = cmd->device;
+			entry->def = cmd->def;
+			entry->hash = hash;
+			entry->owner = cmd;
+			entry->waiting = NULL;
+			bufferReset(&entry->response);
+			requestCache.slots[slot] = index + 1;
+			requestCacheTouch(index);
+			cmd->cached = 1;
+		}
+	}
+	pthread_mutex_unlock(&requestCache.lock);
+
+	return result;
+}
+
+/**
+ * \brief Called once the request of a command owning a cache entry (cmd->cached) has been answered, the given
+ * response is published once more for each duplicate waiting for it (any thread).
+ * \details If the request has been executed the response is kept for later duplicates, otherwise (refused,
+ * deadline exceeded) the entry is dropped, so it can be sent again. A NULL response drops the entry as well.
+ */
+void requestCacheFinish(struct m_command *cmd, const char *response, size_t length, int executed) {
+	if (! cmd->cached) {
+		return;
+	}
+	cmd->cached = 0;
+
+	pthread_mutex_lock(&requestCache.lock);
+	unsigned int slot = requestCacheSlot(cmd->device, cmd->correlId, hashCommand(cmd->correlId));
+	if (requestCache.slots[slot] == 0 || requestCache.entries[requestCache.slots[slot] - 1].owner != cmd) {
+		// can't happen, the entry of an executing request is never taken
+		pthread_mutex_unlock(&requestCache.lock);
+		return;
+	}
+
+	int index = requestCache.slots[slot] - 1;
+	struct m_request_entry *entry = &requestCache.entries[index];
+	struct m_command *waiting = entry->waiting;
+	entry->owner = NULL;
+	entry->waiting = NULL;
+	entry->answeredAt = monotonicMs();
+	if (executed && response && bufferAppend(&entry->response, response, length) == 0) {
+		response = entry->response.data;
+	} else {
+		// out of the index and to the end of the LRU list, so it is taken next
+		requestCacheRemoveSlot(slot);
+		requestCacheUnlink(index);
+		entry->device = NULL;
+		entry->prev = requestCache.tail;
+		entry->next = -1;
+		if (requestCache.tail != -1) {
+			requestCache.entries[requestCache.tail].next = index;
+		}
+		requestCache.tail = index;
+		if (requestCache.head == -1) {
+			requestCache.head = index;
+		}
+	}
+
+	for (struct m_command *duplicate = waiting; duplicate; duplicate = duplicate->coalesced) {
+		if (response) {
+			publishMessage(duplicate->responseTopic, response, length);
+		} else {
+			replyWithError(duplicate->responseTopic, "{\"correlId\":\"%s\",\"error\":\"response unavailable\"}",
+					duplicate->correlId);
+		}
+	}
+	pthread_mutex_unlock(&requestCache.lock);
+	freeCommand(waiting);
+}
+
+/**
+ * \brief Answers the request of the command with the error without executing it, drops its cache entry.
+ */
+void replyNotExecuted(struct m_command *cmd, const char *error) {
+	struct m_buffer text = { NULL, 0, 0, 0 };
+	bufferPrintf(&text, "{\"correlId\":\"%s\",\"error\":\"%s\"}", cmd->correlId, error);
+	if (text.failed) {
+		requestCacheFinish(cmd, NULL, 0, 0);
+		replyWithError(cmd->responseTopic, "{\"correlId\":\"%s\",\"error\":\"out of memory\"}", cmd->correlId);
+	} else {
+		publishMessage(cmd->responseTopic, text.data, text.length);
+		requestCacheFinish(cmd, text.data, text.length, 0);
+	}
+	bufferFree(&text);
+}
+
+/**
+ * \brief Frees the request cache and the duplicates still waiting in it, called once the workers have stopped.
+ */
+void requestCacheStop(void) {
+	pthread_mutex_lock(&requestCache.lock);
+	for (unsigned int i = 0; i < requestCache.used; i++) {
+		freeCommand(requestCache.entries[i].waiting);
+		requestCache.entries[i].waiting = NULL;
+		bufferFree(&requestCache.entries[i].response);
+	}
+	pthread_mutex_unlock(&requestCache.lock);
+}
+
+/**
+ * \brief Checks if a step of the JSON "batch" command moves money (CMD_TRANSACTION), the batch is then
+ * queued and accounted like a single transaction.
+ */
+int batchHasTransaction(struct m_command *cmd) {
+	json_t *jCommands = json_object_get(cmd->jsonMessage, "commands");
+	size_t count = json_is_array(jCommands) ? json_array_size(jCommands) : 0;
+
+	for (size_t i = 0; i < count; i++) {
+		json_t *jCmd = json_object_get(json_array_get(jCommands, i), "cmd");
+		struct m_command_def *def = json_is_string(jCmd) ? findCommand(json_string_value(jCmd)) : NULL;
+		if(def && (def->flags & CMD_TRANSACTION)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * \brief Handles the JSON "batch" command: executes the commands in "commands" one after the other
+ * on the device and answers with a single response, "results"[i] is the response of commands[i].
+ * \details The steps are looked up in commandDefs like a single request, but they bypass the state cache and
+ * their responses are collected (replyCapture) instead of published. With "stopOnError":true the remaining
+ * steps are skipped once a step has answered with an error.
+ */
+void handleBatch(struct m_command *cmd) {
+	json_t *jCommands = json_object_get(cmd->jsonMessage, "commands");
+	if(! json_is_array(jCommands) || json_array_size(jCommands) > BATCH_MAX_COMMANDS) {
+		replyWithPropertyError(cmd, "commands");
+		return;
+	}
+	int stopOnError = cmdIsTrue(cmd, "stopOnError");
+
+	struct m_reply_capture capture = { cmd->responseTopic, { NULL, 0, 0, 0 }, 0, 0, 0 };
+	// records the response of the whole batch if it is a cached request
+	struct m_reply_capture *outer = replyCapture;
+	struct m_buffer response = { NULL, 0, 0, 0 };
+	size_t count = json_array_size(jCommands);
+	size_t executed = 0;
+	size_t i;
+	int failed = 0;
+
+	bufferPrintf(&response, "{\"msgId\":\"%s\",\"correlId\":\"%s\",\"results\":[", cmd->msgId, cmd->correlId);
+
+	for (i = 0; i < count && ! (failed && stopOnError); i++) {
+		json_t *jStep = json_array_get(jCommands, i);
+		json_t *jCmd = json_object_get(jStep, "cmd");
+		json_t *jMsgId = json_object_get(jStep, "msgId");
+
+		// the step shares the device, topic and msgId with the batch
+		struct m_command step = *cmd;
+		step.jsonMessage = jStep;
+		step.fieldCount = 0;
+		step.command = json_is_string(jCmd) ? (char *) json_string_value(jCmd) : "";
+		step.correlId = json_is_string(jMsgId) ? (char *) json_string_value(jMsgId) : cmd->correlId;
+		step.def = findCommand(step.command);
+
+		bufferReset(&capture.replies);
+		capture.count = 0;
+		capture.error = 0;
+		replyCapture = &capture;
+
+		if(! json_is_string(jCmd)) {
+			replyWithPropertyError(&step, "cmd");
+		} else if(step.def == NULL) {
+			replyWithError(step.responseTopic, "{\"correlId\":\"%s\",\"error\":\"unknown command\",\"cmd\":\"%s\"}",
+					step.correlId, step.command);
+		} else if(step.def->handlerFn == handleBatch || ! (step.def->flags & CMD_HARDWARE)) {
+			replyWithError(step.responseTopic, "{\"correlId\":\"%s\",\"error\":\"command not allowed in batch\",\"cmd\":\"%s\"}",
+					step.correlId, step.command);
+		} else if(! (step.def->flags & cmd->device->commandClass)) {
+			replyWithError(step.responseTopic, "{\"correlId\":\"%s\",\"error\":\"command not supported by device\",\"cmd\":\"%s\"}",
+					step.correlId, step.command);
+		} else {
+			step.def->handlerFn(&step);
+			executed++;
+		}
+
+		replyCapture = outer;
+
+		const char *replies = capture.replies.data;
+		failed = capture.count == 0 || capture.replies.failed || capture.error;
+
+		if(i) {
+			bufferAppend(&response, ",", 1);
+		}
+		if(capture.count == 1) {
+			bufferAppend(&response, replies, capture.replies.length);
+		} else if(capture.count > 1) {
+			bufferPrintf(&response, "[%s]", replies);
+		} else {
+			bufferAppend(&response, "null", 4);
+		}
+	}
+
+	bufferPrintf(&response, "],\"executed\":%zu,\"skipped\":%zu}", executed, count - i);
+
+	if(response.failed) {
+		logMessage(LOG_ERR, "handleBatch: out of memory building the response for msgId='%s'", cmd->correlId);
+		replyWithError(cmd->responseTopic, "{\"msgId\":\"%s\",\"correlId\":\"%s\",\"error\":\"out of memory\"}",
+				cmd->msgId, cmd->correlId);
+	} else {
+		publishMessage(cmd->responseTopic, response.data, response.length);
+	}
+
+	bufferFree(&capture.replies);
+	bufferFree(&response);
+}
+
+/**
+ * \brief Appends the latency histogram as JSON object to the buffer.
+ */
+void bufferPrintLatency(struct m_buffer *buffer, const SSP_LATENCY *latency) {
+	bufferPrintf(buffer, "{\"count\":%lu,\"avg_ms\":%llu,\"max_ms\":%lu,\"buckets\":[",
+			latency->count, latency->count ? latency->total_ms / latency->count : 0, latency->max_ms);
+	for (int i = 0; i < SSP_LATENCY_BUCKETS; i++) {
+		bufferPrintf(buffer, "%s%lu", i ? "," : "", latency->buckets[i]);
+	}
+	bufferPrintf(buffer, "]}");
+}
+
+/**
+ * \brief Builds the JSON object with all the metrics into the buffer (libevent thread only).
+ */
+void buildMetrics(struct m_metacash *metacash, struct m_buffer *buffer) {
+	unsigned long long now = monotonicMs();
+
+	pthread_mutex_lock(&outbox.lock);
+	size_t outboxBytes = outbox.pending.length;
+	size_t spillBytes = outbox.spillLength;
+	unsigned long dropped = outbox.dropped;
+	pthread_mutex_unlock(&outbox.lock);
+
+	SSP_CAPTURE_STATS wire;
+	get_ssp_capture_stats(&wire);
+
+	pthread_mutex_lock(&requestCache.lock);
+	unsigned int requestCacheUsed = requestCache.used;
+	unsigned long requestCacheHits = requestCache.hits;
+	unsigned long requestCacheAttached = requestCache.attached;
+	unsigned long requestCacheMisses = requestCache.misses;
+	unsigned long requestCacheEvictions = requestCache.evictions;
+	pthread_mutex_unlock(&requestCache.lock);
+
+	bufferPrintf(buffer, "{\"uptime_ms\":%llu,\"poll\":{\"ticks\":%lu,\"interval_ms\":%lu,\"jitter_avg_ms\":%llu,\"jitter_max_ms\":%lu},"
+			"\"redis\":{\"published\":%lu,\"in_flight\":%lu,\"max_in_flight\":%lu,\"outbox_bytes\":%zu,"
+			"\"connected\":%s,\"reconnects\":%lu,\"dropped\":%lu,\"spill_bytes\":%zu},\"log\":{\"dropped\":%lu},"
+			"\"journal\":{\"records\":%lu,\"syncs\":%lu},\"local\":{\"clients\":%u,\"sent\":%lu,\"dropped\":%lu},"
+			"\"wire\":{\"captured\":%lu,\"dropped\":%lu,\"replayed\":%lu,\"unmatched\":%lu,\"skipped\":%lu},"
+			"\"request_cache\":{\"entries\":%u,\"hits\":%lu,\"attached\":%lu,\"misses\":%lu,\"evictions\":%lu},",
+			now - metrics.startedAt, metrics.pollTicks, POLL_TICK,
+			metrics.pollTicks ? metrics.pollJitterTotal / metrics.pollTicks : 0, metrics.pollJitterMax,
+			metrics.published, metrics.publishInFlight, metrics.publishMaxInFlight, outboxBytes,
+			outbox.offline ? "false" : "true", publishLink.reconnects + subscribeLink.reconnects, dropped, spillBytes,
+			atomic_load_explicit(&logRing.dropped, memory_order_relaxed),
+			journal.map ? atomic_load_explicit(&journal.next, memory_order_relaxed) - 1 : 0,
+			atomic_load_explicit(&journal.syncs, memory_order_relaxed),
+			atomic_load_explicit(&local.clientCount, memory_order_relaxed), local.sent, local.dropped,
+			wire.captured, wire.dropped, wire.replayed, wire.unmatched, wire.skipped,
+			requestCacheUsed, requestCacheHits, requestCacheAttached, requestCacheMisses, requestCacheEvictions);
+
+	bufferPrintf(buffer, "\"bucket_bounds_ms\":[");
+	for (int i = 0; i < SSP_LATENCY_BUCKETS - 1; i++) {
+		bufferPrintf(buffer, "%s%lu", i ? "," : "", ssp_latency_bounds[i]);
+	}
+
+	// latency from receiving a request until it has been answered, per cmd
+	bufferPrintf(buffer, "],\"commands\":[");
+	int first = 1;
+	for (size_t i = 0; i < sizeof(commandDefs) / sizeof(commandDefs[0]); i++) {
+		struct m_command_def *def = &commandDefs[i];
+		if (def->received == 0) {
+			continue;
+		}
+
+		pthread_mutex_lock(&metrics.lock);
+		SSP_LATENCY latency = def->latency;
+		pthread_mutex_unlock(&metrics.lock);
+
+		bufferPrintf(buffer, "%s{\"cmd\":\"%s\",\"received\":%lu,\"rejected\":%lu,\"latency\":",
+				first ? "" : ",", def->name, def->received, def->rejected);
+		bufferPrintLatency(buffer, &latency);
+		bufferPrintf(buffer, "}");
+		first = 0;
+	}
+
+	bufferPrintf(buffer, "],\"buses\":[");
+	for (unsigned int i = 0; i < metacash->busCount; i++) {
+		struct m_bus *bus = &metacash->buses[i];
+		bufferPrintf(buffer, "%s{\"bus\":\"%s\",\"serial_device\":\"%s\",\"baud\":%lu,\"devices\":[",
+				i ? "," : "", bus->name, bus->serialDevice, get_ssp_bus_baud(bus->index));
+
+		struct m_device *devices[] = { &bus->hopper, &bus->validator };
+		for (unsigned int j = 0; j < sizeof(devices) / sizeof(devices[0]); j++) {
+			struct m_device *device = devices[j];
+			unsigned int queueDepth = 0;
+			unsigned int maxQueueDepth = 0;
+			unsigned long coalesced = 0;
+			unsigned long shed = 0;
+			unsigned long expired = 0;
+			if (device->workerStarted) {
+				pthread_mutex_lock(&device->jobLock);
+				queueDepth = device->jobCount;
+				maxQueueDepth = device->maxJobCount;
+				coalesced = device->coalescedCommands;
+				shed = device->shedCommands;
+				expired = device->expiredCommands;
+				pthread_mutex_unlock(&device->jobLock);
+			}
+			bufferPrintf(buffer, "%s{\"device\":\"%s\",\"queue_depth\":%u,\"max_queue_depth\":%u,\"coalesced\":%lu,"
+					"\"shed\":%lu,\"expired\":%lu}",
+					j ? "," : "", device->kind, queueDepth, maxQueueDepth, coalesced, shed, expired);
+		}
+
+		// the SSP exchanges on this bus, per command id
+		bufferPrintf(buffer, "],\"ssp\":[");
+		first = 1;
+		for (unsigned int command = 0; command < 256; command++) {
+			SSP_COMMAND_STATS stats;
+			if (! get_ssp_command_stats(bus->index, command, &stats)) {
+				continue;
+			}
+			bufferPrintf(buffer, "%s{\"command\":\"0x%02X\",\"retries\":%lu,\"timeouts\":%lu,\"packet_errors\":%lu,\"port_errors\":%lu,\"latency\":",
+					first ? "" : ",", command, stats.retries, stats.timeouts, stats.packet_errors, stats.port_errors);
+			bufferPrintLatency(buffer, &stats.latency);
+			bufferPrintf(buffer, "}");
+			first = 0;
+		}
+
+		// the encryption key negotiations on this bus
+		SSP_NEGOTIATION_STATS negotiation;
+		if (! get_ssp_negotiation_stats(bus->index, &negotiation)) {
+			memset(&negotiation, 0, sizeof(negotiation));
+		}
+		bufferPrintf(buffer, "],\"negotiation\":{\"failures\":%lu,\"pool_hits\":%lu,\"pool_misses\":%lu,\"latency\":",
+				negotiation.failures, negotiation.pool_hits, negotiation.pool_misses);
+		bufferPrintLatency(buffer, &negotiation.latency);
+		bufferPrintf(buffer, "}}");
+	}
+	bufferPrintf(buffer, "]}");
+}
+
+/**
+ * \brief Callback function for libEvent timer triggered "Metrics" event, publishes the metrics
+ * to the "payout-metrics" topic.
+ */
+void cbOnMetricsEvent(int fd, short event, void *privdata) {
+	struct m_metacash *metacash = privdata;
+	static struct m_buffer buffer = { NULL, 0, 0, 0 };
+	bufferReset(&buffer);
+	buildMetrics(metacash, &buffer);
+
+	if(! buffer.failed) {
+		publishMessage("payout-metrics", buffer.data, buffer.length);
+	}
+}
+
+/**
+ * \brief Returns the device whose request topic is topic, NULL if there is none.
+ */
+struct m_device *findDeviceByRequestTopic(struct m_metacash *metacash, const char *topic) {
+	for (unsigned int i = 0; i < metacash->busCount; i++) {
+		struct m_bus *bus = &metacash->buses[i];
+		if (strcmp(topic, bus->hopper.requestTopic) == 0) {
+			return &bus->hopper;
+		} else if (strcmp(topic, bus->validator.requestTopic) == 0) {
+			return &bus->validator;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * \brief Callback function triggered by an incoming message in the
+ * "hopper-request" or "validator-request" topic of one of our buses.
+ * \details Details only to get graph.
+ * \callgraph
+ */
+void cbOnRequestMessage(redisAsyncContext *c, void *r, void *privdata) {
+	if (r == NULL) {
+		return;
+	}
+
+	redisReply *reply = r;
+
+	// example from http://stackoverflow.com/questions/16213676/hiredis-waiting-for-message
+	if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 3) {
+		if (strcmp(reply->element[0]->str, "subscribe") != 0) {
+			processRequest(c->data, reply->element[1]->str, reply->element[2]->str, NULL);
+		}
+	}
+}
+
+/**
+ * \brief Parses a message received in the request topic of one of our devices and dispatches it
+ * to the handler of the command (pub/sub and streams transport, or from a client of the local socket).
+ * \details Details only to get graph.
+ * \callgraph
+ */
+void processRequest(struct m_metacash *m, const char *topic, const char *message, struct m_local_client *client) {
+	// the command is handed over to the worker of the device, so it
+	// must outlive this callback (as well as its copy of the message). freed by freeCommand().
+	size_t length = strlen(message);
+	struct m_command *cmd = calloc(1, sizeof(struct m_command) + length + 1);
+	if(cmd == NULL) {
+		logMessage(LOG_ERR, "processRequest: out of memory, dropping message\n");
+		return;
+	}
+	cmd->receivedAt = monotonicMs();
+
+	// decide to which topic the response should be sent to
+	cmd->device = findDeviceByRequestTopic(m, topic);
+	if (cmd->device == NULL) {
+		logMessage(LOG_ERR, "processRequest: received a message in topic='%s' we don't have a response topic for\n", topic);
+		free(cmd);
+		return;
+	}
+	if (client) {
+		// only the connection which sent the request gets the response (see flushLocal())
+		snprintf(cmd->replyTopic, sizeof(cmd->replyTopic), "%c%ld.%u:%s", LOCAL_TOPIC_PREFIX,
+				(long) (client - local.clients), client->generation, cmd->device->responseTopic);
+		cmd->responseTopic = cmd->replyTopic;
+	} else {
+		cmd->responseTopic = cmd->device->responseTopic;
+	}
+
+	// generate a new 'msgId' for the response itself
+	uuid_t uuid;
+	uuid_generate_time_safe(uuid);
+	uuid_unparse_lower(uuid, cmd->msgId);
+
+	// most messages are flat objects, split them in place. anything else is parsed by jansson
+	memcpy(cmd->text, message, length + 1);
+	int fieldCount = parseFlatJson(cmd->text, cmd->fields, CMD_MAX_FIELDS);
+	json_error_t error;
+	if (fieldCount >= 0) {
+		cmd->fieldCount = fieldCount;
+	} else if ((cmd->jsonMessage = json_loads(message, 0, &error)) == NULL) {
+		logMessage(LOG_WARNING, "unable to process message: could not parse json. reason: %s, line: %d",
+				error.text, error.line);
+		replyWithError(cmd->responseTopic,
+				"{\"error\":\"could not parse json\",\"reason\":\"%s\",\"line\":%d}",
+				error.text, error.line);
+		// no need to json_decref(cmd->jsonMessage) here
+		freeCommand(cmd);
+		return;
+	}
+
+	// extract the 'msgId' property (used as the 'correlId' in a response)
+	// this will be the 'correlId' used in replies.
+	const char *value;
+	if(cmdGetString(cmd, "msgId", &value)) {
+		logMessage(LOG_WARNING, "unable to process message: property 'msgId' missing or invalid");
+		replyWithPropertyError(cmd, "msgId");
+		freeCommand(cmd);
+		return;
+	} else {
+		cmd->correlId = (char *) value; // cast for now
+	}
+
+	// extract the 'cmd' property
+	if(cmdGetString(cmd, "cmd", &value)) {
+		logMessage(LOG_WARNING, "unable to process message: property 'cmd' missing or invalid");
+		replyWithPropertyError(cmd, "cmd");
+		freeCommand(cmd);
+		return;
+	} else {
+		cmd->command = (char *) value; // cast for now
+	}
+
+	// proper json structure, properties cmd and msgId have been verified here.
+	// also we know which device is used and where we should send our response to.
+	// finally try to dispatch the message to the appropriate command handler
+	// function if any. in case we don't know that command we respond with a
+	// generic error response.
+
+	logMessage(LOG_INFO, "processing cmd='%s' from msgId='%s' in topic='%s' for device='%s'\n",
+			cmd->command, cmd->correlId, topic, cmd->device->name);
+
+	struct m_command_def *def = findCommand(cmd->command);
+	if(def) {
+		def->received++;
+	}
+	cmd->def = def;
+
+	int duplicate;
+	if(def == NULL) {
+		logMessage(LOG_WARNING, "unable to process message: no handler for cmd='%s' found", cmd->command);
+		replyWithError(cmd->responseTopic, "{\"correlId\":\"%s\",\"error\":\"unknown command\",\"cmd\":\"%s\"}",
+				cmd->correlId, cmd->command);
+	} else if(! (def->flags & cmd->device->commandClass)) {
+		def->rejected++;
+		logMessage(LOG_WARNING, "rejecting cmd='%s' from msgId='%s', not supported by device='%s'\n",
+				cmd->command, cmd->correlId, cmd->device->name);
+		replyWithError(cmd->responseTopic, "{\"correlId\":\"%s\",\"error\":\"command not supported by device\",\"cmd\":\"%s\"}",
+				cmd->correlId, cmd->command);
+	} else if(! (def->flags & CMD_HARDWARE)) {
+		def->handlerFn(cmd);
+	} else if(! cmd->device->bus->sspAvailable) {
+		// commands in here need the actual hardware
+		def->rejected++;
+		logMessage(LOG_WARNING, "rejecting cmd='%s' from msgId='%s', hardware unavailable!\n", cmd->command, cmd->correlId);
+		replyWithError(cmd->responseTopic, "{\"correlId\":\"%s\",\"error\":\"hardware unavailable\"}", cmd->correlId);
+	} else if(def->cachedFn && def->cachedFn(cmd)) {
+		// answered from the state cache, no need to bother the hardware
+	} else if(mcSspSetDeadline(cmd)) {
+		def->rejected++;
+		logMessage(LOG_WARNING, "unable to process message: property 'deadlineMs' invalid");
+		replyWithPropertyError(cmd, "deadlineMs");
+	} else if((duplicate = requestCacheBegin(cmd)) != REQUEST_NEW) {
+		// a resent request, don't bother the hardware again
+		logMessage(LOG_INFO, "cmd='%s' from msgId='%s' is a duplicate, %s\n", cmd->command, cmd->correlId,
+				duplicate == REQUEST_ATTACHED ? "waiting for the executing one" : "answered from the request cache");
+		if(duplicate == REQUEST_ATTACHED) {
+			return;
+		}
+	} else {
+		// the worker of the device executes the handler and takes
+		// over the ownership of cmd
+		struct m_job *job = calloc(1, sizeof(struct m_job));
+		if(job) {
+			job->type = JOB_COMMAND;
+			job->cmd = cmd;
+			job->handlerFn = def->handlerFn;
+			job->flags = def->flags;
+			if(def->handlerFn == handleBatch && batchHasTransaction(cmd)) {
+				// served before the other work and keeps the payout planner away, like a single payout
+				job->flags |= CMD_TRANSACTION;
+			}
+
+			// journaled before the worker owns cmd
+			long long amount = 0;
+			cmdGetInteger(cmd, "amount", &amount);
+			journalAppend(cmd->device, JOURNAL_REQUEST, def - commandDefs, (def->flags & CMD_MUTATING) != 0,
+					amount, 0, cmd->correlId);
+		}
+
+		int queued = job ? mcSspQueueJob(cmd->device, job) : QUEUE_UNAVAILABLE;
+		if(queued == QUEUE_OK) {
+			return;
+		}
+
+		free(job);
+		def->rejected++;
+		if(queued == QUEUE_SHED) {
+			logMessage(LOG_WARNING, "shedding cmd='%s' from msgId='%s', queue of device='%s' is full\n",
+					cmd->command, cmd->correlId, cmd->device->name);
+			replyNotExecuted(cmd, "overloaded");
+		} else {
+			logMessage(LOG_ERR, "rejecting cmd='%s' from msgId='%s', could not queue job\n", cmd->command, cmd->correlId);
+			replyNotExecuted(cmd, "hardware unavailable");
+		}
+	}
+
+	// this will also free the other json objects associated with it
+	freeCommand(cmd);
+}
+
+/**
+ * \brief Callback function triggered by redis once it has answered an XGROUP CREATE.
+ */
+void cbOnStreamGroupCreated(redisAsyncContext *c, void *r, void *privdata) {
+	redisReply *reply = r;
+
+	// BUSYGROUP: the group exists already, we go on where the last payoutd has stopped
+	if (reply && reply->type == REDIS_REPLY_ERROR && strncmp(reply->str, "BUSYGROUP", 9) != 0) {
+		logMessage(LOG_ERR, "could not create the consumer group of a request stream: %s", reply->str);
+	}
+}
+
+/**
+ * \brief Creates the consumer group of each request stream (and the stream itself) unless it exists.
+ * \details A new group starts at the end of the stream, old requests are not executed.
+ */
+void createRequestStreamGroups(redisAsyncContext *c) {
+	struct m_metacash *metacash = c->data;
+	for (unsigned int i = 0; i < metacash->busCount; i++) {
+		struct m_bus *bus = &metacash->buses[i];
+		redisAsyncCommand(c, cbOnStreamGroupCreated, NULL, "XGROUP CREATE %s %s $ MKSTREAM",
+				bus->validator.requestTopic, STREAM_GROUP);
+		redisAsyncCommand(c, cbOnStreamGroupCreated, NULL, "XGROUP CREATE %s %s $ MKSTREAM",
+				bus->hopper.requestTopic, STREAM_GROUP);
+	}
+}
+
+/**
+ * \brief Callback function triggered by redis with the requests of an XREADGROUP (or nil if none arrived
+ * within STREAM_BLOCK_MS). Dispatches them, acknowledges them with one XACK per stream and reads again.
+ * \details The requests are acknowledged as soon as they are dispatched, a request is never executed twice
+ * (think of a payout) even if payoutd dies before answering it.
+ */
+void cbOnStreamRequests(redisAsyncContext *c, void *r, void *privdata) {
+	redisReply *reply = r;
+	if (reply == NULL) {
+		return; // disconnected
+	}
+
+	if (reply->type == REDIS_REPLY_ERROR) {
+		if (strncmp(reply->str, "NOGROUP", 7) != 0) {
+			logMessage(LOG_ERR, "reading the request streams failed: %s", reply->str);
+			scheduleRetry(&subscribeLink);
+			return;
+		}
+		// somebody has deleted a stream, start over
+		logMessage(LOG_WARNING, "request stream without consumer group, creating it again: %s", reply->str);
+		createRequestStreamGroups(c);
+	}
+
+	// [[stream, [[id, [field, value, ...]], ...]], ...]
+	subscribeLink.backoff = REDIS_RECONNECT_MIN;
+	if (reply->type == REDIS_REPLY_ARRAY) {
+		for (size_t i = 0; i < reply->elements; i++) {
+			redisReply *stream = reply->element[i];
+			if (stream->type != REDIS_REPLY_ARRAY || stream->elements != 2
+					|| stream->element[0]->type != REDIS_REPLY_STRING || stream->element[1]->type != REDIS_REPLY_ARRAY) {
+				continue;
+			}
+
+			const char *topic = stream->element[0]->str;
+			redisReply *entries = stream->element[1];
+			const char *argv[3 + STREAM_READ_COUNT] = { "XACK", topic, STREAM_GROUP };
+			int argc = 3;
+
+			for (size_t j = 0; j < entries->elements; j++) {
+				redisReply *entry = entries->element[j];
+				if (entry->type != REDIS_REPLY_ARRAY || entry->elements != 2 || entry->element[0]->type != REDIS_REPLY_STRING) {
+					continue;
+				}
+
+				redisReply *fields = entry->element[1];
+				const char *message = NULL;
+				for (size_t k = 0; fields->type == REDIS_REPLY_ARRAY && k + 1 < fields->elements; k += 2) {
+					if (fields->element[k]->type == REDIS_REPLY_STRING && strcmp(fields->element[k]->str, "message") == 0
+							&& fields->element[k + 1]->type == REDIS_REPLY_STRING) {
+						message = fields->element[k + 1]->str;
+					}
+				}
+
+				if (message) {
+					processRequest(c->data, topic, message, NULL);
+				} else {
+					logMessage(LOG_WARNING, "ignoring entry %s in topic='%s' without a 'message' field",
+							entry->element[0]->str, topic);
+				}
+				if (argc < (int) (sizeof(argv) / sizeof(argv[0]))) {
+					argv[argc++] = entry->element[0]->str;
+				}
+			}
+
+			if (argc > 3) {
+				redisAsyncCommandArgv(c, NULL, NULL, argc, argv, NULL);
+			}
+		}
+	}
+
+	readRequestStreams(c);
+}
+
+/**
+ * \brief Reads the next batch of requests from the request streams of all devices (XREADGROUP ... BLOCK).
+ */
+void readRequestStreams(redisAsyncContext *c) {
+	struct m_metacash *metacash = c->data;
+	const char *argv[10 + 4 * MAX_SSP_BUS];
+	char count[16], block[16];
+	int argc = 0;
+
+	snprintf(count, sizeof(count), "%d", STREAM_READ_COUNT);
+	snprintf(block, sizeof(block), "%lu", STREAM_BLOCK_MS);
+
+	argv[argc++] = "XREADGROUP";
+	argv[argc++] = "GROUP";
+	argv[argc++] = STREAM_GROUP;
+	argv[argc++] = STREAM_GROUP; // consumer
+	argv[argc++] = "COUNT";
+	argv[argc++] = count;
+	argv[argc++] = "BLOCK";
+	argv[argc++] = block;
+	argv[argc++] = "STREAMS";
+	for (unsigned int i = 0; i < metacash->busCount; i++) {
+		argv[argc++] = metacash->buses[i].validator.requestTopic;
+		argv[argc++] = metacash->buses[i].hopper.requestTopic;
+	}
+	for (unsigned int i = 0; i < 2 * metacash->busCount; i++) {
+		argv[argc++] = ">"; // only requests never delivered to our group
+	}
+
+	redisAsyncCommandArgv(c, cbOnStreamRequests, NULL, argc, argv, NULL);
+}
+
+/**
+ * \brief Sends an answer of the daemon itself (not of a command) to the local client, ex. "error {...}".
+ */
+void replyLocal(struct m_local_client *client, const char *topic, const char *payload) {
+	char datagram[TOPIC_MAX_LENGTH + 128];
+	int length = snprintf(datagram, sizeof(datagram), "%s %s", topic, payload);
+	sendLocal(client, datagram, length);
+}
+
+/**
+ * \brief Adds (or removes) the space separated topics to the subscriptions of the local client.
+ */
+void subscribeLocal(struct m_local_client *client, char *topics, int subscribe) {
+	char *saveptr;
+	for (char *topic = strtok_r(topics, " ", &saveptr); topic; topic = strtok_r(NULL, " ", &saveptr)) {
+		unsigned int i = 0;
+		while (i < client->subscriptionCount && strcmp(client->subscriptions[i], topic) != 0) {
+			i++;
+		}
+
+		if (! subscribe) {
+			if (i < client->subscriptionCount) {
+				client->subscriptionCount--;
+				memmove(client->subscriptions[i], client->subscriptions[i + 1],
+						(client->subscriptionCount - i) * sizeof(client->subscriptions[0]));
+			}
+		} else if (i == client->subscriptionCount) {
+			if (strlen(topic) >= TOPIC_MAX_LENGTH) {
+				replyLocal(client, "error", "{\"error\":\"topic too long\"}");
+				return;
+			}
+			if (client->subscriptionCount == LOCAL_MAX_SUBSCRIPTIONS) {
+				replyLocal(client, "error", "{\"error\":\"too many subscriptions\"}");
+				return;
+			}
+			strcpy(client->subscriptions[client->subscriptionCount++], topic);
+		}
+	}
+
+	char count[32];
+	snprintf(count, sizeof(count), "{\"count\":%u}", client->subscriptionCount);
+	replyLocal(client, subscribe ? "subscribe" : "unsubscribe", count);
+}
+
+/**
+ * \brief Callback function for libEvent triggered by a datagram of a local client, either
+ * "<request topic> <json>" or "subscribe <topic> ..." / "unsubscribe <topic> ...".
+ * \details Details only to get graph.
+ * \callgraph
+ */
+void cbOnLocalClientEvent(int fd, short event, void *privdata) {
+	struct m_local_client *client = privdata;
+	static char message[LOCAL_MAX_MESSAGE + 1]; // libevent thread only, processRequest() copies it
+
+	// MSG_TRUNC returns the real length of a datagram which didn't fit
+	ssize_t length = recv(fd, message, LOCAL_MAX_MESSAGE, MSG_DONTWAIT | MSG_TRUNC);
+	if (length == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return;
+	}
+	if (length <= 0) {
+		closeLocalClient(client);
+		return;
+	}
+	if (length > LOCAL_MAX_MESSAGE) {
+		logMessage(LOG_WARNING, "ignoring message of %zd bytes from local client %ld", length, (long) (client - local.clients));
+		replyLocal(client, "error", "{\"error\":\"message too long\"}");
+		return;
+	}
+	message[length] = '\0';
+
+	char *payload = strchr(message, ' ');
+	if (payload) {
+		*payload++ = '\0';
+	} else {
+		payload = message + length;
+	}
+
+	if (strcmp(message, "subscribe") == 0) {
+		subscribeLocal(client, payload, 1);
+	} else if (strcmp(message, "unsubscribe") == 0) {
+		subscribeLocal(client, payload, 0);
+	} else if (findDeviceByRequestTopic(client->metacash, message) == NULL) {
+		replyLocal(client, "error", "{\"error\":\"unknown topic\"}");
+	} else {
+		processRequest(client->metacash, message, payload, client);
+	}
+}
+
+/**
+ * \brief Callback function for libEvent triggered by a connection to the local socket.
+ */
+void cbOnLocalAcceptEvent(int fd, short event, void *privdata) {
+	struct m_metacash *metacash = privdata;
+
+	int clientFd;
+	while ((clientFd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+		struct m_local_client *client = NULL;
+		for (unsigned int i = 0; i < LOCAL_MAX_CLIENTS && client == NULL; i++) {
+			if (local.clients[i].fd == -1) {
+				client = &local.clients[i];
+			}
+		}
+		if (client == NULL) {
+			logMessage(LOG_WARNING, "rejecting local client, already %d connected", LOCAL_MAX_CLIENTS);
+			close(clientFd);
+			continue;
+		}
+
+		client->fd = clientFd;
+		client->subscriptionCount = 0;
+		client->metacash = metacash;
+		event_set(&client->evRead, clientFd, EV_READ | EV_PERSIST, cbOnLocalClientEvent, client);
+		event_base_set(metacash->eventBase, &client->evRead);
+		event_add(&client->evRead, NULL);
+		atomic_fetch_add_explicit(&local.clientCount, 1, memory_order_relaxed);
+
+		logMessage(LOG_INFO, "local client %ld connected", (long) (client - local.clients));
+	}
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+		logMessage(LOG_ERR, "cbOnLocalAcceptEvent: could not accept a local client: %s", strerror(errno));
+	}
+}
+
+/**
+ * \brief Starts listening on the local socket given with -U (libevent thread only).
+ */
+void localStart(struct m_metacash *metacash) {
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, metacash->localSocket); // length checked by parseCmdLine()
+
+	for (unsigned int i = 0; i < LOCAL_MAX_CLIENTS; i++) {
+		local.clients[i].fd = -1;
+	}
+
+	local.fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (local.fd == -1) {
+		logMessage(LOG_ERR, "could not create local socket: %s", strerror(errno));
+		die("could not create local socket", 1);
+		// never reached, already exited
+	}
+
+	// left over by the last run
+	unlink(metacash->localSocket);
+	if (bind(local.fd, (struct sockaddr *) &address, sizeof(address)) != 0 || listen(local.fd, LOCAL_MAX_CLIENTS) != 0) {
+		logMessage(LOG_ERR, "could not listen on local socket '%s': %s", metacash->localSocket, strerror(errno));
+		die("could not listen on local socket", 1);
+		// never reached, already exited
+	}
+
+	event_set(&local.evAccept, local.fd, EV_READ | EV_PERSIST, cbOnLocalAcceptEvent, metacash);
+	event_base_set(metacash->eventBase, &local.evAccept);
+	event_add(&local.evAccept, NULL);
+
+	logMessage(LOG_NOTICE, "serving local clients on %s", metacash->localSocket);
+}
+
+/**
+ * \brief Disconnects the local clients and removes the local socket (libevent thread only).
+ */
+void localStop(struct m_metacash *metacash) {
+	if (local.fd == -1) {
+		return;
+	}
+
+	for (unsigned int i = 0; i < LOCAL_MAX_CLIENTS; i++) {
+		if (local.clients[i].fd != -1) {
+			closeLocalClient(&local.clients[i]);
+		}
+	}
+	event_del(&local.evAccept);
+	close(local.fd);
+	local.fd = -1;
+	unlink(metacash->localSocket);
+
+	bufferFree(&local.pending);
+	bufferFree(&local.flushing);
+}
+
+/**
+ * \brief Callback function triggered by the redis client on connecting with
+ * the "publish" context.
+ */
+void cbOnConnectPublishContext(const redisAsyncContext *c, int status) {
+	if (status != REDIS_OK) {
+		logMessage(LOG_ERR, "cbOnConnectPublishContext: redis error: %s\n", c->errstr);
+		scheduleReconnect(&publishLink);
+		return;
+	}
+	logMessage(LOG_INFO, "cbOnConnectPublishContext: connected to redis\n");
+
+	publishLink.backoff = REDIS_RECONNECT_MIN;
+	setOutboxOnline();
+}
+
+/**
+ * \brief Callback function triggered by the redis client on disconnecting with
+ * the "publish" context.
+ */
+void cbOnDisconnectPublishContext(const redisAsyncContext *c, int status) {
+	redisPublishCtx = NULL; // freed by hiredis
+	setOutboxOffline();
+
+	if (status != REDIS_OK) {
+		logMessage(LOG_ERR, "cbOnDisconnectPublishContext: redis error: %s\n", c->errstr);
+		scheduleReconnect(&publishLink);
+		return;
+	}
+	logMessage(LOG_INFO, "cbOnDisconnectPublishContext: disconnected from redis\n");
+}
+
+/**
+ * \brief Callback function triggered by the redis client on connecting with
+ * the "subscribe" context.
+ */
+void cbOnConnectSubscribeContext(const redisAsyncContext *c, int status) {
+	if (status != REDIS_OK) {
+		logMessage(LOG_ERR, "cbOnConnectSubscribeContext - redis error: %s\n", c->errstr);
+		scheduleReconnect(&subscribeLink);
+		return;
+	}
+	logMessage(LOG_INFO, "cbOnConnectSubscribeContext - connected to redis\n");
+	subscribeLink.backoff = REDIS_RECONNECT_MIN;
+	evtimer_del(&subscribeLink.evRetry); // the streams are read right below
+
+	redisAsyncContext *cNotConst = (redisAsyncContext*) c; // get rids of discarding qualifier \"const\" warning
+	struct m_metacash *metacash = c->data;
+
+	if (metacash->useStreams) {
+		createRequestStreamGroups(cNotConst);
+		readRequestStreams(cNotConst);
+		return;
+	}
+
+	// subscribe the topics in redis from which we want to receive messages
+	redisAsyncCommand(cNotConst, cbOnMetacashMessage, NULL, "SUBSCRIBE metacash");
+
+	// n.b: the same callback function handles the request topics of all devices
+	for (unsigned int i = 0; i < metacash->busCount; i++) {
+		struct m_bus *bus = &metacash->buses[i];
+		redisAsyncCommand(cNotConst, cbOnRequestMessage, NULL, "SUBSCRIBE %s", bus->validator.requestTopic);
+		redisAsyncCommand(cNotConst, cbOnRequestMessage, NULL, "SUBSCRIBE %s", bus->hopper.requestTopic);
+	}
+}
+
+/**
+ * \brief Callback function triggered by the redis client on disconnecting with
+ * the "subscribe" context.
+ */
+void cbOnDisconnectSubscribeContext(const redisAsyncContext *c, int status) {
+	redisSubscribeCtx = NULL; // freed by hiredis
+
+	if (status != REDIS_OK) {
+		logMessage(LOG_INFO, "cbOnDisconnectSubscribeContext - redis error: %s\n", c->errstr);
+		scheduleReconnect(&subscribeLink); // subscribes the request topics again once connected
+		return;
+	}
+	logMessage(LOG_INFO, "cbOnDisconnectSubscribeContext - disconnected from redis\n");
+}
+
+/**
+ * \brief This function never returns, it displays the reason argument and return code
+ * in the syslog and exits immediately.
+ */
+void die(char *reason, int rc) {
+	// write out what is still queued first, then synchronously
+	journalStop();
+	logStop();
+	syslog(LOG_EMERG, "fatal error occured: %s, rc=%d", reason, rc);
+	syslog(LOG_EMERG, "exiting NOW");
+	exit(rc);
+}
+
+/**
+ * \brief Returns a monotonic timestamp in ms, used for scheduling the polls.
+ */
+unsigned long long monotonicMs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * \brief Supports arguments -h (redis hostname), -p (redis port), -d (serial device name), -b (named bus), -g/-G (command gap), -s (cache max age), -S (snapshot directory), -m (metrics interval), -T/-M (transport, stream length), -Q/-O (outbox limit, spill file), -E/-C (event batching, coalescing), -L (log file), -J (journal), -B (baud rate), -U (local socket), -w (wire capture), -r/-F (replay), -q/-W (queue limit, shed threshold) and -?.
+ * \callgraph
+ */
+int main(int argc, char *argv[]) {
+	// setup logging via syslog
+	setlogmask(LOG_UPTO(LOG_INFO));
+	openlog("payoutd", LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
+	logMessage(LOG_NOTICE, "Program started by User %d", getuid());
+
+	// register interrupt handler for signals
+	signal(SIGTERM, signalHandler);
+	signal(SIGINT, signalHandler);
+
+	struct m_metacash metacash;
+	metacash.quit = 0;
+	metacash.logSyslogStderr = 0; // default, override using -e
+	metacash.logFile = NULL; // default syslog, set with -L argument
+	metacash.journalFile = NULL; // default no journal, set with -J argument
+	metacash.acceptCoins = 0; // default, override using -c
+	metacash.baudRate = DEFAULT_BAUD_RATE; // default, override with -B argument
+	metacash.queueLimit = DEFAULT_QUEUE_LIMIT; // default, override with -q argument
+	metacash.shedThreshold = DEFAULT_SHED_THRESHOLD; // default, override with -W argument
+
+	metacash.busCount = 0; // add with -d / -b arguments
+	metacash.redisHost = "127.0.0.1";	// default, override with -h argument
+	metacash.redisPort = 6379;			// default, override with -p argument
+
+	metacash.hopperCommandGap = DEFAULT_COMMAND_GAP; // default, override with -g argument
+	metacash.validatorCommandGap = DEFAULT_COMMAND_GAP; // default, override with -G argument
+	metacash.cacheMaxAge = DEFAULT_CACHE_MAX_AGE; // default, override with -s argument
+	metacash.snapshotDir = NULL; // default, set with -S argument
+	metacash.metricsInterval = DEFAULT_METRICS_INTERVAL; // default, override with -m argument
+	metacash.useStreams = 0; // default pub/sub, set with -T streams argument
+	metacash.streamMaxLen = DEFAULT_STREAM_MAX_LEN; // default, override with -M argument
+	metacash.outboxLimit = DEFAULT_OUTBOX_LIMIT; // default, override with -Q argument
+	metacash.batchEvents = 0; // default one message per event, enable with -E argument
+	metacash.coalesceEvents = 0; // default publish every event, enable with -C argument
+	metacash.spillFile = NULL; // default, set with -O argument
+	metacash.localSocket = NULL; // default no local socket, set with -U argument
+	metacash.captureFile = NULL; // default no wire capture, set with -w argument
+	metacash.replayFile = NULL; // default talk to the serial devices, set with -r argument
+	metacash.replayRealtime = 1; // default recorded speed, as fast as possible with -F argument
+	metrics.startedAt = monotonicMs();
+
+	// hash the command table used by processRequest()
+	buildCommandIndex();
+
+	// parse the command line arguments
+	if (parseCmdLine(argc, argv, &metacash)) {
+		die("invalid command line", 1);
+		// never reached, already exited
+	}
+
+	if (metacash.busCount == 0 && addBus(&metacash, "", DEFAULT_SERIAL_DEVICE)) {
+		die("could not add the default bus", 1);
+		// never reached, already exited
+	}
+
+	if(metacash.logSyslogStderr) {
+		closelog();
+		// also writeout syslog messages to stderr (intended for development purposes, you
+		// can enable this with the -e argument)
+		openlog("payoutd", LOG_PERROR | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
+	}
+
+	// from now on the messages are written out by the log thread
+	logStart(metacash.logFile);
+
+	// restores the state cache, so before the workers are started
+	if (metacash.journalFile) {
+		journalStart(&metacash, metacash.journalFile);
+	}
+
+	logMessage(LOG_NOTICE, "using redis at %s:%d", metacash.redisHost, metacash.redisPort);
+
+	// all SSP traffic is encrypted, don't even start if our AES doesn't produce the known answer
+	if (aes_self_test() != E_AES_SUCCESS) {
+		die("AES self test failed", 1);
+		// never reached, already exited
+	}
+
+	// prepares the host keys for the encryption negotiations in the background
+	if (! start_ssp_key_pool()) {
+		logMessage(LOG_WARNING, "could not start the key pool, the host keys are prepared on each negotiation");
+	}
+
+	// both before the buses are opened, a replayed bus doesn't open its serial device
+	if (metacash.replayFile) {
+		if (! start_ssp_replay(metacash.replayFile, metacash.replayRealtime)) {
+			die("could not load the wire capture to replay", 1);
+			// never reached, already exited
+		}
+		logMessage(LOG_NOTICE, "replaying the SSP exchanges from %s %s", metacash.replayFile,
+				metacash.replayRealtime ? "at the recorded speed" : "as fast as possible");
+	}
+	if (metacash.captureFile) {
+		if (start_ssp_capture(metacash.captureFile)) {
+			logMessage(LOG_NOTICE, "capturing the SSP exchanges to %s", metacash.captureFile);
+		} else {
+			logMessage(LOG_ERR, "could not capture the SSP exchanges to %s: %s", metacash.captureFile, strerror(errno));
+		}
+	}
+
+	// open the serial devices
+	for (unsigned int i = 0; i < metacash.busCount; i++) {
+		struct m_bus *bus = &metacash.buses[i];
+		logMessage(LOG_NOTICE, "using hardware device %s for bus %u (topic namespace '%s')",
+				bus->serialDevice, bus->index, bus->name);
+
+		if (mcSspOpenSerialDevice(bus) == 0) {
+			bus->sspAvailable = 1;
+		} else {
+			logMessage(LOG_ALERT, "ssp communication unavailable on %s", bus->serialDevice);
+		}
+	}
+
+	// setup the ssp commands and start the workers which initialize and configure the hardware
+	setup(&metacash);
+
+	logMessage(LOG_NOTICE, "open for business :D");
+
+	publishPayoutEvent("{ \"event\":\"started\" }");
+
+	event_base_dispatch(metacash.eventBase); // blocking until exited via api-call
+
+	logMessage(LOG_NOTICE, "shutting down");
+
+	// wait for the workers to finish their current job before touching the serial device
+	for (unsigned int i = 0; i < metacash.busCount; i++) {
+		mcSspStopWorker(&metacash.buses[i].validator);
+		mcSspStopWorker(&metacash.buses[i].hopper);
+	}
+	stop_ssp_key_pool();
+	requestCacheStop();
+
+	publishPayoutEvent("{ \"event\":\"exiting\" }");
+
+	// hand over whatever the workers have left in the outbox, if redis is unavailable keep it in the spill file
+	flushLocal();
+	localStop(&metacash);
+	flushOutbox();
+	if (outbox.offline && outbox.spillFd != -1 && outbox.pending.length) {
+		pthread_mutex_lock(&outbox.lock);
+		trimOutbox();
+		pthread_mutex_unlock(&outbox.lock);
+	}
+	for (unsigned int i = 0; i < metacash.busCount; i++) {
+		struct m_bus *bus = &metacash.buses[i];
+		bufferFree(&bus->hopper.state.levels);
+		bufferFree(&bus->hopper.state.cashboxData);
+		bufferFree(&bus->validator.state.levels);
+		bufferFree(&bus->validator.state.cashboxData);
+		bufferFree(&bus->hopper.events);
+		bufferFree(&bus->validator.events);
+
+		if (bus->sspAvailable) {
+			mcSspCloseSerialDevice(bus);
+		}
+	}
+	stop_ssp_capture();
+	stop_ssp_replay();
+
+	// cleanup stuff before exiting.
+
+	// redis
+	if (redisPublishCtx) {
+		redisAsyncFree(redisPublishCtx);
+	}
+	if (redisSubscribeCtx) {
+		redisAsyncFree(redisSubscribeCtx);
+	}
+	if (outbox.spillFd != -1) {
+		close(outbox.spillFd);
+	}
+	bufferFree(&outbox.pending);
+	bufferFree(&outbox.flushing);
+	bufferFree(&outbox.unacked);
+
+	// libevent
+	event_base_free(metacash.eventBase);
+
+	journalStop();
+
+	// syslog
+	logMessage(LOG_NOTICE, "exiting NOW");
+	logStop();
+	closelog();
+
+	return 0;
+}
+
+/**
+ * \brief Parse the command line arguments.
+ */
+int parseCmdLine(int argc, char *argv[], struct m_metacash *metacash) {
+	opterr = 0;
+
+	int c;
+	while ((c = getopt(argc, argv, "ecECFh:p:d:b:g:G:s:S:m:T:M:Q:O:L:J:B:U:w:r:q:W:")) != -1) {
+		switch (c) {
+		case 'h':
+			metacash->redisHost = optarg;
 			break;
-		case 0x01: // Note length incorrect
-			reason = "note length incorrect";
+		case 'p':
+			metacash->redisPort = atoi(optarg);
 			break;
-		case 0x02: // Average fail
-			reason = "internal validation failure: average fail";
+		case 'd':
+			// the unnamed bus, its topics have no namespace
+			if (addBus(metacash, "", optarg)) {
+				return 1;
+			}
 			break;
-		case 0x03: // Coastline fail
-			reason = "internal validation failure: coastline fail";
+		case 'b': {
+			// -b <name>=<serial device>, ex. -b kiosk3=/dev/ttyUSB0
+			char *separator = strchr(optarg, '=');
+			if (separator == NULL || separator == optarg) {
+				fprintf(stderr, "Option -b requires an argument like <name>=<serial device>.\n");
+				logMessage(LOG_ERR, "Option -b requires an argument like <name>=<serial device>.\n");
+				return 1;
+			}
+			*separator = '\0';
+			if (addBus(metacash, optarg, separator + 1)) {
+				return 1;
+			}
 			break;
-		case 0x04: // Graph fail
-			reason = "internal validation failure: graph fail";
+		}
+		case 'g':
+			metacash->hopperCommandGap = strtoul(optarg, NULL, 10);
 			break;
-		case 0x05: // Buried fail
-			reason = "internal validation failure: buried fail";
+		case 'G':
+			metacash->validatorCommandGap = strtoul(optarg, NULL, 10);
 			break;
-		case 0x06: // Channel inhibited
-			reason = "channel inhibited";
+		case 's':
+			metacash->cacheMaxAge = strtoul(optarg, NULL, 10);
 			break;
-		case 0x07: // Second note inserted
-			reason = "second note inserted";
+		case 'S':
+			metacash->snapshotDir = optarg;
 			break;
-		case 0x08: // Reject by host
-			reason = "reject by host";
+		case 'm':
+			metacash->metricsInterval = strtoul(optarg, NULL, 10);
 			break;
-		case 0x09: // Note recognised in more than one channel
-			reason = "note recognised in more than one channel";
+		case 'T':
+			if (strcmp(optarg, "streams") == 0) {
+				metacash->useStreams = 1;
+			} else if (strcmp(optarg, "pubsub") == 0) {
+				metacash->useStreams = 0;
+			} else {
+				fprintf(stderr, "Option -T requires 'pubsub' or 'streams' as argument.\n");
+				logMessage(LOG_ERR, "Option -T requires 'pubsub' or 'streams' as argument.\n");
+				return 1;
+			}
 			break;
-		case 0x0A: // Reject reason 10
-			reason = "rear sensor error";
+		case 'M':
+			metacash->streamMaxLen = strtoul(optarg, NULL, 10);
 			break;
-		case 0x0B: // Note too long
-			reason = "note too long";
+		case 'Q':
+			metacash->outboxLimit = strtoul(optarg, NULL, 10);
 			break;
-		case 0x0C: // Disabled by host
-			reason = "disabled by host";
+		case 'O':
+			metacash->spillFile = optarg;
 			break;
-		case 0x0D: // Mechanism slow/stalled
-			reason = "mechanism slow/stalled";
+		case 'L':
+			metacash->logFile = optarg;
 			break;
-		case 0x0E: // Strimming attempt detected
-			reason = "strimming attempt detected";
+		case 'J':
+			metacash->journalFile = optarg;
 			break;
-		case 0x0F: // Fraud channel reject
-			reason = "fraud channel reject";
+		case 'B':
+			// the rates of the "SET BAUD RATE" command
+			metacash->baudRate = strtoul(optarg, NULL, 10);
+			if (metacash->baudRate != 9600 && metacash->baudRate != 38400 && metacash->baudRate != 115200) {
+				fprintf(stderr, "Option -B requires 9600, 38400 or 115200 as argument.\n");
+				logMessage(LOG_ERR, "Option -B requires 9600, 38400 or 115200 as argument.\n");
+				return 1;
+			}
 			break;
-		case 0x10: // No notes inserted
-			reason = "no notes inserted";
+		case 'U': {
+			struct sockaddr_un address;
+			if (strlen(optarg) >= sizeof(address.sun_path)) {
+				fprintf(stderr, "Path of the local socket '%s' is too long.\n", optarg);
+				logMessage(LOG_ERR, "Path of the local socket '%s' is too long.\n", optarg);
+				return 1;
+			}
+			metacash->localSocket = optarg;
 			break;
-		case 0x11: // Peak detect fail
-			reason = "peak detect fail";
+		}
+		case 'w':
+			metacash->captureFile = optarg;
 			break;
-		case 0x12: // Twisted note detected
-			reason = "twisted note detected";
+		case 'r':
+			metacash->replayFile = optarg;
 			break;
-		case 0x13: // Escrow time-out
-			reason = "escrow time-out";
+		case 'F':
+			metacash->replayRealtime = 0;
 			break;
-		case 0x14: // Bar code scan fail
-			reason = "bar code scan fail";
+		case 'q':
+			metacash->queueLimit = strtoul(optarg, NULL, 10);
 			break;
-		case 0x15: // Rear sensor 2 fail
-			reason = "rear sensor 2 fail";
+		case 'W':
+			metacash->shedThreshold = strtoul(optarg, NULL, 10);
 			break;
-		case 0x16: // Slot fail 1
-			reason = "slot fail 1";
+		case 'c':
+			metacash->acceptCoins = 1;
 			break;
-		case 0x17: // Slot fail 2
-			reason = "slot fail 2";
+		case 'e':
+			metacash->logSyslogStderr = 1;
 			break;
-		case 0x18: // Lens over-sample
-			reason = "lens over-sample";
+		case 'E':
+			metacash->batchEvents = 1;
 			break;
-		case 0x19: // Width detect fail
-			reason = "width detect fail";
+		case 'C':
+			metacash->coalesceEvents = 1;
 			break;
-		case 0x1A: // Short note detected
-			reason = "short note detected";
+		case '?':
+			if (optopt == 'h' || optopt == 'p' || optopt == 'd' || optopt == 'b' || optopt == 'g' || optopt == 'G' || optopt == 's' || optopt == 'S' || optopt == 'm' || optopt == 'T' || optopt == 'M' || optopt == 'Q' || optopt == 'O' || optopt == 'L' || optopt == 'J' || optopt == 'B' || optopt == 'U' || optopt == 'w' || optopt == 'r' || optopt == 'q' || optopt == 'W') {
+				fprintf(stderr, "Option -%c requires an argument.\n", optopt);
+				logMessage(LOG_ERR, "Option -%c requires an argument.\n", optopt);
+			} else if (isprint(optopt)) {
+				fprintf(stderr, "Unknown option '-%c'.\n", optopt);
+				logMessage(LOG_ERR, "Unknown option '-%c'.\n", optopt);
+			} else {
+				fprintf(stderr, "Unknown option character 'x%x'.\n", optopt);
+				logMessage(LOG_ERR, "Unknown option character 'x%x'.\n", optopt);
+			}
+			return 1;
+		default:
+			fprintf(stderr, "Unknown argument: %c", c);
+			logMessage(LOG_ERR, "Unknown argument: %c", c);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * \brief Initializes the parts of the device structure which are common to both device types and
+ * builds its topic names (ex. "kiosk3:hopper-request" for kind "hopper").
+ */
+void initDevice(struct m_device *device, struct m_bus *bus, struct m_metacash *metacash, const char *kind) {
+	const char *separator = bus->name[0] ? ":" : "";
+
+	device->kind = kind;
+	device->sspDeviceAvailable = 0; // defaults to no initially
+	device->key = DEFAULT_KEY;
+	device->metacash = metacash;
+	device->bus = bus;
+	device->workerStarted = 0;
+	memset(&device->state, 0, sizeof(device->state)); // nothing cached yet
+	device->state.disabled = 1; // until the setup has enabled it
+	pthread_mutex_init(&device->state.lock, NULL);
+
+	snprintf(device->requestTopic, sizeof(device->requestTopic), "%s%s%s-request", bus->name, separator, kind);
+	snprintf(device->responseTopic, sizeof(device->responseTopic), "%s%s%s-response", bus->name, separator, kind);
+	snprintf(device->eventTopic, sizeof(device->eventTopic), "%s%s%s-event", bus->name, separator, kind);
+	snprintf(device->eventsTopic, sizeof(device->eventsTopic), "%s%s%s-events", bus->name, separator, kind);
+}
+
+/**
+ * \brief Adds a bus with a hopper and a validator on the given serial device to the registry.
+ * The name is used as namespace of its topics ("" for none). Returns 0 on success.
+ */
+int addBus(struct m_metacash *metacash, char *name, char *serialDevice) {
+	if (metacash->busCount >= MAX_SSP_BUS) {
+		fprintf(stderr, "At most %d buses are supported.\n", MAX_SSP_BUS);
+		logMessage(LOG_ERR, "At most %d buses are supported.\n", MAX_SSP_BUS);
+		return 1;
+	}
+
+	// the longest topic is "<name>:validator-response"
+	if (strlen(name) + strlen(":validator-response") >= TOPIC_MAX_LENGTH) {
+		fprintf(stderr, "Bus name '%s' is too long.\n", name);
+		logMessage(LOG_ERR, "Bus name '%s' is too long.\n", name);
+		return 1;
+	}
+
+	// the name is also part of the snapshot file names, the metrics (JSON) and the datagrams of the local socket
+	if (strpbrk(name, "/\"\\ ")) {
+		fprintf(stderr, "Bus name '%s' must not contain '/', '\"', '\\' or ' '.\n", name);
+		logMessage(LOG_ERR, "Bus name '%s' must not contain '/', '\"', '\\' or ' '.\n", name);
+		return 1;
+	}
+
+	for (unsigned int i = 0; i < metacash->busCount; i++) {
+		if (strcmp(metacash->buses[i].name, name) == 0) {
+			fprintf(stderr, "Bus name '%s' is used more than once.\n", name);
+			logMessage(LOG_ERR, "Bus name '%s' is used more than once.\n", name);
+			return 1;
+		}
+	}
+
+	struct m_bus *bus = &metacash->buses[metacash->busCount];
+	bus->index = metacash->busCount;
+	bus->name = name;
+	bus->serialDevice = serialDevice;
+	bus->sspAvailable = 0; // defaults to no initially
+
+	initDevice(&bus->hopper, bus, metacash, "hopper");
+	bus->hopper.id = 0x10; // 0x10 -> Smart Hopper ("Münzer")
+	bus->hopper.name = "Mr. Coin";
+	bus->hopper.commandClass = CMD_HOPPER;
+	bus->hopper.setupFn = setupHopper;
+	bus->hopper.eventKind = EVENT_HOPPER;
+
+	initDevice(&bus->validator, bus, metacash, "validator");
+	bus->validator.id = 0x00; // 0x00 -> Smart Payout NV200 ("Scheiner")
+	bus->validator.name = "Ms. Note";
+	bus->validator.commandClass = CMD_VALIDATOR;
+	bus->validator.setupFn = setupValidator;
+	bus->validator.eventKind = EVENT_VALIDATOR;
+
+	metacash->busCount++;
+	return 0;
+}
+
+/**
+ * \brief Properties of the JSON event which are rendered from the data of a poll event.
+ */
+enum m_event_field {
+	/** \brief End of the fields */
+	EVENT_FIELD_END,
+	/** \brief "amount" from data1 */
+	EVENT_FIELD_AMOUNT,
+	/** \brief "amount" the note of the channel in data1 is worth (validator) */
+	EVENT_FIELD_NOTE_AMOUNT,
+	/** \brief "channel" from data1 */
+	EVENT_FIELD_CHANNEL,
+	/** \brief "dispensed" from data1 */
+	EVENT_FIELD_DISPENSED,
+	/** \brief "requested" from data2 */
+	EVENT_FIELD_REQUESTED,
+	/** \brief "cc", the country code */
+	EVENT_FIELD_CC,
+	/** \brief "id", the hex code of the event (unknown events) */
+	EVENT_FIELD_ID
+};
+
+/** \brief Maximum number of fields of an event template */
+#define EVENT_MAX_FIELDS 3
+
+/**
+ * \brief A JSON event split into its constant beginning and the fields appended behind it.
+ */
+struct m_event_template {
+	/** \brief The constant beginning of the JSON object (ex. '{"event":"dispensing"'), NULL if the device doesn't report the event */
+	const char *prefix;
+	/** \brief Length of prefix */
+	size_t prefixLength;
+	/** \brief The fields appended to the prefix, terminated by EVENT_FIELD_END if less than EVENT_MAX_FIELDS */
+	unsigned char fields[EVENT_MAX_FIELDS];
+};
+
+/** \brief Flag of eventDefs: the event ends a running payout, float or empty */
+#define EVENT_TRANSACTION_END 0x01
+/** \brief Flag of eventDefs: the event means the levels of the device have changed */
+#define EVENT_LEVEL_CHANGE 0x02
+/** \brief Flag of eventDefs: the event only tells about the progress of an operation, repeated on every poll */
+#define EVENT_PROGRESS 0x04
+/** \brief Flag of eventDefs: data1 0 means a note is being read (progress event readingEvent) */
+#define EVENT_NOTE_READ 0x08
+/** \brief Flag of eventDefs: the device has been reset, the host protocol has to be set again */
+#define EVENT_RESET 0x10
+/** \brief Flag of eventDefs: data1 is the error code, rendered with calibrationEvents */
+#define EVENT_CALIBRATION 0x20
+
+/**
+ * \brief How an event reported by a poll is rendered and what it means.
+ */
+struct m_event_def {
+	/** \brief EVENT_* flags */
+	unsigned char flags;
+	/** \brief The syslog priority the event is logged with, if more important than LOG_INFO */
+	unsigned char severity;
+	/** \brief The JSON event per m_event_kind */
+	struct m_event_template templates[2];
+};
+
+#define EVENT_TEMPLATE_JSON(json, ...) { json, sizeof(json) - 1, { __VA_ARGS__ } }
+#define EVENT_TEMPLATE(name, ...) EVENT_TEMPLATE_JSON("{\"event\":\"" name "\"", __VA_ARGS__)
+#define EVENT_UNSUPPORTED { NULL, 0, { EVENT_FIELD_END } }
+#define EVENT_SAME(name, ...) { EVENT_TEMPLATE(name, __VA_ARGS__), EVENT_TEMPLATE(name, __VA_ARGS__) }
+
+/**
+ * \brief The events reported by a poll indexed by their SSP code, every code not listed is published as "unknown".
+ * \details The payload layout of the codes is decoded by ssp6_decode_poll() of libitlssp.
+ */
+static const struct m_event_def eventDefs[256] = {
+	[SSP_POLL_RESET] = { EVENT_TRANSACTION_END | EVENT_LEVEL_CHANGE | EVENT_RESET, LOG_NOTICE,
+			EVENT_SAME("unit reset", EVENT_FIELD_END) },
+	[SSP_POLL_READ] = { EVENT_NOTE_READ, LOG_INFO, {
+			EVENT_TEMPLATE("read", EVENT_FIELD_CHANNEL),
+			EVENT_TEMPLATE("read", EVENT_FIELD_NOTE_AMOUNT, EVENT_FIELD_CHANNEL) } },
+	[SSP_POLL_TIMEOUT] = { EVENT_TRANSACTION_END, LOG_WARNING,
+			EVENT_SAME("timeout", EVENT_FIELD_AMOUNT, EVENT_FIELD_CC) },
+	[SSP_POLL_DISPENSING] = { EVENT_PROGRESS, LOG_INFO, {
+			EVENT_TEMPLATE("dispensing", EVENT_FIELD_AMOUNT), EVENT_UNSUPPORTED } },
+	[SSP_POLL_DISPENSED] = { EVENT_TRANSACTION_END | EVENT_LEVEL_CHANGE, LOG_INFO, {
+			EVENT_TEMPLATE("dispensed", EVENT_FIELD_AMOUNT), EVENT_UNSUPPORTED } },
+	[SSP_POLL_FLOATING] = { EVENT_PROGRESS, LOG_INFO, {
+			EVENT_TEMPLATE("floating", EVENT_FIELD_AMOUNT, EVENT_FIELD_CC), EVENT_UNSUPPORTED } },
+	[SSP_POLL_FLOATED] = { EVENT_TRANSACTION_END | EVENT_LEVEL_CHANGE, LOG_INFO, {
+			EVENT_TEMPLATE("floated", EVENT_FIELD_AMOUNT, EVENT_FIELD_CC), EVENT_UNSUPPORTED } },
+	[SSP_POLL_CASHBOX_PAID] = { EVENT_LEVEL_CHANGE, LOG_INFO, {
+			EVENT_TEMPLATE("cashbox paid", EVENT_FIELD_AMOUNT, EVENT_FIELD_CC), EVENT_UNSUPPORTED } },
+	[SSP_POLL_JAMMED] = { EVENT_TRANSACTION_END, LOG_WARNING, {
+			EVENT_TEMPLATE("jammed", EVENT_FIELD_END), EVENT_UNSUPPORTED } },
+	[SSP_POLL_FRAUD_ATTEMPT] = { 0, LOG_WARNING, {
+			EVENT_TEMPLATE("fraud attempt", EVENT_FIELD_END),
+			EVENT_TEMPLATE("fraud attempt", EVENT_FIELD_DISPENSED) } },
+	[SSP_POLL_COIN_CREDIT] = { EVENT_LEVEL_CHANGE, LOG_INFO, {
+			EVENT_TEMPLATE("coin credit", EVENT_FIELD_AMOUNT, EVENT_FIELD_CC), EVENT_UNSUPPORTED } },
+	[SSP_POLL_EMPTY] = { EVENT_TRANSACTION_END | EVENT_LEVEL_CHANGE, LOG_INFO,
+			EVENT_SAME("empty", EVENT_FIELD_END) },
+	[SSP_POLL_EMPTYING] = { EVENT_PROGRESS, LOG_INFO,
+			EVENT_SAME("emptying", EVENT_FIELD_END) },
+	[SSP_POLL_SMART_EMPTYING] = { EVENT_PROGRESS, LOG_INFO, {
+			EVENT_TEMPLATE("smart emptying", EVENT_FIELD_AMOUNT, EVENT_FIELD_CC),
+			EVENT_TEMPLATE("smart emptying", EVENT_FIELD_END) } },
+	[SSP_POLL_SMART_EMPTIED] = { EVENT_TRANSACTION_END | EVENT_LEVEL_CHANGE, LOG_INFO, {
+			EVENT_TEMPLATE("smart emptied", EVENT_FIELD_AMOUNT, EVENT_FIELD_CC), EVENT_UNSUPPORTED } },
+	// the note which was in escrow has been accepted
+	[SSP_POLL_CREDIT] = { EVENT_LEVEL_CHANGE, LOG_INFO, {
+			EVENT_TEMPLATE("credit", EVENT_FIELD_CHANNEL, EVENT_FIELD_CC),
+			EVENT_TEMPLATE("credit", EVENT_FIELD_NOTE_AMOUNT, EVENT_FIELD_CHANNEL) } },
+	// the device shut down during a payout / float, some value remains to pay out / float
+	[SSP_POLL_INCOMPLETE_PAYOUT] = { EVENT_TRANSACTION_END | EVENT_LEVEL_CHANGE, LOG_WARNING,
+			EVENT_SAME("incomplete payout", EVENT_FIELD_DISPENSED, EVENT_FIELD_REQUESTED, EVENT_FIELD_CC) },
+	[SSP_POLL_INCOMPLETE_FLOAT] = { EVENT_TRANSACTION_END | EVENT_LEVEL_CHANGE, LOG_WARNING,
+			EVENT_SAME("incomplete float", EVENT_FIELD_DISPENSED, EVENT_FIELD_REQUESTED, EVENT_FIELD_CC) },
+	[SSP_POLL_DISABLED] = { EVENT_TRANSACTION_END, LOG_INFO,
+			EVENT_SAME("disabled", EVENT_FIELD_END) },
+	[SSP_POLL_CALIBRATION_FAIL] = { EVENT_CALIBRATION, LOG_WARNING,
+			EVENT_SAME("calibration fail", EVENT_FIELD_END) },
+	[SSP_POLL_REJECTING] = { 0, LOG_INFO, { EVENT_UNSUPPORTED, EVENT_TEMPLATE("rejecting", EVENT_FIELD_END) } },
+	[SSP_POLL_REJECTED] = { 0, LOG_INFO, { EVENT_UNSUPPORTED, EVENT_TEMPLATE("rejected", EVENT_FIELD_END) } },
+	[SSP_POLL_STACKING] = { 0, LOG_INFO, { EVENT_UNSUPPORTED, EVENT_TEMPLATE("stacking", EVENT_FIELD_END) } },
+	// the note has been stored in the payout unit
+	[SSP_POLL_STORED] = { EVENT_LEVEL_CHANGE, LOG_INFO, { EVENT_UNSUPPORTED, EVENT_TEMPLATE("stored", EVENT_FIELD_END) } },
+	// the note has been stacked in the cashbox
+	[SSP_POLL_STACKED] = { 0, LOG_INFO, { EVENT_UNSUPPORTED, EVENT_TEMPLATE("stacked", EVENT_FIELD_END) } },
+	[SSP_POLL_SAFE_JAM] = { 0, LOG_WARNING, { EVENT_UNSUPPORTED, EVENT_TEMPLATE("safe jam", EVENT_FIELD_END) } },
+	[SSP_POLL_UNSAFE_JAM] = { 0, LOG_WARNING, { EVENT_UNSUPPORTED, EVENT_TEMPLATE("unsafe jam", EVENT_FIELD_END) } },
+	[SSP_POLL_STACKER_FULL] = { 0, LOG_WARNING, { EVENT_UNSUPPORTED, EVENT_TEMPLATE("stacker full", EVENT_FIELD_END) } },
+	[SSP_POLL_CASH_BOX_REMOVED] = { 0, LOG_NOTICE, { EVENT_UNSUPPORTED, EVENT_TEMPLATE("cashbox removed", EVENT_FIELD_END) } },
+	[SSP_POLL_CASH_BOX_REPLACED] = { 0, LOG_NOTICE, { EVENT_UNSUPPORTED, EVENT_TEMPLATE("cashbox replaced", EVENT_FIELD_END) } },
+	// a note was in the notepath at startup and has been cleared from the front / into the cashbox
+	[SSP_POLL_CLEARED_FROM_FRONT] = { 0, LOG_INFO, { EVENT_UNSUPPORTED, EVENT_TEMPLATE("cleared from front", EVENT_FIELD_END) } },
+	[SSP_POLL_CLEARED_INTO_CASHBOX] = { 0, LOG_INFO, { EVENT_UNSUPPORTED, EVENT_TEMPLATE("cleared into cashbox", EVENT_FIELD_END) } }
+};
+
+/** \brief A "read" without a channel, the note has not been validated yet (reported more than once for a single note) */
+static const struct m_event_template readingEvent = EVENT_TEMPLATE("reading", EVENT_FIELD_END);
+
+/** \brief Fallback for the codes a device isn't known to report, have a look in the SSP reference manual if you see it */
+static const struct m_event_template unknownEvent = EVENT_TEMPLATE("unknown", EVENT_FIELD_ID);
+
+/** \brief SSP_POLL_CALIBRATION_FAIL indexed by its error code (enum calibration_failures), other codes aren't published */
+static const struct m_event_template calibrationEvents[] = {
+	[NO_FAILUE] = EVENT_TEMPLATE_JSON("{\"event\":\"calibration fail\",\"error\":\"no error\"", EVENT_FIELD_END),
+	[SENSOR_FLAP] = EVENT_TEMPLATE_JSON("{\"event\":\"calibration fail\",\"error\":\"sensor flap\"", EVENT_FIELD_END),
+	[SENSOR_EXIT] = EVENT_TEMPLATE_JSON("{\"event\":\"calibration fail\",\"error\":\"sensor exit\"", EVENT_FIELD_END),
+	[SENSOR_COIL1] = EVENT_TEMPLATE_JSON("{\"event\":\"calibration fail\",\"error\":\"sensor coil 1\"", EVENT_FIELD_END),
+	[SENSOR_COIL2] = EVENT_TEMPLATE_JSON("{\"event\":\"calibration fail\",\"error\":\"sensor coil 2\"", EVENT_FIELD_END),
+	[NOT_INITIALISED] = EVENT_TEMPLATE_JSON("{\"event\":\"calibration fail\",\"error\":\"not initialized\"", EVENT_FIELD_END),
+	[CHECKSUM_ERROR] = EVENT_TEMPLATE_JSON("{\"event\":\"calibration fail\",\"error\":\"checksum error\"", EVENT_FIELD_END),
+	// the device asks us to run the calibration
+	[COMMAND_RECAL] = EVENT_TEMPLATE("recalibrating", EVENT_FIELD_END)
+};
+
+/**
+ * \brief Appends the key of a field (ex. ',"amount":') followed by the decimal value to the buffer.
+ */
+void bufferAppendField(struct m_buffer *buffer, const char *key, size_t keyLength, unsigned long value) {
+	char digits[24];
+	char *end = digits + sizeof(digits);
+	char *start = end;
+	do {
+		*--start = '0' + value % 10;
+		value /= 10;
+	} while (value);
+
+	bufferAppend(buffer, key, keyLength);
+	bufferAppend(buffer, start, end - start);
+}
+
+/**
+ * \brief Appends the event rendered with the template as JSON object to the buffer, with a "count" if count != 0.
+ * Returns 0 on success.
+ */
+int renderEvent(struct m_buffer *buffer, struct m_device *device, const struct m_event_template *template,
+		const SSP_POLL_EVENT6 *event, unsigned int count) {
+	static const char hex[] = "0123456789ABCDEF";
+
+	bufferAppend(buffer, template->prefix, template->prefixLength);
+	for (int i = 0; i < EVENT_MAX_FIELDS && template->fields[i] != EVENT_FIELD_END; i++) {
+		switch (template->fields[i]) {
+		case EVENT_FIELD_AMOUNT:
+			bufferAppendField(buffer, ",\"amount\":", 10, event->data1);
 			break;
-		case 0x1B: // Note payout
-			reason = "note payout";
+		case EVENT_FIELD_NOTE_AMOUNT: {
+			// the channels are numbered from 1
+			SSP6_SETUP_REQUEST_DATA *setup = &device->sspSetupReq;
+			unsigned long amount = 0;
+			if (event->data1 > 0 && event->data1 <= setup->NumberOfChannels && event->data1 <= 20) {
+				amount = setup->ChannelData[event->data1 - 1].value * 100;
+			}
+			bufferAppendField(buffer, ",\"amount\":", 10, amount);
 			break;
-		case 0x1C: // Unable to stack note
-			reason = "unable to stack note";
+		}
+		case EVENT_FIELD_CHANNEL:
+			bufferAppendField(buffer, ",\"channel\":", 11, event->data1);
 			break;
-		default: // not defined in API doc
-			reason = "undefined in API";
+		case EVENT_FIELD_DISPENSED:
+			bufferAppendField(buffer, ",\"dispensed\":", 13, event->data1);
+			break;
+		case EVENT_FIELD_REQUESTED:
+			bufferAppendField(buffer, ",\"requested\":", 13, event->data2);
+			break;
+		case EVENT_FIELD_CC:
+			bufferAppend(buffer, ",\"cc\":\"", 7);
+			// the country code comes from the device, only letters end up in the JSON
+			for (int j = 0; j < 3 && event->cc[j]; j++) {
+				if (isalpha((unsigned char) event->cc[j])) {
+					bufferAppend(buffer, &event->cc[j], 1);
+				}
+			}
+			bufferAppend(buffer, "\"", 1);
+			break;
+		case EVENT_FIELD_ID: {
+			char id[] = ",\"id\":\"0x00\"";
+			id[9] = hex[event->event >> 4];
+			id[10] = hex[event->event & 0x0F];
+			bufferAppend(buffer, id, sizeof(id) - 1);
 			break;
 		}
+		}
+	}
+	if (count) {
+		bufferAppendField(buffer, ",\"count\":", 9, count);
+	}
+	bufferAppend(buffer, "}", 1);
+
+	return buffer->failed;
+}
+
+/**
+ * \brief Renders the event reported by a poll of the device (worker only) with the template of eventDefs and publishes it
+ * to the event topic of the device (or adds it to the events of the poll with -E). count != 0 is the number of events
+ * a coalesced progress event stands for (see mcSspPublishHeldEvent()). Returns 0 on success.
+ * \details Details only to get graph.
+ * \callgraph
+ */
+int mcSspPublishEvent(struct m_device *device, const SSP_POLL_EVENT6 *event, unsigned int count) {
+	// reused for every event of this thread, never shrinks
+	static _Thread_local struct m_buffer scratch;
+
+	const struct m_event_def *def = &eventDefs[event->event];
+	const struct m_event_template *template = &def->templates[device->eventKind];
+	if (def->flags & EVENT_CALIBRATION) {
+		if (event->data1 >= sizeof(calibrationEvents) / sizeof(calibrationEvents[0])) {
+			return 0;
+		}
+		template = &calibrationEvents[event->data1];
+	} else if ((def->flags & EVENT_NOTE_READ) && event->data1 == 0) {
+		template = &readingEvent;
+	} else if (template->prefix == NULL) {
+		template = &unknownEvent;
+	}
+
+	// with -E the event goes straight into the array published by mcSspDispatchEvents()
+	struct m_buffer *buffer = &scratch;
+	size_t start = 0;
+	if (device->batchingEvents) {
+		buffer = &device->events;
+		if (buffer->length > 1) {
+			bufferAppend(buffer, ",", 1);
+		}
+		start = buffer->length;
+	} else {
+		bufferReset(buffer);
+	}
+	if (renderEvent(buffer, device, template, event, count)) {
+		logMessage(LOG_ERR, "mcSspPublishEvent: out of memory, dropping event 0x%02X of '%s'", event->event, device->name);
+		return 1;
+	}
+
+	int rc = buffer == &scratch ? publishMessage(device->eventTopic, buffer->data, buffer->length) : 0;
+	if (def->severity < LOG_INFO && template != &unknownEvent) {
+		logMessage(def->severity, "%s reported %.*s", device->name, (int) (buffer->length - start), buffer->data + start);
+	}
+
+	if (count) {
+		return rc;
+	}
+	if (def->flags & EVENT_RESET) {
+		// make sure we are using ssp version 6
+		if (ssp6_host_protocol(&device->sspC, 0x06) != SSP_RESPONSE_OK) {
+			die("mcSspPublishEvent: SSP Host Protocol Failed", 3);
+			// never reached, already exited
+		}
+	} else if (template == &calibrationEvents[COMMAND_RECAL]) {
+		ssp6_run_calibration(&device->sspC);
+	}
+
+	return rc;
+}
+
+/**
+ * \brief Publishes the events reported by a poll of the device, one by one in the order of the poll (worker only).
+ */
+void mcSspPublishEvents(struct m_device *device, SSP_POLL_DATA6 *poll) {
+	for (unsigned int i = 0; i < poll->event_count; i++) {
+		mcSspPublishEvent(device, &poll->events[i], 0);
+	}
+}
+
+/**
+ * \brief Initializes and configures redis, libevent and the hardware.
+ */
+void setup(struct m_metacash *metacash) {
+	// initialize libEvent
+	metacash->eventBase = event_base_new();
+
+	// the outbox keeps the messages while redis is unavailable, optionally spilling them to a file
+	outbox.offlineLimit = metacash->outboxLimit * 1024;
+	if (metacash->spillFile) {
+		outbox.spillFd = open(metacash->spillFile, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+		if (outbox.spillFd == -1) {
+			logMessage(LOG_ERR, "could not open spill file '%s': %s", metacash->spillFile, strerror(errno));
+			die("could not open spill file", 1);
+			// never reached, already exited
+		}
+
+		// messages left over by the last run are published first
+		struct stat st;
+		if (fstat(outbox.spillFd, &st) == 0) {
+			outbox.spillLength = st.st_size;
+		}
+	}
+
+	// connect to redis, both connections are reconnected with a backoff whenever they are lost
+	struct m_redis_link *links[] = { &publishLink, &subscribeLink };
+	publishLink.name = "publish";
+	publishLink.ctx = &redisPublishCtx;
+	publishLink.connectFn = cbOnConnectPublishContext;
+	publishLink.disconnectFn = cbOnDisconnectPublishContext;
+	subscribeLink.name = "subscribe";
+	subscribeLink.ctx = &redisSubscribeCtx;
+	subscribeLink.connectFn = cbOnConnectSubscribeContext;
+	subscribeLink.disconnectFn = cbOnDisconnectSubscribeContext;
+	for (int i = 0; i < 2; i++) {
+		links[i]->backoff = REDIS_RECONNECT_MIN;
+		links[i]->metacash = metacash;
+		event_set(&links[i]->evReconnect, -1, 0, cbOnReconnectEvent, links[i]);
+		event_base_set(metacash->eventBase, &links[i]->evReconnect);
+		event_set(&links[i]->evRetry, -1, 0, cbOnRetryEvent, links[i]);
+		event_base_set(metacash->eventBase, &links[i]->evRetry);
+		openRedisLink(links[i]);
+	}
+
+	// setup libevent triggered check if we should quit (every 500ms more or less)
+	{
+		struct timeval interval;
+		interval.tv_sec = 0;
+		interval.tv_usec = 500000;
+
+		event_set(&metacash->evCheckQuit, 0, EV_PERSIST, cbOnCheckQuitEvent, metacash); // provide metacash in privdata
+		event_base_set(metacash->eventBase, &metacash->evCheckQuit);
+		evtimer_add(&metacash->evCheckQuit, &interval);
+	}
+
+	// setup libevent triggered publishing of the messages the workers have put into the outbox
+	{
+		outbox.streamMaxLen = metacash->useStreams ? metacash->streamMaxLen : 0;
+		if (metacash->useStreams && outbox.streamMaxLen == 0) {
+			outbox.streamMaxLen = DEFAULT_STREAM_MAX_LEN; // 0 would mean PUBLISH
+		}
+
+		if (pipe(outbox.wakeupFd) != 0) {
+			die("could not create outbox pipe", 1);
+			// never reached, already exited
+		}
+		fcntl(outbox.wakeupFd[0], F_SETFL, O_NONBLOCK);
+		fcntl(outbox.wakeupFd[1], F_SETFL, O_NONBLOCK);
+
+		event_set(&metacash->evOutbox, outbox.wakeupFd[0], EV_READ | EV_PERSIST, cbOnOutboxEvent, metacash);
+		event_base_set(metacash->eventBase, &metacash->evOutbox);
+		event_add(&metacash->evOutbox, NULL);
+	}
+
+	// local clients are served by the same event loop and outbox
+	if (metacash->localSocket) {
+		localStart(metacash);
+	}
+
+	// try to initialize the hardware of the buses we successfully have opened
+	for (unsigned int i = 0; i < metacash->busCount; i++) {
+		setupBus(metacash, &metacash->buses[i]);
+	}
+
+	// setup libevent triggered publishing of the metrics
+	if (metacash->metricsInterval) {
+		struct timeval interval;
+		interval.tv_sec = metacash->metricsInterval;
+		interval.tv_usec = 0;
+
+		event_set(&metacash->evMetrics, 0, EV_PERSIST, cbOnMetricsEvent, metacash); // provide metacash in privdata
+		event_base_set(metacash->eventBase, &metacash->evMetrics);
+		evtimer_add(&metacash->evMetrics, &interval);
+	}
+
+	// setup libevent triggered polling of the hardware, the tick only checks which device is due
+	{
+		struct timeval interval;
+		interval.tv_sec = 0;
+		interval.tv_usec = POLL_TICK * 1000;
 
-		replyWith(cmd->responseTopic,
-				"{\"correlId\":\"%s\",\"reason\":\"%s\",\"code\":%ld}",
-				cmd->correlId, reason, reasonCode);
-	} else {
-		replyWithSspResponse(cmd, resp);
+		event_set(&metacash->evPoll, 0, EV_PERSIST, cbOnPollEvent, metacash); // provide metacash in privdata
+		event_base_set(metacash->eventBase, &metacash->evPoll);
+		evtimer_add(&metacash->evPoll, &interval);
 	}
 }
 
 /**
- * \brief Handles the JSON "channel-security" command.
+ * \brief Prepares the SSP_COMMAND structures of the devices of a bus and starts their workers.
+ * \details Each worker initializes and configures its device as its first job, so the devices
+ * are set up concurrently and a device is polled as soon as it is ready ("started" in its event topic).
  */
-void handleChannelSecurityData(struct m_command *cmd) {
-	mc_ssp_channel_security_data(&cmd->device->sspC);
+void setupBus(struct m_metacash *metacash, struct m_bus *bus) {
+	// try to initialize the hardware only if we successfully have opened the device
+	if (! bus->sspAvailable) {
+		logMessage(LOG_WARNING, "SSP communication on %s unavailable, skipping hardware setup", bus->serialDevice);
+		return;
+	}
+
+	struct m_device *devices[] = { &bus->validator, &bus->hopper };
+	for (unsigned int i = 0; i < sizeof(devices) / sizeof(devices[0]); i++) {
+		struct m_device *device = devices[i];
+
+		// prepare the device structure
+		mcSspSetupCommand(&device->sspC, bus->index, device->id);
+
+		// pace the exchanges per device instead of sleeping before each of them
+		device->commandGap = device == &bus->hopper ? metacash->hopperCommandGap : metacash->validatorCommandGap;
+		set_ssp_command_gap(bus->index, device->sspC.SSPAddress, device->commandGap);
+	}
+
+	// the devices share the port, so they are switched to another rate before any of the workers talks to them
+	if (metacash->baudRate != DEFAULT_BAUD_RATE) {
+		mcSspNegotiateBaud(metacash, bus);
+	}
+
+	for (unsigned int i = 0; i < sizeof(devices) / sizeof(devices[0]); i++) {
+		struct m_device *device = devices[i];
+
+		// from now on all SSP traffic of the device is done by its worker
+		mcSspStartWorker(device);
+
+		struct m_job *job = calloc(1, sizeof(struct m_job));
+		if (job == NULL) {
+			die("could not queue the setup of a device", 1);
+			// never reached, already exited
+		}
+		job->type = JOB_SETUP;
+		if (mcSspQueueJob(device, job) != 0) {
+			die("could not queue the setup of a device", 1);
+			// never reached, already exited
+		}
+	}
 }
 
 /**
- * \brief Handles the JSON "test" command
+ * \brief Builds the path of the configuration snapshot of the device. Returns 0 on success.
  */
-void handleTest(struct m_command *cmd) {
-	replyWithSspResponse(cmd, SSP_RESPONSE_OK);
+int snapshotPath(struct m_device *device, char *path, size_t size) {
+	const char *separator = device->bus->name[0] ? ":" : "";
+	int length = snprintf(path, size, "%s/%s%s%s.snapshot", device->metacash->snapshotDir,
+			device->bus->name, separator, device->kind);
+	return length < 0 || (size_t) length >= size;
 }
 
 /**
- * \brief Handles the JSON "configure-bezel" command.
+ * \brief Builds the content of the configuration snapshot: the dataset version of the device and
+ * the configuration we apply. Returns 0 on success.
  */
-void handleConfigureBezel(struct m_command *cmd) {
-	json_t *jR = json_object_get(cmd->jsonMessage, "r");
-	if(! json_is_integer(jR)) {
-		replyWithPropertyError(cmd, "r");
-		return;
+int snapshotContent(struct m_device *device, const char *config, struct m_buffer *content) {
+	pthread_mutex_lock(&device->state.lock);
+	int rc = device->state.datasetVersionAt == 0
+			|| bufferPrintf(content, "%s\n%s\n", device->state.datasetVersion, config);
+	pthread_mutex_unlock(&device->state.lock);
+	return rc;
+}
+
+/**
+ * \brief Checks if config has already been applied to the device, according to the snapshot
+ * saved by saveSnapshot() for the same dataset version. Returns !=0 if so.
+ */
+int isSnapshotCurrent(struct m_device *device, const char *config) {
+	char path[PATH_MAX];
+	if (device->metacash->snapshotDir == NULL || snapshotPath(device, path, sizeof(path))) {
+		return 0;
 	}
-	unsigned char r = json_integer_value(jR);
 
-	json_t *jG = json_object_get(cmd->jsonMessage, "g");
-	if(! json_is_integer(jG)) {
-		replyWithPropertyError(cmd, "g");
-		return;
+	struct m_buffer expected = { NULL, 0, 0, 0 };
+	if (snapshotContent(device, config, &expected)) {
+		bufferFree(&expected);
+		return 0;
 	}
-	unsigned char g = json_integer_value(jG);
 
-	json_t *jB = json_object_get(cmd->jsonMessage, "b");
-	if(! json_is_integer(jB)) {
-		replyWithPropertyError(cmd, "b");
+	int current = 0;
+	FILE *file = fopen(path, "r");
+	if (file) {
+		char *saved = malloc(expected.length + 1);
+		if (saved) {
+			// one byte more than expected, so a longer snapshot doesn't match either
+			size_t length = fread(saved, 1, expected.length + 1, file);
+			current = length == expected.length && memcmp(saved, expected.data, length) == 0;
+			free(saved);
+		}
+		fclose(file);
+	}
+
+	bufferFree(&expected);
+	return current;
+}
+
+/**
+ * \brief Remembers that config has been applied to the device with its current dataset version.
+ * \details The snapshot is written to a temporary file first and renamed, so a crash never leaves
+ * a partial snapshot behind.
+ */
+void saveSnapshot(struct m_device *device, const char *config) {
+	char path[PATH_MAX];
+	char temporaryPath[PATH_MAX + 4];
+	if (device->metacash->snapshotDir == NULL || snapshotPath(device, path, sizeof(path))) {
 		return;
 	}
-	unsigned char b = json_integer_value(jB);
+	snprintf(temporaryPath, sizeof(temporaryPath), "%s.tmp", path);
 
-	json_t *jType = json_object_get(cmd->jsonMessage, "type");
-	if(! json_is_integer(jType)) {
-		replyWithPropertyError(cmd, "type");
+	struct m_buffer content = { NULL, 0, 0, 0 };
+	if (snapshotContent(device, config, &content)) {
+		bufferFree(&content);
 		return;
 	}
-	unsigned char type = json_integer_value(jType);
 
-	replyWithSspResponse(cmd,
-			mc_ssp_configure_bezel(&cmd->device->sspC, r, g, b, SSP_OPTION_NON_VOLATILE, type));
+	FILE *file = fopen(temporaryPath, "w");
+	if (file == NULL) {
+		logMessage(LOG_WARNING, "could not write snapshot %s: %s", temporaryPath, strerror(errno));
+	} else {
+		int failed = fwrite(content.data, 1, content.length, file) != content.length;
+		failed |= fclose(file) != 0;
+		if (failed || rename(temporaryPath, path) != 0) {
+			logMessage(LOG_WARNING, "could not write snapshot %s: %s", path, strerror(errno));
+			unlink(temporaryPath);
+		}
+	}
+
+	bufferFree(&content);
 }
 
 /**
- * \brief Callback function triggered by an incoming message in either
- * the "hopper-request" or "validator-request" topic.
- * \details Details only to get graph.
- * \callgraph
+ * \brief Switches the devices of the bus and its port to metacash.baudRate, called before the workers are started.
+ * \details A device is asked to change its rate at 9600 baud, or found at the new rate already if it has been
+ * switched by a previous run (the change lasts until the device is reset). As the devices share the port, the bus
+ * is only switched if every device which answers has changed, otherwise they are switched back to 9600 baud.
  */
-void cbOnRequestMessage(redisAsyncContext *c, void *r, void *privdata) {
-	if (r == NULL) {
+void mcSspNegotiateBaud(struct m_metacash *metacash, struct m_bus *bus) {
+	struct m_device *devices[] = { &bus->validator, &bus->hopper };
+	const unsigned int count = sizeof(devices) / sizeof(devices[0]);
+	unsigned long baudRates[sizeof(devices) / sizeof(devices[0])]; // of the devices, 0 if absent
+	int refused = 0;
+
+	for (unsigned int i = 0; i < count; i++) {
+		SSP_COMMAND *sspC = &devices[i]->sspC;
+		baudRates[i] = 0;
+		if (set_ssp_device_baud(sspC, DEFAULT_BAUD_RATE, metacash->baudRate)) {
+			baudRates[i] = metacash->baudRate;
+		} else if (sspC->ResponseData[0] != SSP_RESPONSE_TIMEOUT) {
+			// the device is there, but doesn't support the rate
+			logMessage(LOG_WARNING, "device '%s' refused %lu baud (0x%02X)", devices[i]->name,
+					metacash->baudRate, sspC->ResponseData[0]);
+			baudRates[i] = DEFAULT_BAUD_RATE;
+			refused = 1;
+		} else if (set_ssp_device_baud(sspC, metacash->baudRate, metacash->baudRate)) {
+			baudRates[i] = metacash->baudRate;
+		}
+	}
+
+	if (! refused && set_ssp_bus_baud(bus->index, metacash->baudRate)) {
+		int failed = 0;
+		for (unsigned int i = 0; i < count; i++) {
+			if (baudRates[i] && ssp6_sync(&devices[i]->sspC) != SSP_RESPONSE_OK) {
+				logMessage(LOG_WARNING, "device '%s' does not answer at %lu baud", devices[i]->name, metacash->baudRate);
+				failed = 1;
+			}
+		}
+		if (! failed) {
+			logMessage(LOG_NOTICE, "bus %s switched to %lu baud", bus->serialDevice, metacash->baudRate);
+			return;
+		}
+		set_ssp_bus_baud(bus->index, DEFAULT_BAUD_RATE);
+	}
+
+	// fall back to the rate every device has after a reset
+	for (unsigned int i = 0; i < count; i++) {
+		if (baudRates[i] == metacash->baudRate
+				&& ! set_ssp_device_baud(&devices[i]->sspC, metacash->baudRate, DEFAULT_BAUD_RATE)) {
+			logMessage(LOG_ERR, "could not switch device '%s' back to %lu baud", devices[i]->name, DEFAULT_BAUD_RATE);
+		}
+	}
+	logMessage(LOG_WARNING, "bus %s stays at %lu baud", bus->serialDevice, DEFAULT_BAUD_RATE);
+}
+
+/**
+ * \brief Checks if the device answers after a restart, it is back at DEFAULT_BAUD_RATE without a key.
+ * Switches it to the rate of the bus if that is another one. Returns !=0 if it answers (worker only).
+ */
+int mcSspProbeRestart(struct m_device *device) {
+	unsigned long baudRate = get_ssp_bus_baud(device->bus->index);
+	if (baudRate == DEFAULT_BAUD_RATE) {
+		// a plain sync, a unit may refuse SET BAUD RATE to the rate it is at already
+		return ssp6_sync(&device->sspC) == SSP_RESPONSE_OK;
+	}
+	return set_ssp_device_baud(&device->sspC, DEFAULT_BAUD_RATE, baudRate);
+}
+
+/**
+ * \brief Initializes and configures the device, runs as the first job of its worker.
+ * \details A lost device (setupRetry) is probed with mcSspProbeRestart() first. If it doesn't answer,
+ * the setup is queued again by mcSspQueuePoll() after SETUP_RETRY_INTERVAL ms.
+ */
+void mcSspSetupDevice(struct m_device *device) {
+	int retry = device->setupRetry;
+	if (retry) {
+		mcSspSetupCommand(&device->sspC, device->bus->index, device->id);
+	}
+
+	if ((retry && ! mcSspProbeRestart(device)) || mcSspInitializeDevice(&device->sspC, device->key, device) != 0) {
+		logMessage(LOG_WARNING, "skipping setup of device '%s' as it is not available", device->name);
+		if (retry) {
+			pthread_mutex_lock(&device->jobLock);
+			device->nextPoll = monotonicMs() + SETUP_RETRY_INTERVAL;
+			device->pollPending = 0;
+			pthread_mutex_unlock(&device->jobLock);
+		}
 		return;
 	}
 
-	hardwareWaitTime();
+	// from now on the device is polled
+	pthread_mutex_lock(&device->jobLock);
+	device->sspDeviceAvailable = 1;
+	if (retry) {
+		device->setupRetry = 0;
+		device->pollPending = 0;
+	}
+	pthread_mutex_unlock(&device->jobLock);
 
-	struct m_metacash *m = c->data;
-	redisReply *reply = r;
+	logMessage(LOG_INFO, "setup of device '%s' started", device->name);
+	if (device->setupFn(device) != 0) {
+		logMessage(LOG_ERR, "setup of device '%s' failed", device->name);
+		return;
+	}
+	logMessage(LOG_NOTICE, "setup of device '%s' finished successfully", device->name);
 
-	// example from http://stackoverflow.com/questions/16213676/hiredis-waiting-for-message
-	if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 3) {
-		if (strcmp(reply->element[0]->str, "subscribe") != 0) {
-			char *topic = reply->element[1]->str;
-			struct m_command cmd;
-
-			cmd.msgId = NULL;
-			cmd.correlId = NULL;
-			cmd.command = NULL;
-
-			// decide to which topic the response should be sent to
-			if (strcmp(topic, "validator-request") == 0) {
-				cmd.device = &m->validator;
-				cmd.responseTopic = "validator-response";
-			} else if (strcmp(topic, "hopper-request") == 0) {
-				cmd.device = &m->hopper;
-				cmd.responseTopic = "hopper-response";
-			} else {
-				syslog(LOG_ERR, "cbOnRequestMessage subscribed for a topic we don't have a response topic\n");
-				return;
-			}
+	publishDeviceEvent(device, "{\"event\":\"started\"}");
+}
 
-			// generate a new 'msgId' for the response itself
-			uuid_t uuid;
-			uuid_generate_time_safe(uuid);
-			char msgId[37] = { 0 }; // ex. "1b4e28ba-2fa1-11d2-883f-0016d3cca427" + "\0"
-			uuid_unparse_lower(uuid, msgId);
-			cmd.msgId = (char *) &msgId; // points to a local variable. only valid until this block is exited!
-
-			char *message = reply->element[2]->str;
-
-			// try to parse the message as json
-			json_error_t error;
-			cmd.jsonMessage = json_loads(message, 0, &error);
-
-			if(! cmd.jsonMessage) {
-				syslog(LOG_WARNING, "unable to process message: could not parse json. reason: %s, line: %d",
-						error.text, error.line);
-				replyWith(cmd.responseTopic,
-						"{\"error\":\"could not parse json\",\"reason\":\"%s\",\"line\":%d}",
-						error.text, error.line);
-				// no need to json_decref(cmd.jsonMessage) here
-				return;
-			}
+/**
+ * \brief Configures the coin mech inhibits of the hopper, unless they are known to be applied already.
+ */
+int setupHopper(struct m_device *device) {
+	enum channel_state desiredChannelState = DISABLED;
 
-			// extract the 'msgId' property (used as the 'correlId' in a response)
-			// this will be the 'correlId' used in replies.
-			json_t *jMsgId = json_object_get(cmd.jsonMessage, "msgId");
-			if(! json_is_string(jMsgId)) {
-				syslog(LOG_WARNING, "unable to process message: property 'msgId' missing or invalid");
-				replyWithPropertyError(&cmd, "msgId");
-				json_decref(cmd.jsonMessage);
-				return;
-			} else {
-				cmd.correlId = (char *) json_string_value(jMsgId); // cast for now
-			}
+	if(device->metacash->acceptCoins) {
+		desiredChannelState = ENABLED;
+		logMessage(LOG_WARNING, "coins will be accepted");
+	} else {
+		logMessage(LOG_NOTICE, "coins will not be accepted");
+	}
 
-			// extract the 'cmd' property
-			json_t *jCmd = json_object_get(cmd.jsonMessage, "cmd");
-			if(! json_is_string(jCmd)) {
-				syslog(LOG_WARNING, "unable to process message: property 'cmd' missing or invalid");
-				replyWithPropertyError(&cmd, "cmd");
-				json_decref(cmd.jsonMessage);
-				return;
-			} else {
-				cmd.command = (char *) json_string_value(jCmd); // cast for now
+	struct m_buffer config = { NULL, 0, 0, 0 };
+	bufferPrintf(&config, "coins=%d", desiredChannelState);
+	for (unsigned int i = 0; i < device->sspSetupReq.NumberOfChannels; i++) {
+		bufferPrintf(&config, " %d%s", device->sspSetupReq.ChannelData[i].value,
+				device->sspSetupReq.ChannelData[i].cc);
+	}
+
+	if (! config.failed && isSnapshotCurrent(device, config.data)) {
+		logMessage(LOG_NOTICE, "coin mech inhibits of device '%s' are unchanged, skipping", device->name);
+	} else {
+		// SMART Hopper configuration
+		int failed = 0;
+		for (unsigned int i = 0; i < device->sspSetupReq.NumberOfChannels; i++) {
+			if (ssp6_set_coinmech_inhibits(&device->sspC,
+					device->sspSetupReq.ChannelData[i].value,
+					device->sspSetupReq.ChannelData[i].cc, desiredChannelState) != SSP_RESPONSE_OK) {
+				failed = 1;
 			}
+		}
+
+		if (! failed && ! config.failed) {
+			saveSnapshot(device, config.data);
+		}
+	}
 
-			// proper json structure, properties cmd and msgId have been verified here.
-			// also we know which device is used and where we should send our response to.
-			// finally try to dispatch the message to the appropriate command handler
-			// function if any. in case we don't know that command we respond with a
-			// generic error response.
+	bufferFree(&config);
+	return 0;
+}
 
-			syslog(LOG_INFO, "processing cmd='%s' from msgId='%s' in topic='%s' for device='%s'\n",
-					cmd.command, cmd.correlId, topic, cmd.device->name);
+/**
+ * \brief Configures the refill mode, the routing of the banknotes, the inhibits and the payout unit
+ * of the validator. The routing is skipped if it is known to be applied already.
+ */
+int setupValidator(struct m_device *device) {
+	// reject notes unfit for storage.
+	// if this is not enabled, notes unfit for storage will be silently redirected
+	// to the cashbox of the validator from which no payout can be done.
+	if (mc_ssp_set_refill_mode(&device->sspC)
+			!= SSP_RESPONSE_OK) {
+		logMessage(LOG_WARNING, "setting refill mode failed");
+	}
 
-			if(isCommand(&cmd, "quit")) {
-				handleQuit(&cmd);
-			} else if(isCommand(&cmd, "test")) {
-				handleTest(&cmd);
-			} else {
-				// commands in here need the actual hardware
+	// the routing of the banknotes in the validator (amounts are in cent)
+	const struct {
+		int amount;
+		char route;
+	} routes[] = {
+		{ 500, SSP_OPTION_ROUTE_CASHBOX }, // 5 euro
+		{ 1000, SSP_OPTION_ROUTE_CASHBOX }, // 10 euro
+		{ 2000, SSP_OPTION_ROUTE_CASHBOX }, // 20 euro
+		{ 5000, SSP_OPTION_ROUTE_STORAGE }, // 50 euro
+		{ 10000, SSP_OPTION_ROUTE_STORAGE }, // 100 euro
+		{ 20000, SSP_OPTION_ROUTE_STORAGE }, // 200 euro
+		{ 50000, SSP_OPTION_ROUTE_STORAGE }, // 500 euro
+	};
+
+	struct m_buffer config = { NULL, 0, 0, 0 };
+	bufferPrintf(&config, "routes");
+	for (unsigned int i = 0; i < sizeof(routes) / sizeof(routes[0]); i++) {
+		bufferPrintf(&config, " %d%s:%d", routes[i].amount, CURRENCY, routes[i].route);
+	}
 
-				if(! m->sspAvailable) {
-					// TODO: an unknown command without the actual hardware will also receive this response :-/
-					syslog(LOG_WARNING, "rejecting cmd='%s' from msgId='%s', hardware unavailable!\n", cmd.command, cmd.correlId);
-					replyWith(cmd.responseTopic, "{\"correlId\":\"%s\",\"error\":\"hardware unavailable\"}", cmd.correlId);
-				} else {
-					if(isCommand(&cmd, "configure-bezel")) {
-						handleConfigureBezel(&cmd);
-					} else if(isCommand(&cmd, "empty")) {
-						handleEmpty(&cmd);
-					} else if (isCommand(&cmd, "smart-empty")) {
-						handleSmartEmpty(&cmd);
-					} else if (isCommand(&cmd, "cashbox-payout-operation-data")) {
-						handleCashboxPayoutOperationData(&cmd);
-					} else if (isCommand(&cmd, "set-cashbox-payout-limit")) {
-						handleSetCashboxPayoutLimit(&cmd);
-					} else if (isCommand(&cmd, "enable")) {
-						handleEnable(&cmd);
-					} else if (isCommand(&cmd, "disable")) {
-						handleDisable(&cmd);
-					} else if(isCommand(&cmd, "enable-channels")) {
-						handleEnableChannels(&cmd);
-					} else if(isCommand(&cmd, "disable-channels")) {
-						handleDisableChannels(&cmd);
-					} else if(isCommand(&cmd, "inhibit-channels")) {
-						handleInhibitChannels(&cmd);
-					} else if (isCommand(&cmd, "test-float") || isCommand(&cmd, "do-float")) {
-						handleFloat(&cmd);
-					} else if (isCommand(&cmd, "test-payout") || isCommand(&cmd, "do-payout")) {
-						handlePayout(&cmd);
-					} else if (isCommand(&cmd, "get-firmware-version")) {
-						handleGetFirmwareVersion(&cmd);
-					} else if (isCommand(&cmd, "get-dataset-version")) {
-						handleGetDatasetVersion(&cmd);
-					} else if (isCommand(&cmd, "channel-security-data")) {
-						handleChannelSecurityData(&cmd);
-					} else if (isCommand(&cmd, "get-all-levels")) {
-						handleGetAllLevels(&cmd);
-					} else if (isCommand(&cmd, "set-denomination-level")) {
-						handleSetDenominationLevels(&cmd);
-					} else if (isCommand(&cmd, "last-reject-note")) {
-						handleLastRejectNote(&cmd);
-					} else {
-						syslog(LOG_WARNING, "unable to process message: no handler for cmd='%s' found", cmd.command);
-						replyWith(cmd.responseTopic, "{\"correlId\":\"%s\",\"error\":\"unknown command\",\"cmd\":\"%s\"}",
-								cmd.correlId, cmd.command);
-					}
-				}
+	if (! config.failed && isSnapshotCurrent(device, config.data)) {
+		logMessage(LOG_NOTICE, "routing of device '%s' is unchanged, skipping", device->name);
+	} else {
+		int failed = 0;
+		for (unsigned int i = 0; i < sizeof(routes) / sizeof(routes[0]); i++) {
+			if (ssp6_set_route(&device->sspC, routes[i].amount, CURRENCY, routes[i].route) != SSP_RESPONSE_OK) {
+				failed = 1;
 			}
+		}
 
-			// this will also free the other json objects associated with it
-			json_decref(cmd.jsonMessage);
+		if (! failed && ! config.failed) {
+			saveSnapshot(device, config.data);
 		}
 	}
+	bufferFree(&config);
+
+	device->channelInhibits = 0x0; // disable all channels
+
+	// set the inhibits in the hardware
+	if (ssp6_set_inhibits(&device->sspC, device->channelInhibits, 0x0)
+			!= SSP_RESPONSE_OK) {
+		logMessage(LOG_ERR, "Inhibits Failed\n");
+		return 1;
+	}
+
+	//enable the payout unit
+	if (ssp6_enable_payout(&device->sspC,
+			device->sspSetupReq.UnitType)
+			!= SSP_RESPONSE_OK) {
+		logMessage(LOG_ERR, "Enable Payout Failed\n");
+		return 1;
+	}
+
+	return 0;
 }
 
 /**
- * \brief Callback function triggered by the redis client on connecting with
- * the "publish" context.
+ * \brief Opens the serial device.
  */
-void cbOnConnectPublishContext(const redisAsyncContext *c, int status) {
-	if (status != REDIS_OK) {
-		syslog(LOG_ERR, "cbOnConnectPublishContext: redis error: %s\n", c->errstr);
-		return;
+int mcSspOpenSerialDevice(struct m_bus *bus) {
+	// open the serial device
+	logMessage(LOG_INFO, "opening serial device: %s\n", bus->serialDevice);
+
+	// a replay answers from the capture, the device doesn't have to exist
+	if (! is_ssp_replay()) {
+		struct stat buffer;
+		int fildes = open(bus->serialDevice, O_RDWR);
+		if (fildes <= 0) {
+			logMessage(LOG_ERR, "opening device %s failed: %s\n", bus->serialDevice, strerror(errno));
+			return 1;
+		}
+
+		fstat(fildes, &buffer); // TODO: error handling
+
+		close(fildes);
+
+		switch (buffer.st_mode & S_IFMT) {
+		case S_IFCHR:
+			break;
+		default:
+			logMessage(LOG_ERR, "file %s is not a device\n", bus->serialDevice);
+			return 1;
+		}
+	}
+
+	if (open_ssp_bus(bus->index, bus->serialDevice) == 0) {
+		logMessage(LOG_ERR, "could not open serial device %s\n",
+				bus->serialDevice);
+		return 1;
 	}
-	syslog(LOG_INFO, "cbOnConnectPublishContext: connected to redis\n");
+	return 0;
 }
 
 /**
- * \brief Callback function triggered by the redis client on disconnecting with
- * the "publish" context.
+ * \brief Closes the serial device.
  */
-void cbOnDisconnectPublishContext(const redisAsyncContext *c, int status) {
-	if (status != REDIS_OK) {
-		syslog(LOG_ERR, "cbOnDisconnectPublishContext: redis error: %s\n", c->errstr);
-		return;
-	}
-	syslog(LOG_INFO, "cbOnDisconnectPublishContext: disconnected from redis\n");
+void mcSspCloseSerialDevice(struct m_bus *bus) {
+	close_ssp_bus(bus->index);
 }
 
 /**
- * \brief Callback function triggered by the redis client on connecting with
- * the "subscribe" context.
+ * \brief Main function of the worker thread of a device. Executes the queued
+ * jobs one after another until asked to quit.
  */
-void cbOnConnectSubscribeContext(const redisAsyncContext *c, int status) {
-	if (status != REDIS_OK) {
-		syslog(LOG_ERR, "cbOnConnectSubscribeContext - redis error: %s\n", c->errstr);
-		return;
+void *mcSspWorkerMain(void *privdata) {
+	struct m_device *device = privdata;
+
+	pthread_mutex_lock(&device->jobLock);
+	while(! device->workerQuit) {
+		if(device->jobHead == NULL) {
+			pthread_cond_wait(&device->jobCond, &device->jobLock);
+			continue;
+		}
+
+		struct m_job *job = mcSspNextJob(device);
+		pthread_mutex_unlock(&device->jobLock);
+
+		// the other device on the bus gives way to our transactions as well
+		set_ssp_priority(job->priority);
+
+		switch(job->type) {
+		case JOB_SETUP:
+			mcSspSetupDevice(device);
+			break;
+		case JOB_POLL:
+			mcSspSchedulePoll(device, mcSspPollDevice(device, device->metacash));
+			break;
+		case JOB_COMMAND:
+			mcSspRunCommand(job);
+			if(job->flags & CMD_TRANSACTION) {
+				// a started transaction has set transactionRunning by now
+				pthread_mutex_lock(&device->state.lock);
+				device->state.transactionsQueued--;
+				pthread_mutex_unlock(&device->state.lock);
+			}
+			break;
+		}
+		free(job);
+
+		pthread_mutex_lock(&device->jobLock);
 	}
-	syslog(LOG_INFO, "cbOnConnectSubscribeContext - connected to redis\n");
 
-	redisAsyncContext *cNotConst = (redisAsyncContext*) c; // get rids of discarding qualifier \"const\" warning
+	// discard whatever is left, we are shutting down
+	while(device->jobHead) {
+		struct m_job *job = device->jobHead;
+		device->jobHead = job->next;
+		if(job->type == JOB_COMMAND) {
+			logMessage(LOG_WARNING, "discarding cmd='%s' from msgId='%s', shutting down\n",
+					job->cmd->command, job->cmd->correlId);
+			freeCommand(job->cmd);
+		}
+		free(job);
+	}
+	device->jobTail = NULL;
+	device->jobCount = 0;
+	pthread_mutex_unlock(&device->jobLock);
 
-	// subscribe the topics in redis from which we want to receive messages
-	redisAsyncCommand(cNotConst, cbOnMetacashMessage, NULL, "SUBSCRIBE metacash");
+	return NULL;
+}
 
-	// n.b: the same callback function handles both topics
-	redisAsyncCommand(cNotConst, cbOnRequestMessage, NULL, "SUBSCRIBE validator-request");
-	redisAsyncCommand(cNotConst, cbOnRequestMessage, NULL, "SUBSCRIBE hopper-request");
+/**
+ * \brief Starts the worker thread of the device.
+ */
+void mcSspStartWorker(struct m_device *device) {
+	device->workerQuit = 0;
+	device->jobHead = NULL;
+	device->jobTail = NULL;
+	device->jobCount = 0;
+	device->maxJobCount = 0;
+	device->pollPending = 0;
+	device->setupRetry = 0;
+	device->coalescedCommands = 0;
+	device->shedCommands = 0;
+	device->expiredCommands = 0;
+	device->pollInterval = POLL_INTERVAL_BURST;
+	device->nextPoll = 0;
+	device->idlePolls = 0;
+	device->transactionUntil = 0;
+	device->reply = (struct m_buffer) { NULL, 0, 0, 0 };
+	pthread_mutex_init(&device->jobLock, NULL);
+	pthread_cond_init(&device->jobCond, NULL);
+
+	int rc = pthread_create(&device->worker, NULL, mcSspWorkerMain, device);
+	if(rc != 0) {
+		logMessage(LOG_ERR, "could not start worker for device '%s': %s\n", device->name, strerror(rc));
+		die("could not start worker thread", 1);
+		// never reached, already exited
+	}
+	device->workerStarted = 1;
 }
 
 /**
- * \brief Callback function triggered by the redis client on disconnecting with
- * the "subscribe" context.
+ * \brief Asks the worker thread of the device to quit and waits until it has exited.
+ * Jobs still waiting in the queue are discarded.
  */
-void cbOnDisconnectSubscribeContext(const redisAsyncContext *c, int status) {
-	if (status != REDIS_OK) {
-		syslog(LOG_INFO, "cbOnDisconnectSubscribeContext - redis error: %s\n", c->errstr);
+void mcSspStopWorker(struct m_device *device) {
+	if(! device->workerStarted) {
 		return;
 	}
-	syslog(LOG_INFO, "cbOnDisconnectSubscribeContext - disconnected from redis\n");
+
+	pthread_mutex_lock(&device->jobLock);
+	device->workerQuit = 1;
+	pthread_cond_signal(&device->jobCond);
+	pthread_mutex_unlock(&device->jobLock);
+
+	pthread_join(device->worker, NULL);
+	device->workerStarted = 0;
+
+	pthread_cond_destroy(&device->jobCond);
+	pthread_mutex_destroy(&device->jobLock);
+	bufferFree(&device->reply);
 }
 
 /**
- * \brief This function never returns, it displays the reason argument and return code
- * in the syslog and exits immediately.
+ * \brief Returns !=0 if the job may be shed to make room, read-only commands.
  */
-void die(char *reason, int rc) {
-	syslog(LOG_EMERG, "fatal error occured: %s, rc=%d", reason, rc);
-	syslog(LOG_EMERG, "exiting NOW");
-	exit(rc);
+int mcSspIsSheddable(const struct m_job *job) {
+	return job->type == JOB_COMMAND && ! (job->flags & CMD_MUTATING);
 }
 
 /**
- * \brief Supports arguments -h (redis hostname), -p (redis port), -d (serial device name) and -?.
- * \details Warning: both "calls" to hopperEventHandler() and validatorEventHandler() in the callgraph are false positives!
- * \callgraph
+ * \brief Removes the job following previous (NULL for the first one) from the queue of the device,
+ * device->jobLock must be held.
  */
-int main(int argc, char *argv[]) {
-	// setup logging via syslog
-	setlogmask(LOG_UPTO(LOG_INFO));
-	openlog("payoutd", LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
-	syslog(LOG_NOTICE, "Program started by User %d", getuid());
-
-	// register interrupt handler for signals
-	signal(SIGTERM, signalHandler);
-	signal(SIGINT, signalHandler);
+void mcSspUnlinkJob(struct m_device *device, struct m_job *previous, struct m_job *job) {
+	if(previous) {
+		previous->next = job->next;
+	} else {
+		device->jobHead = job->next;
+	}
+	if(device->jobTail == job) {
+		device->jobTail = previous;
+	}
+	device->jobCount--;
+}
 
-	struct m_metacash metacash;
-	metacash.sspAvailable = 0; // defaults to no initially
-	metacash.quit = 0;
-	metacash.logSyslogStderr = 0; // default, override using -e
-	metacash.acceptCoins = 0; // default, override using -c
+/**
+ * \brief Inserts the job into the queue of the worker of the device. On success (QUEUE_OK) the
+ * worker takes over the ownership of the job.
+ * \details The queue is ordered by priority: transactions (CMD_TRANSACTION) and the setup first,
+ * then the other commands, polls last. Jobs of the same priority keep their order.
+ * A CMD_COALESCE command for which an identical one is already waiting behind the last queued
+ * write (CMD_MUTATING or the setup) is attached to that one instead (the job is freed), it gets
+ * the answer of the same SSP exchange. Reads never overtake writes that way.
+ * The queue is bounded: from shedThreshold (-W) jobs on a read-only command is refused (QUEUE_SHED),
+ * at queueLimit (-q) any command is, unless it can take the place of the newest waiting read-only one,
+ * which is answered with "overloaded".
+ */
+int mcSspQueueJob(struct m_device *device, struct m_job *job) {
+	if(! device->workerStarted) {
+		return QUEUE_UNAVAILABLE;
+	}
 
-	metacash.serialDevice = "/dev/ttyACM0";	// default, override with -d argument
-	metacash.redisHost = "127.0.0.1";	// default, override with -h argument
-	metacash.redisPort = 6379;			// default, override with -p argument
+	job->next = NULL;
+	job->queuedAt = monotonicMs();
+	if(job->type == JOB_POLL) {
+		job->priority = SSP_PRIORITY_BACKGROUND;
+	} else if(job->type == JOB_COMMAND && ! (job->flags & CMD_TRANSACTION)) {
+		job->priority = SSP_PRIORITY_INTERACTIVE;
+	} else {
+		job->priority = SSP_PRIORITY_TRANSACTION;
+	}
 
-	metacash.hopper.id = 0x10; // 0x10 -> Smart Hopper ("Münzer")
-	metacash.hopper.sspDeviceAvailable = 0; // defaults to no initially
-	metacash.hopper.name = "Mr. Coin";
-	metacash.hopper.key = DEFAULT_KEY;
-	metacash.hopper.eventHandlerFn = hopperEventHandler;
+	pthread_mutex_lock(&device->jobLock);
+	if(job->type == JOB_COMMAND && (job->flags & CMD_COALESCE)) {
+		// only a duplicate behind the last queued write, the answer must not predate it
+		struct m_job *duplicate = NULL;
+		for(struct m_job *queued = device->jobHead; queued; queued = queued->next) {
+			if(queued->type == JOB_SETUP || (queued->type == JOB_COMMAND && (queued->flags & CMD_MUTATING))) {
+				duplicate = NULL;
+			} else if(! duplicate && queued->type == JOB_COMMAND && queued->cmd->def == job->cmd->def) {
+				duplicate = queued;
+			}
+		}
+		if(duplicate) {
+			// append to the duplicates, they are answered in the order they have been received
+			struct m_command *last = duplicate->cmd;
+			while(last->coalesced) {
+				last = last->coalesced;
+			}
+			last->coalesced = job->cmd;
+			device->coalescedCommands++;
+			pthread_mutex_unlock(&device->jobLock);
+			free(job);
+			return QUEUE_OK;
+		}
+	}
 
-	metacash.validator.id = 0x00; // 0x00 -> Smart Payout NV200 ("Scheiner")
-	metacash.validator.sspDeviceAvailable = 0; // defaults to no initially
-	metacash.validator.name = "Ms. Note";
-	metacash.validator.key = DEFAULT_KEY;
-	metacash.validator.eventHandlerFn = validatorEventHandler;
+	// the setup and polls are never refused, they are at most one each
+	struct m_job *evicted = NULL;
+	if(job->type == JOB_COMMAND) {
+		struct m_metacash *metacash = device->metacash;
+		int shed = 0;
+		if(mcSspIsSheddable(job)) {
+			shed = (metacash->shedThreshold && device->jobCount >= metacash->shedThreshold)
+					|| (metacash->queueLimit && device->jobCount >= metacash->queueLimit);
+		} else if(metacash->queueLimit && device->jobCount >= metacash->queueLimit) {
+			struct m_job *evictedPrevious = NULL;
+			struct m_job *previous = NULL;
+			for(struct m_job *queued = device->jobHead; queued; previous = queued, queued = queued->next) {
+				if(mcSspIsSheddable(queued)) {
+					evicted = queued;
+					evictedPrevious = previous;
+				}
+			}
+			if(evicted) {
+				mcSspUnlinkJob(device, evictedPrevious, evicted);
+				for(struct m_command *cmd = evicted->cmd; cmd; cmd = cmd->coalesced) {
+					device->shedCommands++;
+				}
+			} else {
+				shed = 1;
+			}
+		}
+		if(shed) {
+			device->shedCommands++;
+			pthread_mutex_unlock(&device->jobLock);
+			return QUEUE_SHED;
+		}
+	}
 
-	// parse the command line arguments
-	if (parseCmdLine(argc, argv, &metacash)) {
-		die("invalid command line", 1);
-		// never reached, already exited
+	struct m_job *previous = NULL;
+	for(struct m_job *queued = device->jobHead; queued; queued = queued->next) {
+		if(queued->priority <= job->priority) {
+			previous = queued;
+		}
 	}
 
-	if(metacash.logSyslogStderr) {
-		closelog();
-		// also writeout syslog messages to stderr (intended for development purposes, you
-		// can enable this with the -e argument)
-		openlog("payoutd", LOG_PERROR | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
+	if(previous) {
+		job->next = previous->next;
+		previous->next = job;
+	} else {
+		job->next = device->jobHead;
+		device->jobHead = job;
+	}
+	if(job->next == NULL) {
+		device->jobTail = job;
+	}
+	device->jobCount++;
+	if(device->jobCount > device->maxJobCount) {
+		device->maxJobCount = device->jobCount;
+	}
+	if(job->type == JOB_COMMAND && (job->flags & CMD_TRANSACTION)) {
+		// the device is busy from now on as far as the payout planner is concerned
+		pthread_mutex_lock(&device->state.lock);
+		device->state.transactionsQueued++;
+		pthread_mutex_unlock(&device->state.lock);
+	}
+	pthread_cond_signal(&device->jobCond);
+	pthread_mutex_unlock(&device->jobLock);
+
+	// answered outside of the lock, publishing takes the outbox lock
+	if(evicted) {
+		for(struct m_command *cmd = evicted->cmd; cmd; cmd = cmd->coalesced) {
+			logMessage(LOG_WARNING, "shedding cmd='%s' from msgId='%s', queue of device='%s' is full\n",
+					cmd->command, cmd->correlId, device->name);
+			replyNotExecuted(cmd, "overloaded");
+		}
+		freeCommand(evicted->cmd);
+		free(evicted);
 	}
 
-	syslog(LOG_NOTICE, "using redis at %s:%d and hardware device %s",
-			metacash.redisHost, metacash.redisPort, metacash.serialDevice);
+	return QUEUE_OK;
+}
 
-	// open the serial device
-	if (mcSspOpenSerialDevice(&metacash) == 0) {
-		metacash.sspAvailable = 1;
-	} else {
-		syslog(LOG_ALERT, "ssp communication unavailable");
+/**
+ * \brief Removes the job the worker should execute next from the queue of the device and returns it.
+ * \details Usually the first one, but a poll which has been waiting for POLL_MAX_DEFER goes first.
+ * The queue must not be empty and device->jobLock must be held.
+ */
+struct m_job *mcSspNextJob(struct m_device *device) {
+	struct m_job *previous = NULL;
+	struct m_job *job = device->jobHead;
+
+	// there is at most one poll queued and it is behind all commands
+	if(job->type != JOB_POLL && device->jobTail->type == JOB_POLL
+			&& monotonicMs() - device->jobTail->queuedAt >= POLL_MAX_DEFER) {
+		for(previous = job; previous->next != device->jobTail; previous = previous->next)
+			;
+		job = device->jobTail;
 	}
+	mcSspUnlinkJob(device, previous, job);
 
-	// setup the ssp commands, configure and initialize the hardware
-	setup(&metacash);
-
-	syslog(LOG_NOTICE, "open for business :D");
+	return job;
+}
 
-	publishPayoutEvent("{ \"event\":\"started\" }");
+/**
+ * \brief Sets the deadline of the command from its 'deadlineMs' property (ms after it has been received,
+ * 0 for none) or the default of the command. Returns !=0 if the property is invalid.
+ */
+int mcSspSetDeadline(struct m_command *cmd) {
+	long long deadline = cmd->def->deadline;
 
-	event_base_dispatch(metacash.eventBase); // blocking until exited via api-call
+	if(cmdHasProperty(cmd, "deadlineMs") && (cmdGetInteger(cmd, "deadlineMs", &deadline) || deadline < 0)) {
+		return 1;
+	}
+	cmd->deadlineAt = deadline ? cmd->receivedAt + deadline : 0;
+	return 0;
+}
 
-	publishPayoutEvent("{ \"event\":\"exiting\" }");
+/**
+ * \brief Answers the commands of the job whose deadline has passed with "deadline exceeded" instead
+ * of executing them, called by the worker before the job reaches the bus. Returns the number of
+ * commands left to execute.
+ */
+unsigned int mcSspExpireCommands(struct m_job *job) {
+	struct m_device *device = job->cmd->device;
+	unsigned long long now = monotonicMs();
+	struct m_command **link = &job->cmd;
+	unsigned int left = 0;
+
+	while(*link) {
+		struct m_command *cmd = *link;
+		if(cmd->deadlineAt == 0 || now < cmd->deadlineAt) {
+			left++;
+			link = &cmd->coalesced;
+			continue;
+		}
 
-	syslog(LOG_NOTICE, "shutting down");
+		*link = cmd->coalesced;
+		cmd->coalesced = NULL;
+		logMessage(LOG_WARNING, "dropping cmd='%s' from msgId='%s', deadline exceeded after %llums in the queue of device='%s'\n",
+				cmd->command, cmd->correlId, now - cmd->receivedAt, device->name);
+		replyNotExecuted(cmd, "deadline exceeded");
+		freeCommand(cmd);
 
-	if (metacash.sspAvailable) {
-		mcSspCloseSerialDevice(&metacash);
+		pthread_mutex_lock(&device->jobLock);
+		device->expiredCommands++;
+		pthread_mutex_unlock(&device->jobLock);
 	}
+	return left;
+}
 
-	// cleanup stuff before exiting.
+/**
+ * \brief Executes the command of a JOB_COMMAND on the worker of the device.
+ * \details Commands past their deadline are answered with "deadline exceeded" instead. If duplicates
+ * have been coalesced into the command its response is captured and published for all of them. The
+ * response of a command with an entry in the request cache is kept there (requestCacheFinish()).
+ */
+void mcSspRunCommand(struct m_job *job) {
+	if(mcSspExpireCommands(job) == 0) {
+		return;
+	}
+	struct m_command *cmd = job->cmd;
 
-	// redis
-	redisAsyncFree(redisPublishCtx);
-	redisAsyncFree(redisSubscribeCtx);
+	if(cmd->coalesced) {
+		struct m_reply_capture capture = { cmd->responseTopic, { NULL, 0, 0, 0 }, 0, 0, 0 };
+		replyCapture = &capture;
+		job->handlerFn(cmd);
+		replyCapture = NULL;
 
-	// libevent
-	event_base_free(metacash.eventBase);
+		if(capture.replies.failed) {
+			logMessage(LOG_ERR, "mcSspRunCommand: out of memory\n");
+		}
+		for(struct m_command *duplicate = cmd; duplicate; duplicate = duplicate->coalesced) {
+			if(capture.replies.failed) {
+				replyWithError(duplicate->responseTopic, "{\"correlId\":\"%s\",\"error\":\"out of memory\"}",
+						duplicate->correlId);
+				requestCacheFinish(duplicate, NULL, 0, 1);
+			} else if(duplicate == cmd) {
+				publishMessage(cmd->responseTopic, capture.replies.data, capture.replies.length);
+				requestCacheFinish(cmd, capture.replies.data, capture.replies.length, 1);
+			} else {
+				// the response with the ids of the duplicate is left in the reply buffer of the device
+				struct m_buffer *reply = &duplicate->device->reply;
+				replyCoalesced(cmd, duplicate, capture.replies.data, capture.replies.length);
+				requestCacheFinish(duplicate, reply->failed ? NULL : reply->data, reply->length, 1);
+			}
+		}
+		bufferFree(&capture.replies);
+	} else if(cmd->cached) {
+		// published as usual, the last response is kept for resent duplicates
+		struct m_reply_capture record = { cmd->responseTopic, { NULL, 0, 0, 0 }, 0, 1, 0 };
+		replyCapture = &record;
+		job->handlerFn(cmd);
+		replyCapture = NULL;
+
+		requestCacheFinish(cmd, record.count && ! record.replies.failed ? record.replies.data : NULL,
+				record.replies.length, 1);
+		bufferFree(&record.replies);
+	} else {
+		job->handlerFn(cmd);
+	}
 
-	// syslog
-	syslog(LOG_NOTICE, "exiting NOW");
-	closelog();
+	// the outcome of the last SSP exchange of the command
+	journalAppend(cmd->device, JOURNAL_RESULT, cmd->device->sspC.ResponseData[0], cmd->device->sspC.ResponseStatus,
+			cmd->def - commandDefs, 0, cmd->correlId);
 
-	return 0;
+	if(job->flags & CMD_MUTATING) {
+		// don't trust the cached levels after changing the state of the device
+		invalidateLevels(cmd->device);
+	}
+	freeCommand(cmd);
 }
 
 /**
- * \brief Parse the command line arguments.
+ * \brief Queues a poll of the device unless there is already one waiting or running, or the setup
+ * of a lost device (setupRetry) instead.
  */
-int parseCmdLine(int argc, char *argv[], struct m_metacash *metacash) {
-	opterr = 0;
+void mcSspQueuePoll(struct m_device *device) {
+	if(! device->workerStarted) {
+		return;
+	}
 
-	int c;
-	while ((c = getopt(argc, argv, "ech:p:d:")) != -1) {
-		switch (c) {
-		case 'h':
-			metacash->redisHost = optarg;
-			break;
-		case 'p':
-			metacash->redisPort = atoi(optarg);
-			break;
-		case 'd':
-			metacash->serialDevice = optarg;
-			break;
-		case 'c':
-			metacash->acceptCoins = 1;
-			break;
-		case 'e':
-			metacash->logSyslogStderr = 1;
-			break;
-		case '?':
-			if (optopt == 'h' || optopt == 'p' || optopt == 'd') {
-				fprintf(stderr, "Option -%c requires an argument.\n", optopt);
-				syslog(LOG_ERR, "Option -%c requires an argument.\n", optopt);
-			} else if (isprint(optopt)) {
-				fprintf(stderr, "Unknown option '-%c'.\n", optopt);
-				syslog(LOG_ERR, "Unknown option '-%c'.\n", optopt);
-			} else {
-				fprintf(stderr, "Unknown option character 'x%x'.\n", optopt);
-				syslog(LOG_ERR, "Unknown option character 'x%x'.\n", optopt);
-			}
-			return 1;
-		default:
-			fprintf(stderr, "Unknown argument: %c", c);
-			syslog(LOG_ERR, "Unknown argument: %c", c);
-			return 1;
+	pthread_mutex_lock(&device->jobLock);
+	// a lost device gets its setup queued again in place of the polls
+	int setup = ! device->sspDeviceAvailable && device->setupRetry;
+	if((! device->sspDeviceAvailable && ! setup) || device->pollPending || monotonicMs() < device->nextPoll) {
+		// the device is unavailable, busy or not due yet, skip this tick
+		pthread_mutex_unlock(&device->jobLock);
+		return;
+	}
+	device->pollPending = 1;
+	pthread_mutex_unlock(&device->jobLock);
+
+	struct m_job *job = calloc(1, sizeof(struct m_job));
+	if(job == NULL) {
+		logMessage(LOG_ERR, "mcSspQueuePoll: out of memory\n");
+	} else {
+		job->type = setup ? JOB_SETUP : JOB_POLL;
+		if(mcSspQueueJob(device, job) == 0) {
+			return;
 		}
+		free(job);
 	}
 
-	return 0;
+	pthread_mutex_lock(&device->jobLock);
+	device->pollPending = 0;
+	pthread_mutex_unlock(&device->jobLock);
 }
 
 /**
- * \brief Callback function used for inspecting and publishing events reported by the Hopper hardware.
+ * \brief Computes when the device should be polled next, called by the worker after each poll.
+ * \details eventCount is the number of events reported by the poll, -1 if the poll failed.
+ * Any event or a running transaction switches to burst mode, after POLL_IDLE_THRESHOLD
+ * quiet polls the interval is doubled with each further quiet poll up to POLL_INTERVAL_IDLE.
  */
-void hopperEventHandler(struct m_device *device,
-		struct m_metacash *metacash, SSP_POLL_DATA6 *poll) {
-	for (unsigned char i = 0; i < poll->event_count; ++i) {
-		switch (poll->events[i].event) {
-		case SSP_POLL_RESET:
-			publishHopperEvent("{\"event\":\"unit reset\"}");
-			// Make sure we are using ssp version 6
-			if (ssp6_host_protocol(&device->sspC, 0x06) != SSP_RESPONSE_OK) {
-				die("hopperEventHandler: SSP Host Protocol Failed", 3);
-				// never reached, already exited
-			}
-			break;
-		case SSP_POLL_READ:
-			// the \"read\" event contains 1 data value, which if >0 means a note has been validated and is in escrow
-			if (poll->events[i].data1 > 0) {
-				publishHopperEvent("{\"event\":\"read\",\"channel\":%ld}", poll->events[i].data1);
-			} else {
-				// this is reported more than once for a single note
-				publishHopperEvent("{\"event\":\"reading\"}");
-			}
-			break;
-		case SSP_POLL_TIMEOUT:
-			publishHopperEvent("{\"event\":\"timeout\",\"amount\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
-			break;
-		case SSP_POLL_DISPENSING:
-			publishHopperEvent("{\"event\":\"dispensing\",\"amount\":%ld}", poll->events[i].data1);
-			break;
-		case SSP_POLL_DISPENSED:
-			publishHopperEvent("{\"event\":\"dispensed\",\"amount\":%ld}", poll->events[i].data1);
-			break;
-		case SSP_POLL_FLOATING:
-			publishHopperEvent("{\"event\":\"floating\",\"amount\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
-			break;
-		case SSP_POLL_FLOATED:
-			publishHopperEvent("{\"event\":\"floated\",\"amount\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
-			break;
-		case SSP_POLL_CASHBOX_PAID:
-			publishHopperEvent("{\"event\":\"cashbox paid\",\"amount\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
-			break;
-		case SSP_POLL_JAMMED:
-			publishHopperEvent("{\"event\":\"jammed\"}");
-			break;
-		case SSP_POLL_FRAUD_ATTEMPT:
-			publishHopperEvent("{\"event\":\"fraud attempt\"}");
-			break;
-		case SSP_POLL_COIN_CREDIT:
-			publishHopperEvent("{\"event\":\"coin credit\",\"amount\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
-			break;
-		case SSP_POLL_EMPTY:
-			publishHopperEvent("{\"event\":\"empty\"}");
-			break;
-		case SSP_POLL_EMPTYING:
-			publishHopperEvent("{\"event\":\"emptying\"}");
-			break;
-		case SSP_POLL_SMART_EMPTYING:
-			publishHopperEvent("{\"event\":\"smart emptying\",\"amount\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
-			break;
-		case SSP_POLL_SMART_EMPTIED:
-			publishHopperEvent("{\"event\":\"smart emptied\",\"amount\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
-			break;
-		case SSP_POLL_CREDIT:
-			// The note which was in escrow has been accepted
-			publishHopperEvent("{\"event\":\"credit\",\"channel\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
-			break;
-		case SSP_POLL_INCOMPLETE_PAYOUT:
-			// the validator shutdown during a payout, this event is reporting that some value remains to payout
-			publishHopperEvent(
-					"{\"event\":\"incomplete payout\",\"dispensed\":%ld,\"requested\":%ld,\"cc\":\"%s\"}",
-					poll->events[i].data1, poll->events[i].data2,
-					poll->events[i].cc);
-			break;
-		case SSP_POLL_INCOMPLETE_FLOAT:
-			// the validator shutdown during a float, this event is reporting that some value remains to float
-			publishHopperEvent(
-					"{\"event\":\"incomplete float\",\"dispensed\":%ld,\"requested\":%ld,\"cc\":\"%s\"}",
-					poll->events[i].data1, poll->events[i].data2,
-					poll->events[i].cc);
-			break;
-		case SSP_POLL_DISABLED:
-			// The unit has been disabled
-			publishHopperEvent("{\"event\":\"disabled\"}");
-			break;
-		case SSP_POLL_CALIBRATION_FAIL:
-			// the hopper calibration has failed. An extra byte is available with an error code.
-			switch (poll->events[i].data1) {
-			case NO_FAILUE:
-				publishHopperEvent("{\"event\":\"calibration fail\",\"error\":\"no error\"}");
-				break;
-			case SENSOR_FLAP:
-				publishHopperEvent("{\"event\":\"calibration fail\",\"error\":\"sensor flap\"}");
-				break;
-			case SENSOR_EXIT:
-				publishHopperEvent("{\"event\":\"calibration fail\",\"error\":\"sensor exit\"}");
-				break;
-			case SENSOR_COIL1:
-				publishHopperEvent("{\"event\":\"calibration fail\",\"error\":\"sensor coil 1\"}");
-				break;
-			case SENSOR_COIL2:
-				publishHopperEvent("{\"event\":\"calibration fail\",\"error\":\"sensor coil 2\"}");
-				break;
-			case NOT_INITIALISED:
-				publishHopperEvent("{\"event\":\"calibration fail\",\"error\":\"not initialized\"}");
-				break;
-			case CHECKSUM_ERROR:
-				publishHopperEvent("{\"event\":\"calibration fail\",\"error\":\"checksum error\"}");
-				break;
-			case COMMAND_RECAL:
-				publishHopperEvent("{\"event\":\"recalibrating\"}");
-				ssp6_run_calibration(&device->sspC);
-				break;
+void mcSspSchedulePoll(struct m_device *device, int eventCount) {
+	unsigned long long now = monotonicMs();
+
+	pthread_mutex_lock(&device->jobLock);
+	if(eventCount > 0 || now < device->transactionUntil) {
+		device->idlePolls = 0;
+		device->pollInterval = POLL_INTERVAL_BURST;
+	} else if(eventCount == 0) {
+		if(device->idlePolls < POLL_IDLE_THRESHOLD) {
+			device->idlePolls++;
+		} else if(device->pollInterval < POLL_INTERVAL_IDLE) {
+			device->pollInterval *= 2;
+			if(device->pollInterval > POLL_INTERVAL_IDLE) {
+				device->pollInterval = POLL_INTERVAL_IDLE;
 			}
-			break;
-		default:
-			// fallback only. in case we got a message which is not handled above.
-			// if you can see this have a look in the SSP reference manual what
-			// the message is about.
-			publishHopperEvent("{\"event\":\"unknown\",\"id\":\"0x%02X\"}", poll->events[i].event);
-			break;
 		}
 	}
+	// failed polls keep the current interval
+	device->nextPoll = now + device->pollInterval;
+	device->pollPending = 0;
+	pthread_mutex_unlock(&device->jobLock);
 }
 
 /**
- * \brief Callback function used for inspecting and publishing events reported by the Validator hardware.
+ * \brief Switches the device to burst polling because a payout, float or empty has been started
+ * by the request with the given correlId.
+ * \details Only to be called on the worker of the device.
  */
-void validatorEventHandler(struct m_device *device,
-		struct m_metacash *metacash, SSP_POLL_DATA6 *poll) {
-	for (unsigned char i = 0; i < poll->event_count; ++i) {
-		switch (poll->events[i].event) {
-		case SSP_POLL_RESET:
-			publishValidatorEvent("{\"event\":\"unit reset\"}");
-			// Make sure we are using ssp version 6
-			if (ssp6_host_protocol(&device->sspC, 0x06) != SSP_RESPONSE_OK) {
-				die("validatorEventHandler: SSP Host Protocol Failed", 3);
-				// never reached, already exited
-			}
-			break;
-		case SSP_POLL_READ:
-			// the \"read\" event contains 1 data value, which if >0 means a note has been validated and is in escrow
-			if (poll->events[i].data1 > 0) {
-				// The note which was in escrow has been accepted
-				unsigned long amount =
-						device->sspSetupReq.ChannelData[poll->events[i].data1 - 1].value
-								* 100;
-				publishValidatorEvent("{\"event\":\"read\",\"amount\":%ld,\"channel\":%ld}",
-						amount, poll->events[i].data1);
-			} else {
-				publishValidatorEvent("{\"event\":\"reading\"}");
-			}
-			break;
-		case SSP_POLL_EMPTY:
-			publishValidatorEvent("{\"event\":\"empty\"}");
-			break;
-		case SSP_POLL_EMPTYING:
-			publishValidatorEvent("{\"event\":\"emptying\"}");
-			break;
-		case SSP_POLL_SMART_EMPTYING:
-			publishValidatorEvent("{\"event\":\"smart emptying\"}");
-			break;
-		case SSP_POLL_TIMEOUT:
-			publishValidatorEvent("{\"event\":\"timeout\",\"amount\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
-			break;
-		case SSP_POLL_CREDIT:
-			// The note which was in escrow has been accepted
-		{
-			unsigned long amount =
-					device->sspSetupReq.ChannelData[poll->events[i].data1 - 1].value
-							* 100;
-			publishValidatorEvent("{\"event\":\"credit\",\"amount\":%ld,\"channel\":%ld}",
-					amount, poll->events[i].data1);
-		}
-			break;
-		case SSP_POLL_INCOMPLETE_PAYOUT:
-			// the validator shutdown during a payout, this event is reporting that some value remains to payout
-			publishValidatorEvent(
-					"{\"event\":\"incomplete payout\",\"dispensed\":%ld,\"requested\":%ld,\"cc\":\"%s\"}",
-					poll->events[i].data1, poll->events[i].data2,
-					poll->events[i].cc);
-			break;
-		case SSP_POLL_INCOMPLETE_FLOAT:
-			// the validator shutdown during a float, this event is reporting that some value remains to float
-			publishValidatorEvent(
-					"{\"event\":\"incomplete float\",\"dispensed\":%ld,\"requested\":%ld,\"cc\":\"%s\"}",
-					poll->events[i].data1, poll->events[i].data2,
-					poll->events[i].cc);
-			break;
-		case SSP_POLL_REJECTING:
-			publishValidatorEvent("{\"event\":\"rejecting\"}");
-			break;
-		case SSP_POLL_REJECTED:
-			// The note was rejected
-			publishValidatorEvent("{\"event\":\"rejected\"}");
-			break;
-		case SSP_POLL_STACKING:
-			publishValidatorEvent("{\"event\":\"stacking\"}");
-			break;
-		case SSP_POLL_STORED:
-			// The note has been stored in the payout unit
-			publishValidatorEvent("{\"event\":\"stored\"}");
-			break;
-		case SSP_POLL_STACKED:
-			// The note has been stacked in the cashbox
-			publishValidatorEvent("{\"event\":\"stacked\"}");
-			break;
-		case SSP_POLL_SAFE_JAM:
-			publishValidatorEvent("{\"event\":\"safe jam\"}");
-			break;
-		case SSP_POLL_UNSAFE_JAM:
-			publishValidatorEvent("{\"event\":\"unsafe jam\"}");
-			break;
-		case SSP_POLL_DISABLED:
-			// The validator has been disabled
-			publishValidatorEvent("{\"event\":\"disabled\"}");
-			break;
-		case SSP_POLL_FRAUD_ATTEMPT:
-			// The validator has detected a fraud attempt
-			publishValidatorEvent(
-					"{\"event\":\"fraud attempt\",\"dispensed\":%ld}",
-					poll->events[i].data1);
-			break;
-		case SSP_POLL_STACKER_FULL:
-			// The cashbox is full
-			publishValidatorEvent("{\"event\":\"stacker full\"}");
-			break;
-		case SSP_POLL_CASH_BOX_REMOVED:
-			// The cashbox has been removed
-			publishValidatorEvent("{\"event\":\"cashbox removed\"}");
-			break;
-		case SSP_POLL_CASH_BOX_REPLACED:
-			// The cashbox has been replaced
-			publishValidatorEvent("{\"event\":\"cashbox replaced\"}");
-			break;
-		case SSP_POLL_CLEARED_FROM_FRONT:
-			// A note was in the notepath at startup and has been cleared from the front of the validator
-			publishValidatorEvent("{\"event\":\"cleared from front\"}");
-			break;
-		case SSP_POLL_CLEARED_INTO_CASHBOX:
-			// A note was in the notepath at startup and has been cleared into the cashbox
-			publishValidatorEvent("{\"event\":\"cleared into cashbox\"}");
-			break;
-		case SSP_POLL_CALIBRATION_FAIL:
-			// the hopper calibration has failed. An extra byte is available with an error code.
-			switch (poll->events[i].data1) {
-			case NO_FAILUE:
-				publishValidatorEvent("{\"event\":\"calibration fail\",\"error\":\"no error\"}");
-				break;
-			case SENSOR_FLAP:
-				publishValidatorEvent("{\"event\":\"calibration fail\",\"error\":\"sensor flap\"}");
-				break;
-			case SENSOR_EXIT:
-				publishValidatorEvent("{\"event\":\"calibration fail\",\"error\":\"sensor exit\"}");
-				break;
-			case SENSOR_COIL1:
-				publishValidatorEvent("{\"event\":\"calibration fail\",\"error\":\"sensor coil 1\"}");
-				break;
-			case SENSOR_COIL2:
-				publishValidatorEvent("{\"event\":\"calibration fail\",\"error\":\"sensor coil 2\"}");
-				break;
-			case NOT_INITIALISED:
-				publishValidatorEvent("{\"event\":\"calibration fail\",\"error\":\"not initialized\"}");
-				break;
-			case CHECKSUM_ERROR:
-				publishValidatorEvent("{\"event\":\"calibration fail\",\"error\":\"checksum error\"}");
-				break;
-			case COMMAND_RECAL:
-				publishValidatorEvent("{\"event\":\"recalibrating\"}");
-				ssp6_run_calibration(&device->sspC);
-				break;
-			}
-			break;
-		default:
-			// fallback only. in case we got a message which is not handled above.
-			// if you can see this have a look in the SSP reference manual what
-			// the message is about.
-			publishValidatorEvent("{\"event\":\"unknown\",\"id\":\"0x%02X\"}", poll->events[i].event);
-			break;
-		}
+void mcSspStartTransaction(struct m_device *device, const char *correlId) {
+	unsigned long long now = monotonicMs();
+
+	device->transactionUntil = now + TRANSACTION_BURST_LIMIT;
+	snprintf(device->transactionCorrelId, sizeof(device->transactionCorrelId), "%s", correlId);
+	cacheStatus(device, &device->state.transactionRunning, 1);
+
+	pthread_mutex_lock(&device->jobLock);
+	device->idlePolls = 0;
+	device->pollInterval = POLL_INTERVAL_BURST;
+	if(device->nextPoll > now + POLL_INTERVAL_BURST) {
+		device->nextPoll = now + POLL_INTERVAL_BURST;
 	}
+	pthread_mutex_unlock(&device->jobLock);
 }
 
 /**
- * \brief Initializes and configures redis, libevent and the hardware.
+ * \brief Checks if the event reported by a poll marks the end of a payout, float or empty.
  */
-void setup(struct m_metacash *metacash) {
-	// initialize libEvent
-	metacash->eventBase = event_base_new();
+int mcSspIsTransactionEnd(unsigned char event) {
+	return (eventDefs[event].flags & EVENT_TRANSACTION_END) != 0;
+}
 
-	// connect to redis
-	redisPublishCtx = connectRedis(metacash); // establish connection for publishing
-	redisSubscribeCtx = connectRedis(metacash); // establich connection for subscribing
+/**
+ * \brief Checks if the event reported by a poll means that the levels of the device have changed.
+ */
+int mcSspIsLevelChange(unsigned char event) {
+	return (eventDefs[event].flags & EVENT_LEVEL_CHANGE) != 0;
+}
 
-	// setup redis
-	if (redisPublishCtx && redisSubscribeCtx) {
-		redisLibeventAttach(redisPublishCtx, metacash->eventBase);
-		redisAsyncSetConnectCallback(redisPublishCtx, cbOnConnectPublishContext);
-		redisAsyncSetDisconnectCallback(redisPublishCtx, cbOnDisconnectPublishContext);
+/**
+ * \brief Checks if the event reported by a poll only tells about the progress of an operation, it is repeated
+ * on every poll while the operation is running.
+ */
+int mcSspIsProgressEvent(const SSP_POLL_EVENT6 *event) {
+	unsigned char flags = eventDefs[event->event].flags;
+	// "reading", a note has not been validated yet
+	return (flags & EVENT_PROGRESS) || ((flags & EVENT_NOTE_READ) && event->data1 == 0);
+}
 
-		redisLibeventAttach(redisSubscribeCtx, metacash->eventBase);
-		redisAsyncSetConnectCallback(redisSubscribeCtx, cbOnConnectSubscribeContext);
-		redisAsyncSetDisconnectCallback(redisSubscribeCtx, cbOnDisconnectSubscribeContext);
-	} else {
-		die("could not establish connection to redis", 1);
-		// never reached, already exited
-	}
+/**
+ * \brief Publishes the latest event of the run of progress events together with the number
+ * of events it stands for and starts counting again (worker only).
+ */
+void mcSspPublishHeldEvent(struct m_device *device, unsigned int count) {
+	mcSspPublishEvent(device, &device->heldEvent, count);
 
-	// setup libevent triggered check if we should quit (every 500ms more or less)
-	{
-		struct timeval interval;
-		interval.tv_sec = 0;
-		interval.tv_usec = 500000;
+	device->heldCount = 0;
+	device->heldAt = monotonicMs();
+}
 
-		event_set(&metacash->evCheckQuit, 0, EV_PERSIST, cbOnCheckQuitEvent, metacash); // provide metacash in privdata
-		event_base_set(metacash->eventBase, &metacash->evCheckQuit);
-		evtimer_add(&metacash->evCheckQuit, &interval);
+/**
+ * \brief Publishes the events of a poll with mcSspPublishEvents() (worker only).
+ * \details With -C the first event of a run of identical progress events is published as usual, the following ones
+ * are swallowed and published as one (the latest with "count") once the run ends or every COALESCE_WINDOW ms.
+ * With -E the events published while dispatching are sent as one JSON array to the events topic of the device.
+ */
+void mcSspDispatchEvents(struct m_device *device, struct m_metacash *metacash, SSP_POLL_DATA6 *poll) {
+	for (unsigned char i = 0; i < poll->event_count; i++) {
+		journalAppend(device, JOURNAL_EVENT, poll->events[i].event, 0, poll->events[i].data1, poll->events[i].data2,
+				device->transactionCorrelId);
 	}
 
-	// try to initialize the hardware only if we successfully have opened the device
-	if (metacash->sspAvailable) {
-		// prepare the device structures
-		mcSspSetupCommand(&metacash->validator.sspC, metacash->validator.id);
-		mcSspSetupCommand(&metacash->hopper.sspC, metacash->hopper.id);
-
-		// initialize the devices
-		mcSspInitializeDevice(&metacash->validator.sspC,
-				metacash->validator.key, &metacash->validator);
-		mcSspInitializeDevice(&metacash->hopper.sspC, metacash->hopper.key,
-				&metacash->hopper);
-
-		// only try to configure the hopper if it is available
-		if (metacash->hopper.sspDeviceAvailable) {
-			syslog(LOG_INFO, "setup of device '%s' started", metacash->hopper.name);
-
-			enum channel_state desiredChannelState = DISABLED;
-
-			if(metacash->acceptCoins) {
-				desiredChannelState = ENABLED;
-				syslog(LOG_WARNING, "coins will be accepted");
-			} else {
-				syslog(LOG_NOTICE, "coins will not be accepted");
-			}
+	if (! metacash->coalesceEvents && ! metacash->batchEvents) {
+		mcSspPublishEvents(device, poll);
+		return;
+	}
 
-			// SMART Hopper configuration
-			for (unsigned int i = 0; i < metacash->hopper.sspSetupReq.NumberOfChannels; i++) {
-				ssp6_set_coinmech_inhibits(&metacash->hopper.sspC,
-						metacash->hopper.sspSetupReq.ChannelData[i].value,
-						metacash->hopper.sspSetupReq.ChannelData[i].cc, desiredChannelState);
-			}
+	if (metacash->batchEvents) {
+		bufferReset(&device->events);
+		bufferAppend(&device->events, "[", 1);
+		device->batchingEvents = 1;
+	}
 
-			syslog(LOG_NOTICE, "setup of device '%s' finished successfully", metacash->hopper.name);
-		} else {
-			syslog(LOG_WARNING, "skipping setup of device '%s' as it is not available", metacash->hopper.name);
-		}
+	if (! metacash->coalesceEvents) {
+		mcSspPublishEvents(device, poll);
+	} else {
+		// the events are published one by one, so a coalesced one is published in the right order
+		unsigned long long now = monotonicMs();
 
-		// only try to configure the validator if it is available
-		if (metacash->validator.sspDeviceAvailable) {
-			syslog(LOG_INFO, "setup of device '%s' started", metacash->validator.name);
+		for (unsigned char i = 0; i < poll->event_count; i++) {
+			SSP_POLL_EVENT6 *event = &poll->events[i];
 
-			// reject notes unfit for storage.
-			// if this is not enabled, notes unfit for storage will be silently redirected
-			// to the cashbox of the validator from which no payout can be done.
-			if (mc_ssp_set_refill_mode(&metacash->validator.sspC)
-					!= SSP_RESPONSE_OK) {
-				syslog(LOG_WARNING, "setting refill mode failed");
+			if (event->event == SSP_POLL_DISABLED && device->heldEvent.event) {
+				continue; // reported on every poll as well, neither ends nor interrupts the run
 			}
 
-			// setup the routing of the banknotes in the validator (amounts are in cent)
-			ssp6_set_route(&metacash->validator.sspC, 500, CURRENCY,
-					SSP_OPTION_ROUTE_CASHBOX); // 5 euro
-			ssp6_set_route(&metacash->validator.sspC, 1000, CURRENCY,
-					SSP_OPTION_ROUTE_CASHBOX); // 10 euro
-			ssp6_set_route(&metacash->validator.sspC, 2000, CURRENCY,
-					SSP_OPTION_ROUTE_CASHBOX); // 20 euro
-			ssp6_set_route(&metacash->validator.sspC, 5000, CURRENCY,
-					SSP_OPTION_ROUTE_STORAGE); // 50 euro
-			ssp6_set_route(&metacash->validator.sspC, 10000, CURRENCY,
-					SSP_OPTION_ROUTE_STORAGE); // 100 euro
-			ssp6_set_route(&metacash->validator.sspC, 20000, CURRENCY,
-					SSP_OPTION_ROUTE_STORAGE); // 200 euro
-			ssp6_set_route(&metacash->validator.sspC, 50000, CURRENCY,
-					SSP_OPTION_ROUTE_STORAGE); // 500 euro
-
-			metacash->validator.channelInhibits = 0x0; // disable all channels
-
-			// set the inhibits in the hardware
-			if (ssp6_set_inhibits(&metacash->validator.sspC, metacash->validator.channelInhibits, 0x0)
-					!= SSP_RESPONSE_OK) {
-				syslog(LOG_ERR, "Inhibits Failed\n");
-				return;
+			if (mcSspIsProgressEvent(event) && device->heldEvent.event == event->event) {
+				device->heldEvent = *event;
+				if (now - device->heldAt < COALESCE_WINDOW) {
+					device->heldCount++;
+				} else {
+					mcSspPublishHeldEvent(device, device->heldCount + 1);
+				}
+				continue;
 			}
 
-			//enable the payout unit
-			if (ssp6_enable_payout(&metacash->validator.sspC,
-					metacash->validator.sspSetupReq.UnitType)
-					!= SSP_RESPONSE_OK) {
-				syslog(LOG_ERR, "Enable Payout Failed\n");
-				return;
+			// any other event ends the run
+			if (device->heldCount) {
+				mcSspPublishHeldEvent(device, device->heldCount);
 			}
+			device->heldEvent.event = 0;
 
-			syslog(LOG_NOTICE, "setup of device '%s' finished successfully", metacash->validator.name);
-		} else {
-			syslog(LOG_WARNING, "skipping configuration of device '%s' as it is not available", metacash->validator.name);
-		}
-	} else {
-		syslog(LOG_WARNING, "SSP communication unavailable, skipping hardware setup");
-	}
-
-	// setup libevent triggered polling of the hardware (every second more or less)
-	{
-		struct timeval interval;
-		interval.tv_sec = 1;
-		interval.tv_usec = 0;
-
-		event_set(&metacash->evPoll, 0, EV_PERSIST, cbOnPollEvent, metacash); // provide metacash in privdata
-		event_base_set(metacash->eventBase, &metacash->evPoll);
-		evtimer_add(&metacash->evPoll, &interval);
-	}
-}
-
-/**
- * \brief Opens the serial device.
- */
-int mcSspOpenSerialDevice(struct m_metacash *metacash) {
-	// open the serial device
-	syslog(LOG_INFO, "opening serial device: %s\n", metacash->serialDevice);
+			mcSspPublishEvent(device, event, 0);
 
-	{
-		struct stat buffer;
-		int fildes = open(metacash->serialDevice, O_RDWR);
-		if (fildes <= 0) {
-			syslog(LOG_ERR, "opening device %s failed: %s\n", metacash->serialDevice, strerror(errno));
-			return 1;
+			if (mcSspIsProgressEvent(event)) {
+				// first event of a new run
+				device->heldEvent = *event;
+				device->heldCount = 0;
+				device->heldAt = now;
+			}
 		}
 
-		fstat(fildes, &buffer); // TODO: error handling
-
-		close(fildes);
-
-		switch (buffer.st_mode & S_IFMT) {
-		case S_IFCHR:
-			break;
-		default:
-			syslog(LOG_ERR, "file %s is not a device\n", metacash->serialDevice);
-			return 1;
+		// don't keep the progress hidden for too long if the run goes on without new events
+		if (device->heldCount && now - device->heldAt >= COALESCE_WINDOW) {
+			mcSspPublishHeldEvent(device, device->heldCount);
 		}
 	}
 
-	if (open_ssp_port(metacash->serialDevice) == 0) {
-		syslog(LOG_ERR, "could not open serial device %s\n",
-				metacash->serialDevice);
-		return 1;
+	if (metacash->batchEvents) {
+		device->batchingEvents = 0;
+		if (device->events.length > 1 && bufferAppend(&device->events, "]", 1) == 0) {
+			publishMessage(device->eventsTopic, device->events.data, device->events.length);
+		}
 	}
-	return 0;
-}
-
-/**
- * \brief Closes the serial device.
- */
-void mcSspCloseSerialDevice(struct m_metacash *metacash) {
-	close_ssp_port();
 }
 
 /**
  * \brief Issues a poll command to the hardware and dispatches the response to the event handler function of the device.
+ * \details Returns the number of events reported by the device or -1 if the poll failed.
+ * A "disabled" event is repeated by the device on every poll as long as it is disabled,
+ * it is not counted so an idle disabled device can still back off.
  */
-void mcSspPollDevice(struct m_device *device, struct m_metacash *metacash) {
+int mcSspPollDevice(struct m_device *device, struct m_metacash *metacash) {
 	SSP_POLL_DATA6 poll;
 
-	hardwareWaitTime();
-
 	// poll the unit
 	SSP_RESPONSE_ENUM resp;
 	if ((resp = ssp6_poll(&device->sspC, &poll)) != SSP_RESPONSE_OK) {
 		if (resp == SSP_RESPONSE_TIMEOUT) {
 			// If the poll timed out, then give up
-			syslog(LOG_WARNING, "SSP Poll Timeout\n");
-			return;
+			logMessage(LOG_WARNING, "SSP Poll Timeout\n");
+
+			// a device which has been reset is back at 9600 baud, switch it to the rate of the bus again. the
+			// next poll then answers "key not set" and the encryption is negotiated again
+			unsigned long baudRate = get_ssp_bus_baud(device->bus->index);
+			if (++device->pollTimeouts >= BAUD_RESET_TIMEOUTS && baudRate != DEFAULT_BAUD_RATE) {
+				if (set_ssp_device_baud(&device->sspC, DEFAULT_BAUD_RATE, baudRate)) {
+					logMessage(LOG_NOTICE, "device '%s' was back at %lu baud, switched it to %lu baud again",
+							device->name, DEFAULT_BAUD_RATE, baudRate);
+				}
+				device->pollTimeouts = 0;
+			}
+			return -1;
 		} else {
 			if (resp == SSP_RESPONSE_KEY_NOT_SET) {
-				// The unit has responded with key not set, so we should try to negotiate one
+				// The unit has responded with key not set, so we should try to negotiate one. the device
+				// is useless until then, so this doesn't wait behind the background work of the other device
+				set_ssp_priority(SSP_PRIORITY_INTERACTIVE);
 				if (ssp6_setup_encryption(&device->sspC, device->key)
 						!= SSP_RESPONSE_OK) {
-					syslog(LOG_ERR, "Encryption Failed\n");
+					logMessage(LOG_ERR, "Encryption Failed\n");
 				} else {
-					syslog(LOG_INFO, "Encryption Setup\n");
+					logMessage(LOG_INFO, "Encryption Setup\n");
 				}
+				set_ssp_priority(SSP_PRIORITY_BACKGROUND);
 			} else {
-				syslog(LOG_ERR, "SSP Poll Error: 0x%x\n", resp);
+				logMessage(LOG_ERR, "SSP Poll Error: 0x%x\n", resp);
 			}
 		}
+		return -1;
 	} else {
+		device->pollTimeouts = 0;
 		if (poll.event_count > 0) {
-			syslog(LOG_INFO, "parsing poll response from \"%s\" now (%d events)\n",
+			logMessage(LOG_INFO, "parsing poll response from \"%s\" now (%d events)\n",
 					device->name, poll.event_count);
-			device->eventHandlerFn(device, metacash, &poll);
+		}
+		mcSspDispatchEvents(device, metacash, &poll);
+		if (poll.event_count > 0) {
+
+			for (unsigned char i = 0; i < poll.event_count; ++i) {
+				if (mcSspIsTransactionEnd(poll.events[i].event)) {
+					device->transactionUntil = 0;
+					device->transactionCorrelId[0] = '\0';
+					cacheStatus(device, &device->state.transactionRunning, 0);
+				}
+				if (poll.events[i].event == SSP_POLL_DISABLED) {
+					cacheStatus(device, &device->state.disabled, 1);
+				}
+				if (mcSspIsLevelChange(poll.events[i].event)) {
+					invalidateLevels(device);
+				}
+			}
 		} else {
 			//printf("polling \"%s\" returned no events\n", device->name);
 		}
+		int eventCount = 0;
+		for (unsigned char i = 0; i < poll.event_count; ++i) {
+			if (poll.events[i].event != SSP_POLL_DISABLED) {
+				eventCount++;
+			}
+		}
+		return eventCount;
 	}
 }
 
 /**
- * \brief Initializes an ITL hardware device via SSP
+ * \brief Initializes an ITL hardware device via SSP. Returns 0 on success.
  */
-void mcSspInitializeDevice(SSP_COMMAND *sspC, unsigned long long key,
+int mcSspInitializeDevice(SSP_COMMAND *sspC, unsigned long long key,
 		struct m_device *device) {
 	SSP6_SETUP_REQUEST_DATA *sspSetupReq = &device->sspSetupReq;
-	syslog(LOG_NOTICE, "initializing device (id=0x%02X, '%s')\n", sspC->SSPAddress, device->name);
+	logMessage(LOG_NOTICE, "initializing device (id=0x%02X, '%s')\n", sspC->SSPAddress, device->name);
 
 	//check device is present
 	if (ssp6_sync(sspC) != SSP_RESPONSE_OK) {
-		syslog(LOG_ERR, "No device found\n");
-		return;
+		logMessage(LOG_ERR, "No device found\n");
+		return 1;
 	}
-	syslog(LOG_INFO, "device found\n");
+	logMessage(LOG_INFO, "device found\n");
 
 	//try to setup encryption using the default key
 	if (ssp6_setup_encryption(sspC, key) != SSP_RESPONSE_OK) {
-		syslog(LOG_ERR, "Encryption failed\n");
-		return;
+		logMessage(LOG_ERR, "Encryption failed\n");
+		return 1;
 	}
-	syslog(LOG_INFO, "encryption setup\n");
+	logMessage(LOG_INFO, "encryption setup\n");
 
 	// Make sure we are using ssp version 6
 	if (ssp6_host_protocol(sspC, 0x06) != SSP_RESPONSE_OK) {
-		syslog(LOG_ERR, "Host Protocol Failed\n");
-		return;
+		logMessage(LOG_ERR, "Host Protocol Failed\n");
+		return 1;
 	}
-	syslog(LOG_INFO, "host protocol verified\n");
+	logMessage(LOG_INFO, "host protocol verified\n");
 
 	// Collect some information about the device
 	if (ssp6_setup_request(sspC, sspSetupReq) != SSP_RESPONSE_OK) {
-		syslog(LOG_ERR, "Setup Request Failed\n");
-		return;
+		logMessage(LOG_ERR, "Setup Request Failed\n");
+		return 1;
 	}
 
-	syslog(LOG_INFO, "channels:\n");
+	logMessage(LOG_INFO, "channels:\n");
 	for (unsigned int i = 0; i < sspSetupReq->NumberOfChannels; i++) {
-		syslog(LOG_INFO, "channel %d: %d %s\n", i + 1, sspSetupReq->ChannelData[i].value,
+		logMessage(LOG_INFO, "channel %d: %d %s\n", i + 1, sspSetupReq->ChannelData[i].value,
 				sspSetupReq->ChannelData[i].cc);
 	}
 
+	// the versions never change at runtime, keep them for get-firmware-version / get-dataset-version
 	char version[100];
-	mc_ssp_get_firmware_version(sspC, &version[0]);
-	syslog(LOG_INFO, "full firmware version: %s\n", version);
+	if (mc_ssp_get_firmware_version(sspC, &version[0]) == SSP_RESPONSE_OK) {
+		logMessage(LOG_INFO, "full firmware version: %s\n", version);
+		cacheVersion(device, device->state.firmwareVersion, &device->state.firmwareVersionAt, version);
+	}
 
-	mc_ssp_get_dataset_version(sspC, &version[0]);
-	syslog(LOG_INFO, "full dataset version : %s\n", version);
+	if (mc_ssp_get_dataset_version(sspC, &version[0]) == SSP_RESPONSE_OK) {
+		logMessage(LOG_INFO, "full dataset version : %s\n", version);
+		cacheVersion(device, device->state.datasetVersion, &device->state.datasetVersionAt, version);
+	}
 
 	//enable the device
 	if (ssp6_enable(sspC) != SSP_RESPONSE_OK) {
-		syslog(LOG_ERR, "Enable Failed\n");
-		return;
+		logMessage(LOG_ERR, "Enable Failed\n");
+		return 1;
 	}
+	cacheStatus(device, &device->state.disabled, 0);
 
-	device->sspDeviceAvailable = 1;
-	syslog(LOG_NOTICE, "device has been successfully initialized (id=0x%02X, '%s')\n", sspC->SSPAddress, device->name);
+	logMessage(LOG_NOTICE, "device has been successfully initialized (id=0x%02X, '%s')\n", sspC->SSPAddress, device->name);
+	return 0;
 }
 
 /**
  * \brief Initializes the SSP_COMMAND structure.
  */
-void mcSspSetupCommand(SSP_COMMAND *sspC, int deviceId) {
+void mcSspSetupCommand(SSP_COMMAND *sspC, unsigned char busIndex, int deviceId) {
+	sspC->PortNumber = busIndex;
 	sspC->SSPAddress = deviceId;
 	sspC->Timeout = 1000;
 	sspC->EncryptionStatus = NO_ENCRYPTION;
@@ -2135,7 +7187,7 @@ SSP_RESPONSE_ENUM mc_ssp_smart_empty(SSP_COMMAND *sspC) {
 }
 
 
-SSP_RESPONSE_ENUM mc_ssp_cashbox_payout_operation_data(SSP_COMMAND *sspC, char **json) {
+SSP_RESPONSE_ENUM mc_ssp_cashbox_payout_operation_data(SSP_COMMAND *sspC, struct m_buffer *json) {
 	sspC->CommandDataLength = 1;
 	sspC->CommandData[0] = SSP_CMD_CASHBOX_PAYOUT_OPERATION_DATA;
 
@@ -2161,9 +7213,6 @@ SSP_RESPONSE_ENUM mc_ssp_cashbox_payout_operation_data(SSP_COMMAND *sspC, char *
 	i++; // move onto numCounters
 	int numCounters = sspC->ResponseData[i];
 
-	/* Create StringBuffer 'object' (struct) */
-	SB *sb = getStringBuffer();
-
 	int j; // current counter
 	for (j = 0; j < numCounters; ++j) {
 		int k;
@@ -2190,17 +7239,8 @@ SSP_RESPONSE_ENUM mc_ssp_cashbox_payout_operation_data(SSP_COMMAND *sspC, char *
 					sspC->ResponseData[i];
 		}
 
-		char *response = NULL;
-		asprintf(&response,
-				"{\"value\":%d,\"level\":%d,\"cc\":\"%s\"}", value, level, cc);
-
-		if(j > 0) {
-			char *sep = ",";
-			sb->append( sb, sep); // json array seperator
-		}
-		sb->append( sb, response);
-
-		free(response);
+		bufferPrintf(json, "%s{\"value\":%d,\"level\":%d,\"cc\":\"%s\"}",
+				j > 0 ? "," : "", value, level, cc); // with json array seperator
 	}
 
 	/* quantity of unknown coins */
@@ -2212,24 +7252,10 @@ SSP_RESPONSE_ENUM mc_ssp_cashbox_payout_operation_data(SSP_COMMAND *sspC, char *
 					(((unsigned long) sspC->ResponseData[i])
 							<< (8 * k));
 		}
-		char *response = NULL;
-		asprintf(&response,
-				",{\"value\":0,\"level\":%d}", qtyUnknown);
 		// json array seperator and value are constant here
-
-		sb->append( sb, response);
-
-		free(response);
+		bufferPrintf(json, ",{\"value\":0,\"level\":%d}", qtyUnknown);
 	}
 
-	/* Call toString() function to get catenated list */
-	char *result = sb->toString( sb );
-
-	asprintf(json, "%s", result);
-
-	/* Dispose of StringBuffer's memory */
-	sb->dispose( &sb ); /* Note: Need to pass ADDRESS of struct pointer to dispose() */
-
 	return resp;
 }
 
@@ -2336,7 +7362,7 @@ SSP_RESPONSE_ENUM mc_ssp_set_cashbox_payout_limit(SSP_COMMAND *sspC, unsigned in
 /**
  * \brief Implements the "GET ALL LEVELS" command from the SSP Protocol.
  */
-SSP_RESPONSE_ENUM mc_ssp_get_all_levels(SSP_COMMAND *sspC, char **json) {
+SSP_RESPONSE_ENUM mc_ssp_get_all_levels(SSP_COMMAND *sspC, struct m_buffer *json) {
 	sspC->CommandDataLength = 1;
 	sspC->CommandData[0] = SSP_CMD_GET_ALL_LEVELS;
 
@@ -2358,9 +7384,6 @@ SSP_RESPONSE_ENUM mc_ssp_get_all_levels(SSP_COMMAND *sspC, char **json) {
 	i++; // move onto numCounters
 	int numCounters = sspC->ResponseData[i];
 
-	/* Create StringBuffer 'object' (struct) */
-	SB *sb = getStringBuffer();
-
 	int j; // current counter
 	for (j = 0; j < numCounters; ++j) {
 		int k;
@@ -2387,27 +7410,10 @@ SSP_RESPONSE_ENUM mc_ssp_get_all_levels(SSP_COMMAND *sspC, char **json) {
 					sspC->ResponseData[i];
 		}
 
-		char *response = NULL;
-		asprintf(&response,
-				"{\"value\":%d,\"level\":%d,\"cc\":\"%s\"}", value, level, cc);
-
-		if(j > 0) {
-			char *sep = ",";
-			sb->append( sb, sep); // json array seperator
-		}
-		sb->append( sb, response);
-
-		free(response);
+		bufferPrintf(json, "%s{\"value\":%d,\"level\":%d,\"cc\":\"%s\"}",
+				j > 0 ? "," : "", value, level, cc); // with json array seperator
 	}
 
-	/* Call toString() function to get catenated list */
-	char *result = sb->toString( sb );
-
-	asprintf(json, "%s", result);
-
-	/* Dispose of StringBuffer's memory */
-	sb->dispose( &sb ); /* Note: Need to pass ADDRESS of struct pointer to dispose() */
-
 	return resp;
 }
 
@@ -2517,10 +7523,10 @@ SSP_RESPONSE_ENUM mc_ssp_channel_security_data(SSP_COMMAND *sspC) {
 	if(resp == SSP_RESPONSE_OK) {
 		int numChannels = sspC->ResponseData[1];
 
-		syslog(LOG_DEBUG, "security status: numChannels=%d\n", numChannels);
-		syslog(LOG_DEBUG, "0 = unused, 1 = low, 2 = std, 3 = high, 4 = inhibited\n");
+		logMessage(LOG_DEBUG, "security status: numChannels=%d\n", numChannels);
+		logMessage(LOG_DEBUG, "0 = unused, 1 = low, 2 = std, 3 = high, 4 = inhibited\n");
 		for(int i = 0; i < numChannels; i++) {
-			syslog(LOG_DEBUG, "security status: channel %d -> %d\n", 1 + i, sspC->ResponseData[2 + i]);
+			logMessage(LOG_DEBUG, "security status: channel %d -> %d\n", 1 + i, sspC->ResponseData[2 + i]);
 		}
 	}
 
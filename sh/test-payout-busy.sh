@@ -0,0 +1,12 @@
+#!/bin/bash
+
+# neither test-payout is planned: the first is answered "smart payout disabled", the second "smart payout busy"
+AMOUNT=${1:-100}
+
+redis-cli publish hopper-request "{ \"cmd\":\"disable\", \"msgId\":\"`uuidgen`\" }"
+# fill the level cache again, disable has dropped it
+redis-cli publish hopper-request "{ \"cmd\":\"get-all-levels\", \"msgId\":\"`uuidgen`\" }"
+redis-cli publish hopper-request "{ \"cmd\":\"test-payout\", \"msgId\":\"`uuidgen`\", \"amount\":${AMOUNT} }"
+redis-cli publish hopper-request "{ \"cmd\":\"enable\", \"msgId\":\"`uuidgen`\" }"
+redis-cli publish hopper-request "{ \"cmd\":\"do-payout\", \"msgId\":\"`uuidgen`\", \"amount\":${AMOUNT} }"
+redis-cli publish hopper-request "{ \"cmd\":\"test-payout\", \"msgId\":\"`uuidgen`\", \"amount\":${AMOUNT} }"
@@ -0,0 +1,1251 @@
+/** \file sspsim.c
+ *  \brief SSP slave simulator, emulates a NV200 validator and a SMART Hopper on a pseudo terminal.
+ *
+ *  In a nutshell:
+ *  - a pty is opened and its slave side is printed to stdout (and linked with -l), payoutd is started with -d <pty>
+ *  - both devices share the bus like the real hardware: validator on address 0x00, SMART Hopper on address 0x10
+ *  - the framing is the one of SSPComs.c: STX, address/seq, length, data, CRC, 'byte stuffing' of STX in the packet
+ *  - the key exchange (set generator, set modulus, request key exchange) and the STEX encryption with the
+ *    packet counter are those of ITLSSPProc.c, the fixed key defaults to the one of payoutd (-k)
+ *  - retransmissions (same seq bit, same packet) are answered with the previous reply and not executed twice
+ *  - every reply is delayed by -r ms plus up to -j ms jitter, -x / -X drop or corrupt the given percentage of replies
+ *  - the poll responses are generated from scenarios: note insertion every -n ms, coin insertion every -c ms,
+ *    payouts / floats / empties dispense one coin per DISPENSE_STEP ms and jam with a probability of -J percent
+ *  - the levels of the devices are kept, so get-all-levels, payouts and floats behave consistently
+ *  - set baud rate is accepted for every rate of the command, a pty transfers at any rate
+ *  - main() supports arguments -l (link to the pty), -k (fixed key), -r, -j, -x, -X, -n, -c, -J, -s (random seed), -v and -?
+ */
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libitlssp/ssp_commands.h"
+#include "libitlssp/Encryption.h"
+#include "libitlssp/Random.h"
+
+/** \brief Fixed part of the key, the same default as the one of payoutd */
+static const unsigned long long DEFAULT_KEY = 0x123456701234567LL;
+
+/** \brief Time in ms the hopper needs for one coin of a payout, float or empty */
+static const unsigned long DISPENSE_STEP = 150;
+/** \brief Time in ms between the poll events of an inserted note (read, credit, stacking, ...) */
+static const unsigned long NOTE_STEP = 300;
+
+/** \brief Upper bound of the events of one poll response, leaves room for the STEX overhead */
+#define MAX_POLL_LENGTH 120
+/** \brief Number of poll events which can be pending on one device */
+#define MAX_FRAMES 64
+#define MAX_CHANNELS 16
+
+/** \brief Magic Constants of commands which are not in the libitlssp headers */
+#define SSP_CMD_GET_FIRMWARE_VERSION 0x20
+#define SSP_CMD_GET_DATASET_VERSION 0x21
+#define SSP_CMD_GET_ALL_LEVELS 0x22
+#define SSP_CMD_SET_CASHBOX_PAYOUT_LIMIT 0x4E
+#define SSP_CMD_SMART_EMPTY 0x52
+#define SSP_CMD_CASHBOX_PAYOUT_OPERATION_DATA 0x53
+#define SSP_CMD_CONFIGURE_BEZEL 0x54
+#define SSP_CMD_SET_REFILL_MODE 0x30
+
+/** \brief Reasons of a "command not processed" reply to a payout */
+#define PAYOUT_NOT_ENOUGH_VALUE 0x01
+#define PAYOUT_NOT_EXACT 0x02
+#define PAYOUT_BUSY 0x03
+#define PAYOUT_DISABLED 0x04
+
+/** \brief Reject reason "channel inhibited" reported by last reject note */
+#define REJECT_CHANNEL_INHIBITED 0x06
+
+struct s_channel {
+	unsigned int value;
+	char cc[4];
+	unsigned int level; // coins / notes in the payout
+	unsigned int cashbox; // coins / notes routed to the cashbox
+	unsigned char route;
+};
+
+/** \brief One pending poll event, reported by the first poll after readyAt */
+struct s_frame {
+	unsigned long long readyAt;
+	unsigned char length;
+	unsigned char data[16];
+};
+
+/** \brief A running payout, float or empty which dispenses one coin per DISPENSE_STEP */
+struct s_transaction {
+	int active;
+	unsigned char progressEvent; // reported after each coin
+	unsigned char doneEvent; // reported at the end
+	unsigned char incompleteEvent; // reported after a jam (0 if there is none)
+	int withValue; // the events carry the value and the country code
+	int toCashbox; // the coins go to the cashbox instead of out of the device
+	unsigned int plan[MAX_CHANNELS]; // coins still to dispense per channel
+	unsigned int requested;
+	unsigned int done;
+	int jamAfter; // number of coins after which the hopper jams, -1 if it doesn't
+	unsigned long long nextAt;
+};
+
+struct s_device {
+	const char *name;
+	unsigned char address;
+	unsigned char unitType;
+	const char *firmwareVersion; // 16 chars
+	const char *datasetVersion; // 8 chars
+
+	struct s_channel channels[MAX_CHANNELS];
+	unsigned int channelCount;
+
+	// encryption
+	long long generator;
+	long long modulus;
+	SSP_FULL_KEY key;
+	int keySet;
+	unsigned int count;
+
+	// retransmission detection
+	int haveLast;
+	unsigned char lastRequest[255];
+	unsigned int lastRequestLength;
+	unsigned char lastReply[255];
+	unsigned int lastReplyLength;
+
+	int enabled;
+	unsigned int inhibits;
+	unsigned char lastReject;
+
+	struct s_frame frames[MAX_FRAMES];
+	unsigned int frameHead;
+	unsigned int frameCount;
+
+	struct s_transaction transaction;
+	unsigned long long nextInsertAt;
+};
+
+struct s_sim {
+	int master;
+	int slave; // kept open so the master doesn't see EIO while no host has the pty open
+	char *link;
+	int verbose;
+	unsigned long long fixedKey;
+	unsigned long replyDelay;
+	unsigned long replyJitter;
+	double dropPercent;
+	double corruptPercent;
+	unsigned long noteInterval;
+	unsigned long coinInterval;
+	double jamPercent;
+
+	struct s_device validator;
+	struct s_device hopper;
+};
+
+/** \brief Receive state of the packet decoder, see SSPDataIn() */
+struct s_rx {
+	unsigned char data[255];
+	unsigned int length;
+	int inPacket;
+	int stuffed;
+};
+
+unsigned long long monotonicMs(void);
+int parseCmdLine(int argc, char *argv[], struct s_sim *sim);
+void initValidator(struct s_device *device);
+void initHopper(struct s_device *device);
+int openPty(struct s_sim *sim);
+int rxByte(struct s_rx *rx, unsigned char b);
+void handlePacket(struct s_sim *sim, const unsigned char *packet, unsigned int length);
+void sendReply(struct s_sim *sim, struct s_device *device, unsigned char addressSeq, const unsigned char *data,
+		unsigned int length, int encrypt);
+unsigned int executeCommand(struct s_sim *sim, struct s_device *device, const unsigned char *cmd, unsigned int length,
+		unsigned char *resp);
+unsigned int buildPoll(struct s_device *device, unsigned char *resp);
+void queueFrame(struct s_device *device, unsigned long long readyAt, const unsigned char *data, unsigned char length);
+void queueValueEvent(struct s_device *device, unsigned long long readyAt, unsigned char event, unsigned int value,
+		const char *cc);
+void tickDevice(struct s_sim *sim, struct s_device *device, unsigned long long now);
+void tickTransaction(struct s_device *device, unsigned long long now);
+void insertNote(struct s_sim *sim, struct s_device *device, unsigned long long now);
+void insertCoin(struct s_device *device, unsigned long long now);
+int chance(double percent);
+
+/**
+ * \brief Set by the signalHandler function and checked in the main loop.
+ */
+int receivedSignal = 0;
+
+/**
+ * \brief Signal handler
+ */
+void signalHandler(int signal) {
+	receivedSignal = signal;
+}
+
+/**
+ * \brief Returns a monotonic timestamp in ms, used for the reply delays and the scenarios.
+ */
+unsigned long long monotonicMs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * \brief Returns 1 with a probability of percent %.
+ */
+int chance(double percent) {
+	return percent > 0 && rand() < percent / 100.0 * RAND_MAX;
+}
+
+/**
+ * \brief The NV200 with SMART Payout as seen by payoutd: EUR notes 5 to 500, unit type 0x06.
+ */
+void initValidator(struct s_device *device) {
+	static const unsigned int values[] = { 5, 10, 20, 50, 100, 200, 500 };
+
+	memset(device, 0, sizeof(*device));
+	device->name = "validator";
+	device->address = 0x00;
+	device->unitType = 0x06;
+	device->firmwareVersion = "NV02004141498000";
+	device->datasetVersion = "EUR01610";
+	device->channelCount = sizeof(values) / sizeof(values[0]);
+	for (unsigned int i = 0; i < device->channelCount; i++) {
+		device->channels[i].value = values[i] * 100;
+		strcpy(device->channels[i].cc, "EUR");
+	}
+}
+
+/**
+ * \brief The SMART Hopper as seen by payoutd: EUR coins 1 cent to 2 euro, unit type 0x03.
+ */
+void initHopper(struct s_device *device) {
+	static const unsigned int values[] = { 1, 2, 5, 10, 20, 50, 100, 200 };
+
+	memset(device, 0, sizeof(*device));
+	device->name = "hopper";
+	device->address = 0x10;
+	device->unitType = 0x03;
+	device->firmwareVersion = "SH03004141498000";
+	device->datasetVersion = "EUR01610";
+	device->channelCount = sizeof(values) / sizeof(values[0]);
+	for (unsigned int i = 0; i < device->channelCount; i++) {
+		device->channels[i].value = values[i];
+		strcpy(device->channels[i].cc, "EUR");
+		device->channels[i].level = 50;
+	}
+}
+
+/**
+ * \brief Opens the pty, puts it into raw mode and publishes the name of its slave side.
+ */
+int openPty(struct s_sim *sim) {
+	sim->master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (sim->master < 0 || grantpt(sim->master) || unlockpt(sim->master)) {
+		syslog(LOG_ERR, "could not open a pty: %s", strerror(errno));
+		return 1;
+	}
+
+	char *name = ptsname(sim->master);
+	sim->slave = open(name, O_RDWR | O_NOCTTY);
+	if (sim->slave < 0) {
+		syslog(LOG_ERR, "could not open %s: %s", name, strerror(errno));
+		return 1;
+	}
+
+	struct termios options;
+	tcgetattr(sim->slave, &options);
+	cfmakeraw(&options);
+	tcsetattr(sim->slave, TCSANOW, &options);
+
+	if (sim->link != NULL) {
+		unlink(sim->link);
+		if (symlink(name, sim->link)) {
+			syslog(LOG_ERR, "could not link %s to %s: %s", sim->link, name, strerror(errno));
+			return 1;
+		}
+	}
+
+	printf("%s\n", name);
+	fflush(stdout);
+	syslog(LOG_NOTICE, "simulating validator (id=0x%02X) and hopper (id=0x%02X) on %s",
+			sim->validator.address, sim->hopper.address, name);
+	return 0;
+}
+
+/**
+ * \brief Feeds one byte into the packet decoder, returns 1 once rx holds a complete packet.
+ * \details Same rules as SSPDataIn(): a STX followed by another STX is a stuffed STX, a STX followed by
+ * anything else starts a new packet.
+ */
+int rxByte(struct s_rx *rx, unsigned char b) {
+	if (! rx->inPacket) {
+		if (b == SSP_STX) {
+			rx->inPacket = 1;
+			rx->stuffed = 0;
+			rx->data[0] = SSP_STX;
+			rx->length = 1;
+		}
+		return 0;
+	}
+
+	if (rx->stuffed) {
+		rx->stuffed = 0;
+		if (b != SSP_STX) {
+			// start of a new packet
+			rx->data[0] = SSP_STX;
+			rx->length = 1;
+		}
+	} else if (b == SSP_STX) {
+		rx->stuffed = 1;
+		return 0;
+	}
+
+	rx->data[rx->length++] = b;
+	if (rx->length >= 3 && rx->length == (unsigned int) rx->data[2] + 5) {
+		rx->inPacket = 0;
+		return 1;
+	}
+	if (rx->length >= sizeof(rx->data)) {
+		rx->inPacket = 0;
+	}
+	return 0;
+}
+
+/**
+ * \brief Checks a complete packet, answers retransmissions and decrypts STEX packets before executing them.
+ */
+void handlePacket(struct s_sim *sim, const unsigned char *packet, unsigned int length) {
+	struct s_device *device;
+	unsigned char addressSeq = packet[1];
+	unsigned char dataLength = packet[2];
+
+	if ((addressSeq & 0x7F) == sim->validator.address) {
+		device = &sim->validator;
+	} else if ((addressSeq & 0x7F) == sim->hopper.address) {
+		device = &sim->hopper;
+	} else {
+		return; // for somebody else on the bus
+	}
+
+	unsigned short crc = cal_crc_loop_CCITT_A(length - 3, (unsigned char *) &packet[1], CRC_SSP_SEED, CRC_SSP_POLY);
+	if ((unsigned char) (crc & 0xFF) != packet[length - 2] || (unsigned char) ((crc >> 8) & 0xFF) != packet[length - 1]) {
+		syslog(LOG_WARNING, "%s: dropping packet with bad CRC", device->name);
+		return;
+	}
+
+	const unsigned char *data = &packet[3];
+	if (data[0] != SSP_CMD_SYNC && device->haveLast && device->lastRequestLength == length
+			&& memcmp(device->lastRequest, packet, length) == 0) {
+		// the host didn't get our reply, send it again without executing the command twice
+		if (sim->verbose) {
+			syslog(LOG_DEBUG, "%s: retransmission, repeating the reply", device->name);
+		}
+		if (write(sim->master, device->lastReply, device->lastReplyLength) != (ssize_t) device->lastReplyLength) {
+			syslog(LOG_ERR, "%s: write failed: %s", device->name, strerror(errno));
+		}
+		return;
+	}
+	memcpy(device->lastRequest, packet, length);
+	device->lastRequestLength = length;
+
+	unsigned char plain[255];
+	unsigned int plainLength = dataLength;
+	int encrypted = 0;
+
+	if (data[0] == SSP_STEX) {
+		unsigned char encryptLength = dataLength - 1;
+		if (! device->keySet) {
+			unsigned char resp = SSP_RESPONSE_KEY_NOT_SET;
+			sendReply(sim, device, addressSeq, &resp, 1, 0);
+			return;
+		}
+		if (encryptLength == 0 || encryptLength % C_MAX_KEY_LENGTH != 0
+				|| aes_decrypt(C_AES_MODE_ECB, (unsigned char *) &device->key, C_MAX_KEY_LENGTH, NULL, 0,
+						plain, (unsigned char *) &data[1], encryptLength) != E_AES_SUCCESS) {
+			syslog(LOG_WARNING, "%s: dropping malformed encrypted packet", device->name);
+			return;
+		}
+
+		crc = cal_crc_loop_CCITT_A(encryptLength - 2, plain, CRC_SSP_SEED, CRC_SSP_POLY);
+		if ((unsigned char) (crc & 0xFF) != plain[encryptLength - 2]
+				|| (unsigned char) ((crc >> 8) & 0xFF) != plain[encryptLength - 1]) {
+			syslog(LOG_WARNING, "%s: dropping encrypted packet with bad CRC (wrong key?)", device->name);
+			return;
+		}
+
+		unsigned int count = 0;
+		for (int i = 0; i < 4; i++) {
+			count += (unsigned int) plain[1 + i] << (8 * i);
+		}
+		if (count != device->count) {
+			// like the real hardware: the packet is ignored, the host has to renegotiate
+			syslog(LOG_WARNING, "%s: dropping encrypted packet with count %u (expected %u)",
+					device->name, count, device->count);
+			return;
+		}
+		device->count++;
+
+		plainLength = plain[0];
+		memmove(plain, &plain[5], plainLength);
+		encrypted = 1;
+	} else {
+		memcpy(plain, data, plainLength);
+	}
+
+	if (plainLength == 0) {
+		return;
+	}
+
+	unsigned char resp[255];
+	unsigned int respLength = executeCommand(sim, device, plain, plainLength, resp);
+
+	if (sim->verbose) {
+		syslog(LOG_DEBUG, "%s: cmd 0x%02X (%u bytes%s) -> 0x%02X (%u bytes)", device->name, plain[0],
+				plainLength, encrypted ? ", encrypted" : "", resp[0], respLength);
+	}
+
+	if (plain[0] == SSP_CMD_SYNC) {
+		device->haveLast = 0;
+	}
+	sendReply(sim, device, addressSeq, resp, respLength, encrypted);
+}
+
+/**
+ * \brief Frames (and encrypts if the command was encrypted) a reply and writes it after the configured delay.
+ */
+void sendReply(struct s_sim *sim, struct s_device *device, unsigned char addressSeq, const unsigned char *data,
+		unsigned int length, int encrypt) {
+	unsigned char body[255];
+	unsigned int bodyLength = length;
+
+	if (encrypt) {
+		unsigned char tmp[255];
+		unsigned int pkLength = length + 7;
+		unsigned int packLength = 0;
+		if (pkLength % C_MAX_KEY_LENGTH != 0) {
+			packLength = C_MAX_KEY_LENGTH - (pkLength % C_MAX_KEY_LENGTH);
+		}
+		pkLength += packLength;
+
+		tmp[0] = length;
+		for (int i = 0; i < 4; i++) {
+			tmp[1 + i] = (unsigned char) ((device->count >> (8 * i)) & 0xFF);
+		}
+		memcpy(&tmp[5], data, length);
+		for (unsigned int i = 0; i < packLength; i++) {
+			tmp[5 + length + i] = (unsigned char) (rand() % 255);
+		}
+		unsigned short crc = cal_crc_loop_CCITT_A(pkLength - 2, tmp, CRC_SSP_SEED, CRC_SSP_POLY);
+		tmp[pkLength - 2] = (unsigned char) (crc & 0xFF);
+		tmp[pkLength - 1] = (unsigned char) ((crc >> 8) & 0xFF);
+
+		body[0] = SSP_STEX;
+		aes_encrypt(C_AES_MODE_ECB, (unsigned char *) &device->key, C_MAX_KEY_LENGTH, NULL, 0, tmp, &body[1], pkLength);
+		bodyLength = pkLength + 1;
+	} else {
+		memcpy(body, data, length);
+	}
+
+	// STX, address/seq (echoed), length, data, CRC with 'byte stuffing'
+	unsigned char out[2 * 255 + 8];
+	unsigned int j = 0;
+	unsigned short crc = CRC_SSP_SEED;
+#define PUT_BYTE(b)							\
+	do {								\
+		out[j++] = (b);						\
+		if ((b) == SSP_STX)					\
+			out[j++] = SSP_STX;				\
+	} while (0)
+
+	out[j++] = SSP_STX;
+	crc = CRC_SSP_UPDATE(crc, addressSeq);
+	PUT_BYTE(addressSeq);
+	crc = CRC_SSP_UPDATE(crc, bodyLength);
+	PUT_BYTE((unsigned char) bodyLength);
+	for (unsigned int i = 0; i < bodyLength; i++) {
+		crc = CRC_SSP_UPDATE(crc, body[i]);
+		PUT_BYTE(body[i]);
+	}
+	if (chance(sim->corruptPercent)) {
+		crc ^= 0x5A5A;
+	}
+	PUT_BYTE((unsigned char) (crc & 0xFF));
+	PUT_BYTE((unsigned char) ((crc >> 8) & 0xFF));
+#undef PUT_BYTE
+
+	memcpy(device->lastReply, out, j < sizeof(device->lastReply) ? j : sizeof(device->lastReply));
+	device->lastReplyLength = j < sizeof(device->lastReply) ? j : sizeof(device->lastReply);
+	device->haveLast = 1;
+
+	if (chance(sim->dropPercent)) {
+		if (sim->verbose) {
+			syslog(LOG_DEBUG, "%s: dropping reply", device->name);
+		}
+		return;
+	}
+
+	unsigned long delay = sim->replyDelay;
+	if (sim->replyJitter > 0) {
+		delay += rand() % (sim->replyJitter + 1);
+	}
+	if (delay > 0) {
+		struct timespec ts = { delay / 1000, (delay % 1000) * 1000000 };
+		nanosleep(&ts, NULL);
+	}
+
+	if (write(sim->master, out, j) != (ssize_t) j) {
+		syslog(LOG_ERR, "%s: write failed: %s", device->name, strerror(errno));
+	}
+}
+
+/**
+ * \brief Queues a poll event which is reported by the first poll after readyAt.
+ */
+void queueFrame(struct s_device *device, unsigned long long readyAt, const unsigned char *data, unsigned char length) {
+	if (device->frameCount == MAX_FRAMES || length > sizeof(device->frames[0].data)) {
+		syslog(LOG_WARNING, "%s: event queue full, dropping event 0x%02X", device->name, data[0]);
+		return;
+	}
+	struct s_frame *frame = &device->frames[(device->frameHead + device->frameCount) % MAX_FRAMES];
+	frame->readyAt = readyAt;
+	frame->length = length;
+	memcpy(frame->data, data, length);
+	device->frameCount++;
+}
+
+/**
+ * \brief Queues one of the events with a country count, value and country code (dispensing, floated, ...).
+ */
+void queueValueEvent(struct s_device *device, unsigned long long readyAt, unsigned char event, unsigned int value,
+		const char *cc) {
+	unsigned char data[9] = { event, 1 };
+	for (int i = 0; i < 4; i++) {
+		data[2 + i] = (unsigned char) (value >> (8 * i));
+	}
+	memcpy(&data[6], cc, 3);
+	queueFrame(device, readyAt, data, sizeof(data));
+}
+
+/**
+ * \brief Builds the poll response from the due events, reports 'disabled' while the device is disabled.
+ */
+unsigned int buildPoll(struct s_device *device, unsigned char *resp) {
+	unsigned long long now = monotonicMs();
+	unsigned int length = 0;
+
+	resp[length++] = SSP_RESPONSE_OK;
+	while (device->frameCount > 0) {
+		struct s_frame *frame = &device->frames[device->frameHead];
+		if (frame->readyAt > now || length + frame->length > MAX_POLL_LENGTH) {
+			break;
+		}
+		memcpy(&resp[length], frame->data, frame->length);
+		length += frame->length;
+		device->frameHead = (device->frameHead + 1) % MAX_FRAMES;
+		device->frameCount--;
+	}
+
+	if (! device->enabled && length + 1 <= MAX_POLL_LENGTH) {
+		resp[length++] = SSP_POLL_DISABLED;
+	}
+	return length;
+}
+
+/**
+ * \brief Finds the channel of a value / country code pair, returns -1 if there is none.
+ */
+static int findChannel(struct s_device *device, unsigned int value, const unsigned char *cc) {
+	for (unsigned int i = 0; i < device->channelCount; i++) {
+		if (device->channels[i].value == value && memcmp(device->channels[i].cc, cc, 3) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/**
+ * \brief Reads a little endian value of n bytes.
+ */
+static unsigned int readLe(const unsigned char *data, int n) {
+	unsigned int value = 0;
+	for (int i = 0; i < n; i++) {
+		value += (unsigned int) data[i] << (8 * i);
+	}
+	return value;
+}
+
+/**
+ * \brief Writes a little endian value of n bytes, returns the number of bytes written.
+ */
+static unsigned int writeLe(unsigned char *data, unsigned int value, int n) {
+	for (int i = 0; i < n; i++) {
+		data[i] = (unsigned char) (value >> (8 * i));
+	}
+	return n;
+}
+
+/**
+ * \brief Plans the coins of a payout (largest first), returns the value which can be paid.
+ */
+static unsigned int planPayout(struct s_device *device, unsigned int amount, unsigned int *plan) {
+	unsigned int remaining = amount;
+	for (int i = device->channelCount - 1; i >= 0; i--) {
+		unsigned int coins = remaining / device->channels[i].value;
+		if (coins > device->channels[i].level) {
+			coins = device->channels[i].level;
+		}
+		plan[i] = coins;
+		remaining -= coins * device->channels[i].value;
+	}
+	return amount - remaining;
+}
+
+/**
+ * \brief Starts a transaction which dispenses the planned coins.
+ */
+static void startTransaction(struct s_sim *sim, struct s_device *device, unsigned char progressEvent,
+		unsigned char doneEvent, unsigned char incompleteEvent, int withValue, int toCashbox, unsigned int requested) {
+	struct s_transaction *t = &device->transaction;
+	t->active = 1;
+	t->progressEvent = progressEvent;
+	t->doneEvent = doneEvent;
+	t->incompleteEvent = incompleteEvent;
+	t->withValue = withValue;
+	t->toCashbox = toCashbox;
+	t->requested = requested;
+	t->done = 0;
+	t->nextAt = monotonicMs() + DISPENSE_STEP;
+	t->jamAfter = -1;
+
+	unsigned int coins = 0;
+	for (unsigned int i = 0; i < device->channelCount; i++) {
+		coins += t->plan[i];
+	}
+	if (incompleteEvent != 0 && coins > 1 && chance(sim->jamPercent)) {
+		t->jamAfter = rand() % coins;
+	}
+}
+
+/**
+ * \brief Executes a plain command, returns the length of the response written to resp.
+ */
+unsigned int executeCommand(struct s_sim *sim, struct s_device *device, const unsigned char *cmd, unsigned int length,
+		unsigned char *resp) {
+	unsigned int n = 0;
+	int isHopper = device->unitType == 0x03;
+
+	switch (cmd[0]) {
+	case SSP_CMD_SYNC:
+		resp[n++] = SSP_RESPONSE_OK;
+		break;
+	case SSP_CMD_RESET:
+		resp[n++] = SSP_RESPONSE_OK;
+		device->enabled = 0;
+		device->frameCount = 0;
+		device->transaction.active = 0;
+		{
+			unsigned char event = SSP_POLL_RESET;
+			queueFrame(device, monotonicMs() + 1000, &event, 1);
+		}
+		break;
+	case SSP_CMD_SET_GENERATOR:
+	case SSP_CMD_SET_MODULUS:
+		if (length != 9) {
+			resp[n++] = SSP_RESPONSE_INCORRECT_PARAMETERS;
+			break;
+		}
+		{
+			long long value = 0;
+			for (int i = 0; i < 8; i++) {
+				value += (long long) cmd[1 + i] << (8 * i);
+			}
+			if (value == 0) {
+				resp[n++] = SSP_RESPONSE_INVALID_PARAMETER;
+				break;
+			}
+			if (cmd[0] == SSP_CMD_SET_GENERATOR) {
+				device->generator = value;
+			} else {
+				device->modulus = value;
+			}
+		}
+		resp[n++] = SSP_RESPONSE_OK;
+		break;
+	case SSP_CMD_REQ_KEY_EXCHANGE:
+		if (length != 9 || device->generator == 0 || device->modulus == 0) {
+			resp[n++] = SSP_RESPONSE_COMMAND_NOT_PROCESSED;
+			break;
+		}
+		{
+			long long hostInter = 0;
+			for (int i = 0; i < 8; i++) {
+				hostInter += (long long) cmd[1 + i] << (8 * i);
+			}
+			long long slaveRandom = (long long) (GenerateRandomNumber() % MAX_RANDOM_INTEGER);
+			long long slaveInter = XpowYmodN(device->generator, slaveRandom, device->modulus);
+
+			device->key.FixedKey = sim->fixedKey;
+			device->key.EncryptKey = XpowYmodN(hostInter, slaveRandom, device->modulus);
+			device->keySet = 1;
+			device->count = 0;
+
+			resp[n++] = SSP_RESPONSE_OK;
+			for (int i = 0; i < 8; i++) {
+				resp[n++] = (unsigned char) (slaveInter >> (8 * i));
+			}
+		}
+		break;
+	case SSP_CMD_HOST_PROTOCOL:
+		resp[n++] = (length == 2 && cmd[1] == 0x06) ? SSP_RESPONSE_OK : SSP_RESPONSE_FAILURE;
+		break;
+	case SSP_CMD_SETUP_REQUEST:
+		resp[n++] = SSP_RESPONSE_OK;
+		resp[n++] = device->unitType;
+		memcpy(&resp[n], device->firmwareVersion + 4, 4); // ex. "4149"
+		n += 4;
+		memcpy(&resp[n], "EUR", 3); // obsolete country code
+		n += 3;
+		if (isHopper) {
+			resp[n++] = 0x06; // protocol version
+			resp[n++] = device->channelCount;
+			for (unsigned int i = 0; i < device->channelCount; i++) {
+				n += writeLe(&resp[n], device->channels[i].value, 2);
+			}
+			for (unsigned int i = 0; i < device->channelCount; i++) {
+				memcpy(&resp[n], device->channels[i].cc, 3);
+				n += 3;
+			}
+		} else {
+			n += writeLe(&resp[n], 0, 3); // obsolete value multiplier
+			resp[n++] = device->channelCount;
+			for (unsigned int i = 0; i < device->channelCount; i++) {
+				resp[n++] = 0; // obsolete channel values
+			}
+			for (unsigned int i = 0; i < device->channelCount; i++) {
+				resp[n++] = 0x02; // security
+			}
+			resp[n++] = 0x00; // real value multiplier (big endian)
+			resp[n++] = 0x00;
+			resp[n++] = 0x64;
+			resp[n++] = 0x06; // protocol version
+			for (unsigned int i = 0; i < device->channelCount; i++) {
+				memcpy(&resp[n], device->channels[i].cc, 3);
+				n += 3;
+			}
+			for (unsigned int i = 0; i < device->channelCount; i++) {
+				n += writeLe(&resp[n], device->channels[i].value / 100, 4);
+			}
+		}
+		break;
+	case SSP_CMD_GET_FIRMWARE_VERSION:
+		resp[n++] = SSP_RESPONSE_OK;
+		memcpy(&resp[n], device->firmwareVersion, 16);
+		n += 16;
+		break;
+	case SSP_CMD_GET_DATASET_VERSION:
+		resp[n++] = SSP_RESPONSE_OK;
+		memcpy(&resp[n], device->datasetVersion, 8);
+		n += 8;
+		break;
+	case SSP_CMD_ENABLE:
+		device->enabled = 1;
+		resp[n++] = SSP_RESPONSE_OK;
+		break;
+	case SSP_CMD_DISABLE:
+		device->enabled = 0;
+		resp[n++] = SSP_RESPONSE_OK;
+		break;
+	case SSP_CMD_SET_INHIBITS:
+		if (length != 3) {
+			resp[n++] = SSP_RESPONSE_INCORRECT_PARAMETERS;
+			break;
+		}
+		device->inhibits = cmd[1] | (cmd[2] << 8);
+		resp[n++] = SSP_RESPONSE_OK;
+		break;
+	case SSP_CMD_SET_ROUTING:
+		if (length != 9) {
+			resp[n++] = SSP_RESPONSE_INCORRECT_PARAMETERS;
+			break;
+		}
+		{
+			int channel = findChannel(device, readLe(&cmd[2], 4), &cmd[6]);
+			if (channel < 0) {
+				resp[n++] = SSP_RESPONSE_INVALID_PARAMETER;
+				break;
+			}
+			device->channels[channel].route = cmd[1];
+		}
+		resp[n++] = SSP_RESPONSE_OK;
+		break;
+	case SSP_CMD_ENABLE_PAYOUT_DEVICE:
+	case SSP_CMD_DISABLE_PAYOUT_DEVICE:
+	case SSP_CMD_SET_COINMECH_INHIBITS:
+	case SSP_CMD_SET_REFILL_MODE:
+	case SSP_CMD_CONFIGURE_BEZEL:
+	case SSP_CMD_BULB_ON:
+	case SSP_CMD_BULB_OFF:
+	case SSP_CMD_SET_CASHBOX_PAYOUT_LIMIT:
+	case SSP_CMD_RUN_CALIBRATION:
+	case SSP_CMD_STACK_NOTE:
+		resp[n++] = SSP_RESPONSE_OK;
+		break;
+	case SSP_CMD_SET_BAUD_RATE:
+		// the rate of a pty doesn't matter, so any rate of the command is accepted
+		resp[n++] = length == 3 && cmd[1] <= SSP_BAUD_115200 && cmd[2] <= 1
+				? SSP_RESPONSE_OK : SSP_RESPONSE_INVALID_PARAMETER;
+		break;
+	case SSP_CMD_LAST_REJECT:
+		resp[n++] = SSP_RESPONSE_OK;
+		resp[n++] = device->lastReject;
+		break;
+	case SSP_CMD_CHANNEL_SECURITY:
+		resp[n++] = SSP_RESPONSE_OK;
+		resp[n++] = device->channelCount;
+		for (unsigned int i = 0; i < device->channelCount; i++) {
+			resp[n++] = 0x02;
+		}
+		break;
+	case SSP_CMD_GET_ALL_LEVELS:
+		resp[n++] = SSP_RESPONSE_OK;
+		resp[n++] = device->channelCount;
+		for (unsigned int i = 0; i < device->channelCount; i++) {
+			n += writeLe(&resp[n], device->channels[i].level, 2);
+			n += writeLe(&resp[n], device->channels[i].value, 4);
+			memcpy(&resp[n], device->channels[i].cc, 3);
+			n += 3;
+		}
+		break;
+	case SSP_CMD_CASHBOX_PAYOUT_OPERATION_DATA:
+		resp[n++] = SSP_RESPONSE_OK;
+		resp[n++] = device->channelCount;
+		for (unsigned int i = 0; i < device->channelCount; i++) {
+			n += writeLe(&resp[n], device->channels[i].cashbox, 2);
+			n += writeLe(&resp[n], device->channels[i].value, 4);
+			memcpy(&resp[n], device->channels[i].cc, 3);
+			n += 3;
+		}
+		n += writeLe(&resp[n], 0, 4); // unknown coins
+		break;
+	case SSP_CMD_SET_COIN_AMOUNT: // set denomination level
+		if (length != 10) {
+			resp[n++] = SSP_RESPONSE_INCORRECT_PARAMETERS;
+			break;
+		}
+		{
+			int channel = findChannel(device, readLe(&cmd[3], 4), &cmd[7]);
+			if (channel < 0) {
+				resp[n++] = SSP_RESPONSE_INVALID_PARAMETER;
+				break;
+			}
+			unsigned int level = readLe(&cmd[1], 2);
+			// a level of 0 empties the denomination, anything else is added
+			device->channels[channel].level = level == 0 ? 0 : device->channels[channel].level + level;
+		}
+		resp[n++] = SSP_RESPONSE_OK;
+		break;
+	case SSP_CMD_PAYOUT_VALUE:
+		if (length != 9) {
+			resp[n++] = SSP_RESPONSE_INCORRECT_PARAMETERS;
+			break;
+		}
+		{
+			unsigned int amount = readLe(&cmd[1], 4);
+			unsigned int plan[MAX_CHANNELS] = { 0 };
+			unsigned char reason = 0;
+
+			if (! device->enabled) {
+				reason = PAYOUT_DISABLED;
+			} else if (device->transaction.active) {
+				reason = PAYOUT_BUSY;
+			} else if (planPayout(device, amount, plan) != amount) {
+				unsigned int total = 0;
+				for (unsigned int i = 0; i < device->channelCount; i++) {
+					total += device->channels[i].level * device->channels[i].value;
+				}
+				reason = total < amount ? PAYOUT_NOT_ENOUGH_VALUE : PAYOUT_NOT_EXACT;
+			}
+
+			if (reason != 0) {
+				resp[n++] = SSP_RESPONSE_COMMAND_NOT_PROCESSED;
+				resp[n++] = reason;
+				break;
+			}
+
+			if (cmd[8] == SSP6_OPTION_BYTE_DO) {
+				memcpy(device->transaction.plan, plan, sizeof(plan));
+				startTransaction(sim, device, SSP_POLL_DISPENSING, SSP_POLL_DISPENSED, SSP_POLL_INCOMPLETE_PAYOUT,
+						1, 0, amount);
+			}
+		}
+		resp[n++] = SSP_RESPONSE_OK;
+		break;
+	case SSP_CMD_FLOAT:
+		if (length != 11) {
+			resp[n++] = SSP_RESPONSE_INCORRECT_PARAMETERS;
+			break;
+		}
+		{
+			unsigned int keep = readLe(&cmd[3], 4);
+			unsigned int total = 0;
+			for (unsigned int i = 0; i < device->channelCount; i++) {
+				total += device->channels[i].level * device->channels[i].value;
+			}
+			if (device->transaction.active) {
+				resp[n++] = SSP_RESPONSE_COMMAND_NOT_PROCESSED;
+				resp[n++] = PAYOUT_BUSY;
+				break;
+			}
+			if (total < keep) {
+				resp[n++] = SSP_RESPONSE_COMMAND_NOT_PROCESSED;
+				resp[n++] = PAYOUT_NOT_ENOUGH_VALUE;
+				break;
+			}
+			unsigned int plan[MAX_CHANNELS] = { 0 };
+			unsigned int moved = planPayout(device, total - keep, plan);
+			if (cmd[10] == SSP6_OPTION_BYTE_DO) {
+				memcpy(device->transaction.plan, plan, sizeof(plan));
+				startTransaction(sim, device, SSP_POLL_FLOATING, SSP_POLL_FLOATED, SSP_POLL_INCOMPLETE_FLOAT,
+						1, 1, moved);
+			}
+		}
+		resp[n++] = SSP_RESPONSE_OK;
+		break;
+	case SSP_CMD_EMPTY:
+	case SSP_CMD_SMART_EMPTY:
+		if (device->transaction.active) {
+			resp[n++] = SSP_RESPONSE_COMMAND_NOT_PROCESSED;
+			resp[n++] = PAYOUT_BUSY;
+			break;
+		}
+		{
+			unsigned int total = 0;
+			for (unsigned int i = 0; i < device->channelCount; i++) {
+				device->transaction.plan[i] = device->channels[i].level;
+				total += device->channels[i].level * device->channels[i].value;
+			}
+			if (cmd[0] == SSP_CMD_EMPTY) {
+				startTransaction(sim, device, SSP_POLL_EMPTYING, SSP_POLL_EMPTY, 0, 0, 1, total);
+			} else {
+				startTransaction(sim, device, SSP_POLL_SMART_EMPTYING, SSP_POLL_SMART_EMPTIED, 0, 1, 1, total);
+			}
+		}
+		resp[n++] = SSP_RESPONSE_OK;
+		break;
+	case SSP_CMD_HALT_PAYOUT:
+		if (device->transaction.active) {
+			device->transaction.active = 0;
+			queueValueEvent(device, monotonicMs(), SSP_POLL_HALTED, device->transaction.done, "EUR");
+		}
+		resp[n++] = SSP_RESPONSE_OK;
+		break;
+	case SSP_CMD_PAYOUT_NOTE:
+		if (isHopper) {
+			resp[n++] = SSP_RESPONSE_UNKNOWN_COMMAND;
+			break;
+		}
+		{
+			int channel = -1;
+			for (unsigned int i = 0; i < device->channelCount; i++) {
+				if (device->channels[i].level > 0) {
+					channel = i;
+					break;
+				}
+			}
+			if (channel < 0 || device->transaction.active) {
+				resp[n++] = SSP_RESPONSE_COMMAND_NOT_PROCESSED;
+				resp[n++] = channel < 0 ? PAYOUT_NOT_ENOUGH_VALUE : PAYOUT_BUSY;
+				break;
+			}
+			memset(device->transaction.plan, 0, sizeof(device->transaction.plan));
+			device->transaction.plan[channel] = 1;
+			startTransaction(sim, device, SSP_POLL_DISPENSING, SSP_POLL_DISPENSED, 0, 1, 0,
+					device->channels[channel].value);
+		}
+		resp[n++] = SSP_RESPONSE_OK;
+		break;
+	case SSP_CMD_POLL:
+		n = buildPoll(device, resp);
+		break;
+	default:
+		resp[n++] = SSP_RESPONSE_UNKNOWN_COMMAND;
+		break;
+	}
+
+	return n;
+}
+
+/**
+ * \brief Dispenses the next coin of the running transaction once it is due.
+ */
+void tickTransaction(struct s_device *device, unsigned long long now) {
+	struct s_transaction *t = &device->transaction;
+	if (! t->active || now < t->nextAt) {
+		return;
+	}
+	t->nextAt = now + DISPENSE_STEP;
+
+	int channel = -1;
+	for (int i = device->channelCount - 1; i >= 0; i--) {
+		if (t->plan[i] > 0) {
+			channel = i;
+			break;
+		}
+	}
+
+	if (channel >= 0 && t->jamAfter == 0) {
+		// the coins of the plan stay in the hopper
+		queueValueEvent(device, now, SSP_POLL_JAMMED, t->done, "EUR");
+
+		unsigned char data[13] = { t->incompleteEvent, 1 };
+		writeLe(&data[2], t->done, 4);
+		writeLe(&data[6], t->requested, 4);
+		memcpy(&data[10], "EUR", 3);
+		queueFrame(device, now + 3 * DISPENSE_STEP, data, sizeof(data));
+		t->active = 0;
+		return;
+	}
+
+	if (channel < 0) {
+		if (t->withValue) {
+			queueValueEvent(device, now, t->doneEvent, t->done, "EUR");
+		} else {
+			queueFrame(device, now, &t->doneEvent, 1);
+		}
+		t->active = 0;
+		return;
+	}
+
+	t->plan[channel]--;
+	t->done += device->channels[channel].value;
+	device->channels[channel].level--;
+	if (t->toCashbox) {
+		device->channels[channel].cashbox++;
+	}
+	if (t->jamAfter > 0) {
+		t->jamAfter--;
+	}
+
+	if (t->withValue) {
+		queueValueEvent(device, now, t->progressEvent, t->done, "EUR");
+	} else {
+		queueFrame(device, now, &t->progressEvent, 1);
+	}
+}
+
+/**
+ * \brief Scenario of an inserted note: read, then credit and stacking / stored, reject or jam.
+ */
+void insertNote(struct s_sim *sim, struct s_device *device, unsigned long long now) {
+	unsigned char channel = 1 + rand() % device->channelCount; // SSP channels start with 1
+	struct s_channel *c = &device->channels[channel - 1];
+	unsigned char event[2];
+
+	event[0] = SSP_POLL_READ;
+	event[1] = 0; // still reading
+	queueFrame(device, now, event, 2);
+	event[1] = channel;
+	queueFrame(device, now + NOTE_STEP, event, 2);
+
+	if (chance(sim->jamPercent)) {
+		event[0] = SSP_POLL_UNSAFE_JAM;
+		queueFrame(device, now + 2 * NOTE_STEP, event, 1);
+		queueFrame(device, now + 3 * NOTE_STEP, event, 1);
+		event[0] = SSP_POLL_CLEARED_FROM_FRONT;
+		queueFrame(device, now + 6 * NOTE_STEP, event, 2);
+		return;
+	}
+
+	if (! (device->inhibits & (1u << (channel - 1)))) {
+		device->lastReject = REJECT_CHANNEL_INHIBITED;
+		event[0] = SSP_POLL_REJECTING;
+		queueFrame(device, now + 2 * NOTE_STEP, event, 1);
+		event[0] = SSP_POLL_REJECTED;
+		queueFrame(device, now + 3 * NOTE_STEP, event, 1);
+		return;
+	}
+
+	event[0] = SSP_POLL_CREDIT;
+	queueFrame(device, now + 2 * NOTE_STEP, event, 2);
+	event[0] = SSP_POLL_STACKING;
+	queueFrame(device, now + 3 * NOTE_STEP, event, 1);
+	// ssp6_poll() knows 'stored' without data only
+	event[0] = c->route == 0x00 ? SSP_POLL_STORED : SSP_POLL_STACKED;
+	queueFrame(device, now + 4 * NOTE_STEP, event, 1);
+	if (c->route == 0x00) {
+		c->level++;
+	} else {
+		c->cashbox++;
+	}
+}
+
+/**
+ * \brief Scenario of an inserted coin: coin credit, the coin goes into the hopper.
+ */
+void insertCoin(struct s_device *device, unsigned long long now) {
+	struct s_channel *c = &device->channels[rand() % device->channelCount];
+	unsigned char data[8] = { SSP_POLL_COIN_CREDIT };
+	writeLe(&data[1], c->value, 4);
+	memcpy(&data[5], c->cc, 3);
+	queueFrame(device, now, data, sizeof(data));
+	c->level++;
+}
+
+/**
+ * \brief Advances the scenarios of a device.
+ */
+void tickDevice(struct s_sim *sim, struct s_device *device, unsigned long long now) {
+	tickTransaction(device, now);
+
+	unsigned long interval = device->unitType == 0x03 ? sim->coinInterval : sim->noteInterval;
+	if (interval == 0 || ! device->enabled || device->transaction.active) {
+		device->nextInsertAt = 0;
+		return;
+	}
+	if (device->nextInsertAt == 0) {
+		device->nextInsertAt = now + interval;
+	} else if (now >= device->nextInsertAt) {
+		if (device->unitType == 0x03) {
+			insertCoin(device, now);
+		} else {
+			insertNote(sim, device, now);
+		}
+		device->nextInsertAt = now + interval;
+	}
+}
+
+/**
+ * \brief Supports arguments -l (link), -k (fixed key), -r (reply delay), -j (jitter), -x (drop %), -X (corrupt %),
+ * -n (note interval), -c (coin interval), -J (jam %), -s (seed), -v and -?.
+ */
+int parseCmdLine(int argc, char *argv[], struct s_sim *sim) {
+	opterr = 0;
+
+	int c;
+	while ((c = getopt(argc, argv, "vl:k:r:j:x:X:n:c:J:s:")) != -1) {
+		switch (c) {
+		case 'l':
+			sim->link = optarg;
+			break;
+		case 'k':
+			sim->fixedKey = strtoull(optarg, NULL, 16);
+			break;
+		case 'r':
+			sim->replyDelay = strtoul(optarg, NULL, 10);
+			break;
+		case 'j':
+			sim->replyJitter = strtoul(optarg, NULL, 10);
+			break;
+		case 'x':
+			sim->dropPercent = strtod(optarg, NULL);
+			break;
+		case 'X':
+			sim->corruptPercent = strtod(optarg, NULL);
+			break;
+		case 'n':
+			sim->noteInterval = strtoul(optarg, NULL, 10);
+			break;
+		case 'c':
+			sim->coinInterval = strtoul(optarg, NULL, 10);
+			break;
+		case 'J':
+			sim->jamPercent = strtod(optarg, NULL);
+			break;
+		case 's':
+			srand(strtoul(optarg, NULL, 10));
+			break;
+		case 'v':
+			sim->verbose = 1;
+			break;
+		case '?':
+			if (strchr("lkrjxXncJs", optopt) != NULL) {
+				fprintf(stderr, "Option -%c requires an argument.\n", optopt);
+			} else if (isprint(optopt)) {
+				fprintf(stderr, "Unknown option '-%c'.\n", optopt);
+			} else {
+				fprintf(stderr, "Unknown option character 'x%x'.\n", optopt);
+			}
+			return 1;
+		default:
+			fprintf(stderr, "Unknown argument: %c", c);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	struct s_sim sim;
+	memset(&sim, 0, sizeof(sim));
+	sim.fixedKey = DEFAULT_KEY; // default, override with -k argument
+	sim.replyDelay = 5; // default, override with -r argument
+	initValidator(&sim.validator);
+	initHopper(&sim.hopper);
+	srand(time(NULL)); // default, override with -s argument
+
+	if (parseCmdLine(argc, argv, &sim)) {
+		fprintf(stderr, "usage: %s [-l link] [-k fixed key (hex)] [-r reply delay ms] [-j jitter ms] "
+				"[-x drop %%] [-X corrupt %%] [-n note interval ms] [-c coin interval ms] [-J jam %%] "
+				"[-s seed] [-v]\n", argv[0]);
+		return 1;
+	}
+
+	setlogmask(LOG_UPTO(sim.verbose ? LOG_DEBUG : LOG_NOTICE));
+	openlog("sspsim", LOG_PERROR | LOG_PID, LOG_LOCAL1);
+
+	signal(SIGTERM, signalHandler);
+	signal(SIGINT, signalHandler);
+
+	if (openPty(&sim)) {
+		return 1;
+	}
+
+	struct s_rx rx;
+	memset(&rx, 0, sizeof(rx));
+
+	while (! receivedSignal) {
+		struct pollfd pfd = { sim.master, POLLIN, 0 };
+		int ready = poll(&pfd, 1, 10);
+		if (ready < 0 && errno != EINTR) {
+			syslog(LOG_ERR, "poll failed: %s", strerror(errno));
+			break;
+		}
+
+		if (ready > 0 && (pfd.revents & POLLIN)) {
+			unsigned char buffer[256];
+			ssize_t bytesRead = read(sim.master, buffer, sizeof(buffer));
+			for (ssize_t i = 0; i < bytesRead; i++) {
+				if (rxByte(&rx, buffer[i])) {
+					handlePacket(&sim, rx.data, rx.length);
+				}
+			}
+		}
+
+		unsigned long long now = monotonicMs();
+		tickDevice(&sim, &sim.validator, now);
+		tickDevice(&sim, &sim.hopper, now);
+	}
+
+	if (sim.link != NULL) {
+		unlink(sim.link);
+	}
+	close(sim.slave);
+	close(sim.master);
+	syslog(LOG_NOTICE, "exiting");
+	return 0;
+}